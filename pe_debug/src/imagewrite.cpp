@@ -0,0 +1,250 @@
+#include "StdInc.h"
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+
+#include <CFileSystem.h>
+
+#include <peframework.h>
+
+#include "pechecksum.h"
+
+// Growable in-memory PE stream, so that the image can be serialized in full before touching the disk.
+struct PEStreamMemory final : public PEStream
+{
+    size_t Read( void *buf, size_t readCount ) override
+    {
+        size_t bufSize = this->buffer.size();
+
+        if ( this->seekPtr >= bufSize )
+        {
+            return 0;
+        }
+
+        size_t canRead = std::min( readCount, bufSize - this->seekPtr );
+
+        memcpy( buf, this->buffer.data() + this->seekPtr, canRead );
+
+        this->seekPtr += canRead;
+
+        return canRead;
+    }
+
+    bool Write( const void *buf, size_t writeCount ) override
+    {
+        size_t writeEnd = ( this->seekPtr + writeCount );
+
+        if ( writeEnd > this->buffer.size() )
+        {
+            this->buffer.resize( writeEnd );
+        }
+
+        memcpy( this->buffer.data() + this->seekPtr, buf, writeCount );
+
+        this->seekPtr = writeEnd;
+
+        return true;
+    }
+
+    bool Seek( pe_file_ptr_t seek ) override
+    {
+        if ( seek < 0 )
+        {
+            return false;
+        }
+
+        this->seekPtr = (size_t)seek;
+
+        return true;
+    }
+
+    pe_file_ptr_t Tell( void ) const override
+    {
+        return (pe_file_ptr_t)this->seekPtr;
+    }
+
+    inline char* GetData( void )                    { return this->buffer.data(); }
+    inline const char* GetData( void ) const        { return this->buffer.data(); }
+    inline size_t GetSize( void ) const             { return this->buffer.size(); }
+
+private:
+    std::vector <char> buffer;
+    size_t seekPtr = 0;
+};
+
+// Compares the image against the previous output file. The image must carry the placeholder CodeView
+// record of prepareDebugImageComparison; the PDB signature and the header checksum of the previous
+// output are not compared, since they change with every generated PDB.
+bool isDebugImageUnchanged( PEFile& peFile, CFileTranslator *outputRoot, const filePath& outFileName )
+{
+    PEStreamMemory memStream;
+
+    peFile.WriteToStream( &memStream );
+
+    const char *imageData = memStream.GetData();
+    size_t imageSize = memStream.GetSize();
+
+    std::vector <char> prevData;
+    {
+        std::unique_ptr <CFile> prevFilePtr( outputRoot->Open( outFileName, "rb" ) );
+
+        if ( !prevFilePtr || (size_t)prevFilePtr->GetSizeNative() != imageSize )
+        {
+            return false;
+        }
+
+        prevData.resize( imageSize );
+
+        if ( prevFilePtr->Read( prevData.data(), imageSize ) != imageSize )
+        {
+            return false;
+        }
+    }
+
+    // Find the placeholder record: 'RSDS' followed by the zeroed signature and age.
+    static const char placeholderRecord[ 24 ] = { 'R', 'S', 'D', 'S' };
+
+    const char *recordPos = std::search( imageData, imageData + imageSize, placeholderRecord, placeholderRecord + sizeof(placeholderRecord) );
+
+    if ( recordPos == imageData + imageSize )
+    {
+        return false;
+    }
+
+    struct ignoredRange
+    {
+        size_t offset, size;
+    };
+
+    std::vector <ignoredRange> ignoredRanges;
+
+    // The optional header checksum.
+    if ( imageSize >= 0x40 )
+    {
+        std::uint32_t peHeaderOff;
+        memcpy( &peHeaderOff, imageData + 0x3C, sizeof(peHeaderOff) );
+
+        ignoredRanges.push_back( { (size_t)peHeaderOff + 4 + 20 + 64, 4 } );
+    }
+
+    ignoredRanges.push_back( { (size_t)( recordPos - imageData ) + 4, 20 } );
+
+    std::sort( ignoredRanges.begin(), ignoredRanges.end(),
+        []( const ignoredRange& left, const ignoredRange& right )
+    {
+        return ( left.offset < right.offset );
+    });
+
+    size_t compareOff = 0;
+
+    for ( const ignoredRange& range : ignoredRanges )
+    {
+        size_t rangeStart = std::min( range.offset, imageSize );
+
+        if ( rangeStart > compareOff && memcmp( imageData + compareOff, prevData.data() + compareOff, rangeStart - compareOff ) != 0 )
+        {
+            return false;
+        }
+
+        compareOff = std::max( compareOff, std::min( range.offset + range.size, imageSize ) );
+    }
+
+    return ( memcmp( imageData + compareOff, prevData.data() + compareOff, imageSize - compareOff ) == 0 );
+}
+
+// Serializes the image into memory and stores it with a single write into a preallocated
+// temporary file, which then replaces the destination.
+bool writeImageBuffered( PEFile& peFile, CFileTranslator *outputRoot, const filePath& outFileName, bool updateChecksum )
+{
+    auto writeStartTime = std::chrono::steady_clock::now();
+
+    PEStreamMemory memStream;
+
+    peFile.WriteToStream( &memStream );
+
+    char *imageData = memStream.GetData();
+    size_t imageSize = memStream.GetSize();
+
+    // Summed over the serialized buffer, after the CodeView record has been finalized.
+    if ( updateChecksum )
+    {
+        std::uint32_t imageChecksum;
+
+        if ( updatePEChecksum( imageData, imageSize, imageChecksum ) )
+        {
+            peFile.peOptHeader.checkSum = imageChecksum;
+
+            printf( "image checksum: 0x%08X\n", (unsigned int)imageChecksum );
+        }
+        else
+        {
+            printf( "failed to compute the image checksum\n" );
+        }
+    }
+
+    filePath tmpFileName = outFileName;
+    tmpFileName += ".tmp";
+
+    bool wroteTemp = false;
+    {
+        std::unique_ptr <CFile> tmpFilePtr( outputRoot->Open( tmpFileName, "wb" ) );
+
+        if ( tmpFilePtr )
+        {
+            // Reserve the file space up front.
+            tmpFilePtr->SeekNative( (fsOffsetNumber_t)imageSize, SEEK_SET );
+            tmpFilePtr->SetSeekEnd();
+            tmpFilePtr->SeekNative( 0, SEEK_SET );
+
+            wroteTemp = ( tmpFilePtr->Write( imageData, imageSize ) == imageSize );
+
+            // The data has to be on the disk before the rename is, or a crash could leave an empty destination.
+            if ( wroteTemp )
+            {
+                tmpFilePtr->Flush();
+            }
+        }
+    }
+
+    bool hasWritten = false;
+
+    if ( wroteTemp )
+    {
+        hasWritten = outputRoot->Rename( tmpFileName, outFileName );
+
+        if ( !hasWritten )
+        {
+            // Not every file system replaces the destination on rename.
+            outputRoot->Delete( outFileName );
+
+            hasWritten = outputRoot->Rename( tmpFileName, outFileName );
+        }
+    }
+
+    if ( !hasWritten )
+    {
+        outputRoot->Delete( tmpFileName );
+
+        // Fall back to writing the destination directly.
+        std::unique_ptr <CFile> outFilePtr( outputRoot->Open( outFileName, "wb" ) );
+
+        if ( !outFilePtr )
+        {
+            return false;
+        }
+
+        if ( outFilePtr->Write( imageData, imageSize ) != imageSize )
+        {
+            return false;
+        }
+    }
+
+    auto writeMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( std::chrono::steady_clock::now() - writeStartTime ).count();
+
+    printf( "wrote PE file (%u bytes) in %ums\n", (unsigned int)imageSize, (unsigned int)writeMillis );
+
+    return true;
+}
@@ -25,6 +25,9 @@ extern CFileSystem *fileSystem;
 
 // From other compilation modules (for a reason).
 void tryGenerateSamplePDB( PEFile& peFile, CFileTranslator *outputRoot, const filePath& nameOfExecutable, const filePath& outPathWithoutExt );
+bool prepareDebugImageComparison( PEFile& peFile, CFileTranslator *outputRoot, const filePath& nameOfExecutable, const filePath& outPathWithoutExt );
+bool isDebugImageUnchanged( PEFile& peFile, CFileTranslator *outputRoot, const filePath& outFileName );
+bool writeImageBuffered( PEFile& peFile, CFileTranslator *outputRoot, const filePath& outFileName, bool updateChecksum );
 
 static void printHeader( void )
 {
@@ -59,12 +62,42 @@ int main( int _, char *__[] )
         return -1;
     }
 
+    // Options come before the executable path.
+    bool skipUnchanged = false;
+    bool updateChecksum = false;
+
+    int firstPathArg = 1;
+
+    while ( firstPathArg < argc )
+    {
+        if ( wcscmp( cmdArgs[ firstPathArg ], L"-skipunchanged" ) == 0 )
+        {
+            skipUnchanged = true;
+        }
+        else if ( wcscmp( cmdArgs[ firstPathArg ], L"-checksum" ) == 0 )
+        {
+            updateChecksum = true;
+        }
+        else
+        {
+            break;
+        }
+
+        firstPathArg++;
+    }
+
+    if ( firstPathArg >= argc )
+    {
+        printf( "too little arguments; at least path to executable required\n" );
+        return -1;
+    }
+
     std::wstring cfgExecutablePath;
     {
         // We skip the source executable path.
-        for ( int n = 1; n < argc; n++ )
+        for ( int n = firstPathArg; n < argc; n++ )
         {
-            if ( n != 1 )
+            if ( n != firstPathArg )
             {
                 cfgExecutablePath += L" ";
             }
@@ -169,8 +202,7 @@ int main( int _, char *__[] )
                         outFileName += nameItem;
                         outFileName += "_debug";
 
-                        // Do some PDB magic I guess.
-                        tryGenerateSamplePDB( filedata, outputRoot, nameItem, outFileName );
+                        filePath outPathWithoutExt = outFileName;
 
                         // We get the extension from the PE file format.
                         if ( filedata.IsDynamicLinkLibrary() )
@@ -182,29 +214,41 @@ int main( int _, char *__[] )
                             outFileName += ".exe";
                         }
 
-                        // Write it to another location.
-                        // This is a test that we can 1:1 convert executables.
-                        // We want to be able to write into any location.
-                        std::unique_ptr <CFile> outFilePtr( outputRoot->Open( outFileName, "wb" ) );
+                        // If the previous output was made from the same image then keep it together with its PDB.
+                        bool hasPlaceholderDebugInfo = ( skipUnchanged && prepareDebugImageComparison( filedata, outputRoot, nameItem, outPathWithoutExt ) );
 
-                        if ( outFilePtr )
+                        if ( hasPlaceholderDebugInfo && isDebugImageUnchanged( filedata, outputRoot, outFileName ) )
                         {
-                            FileSystem::fileStreamBuf stlBuf( outFilePtr.get() );
-                            std::iostream stlStream( &stlBuf );
-
-                            PEStreamSTL peStream( &stlStream );
-
-                            printf( "writing PE file\n" );
-
-                            filedata.WriteToStream( &peStream );
-
-                            printf( "done!\n" );
+                            printf( "output PE file is unchanged; keeping the existing files\n" );
 
                             successful = true;
                         }
                         else
                         {
-                            printf( "failed to create output PE file\n" );
+                            if ( hasPlaceholderDebugInfo )
+                            {
+                                // Must not stay in the image if no PDB can be generated.
+                                filedata.ClearDebugDataOfType( IMAGE_DEBUG_TYPE_CODEVIEW );
+                            }
+
+                            // Do some PDB magic I guess.
+                            tryGenerateSamplePDB( filedata, outputRoot, nameItem, outPathWithoutExt );
+
+                            // Write it to another location.
+                            // This is a test that we can 1:1 convert executables.
+                            // We want to be able to write into any location.
+                            printf( "writing PE file\n" );
+
+                            if ( writeImageBuffered( filedata, outputRoot, outFileName, updateChecksum ) )
+                            {
+                                printf( "done!\n" );
+
+                                successful = true;
+                            }
+                            else
+                            {
+                                printf( "failed to create output PE file\n" );
+                            }
                         }
                     }
                     catch( ... )
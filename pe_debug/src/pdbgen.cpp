@@ -118,6 +118,67 @@ static CFile* OpenSymbolsFileAtRoot( CFileTranslator *symbRoot, const filePath&
     return nullptr;
 }
 
+static void injectCodeViewRecord( PEFile& peFile, const CV_INFO_PDB70& pdbDebugEntry, const filePath& outPathWithoutExt )
+{
+    peFile.ClearDebugDataOfType( IMAGE_DEBUG_TYPE_CODEVIEW );
+
+    PEFile::PEDebugDesc& cvDebug = peFile.AddDebugData( IMAGE_DEBUG_TYPE_CODEVIEW );
+
+    PEFile::fileSpaceStream_t stream = cvDebug.dataStore.OpenStream();
+
+    // First write the header.
+    stream.Write( &pdbDebugEntry, sizeof(pdbDebugEntry) );
+
+    auto widePDBFileLocation = ( outPathWithoutExt.convert_unicode <FileSysCommonAllocator> () + L".pdb" );
+
+    // Inside of the EXE file we must use backslashes.
+    std::replace( (wchar_t*)widePDBFileLocation.GetConstString(), (wchar_t*)widePDBFileLocation.GetConstString() + widePDBFileLocation.GetLength(), L'/', L'\\' );
+
+    // Create a UTF-8 version of the wide PDB location string.
+    auto utf8_pdbLoc = CharacterUtil::ConvertStrings <wchar_t, char8_t> ( widePDBFileLocation );
+
+    // Then write the zero-terminated PDB file location, UTF-8.
+    stream.Write( utf8_pdbLoc.GetConstString(), utf8_pdbLoc.GetLength() + 1 );
+}
+
+// Puts a CodeView record with an all-zero signature into the image, so that it can be compared
+// against a previous output without generating a new PDB (which always gets a fresh signature).
+// Returns false if the PDB would depend on more than the image itself.
+bool prepareDebugImageComparison( PEFile& peFile, CFileTranslator *outputRoot, const filePath& nameOfExecutable, const filePath& outPathWithoutExt )
+{
+    // Symbols files are not reflected in the image, so we cannot tell whether the PDB is up to date.
+    CFile *symbolsFile = OpenSymbolsFileAtRoot( outputRoot, nameOfExecutable );
+
+    if ( !symbolsFile && ( outputRoot != fileRoot ) )
+    {
+        symbolsFile = OpenSymbolsFileAtRoot( fileRoot, nameOfExecutable );
+    }
+
+    if ( symbolsFile )
+    {
+        delete symbolsFile;
+
+        return false;
+    }
+
+    // The previous output is only of use together with its PDB.
+    filePath pdbFileName = outPathWithoutExt;
+    pdbFileName += ".pdb";
+
+    if ( !outputRoot->Exists( pdbFileName ) )
+    {
+        return false;
+    }
+
+    CV_INFO_PDB70 placeholderEntry;
+    memset( &placeholderEntry, 0, sizeof(placeholderEntry) );
+    placeholderEntry.CvSignature = CV_SIGNATURE_RSDS;
+
+    injectCodeViewRecord( peFile, placeholderEntry, outPathWithoutExt );
+
+    return true;
+}
+
 void tryGenerateSamplePDB( PEFile& peFile, CFileTranslator *outputRoot, const filePath& nameOfExecutable, const filePath& outPathWithoutExt )
 {
     // Prepare symbol names from an input file.
@@ -344,13 +405,6 @@ void tryGenerateSamplePDB( PEFile& peFile, CFileTranslator *outputRoot, const fi
 
     // Inject PDB information into the EXE file.
     {
-        peFile.ClearDebugDataOfType( IMAGE_DEBUG_TYPE_CODEVIEW );
-
-        PEFile::PEDebugDesc& cvDebug = peFile.AddDebugData( IMAGE_DEBUG_TYPE_CODEVIEW );
-
-        PEFile::fileSpaceStream_t stream = cvDebug.dataStore.OpenStream();
-
-        // First write the header.
         CV_INFO_PDB70 pdbDebugEntry;
         pdbDebugEntry.CvSignature = CV_SIGNATURE_RSDS;
         BOOL gotSig = pdbHandle->QuerySignature2( &pdbDebugEntry.Signature );
@@ -358,16 +412,7 @@ void tryGenerateSamplePDB( PEFile& peFile, CFileTranslator *outputRoot, const fi
 
         assert( gotSig == TRUE );
 
-        stream.Write( &pdbDebugEntry, sizeof(pdbDebugEntry) );
-
-        // Inside of the EXE file we must use backslashes.
-        std::replace( (wchar_t*)widePDBFileLocation.GetConstString(), (wchar_t*)widePDBFileLocation.GetConstString() + widePDBFileLocation.GetLength(), L'/', L'\\' );
-
-        // Create a UTF-8 version of the wide PDB location string.
-        auto utf8_pdbLoc = CharacterUtil::ConvertStrings <wchar_t, char8_t> ( widePDBFileLocation );
-
-        // Then write the zero-terminated PDB file location, UTF-8.
-        stream.Write( utf8_pdbLoc.GetConstString(), utf8_pdbLoc.GetLength() + 1 );
+        injectCodeViewRecord( peFile, pdbDebugEntry, outPathWithoutExt );
 
         // Done!
     }
@@ -0,0 +1,292 @@
+#include "archivesource.h"
+#include "filestamp.h"
+
+#include <CFileSystem.h>
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+
+// Extensions of the archive formats that CFileSystem opens.
+static const char *const archiveExtensions[] =
+{
+    ".zip"
+};
+
+static bool HasArchiveExtension( const char *path, size_t pathLen )
+{
+    for ( const char *ext : archiveExtensions )
+    {
+        size_t extLen = strlen( ext );
+
+        if ( pathLen <= extLen )
+        {
+            continue;
+        }
+
+        const char *pathExt = ( path + pathLen - extLen );
+
+        bool isMatch = true;
+
+        for ( size_t n = 0; n < extLen; n++ )
+        {
+            if ( tolower( (unsigned char)pathExt[n] ) != ext[n] )
+            {
+                isMatch = false;
+                break;
+            }
+        }
+
+        if ( isMatch )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool SplitArchiveEntryPath( const char *path, std::string& archivePathOut, std::string& entryPathOut )
+{
+    // Only a colon that follows an archive extension separates the entry, so drive letters stay intact.
+    for ( const char *iter = path; *iter != 0; iter++ )
+    {
+        if ( *iter != ':' || iter[1] == 0 )
+        {
+            continue;
+        }
+
+        size_t archivePathLen = (size_t)( iter - path );
+
+        if ( HasArchiveExtension( path, archivePathLen ) )
+        {
+            archivePathOut.assign( path, archivePathLen );
+            entryPathOut = ( iter + 1 );
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Reads a file on disk.
+struct PEStreamDiskFile final : public PEStream
+{
+    inline PEStreamDiskFile( const char *path ) : fileStream( path, std::ios::binary | std::ios::in ), peStream( &fileStream )
+    {
+        return;
+    }
+
+    inline bool IsGood( void ) const
+    {
+        return this->fileStream.good();
+    }
+
+    size_t Read( void *buf, size_t readCount ) override
+    {
+        return this->peStream.Read( buf, readCount );
+    }
+
+    bool Write( const void *buf, size_t writeCount ) override
+    {
+        return false;
+    }
+
+    bool Seek( pe_file_ptr_t seek ) override
+    {
+        return this->peStream.Seek( seek );
+    }
+
+    pe_file_ptr_t Tell( void ) const override
+    {
+        return this->peStream.Tell();
+    }
+
+private:
+    std::fstream fileStream;
+    PEStreamSTL peStream;
+};
+
+struct openArchive
+{
+    inline openArchive( FileSystem::filePtr archiveFile, CArchiveTranslator *translator, const fileStamp& stamp )
+        : archiveFile( std::move( archiveFile ) ), translator( translator ), stamp( stamp )
+    {
+        return;
+    }
+
+    // The translator reads from the file, so it is declared after it and destroyed before it.
+    FileSystem::filePtr archiveFile;
+    FileSystem::archiveTrans translator;
+
+    // Identity of the archive file when it was opened; a rebuilt archive is opened anew.
+    fileStamp stamp;
+};
+
+// Reads an entry straight out of an archive.
+struct PEStreamArchiveEntry final : public PEStream
+{
+    inline PEStreamArchiveEntry( std::shared_ptr <openArchive> archive, FileSystem::filePtr entryFile ) : archive( std::move( archive ) ), entryFile( std::move( entryFile ) )
+    {
+        return;
+    }
+
+    size_t Read( void *buf, size_t readCount ) override
+    {
+        return this->entryFile->Read( buf, readCount );
+    }
+
+    bool Write( const void *buf, size_t writeCount ) override
+    {
+        return false;
+    }
+
+    bool Seek( pe_file_ptr_t seek ) override
+    {
+        return ( this->entryFile->SeekNative( seek, SEEK_SET ) == 0 );
+    }
+
+    pe_file_ptr_t Tell( void ) const override
+    {
+        return this->entryFile->TellNative();
+    }
+
+private:
+    // Keeps the archive open while the entry is read, even if the registry has dropped it.
+    std::shared_ptr <openArchive> archive;
+    FileSystem::filePtr entryFile;
+};
+
+struct archiveRegistry
+{
+    std::mutex lock;
+
+    // Created with the first archive; jobs without archives do not need the file system.
+    std::unique_ptr <FileSystem::fileSysInstance> fileSys;
+
+    std::map <std::string, std::shared_ptr <openArchive>> archives;
+};
+
+static archiveRegistry& GetArchiveRegistry( void )
+{
+    static archiveRegistry registry;
+
+    return registry;
+}
+
+static std::shared_ptr <openArchive> GetOpenArchive( archiveRegistry& registry, const std::string& archivePath )
+{
+    fileStamp stamp;
+
+    if ( !GetFileStamp( archivePath.c_str(), stamp ) )
+    {
+        return nullptr;
+    }
+
+    auto findIter = registry.archives.find( archivePath );
+
+    if ( findIter != registry.archives.end() )
+    {
+        const std::shared_ptr <openArchive>& archive = findIter->second;
+
+        if ( archive->stamp == stamp )
+        {
+            return archive;
+        }
+
+        // The archive has been rebuilt; its entries moved.
+        registry.archives.erase( findIter );
+    }
+
+    if ( !registry.fileSys )
+    {
+        registry.fileSys = std::make_unique <FileSystem::fileSysInstance> ();
+    }
+
+    filePath location = archivePath.c_str();
+
+    FileSystem::filePtr archiveFile( fileRoot, location, "rb" );
+
+    if ( !archiveFile.is_good() )
+    {
+        filePath rootDesc;
+
+        if ( fileSystem->GetSystemRootDescriptor( location, rootDesc ) )
+        {
+            // Absolute paths outside of the working directory need an access point of their own.
+            FileSystem::fileTrans archiveRoot = fileSystem->CreateSystemMinimumAccessPoint( rootDesc );
+
+            if ( archiveRoot.is_good() )
+            {
+                archiveFile = FileSystem::filePtr( archiveRoot, location, "rb" );
+            }
+        }
+    }
+
+    if ( !archiveFile.is_good() )
+    {
+        return nullptr;
+    }
+
+    CArchiveTranslator *translator = fileSystem->OpenArchive( *archiveFile );
+
+    if ( translator == nullptr )
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr <openArchive> archive = std::make_shared <openArchive> ( std::move( archiveFile ), translator, stamp );
+
+    registry.archives[ archivePath ] = archive;
+
+    return archive;
+}
+
+std::unique_ptr <PEStream> OpenInputStream( const char *path )
+{
+    std::string archivePath, entryPath;
+
+    if ( SplitArchiveEntryPath( path, archivePath, entryPath ) == false )
+    {
+        std::unique_ptr <PEStreamDiskFile> diskStream = std::make_unique <PEStreamDiskFile> ( path );
+
+        if ( !diskStream->IsGood() )
+        {
+            return nullptr;
+        }
+
+        return diskStream;
+    }
+
+    archiveRegistry& registry = GetArchiveRegistry();
+
+    std::lock_guard <std::mutex> registryLock( registry.lock );
+
+    std::shared_ptr <openArchive> archive = GetOpenArchive( registry, archivePath );
+
+    if ( archive == nullptr )
+    {
+        return nullptr;
+    }
+
+    FileSystem::filePtr entryFile( archive->translator, entryPath.c_str(), "rb" );
+
+    if ( !entryFile.is_good() )
+    {
+        return nullptr;
+    }
+
+    return std::make_unique <PEStreamArchiveEntry> ( std::move( archive ), std::move( entryFile ) );
+}
+
+void CloseInputArchives( void )
+{
+    archiveRegistry& registry = GetArchiveRegistry();
+
+    std::lock_guard <std::mutex> registryLock( registry.lock );
+
+    registry.archives.clear();
+}
@@ -0,0 +1,25 @@
+#ifndef _ARCHIVE_SOURCE_
+#define _ARCHIVE_SOURCE_
+
+#include <peframework.h>
+
+#include <memory>
+#include <string>
+
+// Input files can be entries of ZIP archives: mods.zip:plugins/foo.asi names plugins/foo.asi inside of mods.zip.
+// Entries are read through the archive support of CFileSystem, like peresembed does, so they do not have to be
+// extracted to disk first. An archive is opened once and stays open, because module bundles usually provide
+// several inputs of the same job; it is opened again once its file stamp (see filestamp.h) has changed.
+
+// Splits a path into the archive file and the entry inside of it. Returns false for plain file paths.
+bool SplitArchiveEntryPath( const char *path, std::string& archivePathOut, std::string& entryPathOut );
+
+// Opens a file on disk or an archive entry for reading. Returns nullptr if it cannot be opened.
+// Streams of the same archive must not be read from multiple threads at once.
+std::unique_ptr <PEStream> OpenInputStream( const char *path );
+
+// Closes the archives that are kept open. Processes that fork jobs call it before forking, so that the jobs
+// do not share the file offsets of the open archive files.
+void CloseInputArchives( void );
+
+#endif //_ARCHIVE_SOURCE_
@@ -0,0 +1,510 @@
+#include "embedlog.h"
+
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <chrono>
+#include <cstdio>
+
+// Console output is written in blocks of this size.
+static const size_t consoleBlockSize = 0x10000;
+
+static std::int64_t GetLogTime( void )
+{
+    return std::chrono::duration_cast <std::chrono::microseconds> ( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static void AppendJSONString( std::string& outStr, const std::string& value )
+{
+    static const char hexDigits[] = "0123456789abcdef";
+
+    outStr += '"';
+
+    for ( char c : value )
+    {
+        if ( c == '"' || c == '\\' )
+        {
+            outStr += '\\';
+            outStr += c;
+        }
+        else if ( (unsigned char)c < 0x20 )
+        {
+            outStr += "\\u00";
+            outStr += hexDigits[ ( c >> 4 ) & 0xF ];
+            outStr += hexDigits[ c & 0xF ];
+        }
+        else
+        {
+            outStr += c;
+        }
+    }
+
+    outStr += '"';
+}
+
+static void AppendJSONMillis( std::string& outStr, std::int64_t micros )
+{
+    char buf[ 32 ];
+    snprintf( buf, sizeof(buf), "%.3f", (double)micros / 1000.0 );
+
+    outStr += buf;
+}
+
+// Appends "name":value to the members of a JSON object.
+static void AppendJSONField( std::string& outStr, const char *name, std::uint64_t value )
+{
+    if ( outStr.empty() == false )
+    {
+        outStr += ',';
+    }
+
+    AppendJSONString( outStr, name );
+    outStr += ':';
+    outStr += std::to_string( value );
+}
+
+static void AppendJSONField( std::string& outStr, const char *name, const char *value )
+{
+    if ( outStr.empty() == false )
+    {
+        outStr += ',';
+    }
+
+    AppendJSONString( outStr, name );
+    outStr += ':';
+    AppendJSONString( outStr, value );
+}
+
+static const char* GetLogLevelName( eLogLevel level )
+{
+    if ( level == eLogLevel::VERBOSE )
+    {
+        return "verbose";
+    }
+    if ( level == eLogLevel::QUIET )
+    {
+        return "quiet";
+    }
+    return "summary";
+}
+
+// Collects the text of one stream until a line is complete.
+struct logLineBuffer : public std::streambuf
+{
+    inline logLineBuffer( eLogLevel lineLevel ) : lineLevel( lineLevel )
+    {
+        return;
+    }
+
+    // Writes the part of the current line that is not on the console yet.
+    void FlushPartialLine( void );
+
+protected:
+    int overflow( int c ) override
+    {
+        if ( c != traits_type::eof() )
+        {
+            char ch = (char)c;
+
+            this->xsputn( &ch, 1 );
+        }
+        return traits_type::not_eof( c );
+    }
+
+    std::streamsize xsputn( const char *s, std::streamsize n ) override;
+
+    // Flushing is left to FlushLog, so that std::endl does not write every line on its own.
+    int sync( void ) override
+    {
+        return 0;
+    }
+
+private:
+    eLogLevel lineLevel;
+    std::string curLine;
+    size_t numConsoleWritten = 0;
+};
+
+struct logState
+{
+    eLogLevel level = eLogLevel::SUMMARY;
+
+    std::string consoleText;
+    std::string retainedText;       // the log of the job at quiet level.
+
+    FILE *jsonFile = nullptr;
+    std::string jsonPath;
+    std::string jsonLine;
+    std::string pendingFields;      // of the next summary line.
+
+    std::int64_t jobStartTime = GetLogTime();
+
+    logLineBuffer summaryBuffer { eLogLevel::SUMMARY };
+    logLineBuffer verboseBuffer { eLogLevel::VERBOSE };
+
+    std::ostream verboseStream { &verboseBuffer };
+
+    std::streambuf *prevCoutBuffer = nullptr;
+
+    ~logState( void );
+};
+
+static logState& GetLogState( void )
+{
+    static logState state;
+
+    return state;
+}
+
+static void WriteConsole( logState& state )
+{
+    if ( state.consoleText.empty() == false )
+    {
+        fwrite( state.consoleText.data(), 1, state.consoleText.size(), stdout );
+        fflush( stdout );
+
+        state.consoleText.clear();
+    }
+}
+
+logState::~logState( void )
+{
+    this->summaryBuffer.FlushPartialLine();
+
+    WriteConsole( *this );
+
+    if ( this->prevCoutBuffer != nullptr )
+    {
+        std::cout.rdbuf( this->prevCoutBuffer );
+    }
+
+    if ( this->jsonFile != nullptr )
+    {
+        fclose( this->jsonFile );
+    }
+}
+
+static bool IsShownOnConsole( const logState& state, eLogLevel lineLevel )
+{
+    return ( state.level != eLogLevel::QUIET && lineLevel <= state.level );
+}
+
+static void PutConsoleText( logState& state, eLogLevel lineLevel, const char *text, size_t textLen )
+{
+    if ( state.level == eLogLevel::QUIET )
+    {
+        if ( lineLevel == eLogLevel::SUMMARY )
+        {
+            state.retainedText.append( text, textLen );
+        }
+        return;
+    }
+
+    if ( lineLevel > state.level )
+    {
+        return;
+    }
+
+    state.consoleText.append( text, textLen );
+
+    if ( state.consoleText.size() >= consoleBlockSize )
+    {
+        WriteConsole( state );
+    }
+}
+
+static void BeginJSONEvent( logState& state, const char *eventName )
+{
+    std::string& line = state.jsonLine;
+
+    line = "{\"t\":";
+    AppendJSONMillis( line, GetLogTime() - state.jobStartTime );
+    line += ",\"event\":\"";
+    line += eventName;
+    line += '"';
+}
+
+static void EndJSONEvent( logState& state, const std::string& fields )
+{
+    std::string& line = state.jsonLine;
+
+    if ( fields.empty() == false )
+    {
+        line += ",\"fields\":{";
+        line += fields;
+        line += '}';
+    }
+
+    line += "}\n";
+
+    // The file is unbuffered, so that every event is one write even with forked jobs appending to it.
+    fwrite( line.data(), 1, line.size(), state.jsonFile );
+}
+
+void logLineBuffer::FlushPartialLine( void )
+{
+    logState& state = GetLogState();
+
+    if ( this->numConsoleWritten < this->curLine.size() )
+    {
+        PutConsoleText( state, this->lineLevel, this->curLine.data() + this->numConsoleWritten, this->curLine.size() - this->numConsoleWritten );
+
+        this->numConsoleWritten = this->curLine.size();
+    }
+}
+
+std::streamsize logLineBuffer::xsputn( const char *s, std::streamsize n )
+{
+    logState& state = GetLogState();
+
+    bool isLineWanted = ( IsShownOnConsole( state, this->lineLevel ) || state.jsonFile != nullptr || this->lineLevel == eLogLevel::SUMMARY );
+
+    if ( isLineWanted == false )
+    {
+        return n;
+    }
+
+    for ( std::streamsize idx = 0; idx < n; idx++ )
+    {
+        char c = s[ idx ];
+
+        if ( c != '\n' )
+        {
+            this->curLine += c;
+            continue;
+        }
+
+        this->FlushPartialLine();
+
+        PutConsoleText( state, this->lineLevel, "\n", 1 );
+
+        if ( state.jsonFile != nullptr )
+        {
+            BeginJSONEvent( state, "log" );
+            state.jsonLine += ",\"level\":\"";
+            state.jsonLine += GetLogLevelName( this->lineLevel );
+            state.jsonLine += "\",\"msg\":";
+            AppendJSONString( state.jsonLine, this->curLine );
+
+            if ( this->lineLevel == eLogLevel::SUMMARY )
+            {
+                EndJSONEvent( state, state.pendingFields );
+
+                state.pendingFields.clear();
+            }
+            else
+            {
+                EndJSONEvent( state, std::string() );
+            }
+        }
+
+        this->curLine.clear();
+        this->numConsoleWritten = 0;
+    }
+
+    return n;
+}
+
+void InstallLogging( void )
+{
+    logState& state = GetLogState();
+
+    if ( state.prevCoutBuffer == nullptr )
+    {
+        state.prevCoutBuffer = std::cout.rdbuf( &state.summaryBuffer );
+    }
+}
+
+bool ConfigureLogging( eLogLevel level, const char *jsonPath, bool isAppending )
+{
+    logState& state = GetLogState();
+
+    state.level = level;
+    state.jobStartTime = GetLogTime();
+    state.retainedText.clear();
+    state.pendingFields.clear();
+
+    // Output from before the options were known is held back, too.
+    if ( level == eLogLevel::QUIET )
+    {
+        state.retainedText = std::move( state.consoleText );
+        state.consoleText.clear();
+    }
+
+    if ( jsonPath == nullptr )
+    {
+        return true;
+    }
+
+    // Forked jobs append to the file of their parent.
+    if ( state.jsonFile != nullptr && state.jsonPath == jsonPath )
+    {
+        return true;
+    }
+
+    if ( state.jsonFile != nullptr )
+    {
+        fclose( state.jsonFile );
+
+        state.jsonFile = nullptr;
+    }
+
+    // Truncate first, then append, so that concurrent writers do not overwrite each other.
+    if ( isAppending == false )
+    {
+        FILE *truncFile = fopen( jsonPath, "wb" );
+
+        if ( truncFile == nullptr )
+        {
+            return false;
+        }
+
+        fclose( truncFile );
+    }
+
+    state.jsonFile = fopen( jsonPath, "ab" );
+
+    if ( state.jsonFile == nullptr )
+    {
+        return false;
+    }
+
+    setvbuf( state.jsonFile, nullptr, _IONBF, 0 );
+
+    state.jsonPath = jsonPath;
+
+    BeginJSONEvent( state, "start" );
+    state.jsonLine += ",\"level\":\"";
+    state.jsonLine += GetLogLevelName( level );
+    state.jsonLine += '"';
+    EndJSONEvent( state, std::string() );
+
+    return true;
+}
+
+eLogLevel GetLogLevel( void )
+{
+    return GetLogState().level;
+}
+
+std::ostream& LogVerbose( void )
+{
+    return GetLogState().verboseStream;
+}
+
+void LogField( const char *name, std::uint64_t value )
+{
+    logState& state = GetLogState();
+
+    if ( state.jsonFile != nullptr )
+    {
+        AppendJSONField( state.pendingFields, name, value );
+    }
+}
+
+void LogField( const char *name, const char *value )
+{
+    logState& state = GetLogState();
+
+    if ( state.jsonFile != nullptr )
+    {
+        AppendJSONField( state.pendingFields, name, value );
+    }
+}
+
+void WriteRelayedLog( const char *text, size_t textLen )
+{
+    logState& state = GetLogState();
+
+    state.summaryBuffer.FlushPartialLine();
+
+    PutConsoleText( state, eLogLevel::SUMMARY, text, textLen );
+}
+
+void FlushLog( void )
+{
+    logState& state = GetLogState();
+
+    state.summaryBuffer.FlushPartialLine();
+    state.verboseBuffer.FlushPartialLine();
+
+    WriteConsole( state );
+
+    std::cout.flush();
+}
+
+void FinishLogJob( int resultCode )
+{
+    logState& state = GetLogState();
+
+    state.summaryBuffer.FlushPartialLine();
+    state.verboseBuffer.FlushPartialLine();
+
+    if ( state.jsonFile != nullptr )
+    {
+        BeginJSONEvent( state, "result" );
+        state.jsonLine += ",\"code\":";
+        state.jsonLine += std::to_string( resultCode );
+        EndJSONEvent( state, std::string() );
+    }
+
+    // Failed jobs print their log even when quiet.
+    if ( state.level == eLogLevel::QUIET && resultCode != 0 )
+    {
+        state.consoleText += state.retainedText;
+    }
+
+    state.retainedText.clear();
+    state.pendingFields.clear();
+
+    WriteConsole( state );
+}
+
+logPhase::logPhase( const char *name ) : name( name ), startTime( GetLogTime() )
+{
+    return;
+}
+
+logPhase::~logPhase( void )
+{
+    logState& state = GetLogState();
+
+    std::int64_t phaseMicros = ( GetLogTime() - this->startTime );
+
+    if ( IsShownOnConsole( state, eLogLevel::VERBOSE ) )
+    {
+        std::string line = "phase ";
+        line += this->name;
+        line += ": ";
+        AppendJSONMillis( line, phaseMicros );
+        line += " ms\n";
+
+        PutConsoleText( state, eLogLevel::VERBOSE, line.data(), line.size() );
+    }
+
+    if ( state.jsonFile != nullptr )
+    {
+        BeginJSONEvent( state, "phase" );
+        state.jsonLine += ",\"name\":";
+        AppendJSONString( state.jsonLine, this->name );
+        state.jsonLine += ",\"ms\":";
+        AppendJSONMillis( state.jsonLine, phaseMicros );
+        EndJSONEvent( state, this->fields );
+    }
+}
+
+void logPhase::SetField( const char *name, std::uint64_t value )
+{
+    if ( GetLogState().jsonFile != nullptr )
+    {
+        AppendJSONField( this->fields, name, value );
+    }
+}
+
+void logPhase::SetField( const char *name, const char *value )
+{
+    if ( GetLogState().jsonFile != nullptr )
+    {
+        AppendJSONField( this->fields, name, value );
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef _EMBED_LOGGING_
+#define _EMBED_LOGGING_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Console output of the tool. std::cout is redirected into a line buffer: std::endl no longer flushes the
+// console, lines are written out in blocks instead. Every line, verbose ones included, can also go to a
+// JSON-lines file (-logjson) together with the timings of the processing phases and the job result. Counts
+// and phase results are attached to the events as fields, so that scripts do not have to parse the text.
+enum class eLogLevel
+{
+    QUIET,          // nothing, unless the job fails; then the whole log is printed.
+    SUMMARY,        // phases and results.
+    VERBOSE         // every section, import and resource item.
+};
+
+// Takes over std::cout; done once at startup.
+void InstallLogging( void );
+
+// Applies the logging options of a job. Forked jobs keep using the JSON-lines file of their parent; job
+// processes that were started anew append to it.
+bool ConfigureLogging( eLogLevel level, const char *jsonPath, bool isAppending );
+
+eLogLevel GetLogLevel( void );
+
+// Stream for per-item lines; they only show at verbose level.
+std::ostream& LogVerbose( void );
+
+// Attaches a value to the JSON event of the next summary line, so that scripts read counts and results as
+// fields of the event instead of out of its message text. Does nothing without a JSON-lines file.
+void LogField( const char *name, std::uint64_t value );
+void LogField( const char *name, const char *value );
+
+// Console text of a job that ran in another process; that job has written its own JSON events already.
+void WriteRelayedLog( const char *text, size_t textLen );
+
+// Writes the buffered console output. Must be called before forking and before _exit.
+void FlushLog( void );
+
+// Sends the result of a job to the JSON-lines file; in quiet mode the log of a failed job is printed now.
+void FinishLogJob( int resultCode );
+
+// Measures a processing phase from construction to destruction. Results of the phase can be attached to its
+// JSON event as fields.
+struct logPhase
+{
+    logPhase( const char *name );
+    ~logPhase( void );
+
+    void SetField( const char *name, std::uint64_t value );
+    void SetField( const char *name, const char *value );
+
+private:
+    const char *name;
+    std::int64_t startTime;
+    std::string fields;
+};
+
+#endif //_EMBED_LOGGING_
@@ -0,0 +1,585 @@
+#include "embedserver.h"
+#include "embedlog.h"
+#include "archivesource.h"
+
+#include <iostream>
+
+#ifndef _WIN32
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Wire format of a job request: the working directory of the client followed by the command line
+// arguments, each zero-terminated, ending with an empty string. The response is the job log,
+// then a zero byte and the 32bit result code.
+static const size_t maxRequestSize = 0x100000;
+
+// A client has to send its whole request within this time, otherwise it is dropped and the worker freed.
+static const int requestTimeoutMillis = 10000;
+
+static bool WriteAll( int fd, const void *buf, size_t bufSize )
+{
+    const char *bytes = (const char*)buf;
+
+    while ( bufSize > 0 )
+    {
+        ssize_t numWritten = write( fd, bytes, bufSize );
+
+        if ( numWritten < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        bytes += numWritten;
+        bufSize -= (size_t)numWritten;
+    }
+
+    return true;
+}
+
+static bool FillUnixSocketAddress( const char *socketPath, sockaddr_un& addrOut )
+{
+    memset( &addrOut, 0, sizeof(addrOut) );
+
+    addrOut.sun_family = AF_UNIX;
+
+    size_t pathLen = strlen( socketPath );
+
+    if ( pathLen >= sizeof(addrOut.sun_path) )
+    {
+        return false;
+    }
+
+    memcpy( addrOut.sun_path, socketPath, pathLen );
+    return true;
+}
+
+static bool ReceiveJobRequest( int clientFd, std::vector <std::string>& stringsOut )
+{
+    std::string curString;
+    size_t numReceived = 0;
+
+    char buf[ 0x1000 ];
+
+    auto deadline = ( std::chrono::steady_clock::now() + std::chrono::milliseconds( requestTimeoutMillis ) );
+
+    while ( true )
+    {
+        auto remainingMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( deadline - std::chrono::steady_clock::now() ).count();
+
+        if ( remainingMillis <= 0 )
+        {
+            return false;
+        }
+
+        pollfd clientPollFd = { clientFd, POLLIN, 0 };
+
+        int pollResult = poll( &clientPollFd, 1, (int)remainingMillis );
+
+        if ( pollResult < 0 && errno == EINTR )
+        {
+            continue;
+        }
+
+        if ( pollResult <= 0 )
+        {
+            return false;
+        }
+
+        ssize_t numRead = read( clientFd, buf, sizeof(buf) );
+
+        if ( numRead < 0 && errno == EINTR )
+        {
+            continue;
+        }
+
+        if ( numRead <= 0 )
+        {
+            return false;
+        }
+
+        numReceived += (size_t)numRead;
+
+        if ( numReceived > maxRequestSize )
+        {
+            return false;
+        }
+
+        for ( ssize_t n = 0; n < numRead; n++ )
+        {
+            char c = buf[n];
+
+            if ( c != 0 )
+            {
+                curString += c;
+                continue;
+            }
+
+            if ( curString.empty() )
+            {
+                // End of request.
+                return ( stringsOut.empty() == false );
+            }
+
+            stringsOut.push_back( std::move( curString ) );
+            curString.clear();
+        }
+    }
+}
+
+// Executed inside of the forked job process.
+static int RunServerJob( int clientFd, peImageCache& imageCache, embedJobFunc_t jobFunc )
+{
+    std::vector <std::string> requestStrings;
+
+    if ( !ReceiveJobRequest( clientFd, requestStrings ) )
+    {
+        std::cout << "dropped client without a complete job request" << std::endl;
+
+        FlushLog();
+
+        return -24;
+    }
+
+    // Relative paths of the job are relative to the client.
+    if ( chdir( requestStrings[0].c_str() ) != 0 )
+    {
+        return -24;
+    }
+
+    // The job log goes straight to the client.
+    dup2( clientFd, STDOUT_FILENO );
+    dup2( clientFd, STDERR_FILENO );
+
+    std::vector <char*> jobArgv;
+    jobArgv.push_back( (char*)"pefrmdllembed" );
+
+    for ( size_t n = 1; n < requestStrings.size(); n++ )
+    {
+        jobArgv.push_back( (char*)requestStrings[n].c_str() );
+    }
+
+    jobArgv.push_back( nullptr );
+
+    int jobResult = jobFunc( (int)( jobArgv.size() - 1 ), jobArgv.data(), &imageCache );
+
+    FlushLog();
+
+    // Terminate the log and send the result.
+    char terminator = 0;
+    std::int32_t resultCode = (std::int32_t)jobResult;
+
+    WriteAll( clientFd, &terminator, sizeof(terminator) );
+    WriteAll( clientFd, &resultCode, sizeof(resultCode) );
+
+    return jobResult;
+}
+
+int RunEmbedServer( const char *socketPath, unsigned int maxWorkers, size_t cacheMemoryCap, embedJobFunc_t jobFunc )
+{
+    // Clients that go away must not kill us.
+    signal( SIGPIPE, SIG_IGN );
+
+    sockaddr_un addr;
+
+    if ( !FillUnixSocketAddress( socketPath, addr ) )
+    {
+        std::cout << "socket path is too long (" << socketPath << ")" << std::endl;
+
+        return -24;
+    }
+
+    int listenFd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+    if ( listenFd < 0 )
+    {
+        std::cout << "failed to create server socket" << std::endl;
+
+        return -24;
+    }
+
+    // Remove the socket of a previous server instance, but nothing else that happens to be at the path.
+    struct stat prevFileInfo;
+
+    if ( lstat( socketPath, &prevFileInfo ) == 0 )
+    {
+        if ( !S_ISSOCK( prevFileInfo.st_mode ) )
+        {
+            std::cout << "socket path exists and is not a socket (" << socketPath << ")" << std::endl;
+
+            close( listenFd );
+            return -24;
+        }
+
+        unlink( socketPath );
+    }
+
+    if ( bind( listenFd, (const sockaddr*)&addr, sizeof(addr) ) != 0 || listen( listenFd, 16 ) != 0 )
+    {
+        std::cout << "failed to listen on socket (" << socketPath << ")" << std::endl;
+
+        close( listenFd );
+        return -24;
+    }
+
+    if ( maxWorkers == 0 )
+    {
+        maxWorkers = 1;
+    }
+
+    std::cout << "serving embed jobs on " << socketPath << " (" << maxWorkers << " workers, " << ( cacheMemoryCap >> 20 ) << "MB image cache)" << std::endl;
+
+    peImageCache imageCache( cacheMemoryCap );
+
+    struct runningJob
+    {
+        pid_t pid;
+        int reportFd;           // receives the paths of the images that the job used.
+        std::string report;
+        unsigned long jobIndex;
+    };
+
+    std::vector <runningJob> jobs;
+    unsigned long numJobsStarted = 0;
+
+    while ( true )
+    {
+        std::vector <pollfd> pollFds;
+
+        for ( const runningJob& job : jobs )
+        {
+            pollFds.push_back( { job.reportFd, POLLIN, 0 } );
+        }
+
+        // New jobs are only accepted if a worker is free; others wait in the listen backlog.
+        bool canAcceptJob = ( jobs.size() < maxWorkers );
+
+        if ( canAcceptJob )
+        {
+            pollFds.push_back( { listenFd, POLLIN, 0 } );
+        }
+
+        if ( poll( pollFds.data(), (nfds_t)pollFds.size(), -1 ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            std::cout << "failed to wait for server events" << std::endl;
+            break;
+        }
+
+        // Collect the reports of jobs.
+        size_t numJobs = jobs.size();
+        std::vector <std::string> usedPaths;
+
+        for ( size_t n = numJobs; n > 0; n-- )
+        {
+            size_t jobIdx = ( n - 1 );
+
+            runningJob& job = jobs[ jobIdx ];
+
+            if ( pollFds[ jobIdx ].revents == 0 )
+            {
+                continue;
+            }
+
+            char buf[ 0x1000 ];
+
+            ssize_t numRead = read( job.reportFd, buf, sizeof(buf) );
+
+            if ( numRead < 0 && errno == EINTR )
+            {
+                continue;
+            }
+
+            if ( numRead > 0 )
+            {
+                job.report.append( buf, (size_t)numRead );
+                continue;
+            }
+
+            // The job has finished.
+            close( job.reportFd );
+
+            int exitStatus = 0;
+            waitpid( job.pid, &exitStatus, 0 );
+
+            std::cout << "job " << job.jobIndex << " finished";
+
+            if ( WIFEXITED( exitStatus ) == false )
+            {
+                std::cout << " abnormally";
+            }
+
+            std::cout << std::endl;
+
+            size_t lineStart = 0;
+
+            while ( lineStart < job.report.size() )
+            {
+                size_t lineEnd = job.report.find( '\n', lineStart );
+
+                if ( lineEnd == std::string::npos )
+                {
+                    lineEnd = job.report.size();
+                }
+
+                if ( lineEnd > lineStart )
+                {
+                    usedPaths.push_back( job.report.substr( lineStart, lineEnd - lineStart ) );
+                }
+
+                lineStart = ( lineEnd + 1 );
+            }
+
+            jobs.erase( jobs.begin() + jobIdx );
+        }
+
+        // Warm the cache for the following jobs.
+        if ( usedPaths.empty() == false )
+        {
+            for ( const std::string& path : usedPaths )
+            {
+                imageCache.Load( path );
+            }
+
+            // The jobs are forked from this process; they must not share the offsets of open archive files.
+            CloseInputArchives();
+
+            imageCache.EvictToMemoryCap();
+
+            std::cout << "image cache: " << imageCache.GetImageCount() << " images, " << ( imageCache.GetMemoryUsage() >> 20 ) << "MB" << std::endl;
+        }
+
+        if ( canAcceptJob && pollFds.back().revents != 0 )
+        {
+            int clientFd = accept( listenFd, nullptr, nullptr );
+
+            if ( clientFd < 0 )
+            {
+                continue;
+            }
+
+            int reportPipe[ 2 ];
+
+            if ( pipe( reportPipe ) != 0 )
+            {
+                close( clientFd );
+                continue;
+            }
+
+            unsigned long jobIndex = ++numJobsStarted;
+
+            std::cout << "job " << jobIndex << " started" << std::endl;
+
+            // Buffered output would be duplicated into the job.
+            FlushLog();
+
+            pid_t jobPid = fork();
+
+            if ( jobPid == 0 )
+            {
+                close( listenFd );
+                close( reportPipe[0] );
+
+                for ( const runningJob& job : jobs )
+                {
+                    close( job.reportFd );
+                }
+
+                RunServerJob( clientFd, imageCache, jobFunc );
+
+                close( clientFd );
+
+                // Report the images that were used.
+                for ( const std::string& path : imageCache.GetUsedPaths() )
+                {
+                    WriteAll( reportPipe[1], path.c_str(), path.size() );
+                    WriteAll( reportPipe[1], "\n", 1 );
+                }
+
+                close( reportPipe[1] );
+
+                // Do not run any cleanup of the server process.
+                _exit( 0 );
+            }
+
+            close( clientFd );
+            close( reportPipe[1] );
+
+            if ( jobPid < 0 )
+            {
+                std::cout << "failed to start job process" << std::endl;
+
+                close( reportPipe[0] );
+                continue;
+            }
+
+            runningJob job;
+            job.pid = jobPid;
+            job.reportFd = reportPipe[0];
+            job.jobIndex = jobIndex;
+
+            jobs.push_back( std::move( job ) );
+        }
+    }
+
+    close( listenFd );
+    unlink( socketPath );
+
+    return -24;
+}
+
+int RunEmbedClient( const char *socketPath, int numJobArgs, char *jobArgs[] )
+{
+    sockaddr_un addr;
+
+    if ( !FillUnixSocketAddress( socketPath, addr ) )
+    {
+        std::cout << "socket path is too long (" << socketPath << ")" << std::endl;
+
+        return -24;
+    }
+
+    int serverFd = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+    if ( serverFd < 0 || connect( serverFd, (const sockaddr*)&addr, sizeof(addr) ) != 0 )
+    {
+        std::cout << "failed to connect to embed server (" << socketPath << ")" << std::endl;
+
+        if ( serverFd >= 0 )
+        {
+            close( serverFd );
+        }
+        return -24;
+    }
+
+    // Send the request.
+    {
+        std::string request;
+
+        char workDir[ PATH_MAX ];
+
+        if ( getcwd( workDir, sizeof(workDir) ) == nullptr )
+        {
+            close( serverFd );
+            return -24;
+        }
+
+        request.append( workDir, strlen( workDir ) + 1 );
+
+        for ( int n = 0; n < numJobArgs; n++ )
+        {
+            request.append( jobArgs[n], strlen( jobArgs[n] ) + 1 );
+        }
+
+        request += '\0';
+
+        if ( !WriteAll( serverFd, request.data(), request.size() ) )
+        {
+            std::cout << "failed to send job to embed server" << std::endl;
+
+            close( serverFd );
+            return -24;
+        }
+    }
+
+    // Print the log until the terminator, then read the result code.
+    bool hasTerminator = false;
+    std::string resultBytes;
+
+    char buf[ 0x1000 ];
+
+    while ( true )
+    {
+        ssize_t numRead = read( serverFd, buf, sizeof(buf) );
+
+        if ( numRead < 0 && errno == EINTR )
+        {
+            continue;
+        }
+
+        if ( numRead <= 0 )
+        {
+            break;
+        }
+
+        size_t logLen = (size_t)numRead;
+
+        if ( hasTerminator == false )
+        {
+            const char *terminatorPtr = (const char*)memchr( buf, 0, (size_t)numRead );
+
+            if ( terminatorPtr != nullptr )
+            {
+                hasTerminator = true;
+
+                logLen = (size_t)( terminatorPtr - buf );
+
+                resultBytes.append( terminatorPtr + 1, (size_t)numRead - logLen - 1 );
+            }
+
+            WriteRelayedLog( buf, logLen );
+        }
+        else
+        {
+            resultBytes.append( buf, (size_t)numRead );
+        }
+    }
+
+    close( serverFd );
+
+    FlushLog();
+
+    std::int32_t resultCode;
+
+    if ( hasTerminator == false || resultBytes.size() < sizeof(resultCode) )
+    {
+        std::cout << "connection to embed server was lost" << std::endl;
+
+        return -24;
+    }
+
+    memcpy( &resultCode, resultBytes.data(), sizeof(resultCode) );
+
+    return (int)resultCode;
+}
+
+#else
+
+int RunEmbedServer( const char *socketPath, unsigned int maxWorkers, size_t cacheMemoryCap, embedJobFunc_t jobFunc )
+{
+    std::cout << "the embed server requires Unix-domain sockets and is not supported on this platform" << std::endl;
+
+    return -24;
+}
+
+int RunEmbedClient( const char *socketPath, int numJobArgs, char *jobArgs[] )
+{
+    std::cout << "the embed server requires Unix-domain sockets and is not supported on this platform" << std::endl;
+
+    return -24;
+}
+
+#endif //_WIN32
@@ -0,0 +1,18 @@
+#ifndef _EMBED_SERVER_
+#define _EMBED_SERVER_
+
+#include "imagecache.h"
+
+// Runs a single embed job with the regular command line; images are taken from the cache if given.
+typedef int (*embedJobFunc_t)( int argc, char *argv[], peImageCache *imageCache );
+
+// Resident embed server on a local Unix-domain socket.
+// Every job is run in a forked process that inherits the parsed image cache of the server; its
+// log output and result code are streamed back to the client. At most maxWorkers jobs run at the same time.
+// After each job the server parses the images that the job used, so that following jobs find them cached.
+int RunEmbedServer( const char *socketPath, unsigned int maxWorkers, size_t cacheMemoryCap, embedJobFunc_t jobFunc );
+
+// Sends an embed job to a running server and prints its log; returns the result code of the job.
+int RunEmbedClient( const char *socketPath, int numJobArgs, char *jobArgs[] );
+
+#endif //_EMBED_SERVER_
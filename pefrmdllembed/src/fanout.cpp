@@ -0,0 +1,491 @@
+#include "fanout.h"
+#include "embedlog.h"
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#else
+#define NOMINMAX
+#include <windows.h>
+#include <memory>
+#include <thread>
+#endif //_WIN32
+
+static void PrintTargetResult( const fanOutTarget& target, int resultCode )
+{
+    std::cout << "target " << target.inputExecPath << " -> " << target.outputExecPath << ": ";
+
+    if ( resultCode == 0 )
+    {
+        std::cout << "success";
+    }
+    else
+    {
+        std::cout << "failed (" << resultCode << ")";
+    }
+
+    std::cout << std::endl;
+}
+
+#ifndef _WIN32
+
+static bool WriteAll( int fd, const void *buf, size_t bufSize )
+{
+    const char *bytes = (const char*)buf;
+
+    while ( bufSize > 0 )
+    {
+        ssize_t numWritten = write( fd, bytes, bufSize );
+
+        if ( numWritten < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        bytes += numWritten;
+        bufSize -= (size_t)numWritten;
+    }
+
+    return true;
+}
+
+int RunFanOutJobs( const std::vector <fanOutTarget>& targets, unsigned int maxParallel, const fanOutArgsFunc_t& makeJobArgs, const fanOutJobFunc_t& runJob )
+{
+    if ( maxParallel == 0 )
+    {
+        maxParallel = 1;
+    }
+
+    struct runningJob
+    {
+        size_t targetIdx;
+        pid_t pid;
+        int logFd;
+        std::string log;
+    };
+
+    std::vector <runningJob> jobs;
+    std::vector <int> resultCodes( targets.size(), 0 );
+
+    size_t nextTargetIdx = 0;
+    size_t numTargets = targets.size();
+
+    while ( nextTargetIdx < numTargets || jobs.empty() == false )
+    {
+        // Start as many jobs as we may.
+        while ( nextTargetIdx < numTargets && jobs.size() < maxParallel )
+        {
+            size_t targetIdx = nextTargetIdx++;
+
+            int logPipe[ 2 ];
+
+            if ( pipe( logPipe ) != 0 )
+            {
+                std::cout << "failed to create log pipe for target job" << std::endl;
+
+                resultCodes[ targetIdx ] = -25;
+                continue;
+            }
+
+            // Buffered output would be duplicated into the job.
+            FlushLog();
+
+            pid_t jobPid = fork();
+
+            if ( jobPid == 0 )
+            {
+                close( logPipe[0] );
+
+                for ( const runningJob& job : jobs )
+                {
+                    close( job.logFd );
+                }
+
+                dup2( logPipe[1], STDOUT_FILENO );
+
+                std::vector <char*> jobArgv = makeJobArgs( targets[ targetIdx ] );
+                jobArgv.push_back( nullptr );
+
+                int jobResult = runJob( (int)( jobArgv.size() - 1 ), jobArgv.data() );
+
+                FlushLog();
+
+                // Terminate the log with the result code.
+                char terminator = 0;
+                std::int32_t resultCode = (std::int32_t)jobResult;
+
+                WriteAll( logPipe[1], &terminator, sizeof(terminator) );
+                WriteAll( logPipe[1], &resultCode, sizeof(resultCode) );
+
+                // Do not run any cleanup of the parent process.
+                _exit( 0 );
+            }
+
+            close( logPipe[1] );
+
+            if ( jobPid < 0 )
+            {
+                std::cout << "failed to start target job process" << std::endl;
+
+                close( logPipe[0] );
+
+                resultCodes[ targetIdx ] = -25;
+                continue;
+            }
+
+            runningJob job;
+            job.targetIdx = targetIdx;
+            job.pid = jobPid;
+            job.logFd = logPipe[0];
+
+            jobs.push_back( std::move( job ) );
+        }
+
+        if ( jobs.empty() )
+        {
+            continue;
+        }
+
+        std::vector <pollfd> pollFds;
+
+        for ( const runningJob& job : jobs )
+        {
+            pollFds.push_back( { job.logFd, POLLIN, 0 } );
+        }
+
+        if ( poll( pollFds.data(), (nfds_t)pollFds.size(), -1 ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            std::cout << "failed to wait for target jobs" << std::endl;
+
+            return -25;
+        }
+
+        for ( size_t n = jobs.size(); n > 0; n-- )
+        {
+            size_t jobIdx = ( n - 1 );
+
+            if ( pollFds[ jobIdx ].revents == 0 )
+            {
+                continue;
+            }
+
+            runningJob& job = jobs[ jobIdx ];
+
+            char buf[ 0x1000 ];
+
+            ssize_t numRead = read( job.logFd, buf, sizeof(buf) );
+
+            if ( numRead < 0 && errno == EINTR )
+            {
+                continue;
+            }
+
+            if ( numRead > 0 )
+            {
+                job.log.append( buf, (size_t)numRead );
+                continue;
+            }
+
+            // The job has finished.
+            close( job.logFd );
+            waitpid( job.pid, nullptr, 0 );
+
+            const fanOutTarget& target = targets[ job.targetIdx ];
+
+            int resultCode = -25;
+
+            size_t terminatorPos = job.log.find( '\0' );
+
+            if ( terminatorPos != std::string::npos && job.log.size() - terminatorPos - 1 >= sizeof(std::int32_t) )
+            {
+                std::int32_t jobResult;
+                memcpy( &jobResult, job.log.data() + terminatorPos + 1, sizeof(jobResult) );
+
+                resultCode = (int)jobResult;
+
+                job.log.resize( terminatorPos );
+            }
+
+            std::cout << "=== " << target.inputExecPath << " -> " << target.outputExecPath << " ===" << std::endl;
+            WriteRelayedLog( job.log.data(), job.log.size() );
+            std::cout << std::endl;
+
+            resultCodes[ job.targetIdx ] = resultCode;
+
+            jobs.erase( jobs.begin() + jobIdx );
+        }
+    }
+
+    int fanOutResult = 0;
+
+    for ( size_t n = 0; n < numTargets; n++ )
+    {
+        int resultCode = resultCodes[ n ];
+
+        PrintTargetResult( targets[ n ], resultCode );
+
+        if ( resultCode != 0 && fanOutResult == 0 )
+        {
+            fanOutResult = resultCode;
+        }
+    }
+
+    return fanOutResult;
+}
+
+#else
+
+// Appends one argument so that the C runtime of the job parses it back unchanged.
+static void AppendCommandLineArg( std::string& cmdLine, const char *arg )
+{
+    if ( cmdLine.empty() == false )
+    {
+        cmdLine += ' ';
+    }
+
+    if ( *arg != 0 && strpbrk( arg, " \t\"" ) == nullptr )
+    {
+        cmdLine += arg;
+        return;
+    }
+
+    cmdLine += '"';
+
+    size_t numBackslashes = 0;
+
+    for ( const char *iter = arg; *iter != 0; iter++ )
+    {
+        if ( *iter == '\\' )
+        {
+            numBackslashes++;
+            continue;
+        }
+
+        // Backslashes only escape when they precede a quote.
+        if ( *iter == '"' )
+        {
+            cmdLine.append( numBackslashes * 2 + 1, '\\' );
+        }
+        else
+        {
+            cmdLine.append( numBackslashes, '\\' );
+        }
+
+        numBackslashes = 0;
+
+        cmdLine += *iter;
+    }
+
+    cmdLine.append( numBackslashes * 2, '\\' );
+    cmdLine += '"';
+}
+
+int RunFanOutJobs( const std::vector <fanOutTarget>& targets, unsigned int maxParallel, const fanOutArgsFunc_t& makeJobArgs, const fanOutJobFunc_t& runJob )
+{
+    if ( maxParallel == 0 )
+    {
+        maxParallel = 1;
+    }
+
+    if ( maxParallel > MAXIMUM_WAIT_OBJECTS )
+    {
+        maxParallel = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    char exePath[ MAX_PATH + 1 ];
+
+    DWORD exePathLen = GetModuleFileNameA( nullptr, exePath, MAX_PATH );
+
+    if ( exePathLen == 0 || exePathLen >= MAX_PATH )
+    {
+        std::cout << "failed to get the path of the executable for target jobs" << std::endl;
+
+        return -25;
+    }
+
+    exePath[ exePathLen ] = 0;
+
+    struct runningJob
+    {
+        size_t targetIdx;
+        HANDLE process;
+        HANDLE logPipe;
+        std::string log;
+        std::thread logReader;
+    };
+
+    // The log readers point at their job, so jobs do not move.
+    std::vector <std::unique_ptr <runningJob>> jobs;
+    std::vector <int> resultCodes( targets.size(), 0 );
+
+    size_t nextTargetIdx = 0;
+    size_t numTargets = targets.size();
+
+    while ( nextTargetIdx < numTargets || jobs.empty() == false )
+    {
+        // Start as many jobs as we may.
+        while ( nextTargetIdx < numTargets && jobs.size() < maxParallel )
+        {
+            size_t targetIdx = nextTargetIdx++;
+
+            std::string cmdLine;
+
+            for ( const char *arg : makeJobArgs( targets[ targetIdx ] ) )
+            {
+                AppendCommandLineArg( cmdLine, arg );
+            }
+
+            SECURITY_ATTRIBUTES pipeAttribs;
+            pipeAttribs.nLength = sizeof(pipeAttribs);
+            pipeAttribs.lpSecurityDescriptor = nullptr;
+            pipeAttribs.bInheritHandle = TRUE;
+
+            HANDLE logRead, logWrite;
+
+            if ( CreatePipe( &logRead, &logWrite, &pipeAttribs, 0 ) == FALSE )
+            {
+                std::cout << "failed to create log pipe for target job" << std::endl;
+
+                resultCodes[ targetIdx ] = -25;
+                continue;
+            }
+
+            // Only the job gets the write end; other jobs must not keep our pipes open.
+            SetHandleInformation( logRead, HANDLE_FLAG_INHERIT, 0 );
+
+            STARTUPINFOA startInfo;
+            memset( &startInfo, 0, sizeof(startInfo) );
+            startInfo.cb = sizeof(startInfo);
+            startInfo.dwFlags = STARTF_USESTDHANDLES;
+            startInfo.hStdInput = GetStdHandle( STD_INPUT_HANDLE );
+            startInfo.hStdOutput = logWrite;
+            startInfo.hStdError = logWrite;
+
+            PROCESS_INFORMATION procInfo;
+
+            BOOL didStart = CreateProcessA( exePath, &cmdLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startInfo, &procInfo );
+
+            CloseHandle( logWrite );
+
+            if ( didStart == FALSE )
+            {
+                std::cout << "failed to start target job process" << std::endl;
+
+                CloseHandle( logRead );
+
+                resultCodes[ targetIdx ] = -25;
+                continue;
+            }
+
+            CloseHandle( procInfo.hThread );
+
+            std::unique_ptr <runningJob> job = std::make_unique <runningJob> ();
+            job->targetIdx = targetIdx;
+            job->process = procInfo.hProcess;
+            job->logPipe = logRead;
+
+            runningJob *jobPtr = job.get();
+
+            // Pipes cannot be waited on together with processes, so every job gets a reader of its own.
+            job->logReader = std::thread( [jobPtr]
+            {
+                char buf[ 0x1000 ];
+                DWORD numRead;
+
+                while ( ReadFile( jobPtr->logPipe, buf, sizeof(buf), &numRead, nullptr ) != FALSE && numRead > 0 )
+                {
+                    jobPtr->log.append( buf, numRead );
+                }
+            });
+
+            jobs.push_back( std::move( job ) );
+        }
+
+        if ( jobs.empty() )
+        {
+            continue;
+        }
+
+        std::vector <HANDLE> processes;
+
+        for ( const std::unique_ptr <runningJob>& job : jobs )
+        {
+            processes.push_back( job->process );
+        }
+
+        DWORD waitResult = WaitForMultipleObjects( (DWORD)processes.size(), processes.data(), FALSE, INFINITE );
+
+        if ( waitResult >= WAIT_OBJECT_0 + processes.size() )
+        {
+            std::cout << "failed to wait for target jobs" << std::endl;
+
+            return -25;
+        }
+
+        size_t jobIdx = ( waitResult - WAIT_OBJECT_0 );
+
+        runningJob& job = *jobs[ jobIdx ];
+
+        // The pipe breaks once the job has exited.
+        job.logReader.join();
+
+        DWORD exitCode;
+
+        int resultCode = -25;
+
+        if ( GetExitCodeProcess( job.process, &exitCode ) != FALSE )
+        {
+            resultCode = (int)exitCode;
+        }
+
+        CloseHandle( job.logPipe );
+        CloseHandle( job.process );
+
+        const fanOutTarget& target = targets[ job.targetIdx ];
+
+        std::cout << "=== " << target.inputExecPath << " -> " << target.outputExecPath << " ===" << std::endl;
+        WriteRelayedLog( job.log.data(), job.log.size() );
+        std::cout << std::endl;
+
+        resultCodes[ job.targetIdx ] = resultCode;
+
+        jobs.erase( jobs.begin() + jobIdx );
+    }
+
+    int fanOutResult = 0;
+
+    for ( size_t n = 0; n < numTargets; n++ )
+    {
+        int resultCode = resultCodes[ n ];
+
+        PrintTargetResult( targets[ n ], resultCode );
+
+        if ( resultCode != 0 && fanOutResult == 0 )
+        {
+            fanOutResult = resultCode;
+        }
+    }
+
+    return fanOutResult;
+}
+
+#endif //_WIN32
@@ -0,0 +1,26 @@
+#ifndef _FAN_OUT_
+#define _FAN_OUT_
+
+#include <functional>
+#include <vector>
+
+// Executable that the shared module set is embedded into.
+struct fanOutTarget
+{
+    const char *inputExecPath;
+    const char *outputExecPath;
+};
+
+// Command line of the job of a target, program name first and without a terminating null pointer.
+typedef std::function <std::vector <char*> ( const fanOutTarget& target )> fanOutArgsFunc_t;
+
+typedef std::function <int ( int argc, char *argv[] )> fanOutJobFunc_t;
+
+// Runs one job per target, each in a child process; up to maxParallel jobs run at the same time and the
+// log of each job is printed in one piece once it has finished. Where fork() is available the child calls
+// runJob, so that all jobs share the images that were parsed before this call. On Windows the job command
+// lines are run by new processes of this executable instead, which parse their images themselves.
+// Returns zero if all jobs succeeded, otherwise the result code of the first failing target.
+int RunFanOutJobs( const std::vector <fanOutTarget>& targets, unsigned int maxParallel, const fanOutArgsFunc_t& makeJobArgs, const fanOutJobFunc_t& runJob );
+
+#endif //_FAN_OUT_
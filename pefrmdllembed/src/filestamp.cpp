@@ -0,0 +1,77 @@
+#include "filestamp.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif //_WIN32
+
+#ifdef _WIN32
+
+static inline std::int64_t GetFileTimeValue( const FILETIME& fileTime )
+{
+    return (std::int64_t)( ( (std::uint64_t)fileTime.dwHighDateTime << 32 ) | fileTime.dwLowDateTime );
+}
+
+bool GetFileStamp( const char *path, fileStamp& stampOut )
+{
+    // No access rights are needed to query the file information.
+    HANDLE fileHandle = CreateFileA(
+        path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr
+    );
+
+    if ( fileHandle == INVALID_HANDLE_VALUE )
+    {
+        return false;
+    }
+
+    BY_HANDLE_FILE_INFORMATION fileInfo;
+
+    BOOL couldQuery = GetFileInformationByHandle( fileHandle, &fileInfo );
+
+    CloseHandle( fileHandle );
+
+    if ( couldQuery == FALSE )
+    {
+        return false;
+    }
+
+    stampOut.fileSize = ( ( (std::uint64_t)fileInfo.nFileSizeHigh << 32 ) | fileInfo.nFileSizeLow );
+    stampOut.modTime = GetFileTimeValue( fileInfo.ftLastWriteTime );
+    stampOut.changeTime = GetFileTimeValue( fileInfo.ftCreationTime );
+    stampOut.fileIndex = ( ( (std::uint64_t)fileInfo.nFileIndexHigh << 32 ) | fileInfo.nFileIndexLow );
+    stampOut.deviceIndex = fileInfo.dwVolumeSerialNumber;
+
+    return true;
+}
+
+#else
+
+bool GetFileStamp( const char *path, fileStamp& stampOut )
+{
+    struct stat fileInfo;
+
+    if ( stat( path, &fileInfo ) != 0 )
+    {
+        return false;
+    }
+
+#ifdef __APPLE__
+    const struct timespec& modTime = fileInfo.st_mtimespec;
+    const struct timespec& changeTime = fileInfo.st_ctimespec;
+#else
+    const struct timespec& modTime = fileInfo.st_mtim;
+    const struct timespec& changeTime = fileInfo.st_ctim;
+#endif //__APPLE__
+
+    stampOut.fileSize = (std::uint64_t)fileInfo.st_size;
+    stampOut.modTime = ( (std::int64_t)modTime.tv_sec * 1000000000 + modTime.tv_nsec );
+    stampOut.changeTime = ( (std::int64_t)changeTime.tv_sec * 1000000000 + changeTime.tv_nsec );
+    stampOut.fileIndex = (std::uint64_t)fileInfo.st_ino;
+    stampOut.deviceIndex = (std::uint64_t)fileInfo.st_dev;
+
+    return true;
+}
+
+#endif //_WIN32
@@ -0,0 +1,34 @@
+#ifndef _FILE_STAMP_
+#define _FILE_STAMP_
+
+#include <cstdint>
+
+// Identity of a file on disk that tells whether a cached copy of it is still current. The modification time
+// of stat has a granularity of one second, so a file that is rebuilt within the same second at the same size
+// would look unchanged; the stamp uses the times at full resolution and the file index as well.
+struct fileStamp
+{
+    std::uint64_t fileSize = 0;
+    std::int64_t modTime = 0;           // nanoseconds on POSIX, 100ns units on Windows.
+    std::int64_t changeTime = 0;        // status change time on POSIX, creation time on Windows.
+    std::uint64_t fileIndex = 0;        // inode number or NTFS file index.
+    std::uint64_t deviceIndex = 0;      // device or volume serial number.
+
+    inline bool operator == ( const fileStamp& right ) const
+    {
+        return (
+            this->fileSize == right.fileSize && this->modTime == right.modTime && this->changeTime == right.changeTime &&
+            this->fileIndex == right.fileIndex && this->deviceIndex == right.deviceIndex
+        );
+    }
+
+    inline bool operator != ( const fileStamp& right ) const
+    {
+        return !( *this == right );
+    }
+};
+
+// Returns false if the file does not exist.
+bool GetFileStamp( const char *path, fileStamp& stampOut );
+
+#endif //_FILE_STAMP_
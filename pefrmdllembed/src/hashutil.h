@@ -0,0 +1,42 @@
+#ifndef _HASH_UTILITIES_
+#define _HASH_UTILITIES_
+
+#include <cstdint>
+#include <cstddef>
+
+// Streaming 64bit FNV-1a hash; used to identify content, not to protect it.
+struct contentHash64
+{
+    inline void Update( const void *data, size_t dataSize )
+    {
+        const unsigned char *bytes = (const unsigned char*)data;
+
+        std::uint64_t hash = this->value;
+
+        for ( size_t n = 0; n < dataSize; n++ )
+        {
+            hash ^= bytes[n];
+            hash *= 0x100000001B3ull;
+        }
+
+        this->value = hash;
+    }
+
+    inline std::uint64_t GetValue( void ) const
+    {
+        return this->value;
+    }
+
+    static inline std::uint64_t HashData( const void *data, size_t dataSize )
+    {
+        contentHash64 hash;
+        hash.Update( data, dataSize );
+
+        return hash.GetValue();
+    }
+
+private:
+    std::uint64_t value = 0xCBF29CE484222325ull;
+};
+
+#endif //_HASH_UTILITIES_
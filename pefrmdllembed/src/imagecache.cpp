@@ -0,0 +1,169 @@
+#include "imagecache.h"
+#include "archivesource.h"
+
+#include <cstdlib>
+#include <climits>
+
+bool peImageCache::GetFileIdentity( const char *path, std::string& absPathOut, fileStamp& stampOut )
+{
+    // Archive entries are identified by the archive file.
+    std::string archivePath, entryPath;
+
+    if ( SplitArchiveEntryPath( path, archivePath, entryPath ) )
+    {
+        if ( !GetFileIdentity( archivePath.c_str(), absPathOut, stampOut ) )
+        {
+            return false;
+        }
+
+        absPathOut += ':';
+        absPathOut += entryPath;
+
+        return true;
+    }
+
+    if ( !GetFileStamp( path, stampOut ) )
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    char absPath[ _MAX_PATH ];
+
+    if ( _fullpath( absPath, path, countof(absPath) ) == nullptr )
+    {
+        return false;
+    }
+#else
+    char absPath[ PATH_MAX ];
+
+    if ( realpath( path, absPath ) == nullptr )
+    {
+        return false;
+    }
+#endif //_WIN32
+
+    absPathOut = absPath;
+
+    return true;
+}
+
+std::unique_ptr <PEFile> peImageCache::Take( const char *path, std::shared_ptr <const resourceSnapshot> *resourcesOut )
+{
+    std::string absPath;
+    fileStamp stamp;
+
+    if ( !GetFileIdentity( path, absPath, stamp ) )
+    {
+        return nullptr;
+    }
+
+    this->usedPaths.push_back( absPath );
+
+    auto findIter = this->images.find( absPath );
+
+    if ( findIter == this->images.end() )
+    {
+        return nullptr;
+    }
+
+    cachedImage& entry = findIter->second;
+
+    if ( entry.stamp != stamp )
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr <PEFile> image = std::move( entry.image );
+
+    if ( resourcesOut != nullptr )
+    {
+        *resourcesOut = entry.resources;
+    }
+
+    this->Remove( findIter );
+
+    return image;
+}
+
+bool peImageCache::Load( const std::string& absPath )
+{
+    std::string identityPath;
+    fileStamp stamp;
+
+    if ( !GetFileIdentity( absPath.c_str(), identityPath, stamp ) )
+    {
+        return false;
+    }
+
+    auto findIter = this->images.find( identityPath );
+
+    if ( findIter != this->images.end() )
+    {
+        cachedImage& entry = findIter->second;
+
+        if ( entry.stamp == stamp )
+        {
+            // Just mark it as recently used.
+            this->lruList.splice( this->lruList.begin(), this->lruList, entry.lruNode );
+            return true;
+        }
+
+        // Stale.
+        this->Remove( findIter );
+    }
+
+    std::unique_ptr <PEFile> image = std::make_unique <PEFile> ();
+    {
+        std::unique_ptr <PEStream> peStream = OpenInputStream( identityPath.c_str() );
+
+        if ( !peStream )
+        {
+            return false;
+        }
+
+        try
+        {
+            image->LoadFromDisk( peStream.get() );
+        }
+        catch( peframework_exception& )
+        {
+            // The job reports the error itself.
+            return false;
+        }
+    }
+
+    this->lruList.push_front( identityPath );
+
+    cachedImage entry;
+    entry.stamp = stamp;
+    entry.resources = resourceSnapshot::Create( image->resourceRoot );
+    entry.image = std::move( image );
+    entry.lruNode = this->lruList.begin();
+
+    this->images.insert( std::make_pair( identityPath, std::move( entry ) ) );
+
+    this->memoryUsage += (size_t)stamp.fileSize;
+
+    return true;
+}
+
+void peImageCache::Remove( std::unordered_map <std::string, cachedImage>::iterator iter )
+{
+    this->memoryUsage -= (size_t)iter->second.stamp.fileSize;
+
+    this->lruList.erase( iter->second.lruNode );
+    this->images.erase( iter );
+}
+
+void peImageCache::EvictToMemoryCap( void )
+{
+    while ( this->memoryUsage > this->memoryCap && this->lruList.empty() == false )
+    {
+        auto findIter = this->images.find( this->lruList.back() );
+
+        assert( findIter != this->images.end() );
+
+        this->Remove( findIter );
+    }
+}
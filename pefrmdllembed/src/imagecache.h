@@ -0,0 +1,64 @@
+#ifndef _IMAGE_CACHE_
+#define _IMAGE_CACHE_
+
+#include <peframework.h>
+
+#include "resourcesnapshot.h"
+#include "filestamp.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+// Parsed PE images of the embed server, keyed by absolute path and checked against the file stamp.
+// Jobs run in processes that are forked from the server, so every job works on its own
+// copy-on-write view of the cache and may take images out of it to modify them.
+struct peImageCache
+{
+    inline peImageCache( size_t memoryCap ) : memoryCap( memoryCap )
+    {
+        return;
+    }
+
+    // Moves the image out of the cache if the file on disk did not change since it was cached.
+    // The path is remembered as used either way, so that the server can warm the cache.
+    // The resource snapshot of the image stays shared with the cache.
+    std::unique_ptr <PEFile> Take( const char *path, std::shared_ptr <const resourceSnapshot> *resourcesOut = nullptr );
+
+    // Parses the image into the cache unless an up-to-date copy is present already.
+    bool Load( const std::string& absPath );
+
+    // Drops the least recently used images until the memory cap is met.
+    void EvictToMemoryCap( void );
+
+    inline size_t GetMemoryUsage( void ) const                      { return this->memoryUsage; }
+    inline size_t GetImageCount( void ) const                       { return this->images.size(); }
+    inline const std::vector <std::string>& GetUsedPaths( void ) const  { return this->usedPaths; }
+
+    // Archive entries have the identity of their archive file, with the entry path appended to the absolute path.
+    static bool GetFileIdentity( const char *path, std::string& absPathOut, fileStamp& stampOut );
+
+private:
+    struct cachedImage
+    {
+        fileStamp stamp;
+        std::unique_ptr <PEFile> image;
+        std::shared_ptr <const resourceSnapshot> resources;
+        std::list <std::string>::iterator lruNode;
+    };
+
+    void Remove( std::unordered_map <std::string, cachedImage>::iterator iter );
+
+    std::unordered_map <std::string, cachedImage> images;
+    std::list <std::string> lruList;    // most recently used first.
+
+    size_t memoryCap;
+    size_t memoryUsage = 0;             // estimated by the file sizes of the images.
+
+    std::vector <std::string> usedPaths;
+};
+
+#endif //_IMAGE_CACHE_
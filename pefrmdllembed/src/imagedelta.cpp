@@ -0,0 +1,626 @@
+#include "imagedelta.h"
+
+#include "hashutil.h"
+#include "layoutmanifest.h"
+#include "outputsink.h"
+
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+static const char deltaMagic[ 8 ] = { 'P', 'E', 'D', 'E', 'L', 'T', 'A', '1' };
+
+enum eDeltaOperation : unsigned char
+{
+    DELTA_OP_END = 0,
+    DELTA_OP_COPY = 1,
+    DELTA_OP_LITERAL = 2
+};
+
+// Files are streamed in chunks of this size, so memory use does not depend on the image size.
+static const size_t deltaChunkSize = 0x10000;
+
+// Granularity of the comparison; small enough that patched pointers do not turn whole pages into literals.
+static const size_t deltaBlockSize = 64;
+
+static void WriteUInt64LE( std::ostream& stream, std::uint64_t value )
+{
+    unsigned char bytes[ 8 ];
+
+    for ( unsigned int n = 0; n < 8; n++ )
+    {
+        bytes[n] = (unsigned char)( value >> ( n * 8 ) );
+    }
+
+    stream.write( (const char*)bytes, sizeof(bytes) );
+}
+
+static bool ReadUInt64LE( std::istream& stream, std::uint64_t& valueOut )
+{
+    unsigned char bytes[ 8 ];
+
+    if ( !stream.read( (char*)bytes, sizeof(bytes) ) )
+    {
+        return false;
+    }
+
+    std::uint64_t value = 0;
+
+    for ( unsigned int n = 0; n < 8; n++ )
+    {
+        value |= ( (std::uint64_t)bytes[n] << ( n * 8 ) );
+    }
+
+    valueOut = value;
+    return true;
+}
+
+static inline std::uint32_t GetUInt32LE( const unsigned char *bytes )
+{
+    return ( (std::uint32_t)bytes[0] | ( (std::uint32_t)bytes[1] << 8 ) | ( (std::uint32_t)bytes[2] << 16 ) | ( (std::uint32_t)bytes[3] << 24 ) );
+}
+
+static inline std::uint16_t GetUInt16LE( const unsigned char *bytes )
+{
+    return (std::uint16_t)( bytes[0] | ( bytes[1] << 8 ) );
+}
+
+static bool ReadBytesAt( std::istream& stream, std::uint64_t offset, void *buf, size_t count )
+{
+    stream.clear();
+    stream.seekg( (std::streamoff)offset );
+
+    return ( (bool)stream.read( (char*)buf, (std::streamsize)count ) );
+}
+
+struct rawSectionInfo
+{
+    char name[ 8 ];
+    std::uint32_t virtualAddress;
+    std::uint64_t fileOffset;
+    std::uint64_t fileSize;
+};
+
+// Reads where the raw data of each section is located in the file; returns false if the file is no PE image.
+static bool ReadImageLayout( std::istream& stream, std::uint64_t fileSize, std::vector <rawSectionInfo>& sectionsOut )
+{
+    unsigned char peHeaderOffBytes[ 4 ];
+
+    if ( !ReadBytesAt( stream, 0x3C, peHeaderOffBytes, sizeof(peHeaderOffBytes) ) )
+    {
+        return false;
+    }
+
+    std::uint32_t peHeaderOff = GetUInt32LE( peHeaderOffBytes );
+
+    // Signature and file header.
+    unsigned char peHeader[ 24 ];
+
+    if ( !ReadBytesAt( stream, peHeaderOff, peHeader, sizeof(peHeader) ) || memcmp( peHeader, "PE\0\0", 4 ) != 0 )
+    {
+        return false;
+    }
+
+    std::uint16_t numSections = GetUInt16LE( peHeader + 4 + 2 );
+    std::uint16_t optHeaderSize = GetUInt16LE( peHeader + 4 + 16 );
+
+    std::uint64_t sectTableOff = ( (std::uint64_t)peHeaderOff + sizeof(peHeader) + optHeaderSize );
+
+    for ( std::uint16_t n = 0; n < numSections; n++ )
+    {
+        unsigned char sectHeader[ 40 ];
+
+        if ( !ReadBytesAt( stream, sectTableOff + n * sizeof(sectHeader), sectHeader, sizeof(sectHeader) ) )
+        {
+            return false;
+        }
+
+        rawSectionInfo info;
+        memcpy( info.name, sectHeader, sizeof(info.name) );
+        info.virtualAddress = GetUInt32LE( sectHeader + 12 );
+        info.fileOffset = GetUInt32LE( sectHeader + 20 );
+        info.fileSize = GetUInt32LE( sectHeader + 16 );
+
+        // Ignore data that is not present in the file.
+        if ( info.fileOffset >= fileSize )
+        {
+            continue;
+        }
+
+        info.fileSize = std::min( info.fileSize, fileSize - info.fileOffset );
+
+        if ( info.fileSize == 0 )
+        {
+            continue;
+        }
+
+        sectionsOut.push_back( info );
+    }
+
+    return true;
+}
+
+// Collects the operations and writes them with as few entries as possible.
+struct deltaWriter
+{
+    inline deltaWriter( std::ostream& stream, imageDeltaStats& stats ) : stream( stream ), stats( stats )
+    {
+        this->literalBuf.reserve( deltaChunkSize );
+    }
+
+    void Copy( std::uint64_t sourceOff, std::uint64_t length )
+    {
+        this->FlushLiteral();
+
+        if ( this->copyLength > 0 && this->copySourceOff + this->copyLength == sourceOff )
+        {
+            this->copyLength += length;
+            return;
+        }
+
+        this->FlushCopy();
+
+        this->copySourceOff = sourceOff;
+        this->copyLength = length;
+    }
+
+    void Literal( const char *data, size_t length )
+    {
+        this->FlushCopy();
+
+        while ( length > 0 )
+        {
+            size_t canPut = std::min( length, deltaChunkSize - this->literalBuf.size() );
+
+            this->literalBuf.insert( this->literalBuf.end(), data, data + canPut );
+
+            data += canPut;
+            length -= canPut;
+
+            if ( this->literalBuf.size() == deltaChunkSize )
+            {
+                this->FlushLiteral();
+            }
+        }
+    }
+
+    void Finish( void )
+    {
+        this->FlushCopy();
+        this->FlushLiteral();
+
+        this->stream.put( (char)DELTA_OP_END );
+    }
+
+private:
+    void FlushCopy( void )
+    {
+        if ( this->copyLength == 0 )
+        {
+            return;
+        }
+
+        this->stream.put( (char)DELTA_OP_COPY );
+        WriteUInt64LE( this->stream, this->copySourceOff );
+        WriteUInt64LE( this->stream, this->copyLength );
+
+        this->stats.numCopiedBytes += this->copyLength;
+        this->stats.numOperations++;
+
+        this->copyLength = 0;
+    }
+
+    void FlushLiteral( void )
+    {
+        if ( this->literalBuf.empty() )
+        {
+            return;
+        }
+
+        this->stream.put( (char)DELTA_OP_LITERAL );
+        WriteUInt64LE( this->stream, this->literalBuf.size() );
+        this->stream.write( this->literalBuf.data(), (std::streamsize)this->literalBuf.size() );
+
+        this->stats.numLiteralBytes += this->literalBuf.size();
+        this->stats.numOperations++;
+
+        this->literalBuf.clear();
+    }
+
+    std::ostream& stream;
+    imageDeltaStats& stats;
+
+    std::uint64_t copySourceOff = 0;
+    std::uint64_t copyLength = 0;
+    std::vector <char> literalBuf;
+};
+
+// Range of the target file together with the source bytes that it most likely equals.
+struct diffRegion
+{
+    std::uint64_t targetOff;
+    std::uint64_t size;
+    std::uint64_t sourceOff;
+    std::uint64_t sourceSize;       // zero if there is nothing to compare with.
+};
+
+static bool DiffRegion( std::istream& targetStream, std::istream& sourceStream, const diffRegion& region, deltaWriter& writer, std::vector <char>& targetBuf, std::vector <char>& sourceBuf )
+{
+    std::uint64_t regionPos = 0;
+
+    while ( regionPos < region.size )
+    {
+        size_t chunkSize = (size_t)std::min( (std::uint64_t)deltaChunkSize, region.size - regionPos );
+
+        if ( !ReadBytesAt( targetStream, region.targetOff + regionPos, targetBuf.data(), chunkSize ) )
+        {
+            return false;
+        }
+
+        size_t sourceAvail = 0;
+
+        if ( regionPos < region.sourceSize )
+        {
+            sourceAvail = (size_t)std::min( (std::uint64_t)chunkSize, region.sourceSize - regionPos );
+
+            if ( !ReadBytesAt( sourceStream, region.sourceOff + regionPos, sourceBuf.data(), sourceAvail ) )
+            {
+                return false;
+            }
+        }
+
+        for ( size_t blockOff = 0; blockOff < chunkSize; blockOff += deltaBlockSize )
+        {
+            size_t blockSize = std::min( deltaBlockSize, chunkSize - blockOff );
+
+            if ( blockOff + blockSize <= sourceAvail && memcmp( targetBuf.data() + blockOff, sourceBuf.data() + blockOff, blockSize ) == 0 )
+            {
+                writer.Copy( region.sourceOff + regionPos + blockOff, blockSize );
+            }
+            else
+            {
+                writer.Literal( targetBuf.data() + blockOff, blockSize );
+            }
+        }
+
+        regionPos += chunkSize;
+    }
+
+    return true;
+}
+
+static const rawSectionInfo* FindSourceSection( const std::vector <rawSectionInfo>& sourceSections, const rawSectionInfo& targetSect )
+{
+    const rawSectionInfo *nameMatch = nullptr;
+    size_t numNameMatches = 0;
+
+    for ( const rawSectionInfo& sourceSect : sourceSections )
+    {
+        if ( memcmp( sourceSect.name, targetSect.name, sizeof(targetSect.name) ) != 0 )
+        {
+            continue;
+        }
+
+        if ( sourceSect.virtualAddress == targetSect.virtualAddress )
+        {
+            return &sourceSect;
+        }
+
+        nameMatch = &sourceSect;
+        numNameMatches++;
+    }
+
+    // A moved section is only matched if its name is unambiguous.
+    return ( numNameMatches == 1 ? nameMatch : nullptr );
+}
+
+bool CreateImageDelta( const char *sourcePath, const char *targetPath, const char *deltaPath, imageDeltaStats& statsOut, std::string& errorOut )
+{
+    std::uint64_t sourceHash, sourceSize, targetHash, targetSize;
+
+    if ( !HashFileContents( sourcePath, sourceHash, sourceSize ) )
+    {
+        errorOut = "failed to read source image";
+        return false;
+    }
+
+    if ( !HashFileContents( targetPath, targetHash, targetSize ) )
+    {
+        errorOut = "failed to read target image";
+        return false;
+    }
+
+    std::ifstream sourceStream( sourcePath, std::ios::binary );
+    std::ifstream targetStream( targetPath, std::ios::binary );
+
+    if ( !sourceStream.good() || !targetStream.good() )
+    {
+        errorOut = "failed to open images for diffing";
+        return false;
+    }
+
+    std::vector <rawSectionInfo> sourceSections, targetSections;
+
+    ReadImageLayout( sourceStream, sourceSize, sourceSections );
+    ReadImageLayout( targetStream, targetSize, targetSections );
+
+    std::sort( targetSections.begin(), targetSections.end(),
+        []( const rawSectionInfo& left, const rawSectionInfo& right )
+    {
+        return ( left.fileOffset < right.fileOffset );
+    });
+
+    // Cover the whole target file. Headers, padding and overlay data are compared at the same offset.
+    std::vector <diffRegion> regions;
+
+    auto addSameOffsetRegion = [&]( std::uint64_t startOff, std::uint64_t endOff )
+    {
+        if ( endOff <= startOff )
+        {
+            return;
+        }
+
+        std::uint64_t sourceAvail = ( startOff < sourceSize ? sourceSize - startOff : 0 );
+
+        regions.push_back( { startOff, endOff - startOff, startOff, sourceAvail } );
+    };
+
+    std::uint64_t regionCursor = 0;
+
+    for ( const rawSectionInfo& targetSect : targetSections )
+    {
+        std::uint64_t sectEnd = ( targetSect.fileOffset + targetSect.fileSize );
+
+        if ( sectEnd <= regionCursor )
+        {
+            continue;
+        }
+
+        addSameOffsetRegion( regionCursor, targetSect.fileOffset );
+
+        // Skip any overlap with the previous region.
+        std::uint64_t skipCount = ( regionCursor > targetSect.fileOffset ? regionCursor - targetSect.fileOffset : 0 );
+
+        diffRegion sectRegion;
+        sectRegion.targetOff = ( targetSect.fileOffset + skipCount );
+        sectRegion.size = ( targetSect.fileSize - skipCount );
+        sectRegion.sourceOff = 0;
+        sectRegion.sourceSize = 0;
+
+        if ( const rawSectionInfo *sourceSect = FindSourceSection( sourceSections, targetSect ) )
+        {
+            if ( skipCount < sourceSect->fileSize )
+            {
+                sectRegion.sourceOff = ( sourceSect->fileOffset + skipCount );
+                sectRegion.sourceSize = ( sourceSect->fileSize - skipCount );
+            }
+        }
+
+        regions.push_back( sectRegion );
+
+        regionCursor = sectEnd;
+    }
+
+    addSameOffsetRegion( regionCursor, targetSize );
+
+    std::ofstream deltaStream( deltaPath, std::ios::binary | std::ios::trunc );
+
+    if ( !deltaStream.good() )
+    {
+        errorOut = "failed to create delta file";
+        return false;
+    }
+
+    deltaStream.write( deltaMagic, sizeof(deltaMagic) );
+    WriteUInt64LE( deltaStream, sourceSize );
+    WriteUInt64LE( deltaStream, sourceHash );
+    WriteUInt64LE( deltaStream, targetSize );
+    WriteUInt64LE( deltaStream, targetHash );
+
+    imageDeltaStats stats;
+
+    std::vector <char> targetBuf( deltaChunkSize );
+    std::vector <char> sourceBuf( deltaChunkSize );
+
+    bool success = true;
+    {
+        deltaWriter writer( deltaStream, stats );
+
+        for ( const diffRegion& region : regions )
+        {
+            if ( !DiffRegion( targetStream, sourceStream, region, writer, targetBuf, sourceBuf ) )
+            {
+                success = false;
+                break;
+            }
+        }
+
+        if ( success )
+        {
+            writer.Finish();
+        }
+    }
+
+    if ( success )
+    {
+        stats.deltaFileSize = (std::uint64_t)deltaStream.tellp();
+
+        deltaStream.close();
+
+        success = !deltaStream.fail();
+    }
+
+    if ( !success )
+    {
+        deltaStream.close();
+
+        std::remove( deltaPath );
+
+        errorOut = "failed to write delta file";
+        return false;
+    }
+
+    statsOut = stats;
+    return true;
+}
+
+bool ApplyImageDelta( const char *sourcePath, const char *deltaPath, const char *outputPath, std::string& errorOut )
+{
+    std::ifstream deltaStream( deltaPath, std::ios::binary );
+
+    if ( !deltaStream.good() )
+    {
+        errorOut = "failed to open delta file";
+        return false;
+    }
+
+    char magic[ sizeof(deltaMagic) ];
+    std::uint64_t expSourceSize, expSourceHash, expTargetSize, expTargetHash;
+
+    if ( !deltaStream.read( magic, sizeof(magic) ) || memcmp( magic, deltaMagic, sizeof(magic) ) != 0 ||
+         !ReadUInt64LE( deltaStream, expSourceSize ) || !ReadUInt64LE( deltaStream, expSourceHash ) ||
+         !ReadUInt64LE( deltaStream, expTargetSize ) || !ReadUInt64LE( deltaStream, expTargetHash ) )
+    {
+        errorOut = "not a valid delta file";
+        return false;
+    }
+
+    // Make sure that we patch the very file that the delta was made from.
+    {
+        std::uint64_t sourceHash, sourceSize;
+
+        if ( !HashFileContents( sourcePath, sourceHash, sourceSize ) )
+        {
+            errorOut = "failed to read source image";
+            return false;
+        }
+
+        if ( sourceSize != expSourceSize || sourceHash != expSourceHash )
+        {
+            errorOut = "source image does not match the delta";
+            return false;
+        }
+    }
+
+    std::ifstream sourceStream( sourcePath, std::ios::binary );
+
+    std::string tmpOutputPath = std::string( outputPath ) + ".tmp";
+
+    std::ofstream outputStream( tmpOutputPath, std::ios::binary | std::ios::trunc );
+
+    if ( !sourceStream.good() || !outputStream.good() )
+    {
+        errorOut = "failed to open files for patching";
+        return false;
+    }
+
+    auto failApply = [&]( const char *msg )
+    {
+        outputStream.close();
+
+        std::remove( tmpOutputPath.c_str() );
+
+        errorOut = msg;
+        return false;
+    };
+
+    contentHash64 targetHash;
+    std::uint64_t targetSize = 0;
+
+    std::vector <char> chunkBuf( deltaChunkSize );
+
+    while ( true )
+    {
+        int opCode = deltaStream.get();
+
+        if ( opCode == std::char_traits <char>::eof() )
+        {
+            return failApply( "delta file is truncated" );
+        }
+
+        if ( opCode == DELTA_OP_END )
+        {
+            break;
+        }
+
+        std::istream *readFrom;
+        std::uint64_t length;
+
+        if ( opCode == DELTA_OP_COPY )
+        {
+            std::uint64_t sourceOff;
+
+            if ( !ReadUInt64LE( deltaStream, sourceOff ) || !ReadUInt64LE( deltaStream, length ) )
+            {
+                return failApply( "delta file is truncated" );
+            }
+
+            if ( sourceOff > expSourceSize || length > expSourceSize - sourceOff )
+            {
+                return failApply( "delta copies from outside of the source image" );
+            }
+
+            sourceStream.clear();
+            sourceStream.seekg( (std::streamoff)sourceOff );
+
+            readFrom = &sourceStream;
+        }
+        else if ( opCode == DELTA_OP_LITERAL )
+        {
+            if ( !ReadUInt64LE( deltaStream, length ) )
+            {
+                return failApply( "delta file is truncated" );
+            }
+
+            readFrom = &deltaStream;
+        }
+        else
+        {
+            return failApply( "delta file contains an unknown operation" );
+        }
+
+        if ( length > expTargetSize - targetSize )
+        {
+            return failApply( "delta produces more data than expected" );
+        }
+
+        while ( length > 0 )
+        {
+            size_t chunkSize = (size_t)std::min( (std::uint64_t)deltaChunkSize, length );
+
+            if ( !readFrom->read( chunkBuf.data(), (std::streamsize)chunkSize ) )
+            {
+                return failApply( "failed to read delta input" );
+            }
+
+            targetHash.Update( chunkBuf.data(), chunkSize );
+
+            outputStream.write( chunkBuf.data(), (std::streamsize)chunkSize );
+
+            targetSize += chunkSize;
+            length -= chunkSize;
+        }
+    }
+
+    outputStream.close();
+
+    if ( outputStream.fail() )
+    {
+        return failApply( "failed to write output image" );
+    }
+
+    if ( targetSize != expTargetSize || targetHash.GetValue() != expTargetHash )
+    {
+        return failApply( "output image does not match the hash of the delta" );
+    }
+
+    if ( !ReplaceFileWithTemp( tmpOutputPath.c_str(), outputPath ) )
+    {
+        errorOut = "failed to replace output image";
+        return false;
+    }
+
+    return true;
+}
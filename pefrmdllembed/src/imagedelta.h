@@ -0,0 +1,32 @@
+#ifndef _IMAGE_DELTA_
+#define _IMAGE_DELTA_
+
+#include <cstdint>
+#include <string>
+
+// Binary delta that rebuilds an output image from the input executable it was made from.
+// The file starts with the header
+//  "PEDELTA1" *source size* *source hash* *target size* *target hash*
+// followed by operations that append to the target, in order:
+//  1 *source offset* *length*      copy bytes of the source
+//  2 *length* *bytes*              put literal bytes
+//  0                               end
+// Operation codes are single bytes, all numbers are 64bit little-endian and the hashes are contentHash64.
+struct imageDeltaStats
+{
+    std::uint64_t numCopiedBytes = 0;
+    std::uint64_t numLiteralBytes = 0;
+    std::uint64_t numOperations = 0;
+    std::uint64_t deltaFileSize = 0;
+};
+
+// Diffs the target image against the source image. Sections of the target are compared with the source
+// section of the same name and address, wherever it is located in the source file; everything else is
+// compared at the same file offset. Both files are streamed in fixed-size chunks.
+bool CreateImageDelta( const char *sourcePath, const char *targetPath, const char *deltaPath, imageDeltaStats& statsOut, std::string& errorOut );
+
+// Rebuilds the target image from the source and the delta. The source is checked against the hash in the
+// delta before anything is written, and the output only replaces outputPath if it matches the target hash.
+bool ApplyImageDelta( const char *sourcePath, const char *deltaPath, const char *outputPath, std::string& errorOut );
+
+#endif //_IMAGE_DELTA_
@@ -0,0 +1,113 @@
+#include "imageopt.h"
+
+#include <unordered_map>
+#include <algorithm>
+
+size_t GetDataSizeWithoutZeroTail( const void *data, size_t dataSize )
+{
+    const char *bytes = (const char*)data;
+
+    size_t trimmedSize = dataSize;
+
+    // Skip zero words first, then the remaining bytes.
+    while ( trimmedSize >= sizeof(std::uint64_t) )
+    {
+        std::uint64_t word;
+        memcpy( &word, bytes + trimmedSize - sizeof(std::uint64_t), sizeof(word) );
+
+        if ( word != 0 )
+        {
+            break;
+        }
+
+        trimmedSize -= sizeof(std::uint64_t);
+    }
+
+    while ( trimmedSize > 0 && bytes[ trimmedSize - 1 ] == 0 )
+    {
+        trimmedSize--;
+    }
+
+    return trimmedSize;
+}
+
+template <typename descListType, typename funcsGetter, typename thunkGetter>
+static inline void RegisterThunkArrayFloors(
+    std::unordered_map <const PEFile::PESection*, std::uint32_t>& floorMap, const descListType& descs,
+    std::uint32_t archPointerSize, const funcsGetter& getFuncs, const thunkGetter& getThunkRef
+)
+{
+    for ( const auto& desc : descs )
+    {
+        const PEFile::PESectionDataReference& thunkRef = getThunkRef( desc );
+
+        const PEFile::PESection *thunkSect = thunkRef.GetSection();
+
+        if ( thunkSect == nullptr )
+        {
+            continue;
+        }
+
+        // Including the zero terminator.
+        std::uint32_t thunkArrayEnd = ( thunkRef.GetSectionOffset() + (std::uint32_t)( getFuncs( desc ).GetCount() + 1 ) * archPointerSize );
+
+        std::uint32_t& floor = floorMap[ thunkSect ];
+
+        floor = std::max( floor, thunkArrayEnd );
+    }
+}
+
+size_t TrimSectionZeroTails( PEFile& image, const std::vector <PEFile::PESectionReference>& sections, std::uint32_t archPointerSize )
+{
+    // The thunk arrays are written by the PE serializer, so they have to stay inside of the raw data.
+    std::unordered_map <const PEFile::PESection*, std::uint32_t> floorMap;
+
+    RegisterThunkArrayFloors( floorMap, image.imports, archPointerSize,
+        []( const PEFile::PEImportDesc& desc ) -> const PEFile::PEImportDesc::functions_t& { return desc.funcs; },
+        []( const PEFile::PEImportDesc& desc ) -> const PEFile::PESectionDataReference& { return desc.firstThunkRef; }
+    );
+    RegisterThunkArrayFloors( floorMap, image.delayLoads, archPointerSize,
+        []( const PEFile::PEDelayLoadDesc& desc ) -> const PEFile::PEImportDesc::functions_t& { return desc.importNames; },
+        []( const PEFile::PEDelayLoadDesc& desc ) -> const PEFile::PESectionDataReference& { return desc.IATRef; }
+    );
+
+    size_t numTrimmedBytes = 0;
+
+    for ( const PEFile::PESectionReference& sectRef : sections )
+    {
+        PEFile::PESection *sect = sectRef.GetSection();
+
+        if ( sect == nullptr )
+        {
+            continue;
+        }
+
+        size_t rawSize = (size_t)sect->stream.Size();
+
+        size_t trimmedSize = GetDataSizeWithoutZeroTail( sect->stream.Data(), rawSize );
+
+        auto findIter = floorMap.find( sect );
+
+        if ( findIter != floorMap.end() )
+        {
+            trimmedSize = std::max( trimmedSize, std::min( rawSize, (size_t)findIter->second ) );
+        }
+
+        if ( trimmedSize == rawSize )
+        {
+            continue;
+        }
+
+        // The virtual size is kept by the section placement, so the tail turns into zero-fill memory.
+        std::uint32_t virtualSize = sect->GetVirtualSize();
+
+        sect->stream.Truncate( (std::int32_t)trimmedSize );
+
+        assert( sect->GetVirtualSize() == virtualSize );
+        (void)virtualSize;
+
+        numTrimmedBytes += ( rawSize - trimmedSize );
+    }
+
+    return numTrimmedBytes;
+}
@@ -0,0 +1,19 @@
+#ifndef _IMAGE_OPTIMIZATIONS_
+#define _IMAGE_OPTIMIZATIONS_
+
+#include <peframework.h>
+
+#include <vector>
+
+// Output optimization passes that are run over the embedded sections before writing the executable.
+
+// Returns the size of the data without its trailing zero bytes.
+size_t GetDataSizeWithoutZeroTail( const void *data, size_t dataSize );
+
+// Shortens the raw data of each section by its trailing zero bytes while keeping the virtual size,
+// so that the loader zero-fills those pages instead of reading them from disk.
+// Data that the PE writer fills in during serialization (import thunk arrays) is never trimmed.
+// Returns the amount of raw bytes that were removed.
+size_t TrimSectionZeroTails( PEFile& image, const std::vector <PEFile::PESectionReference>& sections, std::uint32_t archPointerSize );
+
+#endif //_IMAGE_OPTIMIZATIONS_
@@ -0,0 +1,390 @@
+#include "imagereport.h"
+
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+
+static const char *generatedOwnerName = "(generated)";
+
+static void CountResourceItems( const PEFile::PEResourceDir& dir, std::unordered_map <const PEFile::PESection*, imageCompositionReport::sectionInfo*>& sectInfos )
+{
+    dir.ForAllChildren(
+        [&]( const PEFile::PEResourceItem *item, bool hasIdentifierName )
+    {
+        if ( item->itemType == PEFile::PEResourceItem::eType::DATA )
+        {
+            const PEFile::PEResourceInfo *dataItem = (const PEFile::PEResourceInfo*)item;
+
+            auto findIter = sectInfos.find( dataItem->sectRef.GetSection() );
+
+            if ( findIter != sectInfos.end() )
+            {
+                findIter->second->numResources++;
+                findIter->second->resourceBytes += dataItem->sectRef.GetDataSize();
+            }
+        }
+        else if ( item->itemType == PEFile::PEResourceItem::eType::DIRECTORY )
+        {
+            CountResourceItems( *(const PEFile::PEResourceDir*)item, sectInfos );
+        }
+    });
+}
+
+void BuildImageReport( PEFile& image, const std::vector <imageReportOwner>& owners, imageCompositionReport& reportOut )
+{
+    imageCompositionReport report;
+    report.isRebasable = image.HasRelocationInfo();
+
+    std::unordered_map <const PEFile::PESection*, const std::string*> sectOwners;
+
+    for ( const imageReportOwner& owner : owners )
+    {
+        for ( const PEFile::PESectionReference& sectRef : owner.sections )
+        {
+            if ( const PEFile::PESection *sect = sectRef.GetSection() )
+            {
+                sectOwners.insert( std::make_pair( sect, &owner.name ) );
+            }
+        }
+    }
+
+    report.sections.reserve( image.GetSectionCount() );
+
+    PEFile::sectionIter_t iter = image.GetSectionIterator();
+
+    for ( ; !iter.IsEnd(); iter.Increment() )
+    {
+        const PEFile::PESection *sect = iter.Resolve();
+
+        imageCompositionReport::sectionInfo info;
+
+        auto ownerIter = sectOwners.find( sect );
+
+        info.owner = ( ownerIter != sectOwners.end() ? *ownerIter->second : generatedOwnerName );
+        info.name = sect->shortName.GetConstString();
+        info.rva = sect->GetVirtualAddress();
+        info.rawSize = (std::uint32_t)sect->stream.Size();
+        info.virtualSize = sect->GetVirtualSize();
+        info.isWritable = sect->chars.sect_mem_write;
+        info.isExecutable = sect->chars.sect_mem_execute;
+        info.numPages = ( ( info.virtualSize + report.pageSize - 1 ) / report.pageSize );
+
+        const unsigned char *rawData = (const unsigned char*)sect->stream.Data();
+        std::uint32_t rawEnd = info.rawSize;
+
+        while ( rawEnd > 0 && rawData[ rawEnd - 1 ] == 0 )
+        {
+            rawEnd--;
+        }
+
+        info.zeroTailSize = ( info.rawSize - rawEnd );
+
+        report.sections.push_back( std::move( info ) );
+    }
+
+    // The vector does not grow anymore, so we can point into it.
+    std::unordered_map <const PEFile::PESection*, imageCompositionReport::sectionInfo*> sectInfos;
+    {
+        size_t sectIdx = 0;
+
+        for ( iter = image.GetSectionIterator(); !iter.IsEnd(); iter.Increment() )
+        {
+            sectInfos[ iter.Resolve() ] = &report.sections[ sectIdx++ ];
+        }
+    }
+
+    // Relocations per page of each section.
+    std::map <std::uint32_t, std::uint32_t> relocPageCounts;
+
+    for ( auto *relocNode : image.baseRelocs )
+    {
+        std::uint32_t relocChunkOffset = ( relocNode->GetKey() * PEFile::baserelocChunkSize );
+
+        for ( const PEFile::PEBaseReloc::item& relocItem : relocNode->GetValue().items )
+        {
+            if ( (PEFile::PEBaseReloc::eRelocType)relocItem.type == PEFile::PEBaseReloc::eRelocType::ABSOLUTE )
+            {
+                continue;
+            }
+
+            relocPageCounts[ ( relocChunkOffset + relocItem.offset ) / report.pageSize ]++;
+        }
+    }
+
+    for ( const auto& pagePair : relocPageCounts )
+    {
+        std::uint32_t pageRVA = ( pagePair.first * report.pageSize );
+
+        PEFile::PESection *relocSect = image.FindSectionByRVA( pageRVA );
+
+        if ( relocSect == nullptr )
+        {
+            // The page might start in front of the section that the relocations belong to.
+            relocSect = image.FindSectionByRVA( pageRVA + report.pageSize - 1 );
+        }
+
+        auto findIter = sectInfos.find( relocSect );
+
+        if ( findIter == sectInfos.end() )
+        {
+            continue;
+        }
+
+        imageCompositionReport::sectionInfo& info = *findIter->second;
+
+        info.numRelocs += pagePair.second;
+        info.numRelocPages++;
+        info.maxRelocsPerPage = std::max( info.maxRelocsPerPage, pagePair.second );
+    }
+
+    for ( const PEFile::PEImportDesc& impDesc : image.imports )
+    {
+        auto findIter = sectInfos.find( impDesc.firstThunkRef.GetSection() );
+
+        if ( findIter != sectInfos.end() )
+        {
+            findIter->second->numImportThunks += (std::uint32_t)impDesc.funcs.GetCount();
+        }
+    }
+
+    for ( const PEFile::PEDelayLoadDesc& delayDesc : image.delayLoads )
+    {
+        auto findIter = sectInfos.find( delayDesc.IATRef.GetSection() );
+
+        if ( findIter != sectInfos.end() )
+        {
+            findIter->second->numImportThunks += (std::uint32_t)delayDesc.importNames.GetCount();
+        }
+    }
+
+    CountResourceItems( image.resourceRoot, sectInfos );
+
+    // Writable pages get a private copy as soon as they are written; relocated pages as soon as the image is rebased.
+    for ( imageCompositionReport::sectionInfo& info : report.sections )
+    {
+        if ( info.isWritable )
+        {
+            info.numPrivatePages = info.numPages;
+        }
+        else if ( report.isRebasable )
+        {
+            info.numPrivatePages = std::min( info.numRelocPages, info.numPages );
+        }
+
+        info.numShareablePages = ( info.numPages - info.numPrivatePages );
+    }
+
+    reportOut = std::move( report );
+}
+
+struct reportOwnerTotals
+{
+    std::string name;
+    std::uint64_t rawSize = 0;
+    std::uint64_t virtualSize = 0;
+    std::uint64_t zeroTailSize = 0;
+    std::uint32_t numWritablePages = 0;
+    std::uint32_t numReadOnlyPages = 0;
+    std::uint32_t numRelocs = 0;
+    std::uint32_t numImportThunks = 0;
+    std::uint32_t numResources = 0;
+    std::uint32_t numPrivatePages = 0;
+    std::uint32_t numShareablePages = 0;
+
+    void Add( const imageCompositionReport::sectionInfo& info )
+    {
+        this->rawSize += info.rawSize;
+        this->virtualSize += info.virtualSize;
+        this->zeroTailSize += info.zeroTailSize;
+        ( info.isWritable ? this->numWritablePages : this->numReadOnlyPages ) += info.numPages;
+        this->numRelocs += info.numRelocs;
+        this->numImportThunks += info.numImportThunks;
+        this->numResources += info.numResources;
+        this->numPrivatePages += info.numPrivatePages;
+        this->numShareablePages += info.numShareablePages;
+    }
+};
+
+// Owners in the order of their first section, followed by the image total.
+static std::vector <reportOwnerTotals> CalculateOwnerTotals( const imageCompositionReport& report, reportOwnerTotals& imageTotals )
+{
+    std::vector <reportOwnerTotals> ownerTotals;
+
+    imageTotals.name = "total";
+
+    for ( const imageCompositionReport::sectionInfo& info : report.sections )
+    {
+        auto findIter = std::find_if( ownerTotals.begin(), ownerTotals.end(),
+            [&]( const reportOwnerTotals& totals )
+        {
+            return ( totals.name == info.owner );
+        });
+
+        if ( findIter == ownerTotals.end() )
+        {
+            ownerTotals.emplace_back();
+            ownerTotals.back().name = info.owner;
+
+            findIter = ( ownerTotals.end() - 1 );
+        }
+
+        findIter->Add( info );
+        imageTotals.Add( info );
+    }
+
+    return ownerTotals;
+}
+
+void WriteImageReportText( const imageCompositionReport& report, std::ostream& outStream )
+{
+    std::uint32_t pageKB = ( report.pageSize / 1024 );
+
+    outStream << "sections:" << std::endl;
+
+    for ( const imageCompositionReport::sectionInfo& info : report.sections )
+    {
+        outStream
+            << "* " << info.owner << " " << info.name
+            << " at 0x" << std::hex << info.rva << std::dec
+            << ( info.isWritable ? " rw" : " r" ) << ( info.isExecutable ? "x" : "" )
+            << ": raw " << info.rawSize << ", virtual " << info.virtualSize << ", zero tail " << info.zeroTailSize
+            << ", " << info.numPages << " pages (" << info.numPrivatePages << " private)";
+
+        if ( info.numRelocs > 0 )
+        {
+            outStream << ", " << info.numRelocs << " relocations on " << info.numRelocPages << " pages (max " << info.maxRelocsPerPage << " per page)";
+        }
+
+        if ( info.numImportThunks > 0 )
+        {
+            outStream << ", " << info.numImportThunks << " import thunks";
+        }
+
+        if ( info.numResources > 0 )
+        {
+            outStream << ", " << info.numResources << " resources (" << info.resourceBytes << " bytes)";
+        }
+
+        outStream << std::endl;
+    }
+
+    reportOwnerTotals imageTotals;
+
+    std::vector <reportOwnerTotals> ownerTotals = CalculateOwnerTotals( report, imageTotals );
+
+    ownerTotals.push_back( imageTotals );
+
+    outStream << std::endl << "by owner:" << std::endl;
+
+    for ( const reportOwnerTotals& totals : ownerTotals )
+    {
+        outStream
+            << "* " << totals.name
+            << ": raw " << totals.rawSize << ", virtual " << totals.virtualSize << ", zero tail " << totals.zeroTailSize
+            << ", pages " << totals.numWritablePages << " writable / " << totals.numReadOnlyPages << " read-only"
+            << ", " << totals.numRelocs << " relocations, " << totals.numImportThunks << " import thunks, " << totals.numResources << " resources"
+            << ", private " << ( totals.numPrivatePages * pageKB ) << " KB, shareable " << ( totals.numShareablePages * pageKB ) << " KB"
+            << std::endl;
+    }
+
+    if ( report.isRebasable )
+    {
+        outStream << "(private memory assumes that the image is rebased)" << std::endl;
+    }
+}
+
+static void WriteJSONString( std::ostream& outStream, const std::string& value )
+{
+    static const char hexDigits[] = "0123456789abcdef";
+
+    outStream << '"';
+
+    for ( char c : value )
+    {
+        if ( c == '"' || c == '\\' )
+        {
+            outStream << '\\' << c;
+        }
+        else if ( (unsigned char)c < 0x20 )
+        {
+            outStream << "\\u00" << hexDigits[ ( c >> 4 ) & 0xF ] << hexDigits[ c & 0xF ];
+        }
+        else
+        {
+            outStream << c;
+        }
+    }
+
+    outStream << '"';
+}
+
+void WriteImageReportJSON( const imageCompositionReport& report, std::ostream& outStream )
+{
+    outStream << "{" << std::endl;
+    outStream << "  \"pageSize\": " << report.pageSize << "," << std::endl;
+    outStream << "  \"rebasable\": " << ( report.isRebasable ? "true" : "false" ) << "," << std::endl;
+    outStream << "  \"sections\": [";
+
+    for ( size_t n = 0; n < report.sections.size(); n++ )
+    {
+        const imageCompositionReport::sectionInfo& info = report.sections[ n ];
+
+        outStream << ( n == 0 ? "" : "," ) << std::endl << "    { \"owner\": ";
+        WriteJSONString( outStream, info.owner );
+        outStream << ", \"name\": ";
+        WriteJSONString( outStream, info.name );
+        outStream
+            << ", \"rva\": " << info.rva
+            << ", \"rawSize\": " << info.rawSize
+            << ", \"virtualSize\": " << info.virtualSize
+            << ", \"zeroTailSize\": " << info.zeroTailSize
+            << ", \"writable\": " << ( info.isWritable ? "true" : "false" )
+            << ", \"executable\": " << ( info.isExecutable ? "true" : "false" )
+            << ", \"pages\": " << info.numPages
+            << ", \"relocations\": " << info.numRelocs
+            << ", \"relocationPages\": " << info.numRelocPages
+            << ", \"maxRelocationsPerPage\": " << info.maxRelocsPerPage
+            << ", \"importThunks\": " << info.numImportThunks
+            << ", \"resources\": " << info.numResources
+            << ", \"resourceBytes\": " << info.resourceBytes
+            << ", \"privatePages\": " << info.numPrivatePages
+            << ", \"shareablePages\": " << info.numShareablePages
+            << " }";
+    }
+
+    outStream << std::endl << "  ]," << std::endl;
+
+    reportOwnerTotals imageTotals;
+
+    std::vector <reportOwnerTotals> ownerTotals = CalculateOwnerTotals( report, imageTotals );
+
+    auto writeTotals = [&]( const reportOwnerTotals& totals )
+    {
+        outStream << "{ \"name\": ";
+        WriteJSONString( outStream, totals.name );
+        outStream
+            << ", \"rawSize\": " << totals.rawSize
+            << ", \"virtualSize\": " << totals.virtualSize
+            << ", \"zeroTailSize\": " << totals.zeroTailSize
+            << ", \"writablePages\": " << totals.numWritablePages
+            << ", \"readOnlyPages\": " << totals.numReadOnlyPages
+            << ", \"relocations\": " << totals.numRelocs
+            << ", \"importThunks\": " << totals.numImportThunks
+            << ", \"resources\": " << totals.numResources
+            << ", \"privateBytes\": " << ( (std::uint64_t)totals.numPrivatePages * report.pageSize )
+            << ", \"shareableBytes\": " << ( (std::uint64_t)totals.numShareablePages * report.pageSize )
+            << " }";
+    };
+
+    outStream << "  \"owners\": [";
+
+    for ( size_t n = 0; n < ownerTotals.size(); n++ )
+    {
+        outStream << ( n == 0 ? "" : "," ) << std::endl << "    ";
+        writeTotals( ownerTotals[ n ] );
+    }
+
+    outStream << std::endl << "  ]," << std::endl << "  \"total\": ";
+    writeTotals( imageTotals );
+    outStream << std::endl << "}" << std::endl;
+}
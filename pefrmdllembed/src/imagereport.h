@@ -0,0 +1,55 @@
+#ifndef _IMAGE_REPORT_
+#define _IMAGE_REPORT_
+
+#include <peframework.h>
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A part of the output image that the report attributes sections to: the executable itself
+// or one of the embedded modules. Sections that belong to no owner are reported as generated.
+struct imageReportOwner
+{
+    std::string name;
+    std::vector <PEFile::PESectionReference> sections;
+};
+
+struct imageCompositionReport
+{
+    struct sectionInfo
+    {
+        std::string owner;
+        std::string name;
+        std::uint32_t rva = 0;
+        std::uint32_t rawSize = 0;
+        std::uint32_t virtualSize = 0;
+        std::uint32_t zeroTailSize = 0;         // trailing zero bytes of the raw data.
+        bool isWritable = false;
+        bool isExecutable = false;
+        std::uint32_t numPages = 0;
+        std::uint32_t numRelocs = 0;
+        std::uint32_t numRelocPages = 0;
+        std::uint32_t maxRelocsPerPage = 0;
+        std::uint32_t numImportThunks = 0;
+        std::uint32_t numResources = 0;
+        std::uint32_t resourceBytes = 0;
+        std::uint32_t numPrivatePages = 0;      // committed per process: copy-on-write or rebased.
+        std::uint32_t numShareablePages = 0;
+    };
+
+    std::uint32_t pageSize = 0x1000;
+    bool isRebasable = false;                   // relocated pages only become private when the image is rebased.
+
+    std::vector <sectionInfo> sections;
+};
+
+// Breaks the image down by owner and section. Writable pages count as private memory; read-only pages
+// count as private only if they carry relocations and the image can be rebased.
+void BuildImageReport( PEFile& image, const std::vector <imageReportOwner>& owners, imageCompositionReport& reportOut );
+
+void WriteImageReportText( const imageCompositionReport& report, std::ostream& outStream );
+void WriteImageReportJSON( const imageCompositionReport& report, std::ostream& outStream );
+
+#endif //_IMAGE_REPORT_
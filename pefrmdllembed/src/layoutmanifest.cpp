@@ -0,0 +1,188 @@
+#include "layoutmanifest.h"
+#include "hashutil.h"
+#include "archivesource.h"
+
+#include <fstream>
+#include <sstream>
+
+static const char *manifestSignature = "pefrmdllembed-layout";
+static const unsigned int manifestVersion = 1;
+
+bool layoutManifest::LoadFromFile( const char *path )
+{
+    std::fstream stlFileStream( path, std::ios::in );
+
+    if ( !stlFileStream.good() )
+    {
+        return false;
+    }
+
+    // Verify the header.
+    {
+        std::string signature;
+        unsigned int version = 0;
+
+        stlFileStream >> signature >> version;
+
+        if ( signature != manifestSignature || version != manifestVersion )
+        {
+            return false;
+        }
+    }
+
+    layoutManifest manifest;
+
+    std::string line;
+
+    while ( std::getline( stlFileStream, line ) )
+    {
+        std::istringstream lineStream( line );
+
+        std::string keyword;
+
+        if ( !( lineStream >> keyword ) )
+        {
+            continue;
+        }
+
+        lineStream >> std::hex;
+
+        if ( keyword == "options" )
+        {
+            lineStream >> manifest.optionsHash;
+        }
+        else if ( keyword == "exe" )
+        {
+            lineStream >> manifest.exeHash >> manifest.exeFileSize;
+        }
+        else if ( keyword == "output" )
+        {
+            lineStream >> manifest.outputHash;
+        }
+        else if ( keyword == "module" )
+        {
+            moduleEntry entry;
+
+            lineStream >> entry.contentHash >> entry.fileSize >> entry.arenaOffset >> entry.arenaSize;
+
+            // The path is the rest of the line and may contain spaces.
+            std::getline( lineStream >> std::ws, entry.path );
+
+            manifest.modules.push_back( std::move( entry ) );
+        }
+        else if ( keyword == "link" )
+        {
+            if ( manifest.modules.empty() )
+            {
+                return false;
+            }
+
+            sectionLink link;
+
+            lineStream >> link.moduleRVA >> link.imageRVA;
+
+            manifest.modules.back().sectionLinks.push_back( link );
+        }
+        else
+        {
+            return false;
+        }
+
+        if ( lineStream.fail() )
+        {
+            return false;
+        }
+    }
+
+    *this = std::move( manifest );
+    return true;
+}
+
+bool layoutManifest::SaveToFile( const char *path ) const
+{
+    std::fstream stlFileStream( path, std::ios::out | std::ios::trunc );
+
+    if ( !stlFileStream.good() )
+    {
+        return false;
+    }
+
+    stlFileStream << manifestSignature << " " << manifestVersion << std::endl;
+    stlFileStream << std::hex;
+    stlFileStream << "options " << this->optionsHash << std::endl;
+    stlFileStream << "exe " << this->exeHash << " " << this->exeFileSize << std::endl;
+    stlFileStream << "output " << this->outputHash << std::endl;
+
+    for ( const moduleEntry& entry : this->modules )
+    {
+        stlFileStream
+            << "module " << entry.contentHash << " " << entry.fileSize << " "
+            << entry.arenaOffset << " " << entry.arenaSize << " " << entry.path << std::endl;
+
+        for ( const sectionLink& link : entry.sectionLinks )
+        {
+            stlFileStream << "link " << link.moduleRVA << " " << link.imageRVA << std::endl;
+        }
+    }
+
+    return stlFileStream.good();
+}
+
+bool layoutManifest::HasSameInputs( const layoutManifest& right ) const
+{
+    if ( this->optionsHash != right.optionsHash || this->exeHash != right.exeHash || this->exeFileSize != right.exeFileSize )
+    {
+        return false;
+    }
+
+    size_t numModules = this->modules.size();
+
+    if ( numModules != right.modules.size() )
+    {
+        return false;
+    }
+
+    for ( size_t n = 0; n < numModules; n++ )
+    {
+        if ( this->modules[n].path != right.modules[n].path )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool HashFileContents( const char *path, std::uint64_t& hashOut, std::uint64_t& sizeOut )
+{
+    std::unique_ptr <PEStream> inputStream = OpenInputStream( path );
+
+    if ( !inputStream )
+    {
+        return false;
+    }
+
+    contentHash64 hash;
+    std::uint64_t fileSize = 0;
+
+    char buf[ 0x10000 ];
+
+    while ( true )
+    {
+        size_t readCount = inputStream->Read( buf, sizeof(buf) );
+
+        if ( readCount == 0 )
+        {
+            break;
+        }
+
+        hash.Update( buf, (size_t)readCount );
+
+        fileSize += (std::uint64_t)readCount;
+    }
+
+    hashOut = hash.GetValue();
+    sizeOut = fileSize;
+
+    return true;
+}
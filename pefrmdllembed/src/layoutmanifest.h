@@ -0,0 +1,57 @@
+#ifndef _LAYOUT_MANIFEST_
+#define _LAYOUT_MANIFEST_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Sidecar file next to the output image that remembers how the last run laid out the modules,
+// so that the next run can place unchanged modules at the very same addresses.
+// The file is line-based text:
+//  pefrmdllembed-layout 1
+//  options *hash*
+//  exe *hash* *size*
+//  output *hash*
+//  module *hash* *size* *arena offset* *arena size* *path*
+//  link *module section rva* *image section rva*
+// where link lines belong to the module line before them. All numbers are hexadecimal.
+struct layoutManifest
+{
+    struct sectionLink
+    {
+        std::uint32_t moduleRVA;
+        std::uint32_t imageRVA;
+    };
+
+    struct moduleEntry
+    {
+        std::string path;
+        std::uint64_t contentHash = 0;
+        std::uint64_t fileSize = 0;
+        std::uint32_t arenaOffset = 0;
+        std::uint32_t arenaSize = 0;
+        std::vector <sectionLink> sectionLinks;
+
+        inline bool HasSameContent( const moduleEntry& right ) const
+        {
+            return ( this->contentHash == right.contentHash && this->fileSize == right.fileSize );
+        }
+    };
+
+    bool LoadFromFile( const char *path );
+    bool SaveToFile( const char *path ) const;
+
+    // Returns true if both manifests describe a run with the same options, executable and module list.
+    bool HasSameInputs( const layoutManifest& right ) const;
+
+    std::uint64_t optionsHash = 0;
+    std::uint64_t exeHash = 0;
+    std::uint64_t exeFileSize = 0;
+    std::uint64_t outputHash = 0;
+    std::vector <moduleEntry> modules;
+};
+
+// Hashes the contents of a file or archive entry with contentHash64.
+bool HashFileContents( const char *path, std::uint64_t& hashOut, std::uint64_t& sizeOut );
+
+#endif //_LAYOUT_MANIFEST_
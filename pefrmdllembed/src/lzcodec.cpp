@@ -0,0 +1,207 @@
+#include "lzcodec.h"
+
+#include <cstdint>
+#include <cstring>
+
+static const size_t lzMinMatch = 4;
+static const size_t lzMaxOffset = 0xFFFF;
+static const unsigned int lzHashBits = 16;
+
+static inline std::uint32_t ReadUInt32( const unsigned char *ptr )
+{
+    std::uint32_t value;
+    memcpy( &value, ptr, sizeof(value) );
+
+    return value;
+}
+
+static inline std::uint32_t HashSequence( std::uint32_t sequence )
+{
+    return ( ( sequence * 2654435761u ) >> ( 32 - lzHashBits ) );
+}
+
+static void PutCount( std::vector <char>& out, size_t count )
+{
+    while ( count >= 255 )
+    {
+        out.push_back( (char)255 );
+        count -= 255;
+    }
+
+    out.push_back( (char)count );
+}
+
+static void PutSequence( std::vector <char>& out, const unsigned char *literals, size_t numLiterals, size_t matchOffset, size_t matchLength )
+{
+    size_t litNibble = ( numLiterals < 15 ? numLiterals : 15 );
+    size_t matchNibble = 0;
+
+    if ( matchLength > 0 )
+    {
+        size_t matchCount = ( matchLength - lzMinMatch );
+
+        matchNibble = ( matchCount < 15 ? matchCount : 15 );
+    }
+
+    out.push_back( (char)( ( litNibble << 4 ) | matchNibble ) );
+
+    if ( litNibble == 15 )
+    {
+        PutCount( out, numLiterals - 15 );
+    }
+
+    out.insert( out.end(), (const char*)literals, (const char*)literals + numLiterals );
+
+    if ( matchLength > 0 )
+    {
+        out.push_back( (char)( matchOffset & 0xFF ) );
+        out.push_back( (char)( matchOffset >> 8 ) );
+
+        if ( matchNibble == 15 )
+        {
+            PutCount( out, matchLength - lzMinMatch - 15 );
+        }
+    }
+}
+
+void LZCompress( const void *src, size_t srcSize, std::vector <char>& out )
+{
+    const unsigned char *bytes = (const unsigned char*)src;
+
+    // Last position that a match may start at.
+    size_t lastMatchPos = ( srcSize >= lzMinMatch ? srcSize - lzMinMatch : 0 );
+
+    std::vector <std::uint32_t> hashTable( (size_t)1 << lzHashBits, 0xFFFFFFFF );
+
+    size_t curPos = 0;
+    size_t anchorPos = 0;
+
+    while ( srcSize >= lzMinMatch && curPos <= lastMatchPos )
+    {
+        std::uint32_t sequence = ReadUInt32( bytes + curPos );
+        std::uint32_t& hashSlot = hashTable[ HashSequence( sequence ) ];
+
+        size_t candPos = hashSlot;
+        hashSlot = (std::uint32_t)curPos;
+
+        if ( candPos == 0xFFFFFFFF || curPos - candPos > lzMaxOffset || ReadUInt32( bytes + candPos ) != sequence )
+        {
+            curPos++;
+            continue;
+        }
+
+        size_t matchLength = lzMinMatch;
+
+        while ( curPos + matchLength < srcSize && bytes[ candPos + matchLength ] == bytes[ curPos + matchLength ] )
+        {
+            matchLength++;
+        }
+
+        PutSequence( out, bytes + anchorPos, curPos - anchorPos, curPos - candPos, matchLength );
+
+        curPos += matchLength;
+        anchorPos = curPos;
+    }
+
+    // The block ends with the remaining literals.
+    if ( anchorPos < srcSize )
+    {
+        PutSequence( out, bytes + anchorPos, srcSize - anchorPos, 0, 0 );
+    }
+}
+
+bool LZDecompress( const void *src, size_t srcSize, void *dst, size_t dstSize )
+{
+    const unsigned char *srcPtr = (const unsigned char*)src;
+    const unsigned char *srcEnd = ( srcPtr + srcSize );
+
+    unsigned char *dstStart = (unsigned char*)dst;
+    unsigned char *dstPtr = dstStart;
+    unsigned char *dstEnd = ( dstPtr + dstSize );
+
+    auto readCount = [&]( size_t& count ) -> bool
+    {
+        while ( true )
+        {
+            if ( srcPtr == srcEnd )
+            {
+                return false;
+            }
+
+            unsigned char countByte = *srcPtr++;
+
+            count += countByte;
+
+            if ( countByte != 255 )
+            {
+                return true;
+            }
+        }
+    };
+
+    while ( dstPtr < dstEnd )
+    {
+        if ( srcPtr == srcEnd )
+        {
+            return false;
+        }
+
+        unsigned char token = *srcPtr++;
+
+        size_t numLiterals = ( token >> 4 );
+
+        if ( numLiterals == 15 && !readCount( numLiterals ) )
+        {
+            return false;
+        }
+
+        if ( numLiterals > (size_t)( srcEnd - srcPtr ) || numLiterals > (size_t)( dstEnd - dstPtr ) )
+        {
+            return false;
+        }
+
+        memcpy( dstPtr, srcPtr, numLiterals );
+
+        srcPtr += numLiterals;
+        dstPtr += numLiterals;
+
+        if ( dstPtr == dstEnd )
+        {
+            break;
+        }
+
+        if ( srcEnd - srcPtr < 2 )
+        {
+            return false;
+        }
+
+        size_t matchOffset = ( (size_t)srcPtr[0] | ( (size_t)srcPtr[1] << 8 ) );
+        srcPtr += 2;
+
+        size_t matchLength = ( token & 0x0F );
+
+        if ( matchLength == 15 && !readCount( matchLength ) )
+        {
+            return false;
+        }
+
+        matchLength += lzMinMatch;
+
+        if ( matchOffset == 0 || matchOffset > (size_t)( dstPtr - dstStart ) || matchLength > (size_t)( dstEnd - dstPtr ) )
+        {
+            return false;
+        }
+
+        // Byte-wise, since the match may overlap the output.
+        const unsigned char *matchPtr = ( dstPtr - matchOffset );
+
+        for ( size_t n = 0; n < matchLength; n++ )
+        {
+            dstPtr[n] = matchPtr[n];
+        }
+
+        dstPtr += matchLength;
+    }
+
+    return ( srcPtr == srcEnd );
+}
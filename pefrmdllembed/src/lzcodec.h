@@ -0,0 +1,20 @@
+#ifndef _LZ_CODEC_
+#define _LZ_CODEC_
+
+#include <cstddef>
+#include <vector>
+
+// Byte-oriented LZ77 format of the section packer; it is simple enough to be decoded by a few
+// instructions of generated code. A block is a list of sequences, each made of
+//  * a token byte: literal count in the high nibble, match length minus 4 in the low nibble,
+//  * more literal count bytes if the literal nibble is 15,
+//  * the literal bytes,
+//  * unless the output is complete: a 16bit little-endian match offset (distance back from the
+//    output position) and more match length bytes if the match nibble is 15.
+// More count bytes are added up until one is below 255.
+void LZCompress( const void *src, size_t srcSize, std::vector <char>& out );
+
+// Reference decoder; returns false if the block does not decode to exactly dstSize bytes.
+bool LZDecompress( const void *src, size_t srcSize, void *dst, size_t dstSize );
+
+#endif //_LZ_CODEC_
@@ -7,16 +7,44 @@
 #undef ABSOLUTE
 
 #include <unordered_map>
+#include <unordered_set>
 
 #include <fstream>
 #include <list>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <chrono>
 
 #include <asmjitshared.h>
 
 #include <sdk/UniChar.h>
 
 #include "option.h"
+#include "pgotrace.h"
+#include "imageopt.h"
+#include "hashutil.h"
+#include "sigpatch.h"
+#include "memstream.h"
+#include "verify.h"
+#include "layoutmanifest.h"
+#include "imagecache.h"
+#include "embedserver.h"
+#include "fanout.h"
+#include "moduleloader.h"
+#include "outputsink.h"
+#include "pechecksum.h"
+#include "imagedelta.h"
+#include "sectpack.h"
+#include "imagereport.h"
+#include "resourcesnapshot.h"
+#include "resourcemerge.h"
+#include "tlspatch.h"
+#include "sectpolicy.h"
+#include "embedlog.h"
+#include "archivesource.h"
 
 // We need PE image structures due to Win32 image loading behavior.
 #include "peloader.serialize.h"
@@ -36,264 +64,6 @@ struct runtime_exception
     int error_code;
 };
 
-template <typename callbackType>
-inline void BufferPatternFind(
-    const void *buf, size_t bufSize, size_t numPatterns, const char *patterns[],
-    callbackType cb
-)
-{
-    for ( size_t n = 0; n < bufSize; n++ )
-    {
-        // Check all patterns for validity in this position.
-        for ( size_t patIdx = 0; patIdx < numPatterns; patIdx++ )
-        {
-            const char *curPat = patterns[patIdx];
-
-            size_t patternLen = (size_t)*curPat++;
-
-            bool curPatternMatch = true;
-
-            size_t curIter = n;
-
-            while ( true )
-            {
-                // Has the pattern ended?
-                // Then we accept.
-                if ( patternLen == 0 )
-                {
-                    break;
-                }
-
-                patternLen--;
-
-                char c = *curPat;
-
-                // Is the current pattern check above the buffer bound?
-                // Then we reject, because the pattern is longer than expected.
-                if ( curIter >= bufSize )
-                {
-                    curPatternMatch = false;
-                    break;
-                }
-
-                // Perform special operation based on pattern content.
-                if ( c == '?' )
-                {
-                    // We simply ignore this character, accept all content.
-                }
-                else
-                {
-                    // Check for equality.
-                    char bufByte = *( (const char*)buf + curIter );
-
-                    if ( bufByte != c )
-                    {
-                        curPatternMatch = false;
-                        break;
-                    }
-                }
-
-                curPat++;
-                curIter++;
-            }
-
-            if ( curPatternMatch )
-            {
-                size_t matchSize = ( curIter - n );
-
-                // Signal the runtime.
-                cb( patIdx, n, matchSize );
-
-                n += matchSize;
-                break;
-            }
-        }
-
-        // Continue finding matches.
-    }
-}
-
-// Embed a directory entry into the executable.
-struct resourceHelpers
-{
-    static peString <wchar_t> AppendPath( const peString <wchar_t>& curPath, peString <wchar_t> nameToAppend )
-    {
-        if ( curPath.IsEmpty() )
-        {
-            return nameToAppend;
-        }
-
-        return ( curPath + L"::" + nameToAppend );
-    }
-
-    template <typename sectResolver_t>
-    static bool EmbedResourceDirectoryInto( const peString <wchar_t>& curPath, const sectResolver_t& sectResolver, PEFile::PEResourceDir& into, const PEFile::PEResourceDir& toEmbed )
-    {
-        bool hasChanged = false;
-
-        toEmbed.ForAllChildren(
-            [&]( const PEFile::PEResourceItem *embedItem, bool hasIdentifierName )
-        {
-            PEFile::PEResourceItem *resItem = into.FindItem( hasIdentifierName, embedItem->name, embedItem->identifier );
-
-            const peString <wchar_t> newPath = AppendPath( curPath, embedItem->GetName() );
-
-            if ( !resItem )
-            {
-                std::wcout << L"* merging resource tree '" << newPath.GetConstString() << L"'" << std::endl;
-
-                // Create it if not there yet.
-                resItem = CloneResourceItem( sectResolver, embedItem );
-
-                // Simply insert this item.
-                try
-                {
-                    into.AddItem( resItem );
-                }
-                catch( ... )
-                {
-                    PEFile::PEResourceDir::DestroyItem( resItem );
-
-                    throw;
-                }
-
-                hasChanged = true;
-            }
-            else
-            {
-                // Need to merge the two items, embedItem into resItem.
-                PEFile::PEResourceItem::eType embedItemType = embedItem->itemType;
-
-                bool wantsMerge = false;
-                bool wantsReplace = false;
-
-                // If the types do not match, then we should replace, because we cannot merge.
-                if ( embedItemType != into.itemType )
-                {
-                    wantsReplace = true;
-                }
-
-                // If the insert-type is data, we cannot merge anyway, because data is data.
-                // Then a replace is required.
-                if ( embedItemType == PEFile::PEResourceItem::eType::DATA )
-                {
-                    wantsReplace = true;
-                }
-                // Otherwise we can safely merge.
-                else if ( embedItemType == PEFile::PEResourceItem::eType::DIRECTORY )
-                {
-                    wantsMerge = true;
-                }
-
-                if ( wantsReplace )
-                {
-                    // Give a warning to the user that we replace a resource.
-                    std::wcout << L"* replacing resource item '" << newPath.GetConstString() << L"'" << std::endl;
-
-                    hasChanged = true;
-
-                    into.RemoveItem( resItem );
-
-                    PEFile::PEResourceDir::DestroyItem( resItem );
-
-                    resItem = CloneResourceItem( sectResolver, embedItem );
-
-                    try
-                    {
-                        into.AddItem( resItem );
-                    }
-                    catch( ... )
-                    {
-                        PEFile::PEResourceDir::DestroyItem( resItem );
-
-                        throw;
-                    }
-                }
-
-                if ( wantsMerge )
-                {
-                    // A merge is safe.
-                    assert( embedItemType == PEFile::PEResourceItem::eType::DIRECTORY );
-
-                    const PEFile::PEResourceDir *embedDir = (const PEFile::PEResourceDir*)embedItem;
-
-                    PEFile::PEResourceDir *resDir = (PEFile::PEResourceDir*)resItem;
-
-                    bool subHasChanged = EmbedResourceDirectoryInto( newPath, sectResolver, *resDir, *embedDir );
-
-                    if ( subHasChanged )
-                    {
-                        hasChanged = true;
-                    }
-                }
-            }
-        });
-
-        return hasChanged;
-    }
-
-    // Clones a resource item
-    template <typename sectResolver_t>
-    static PEFile::PEResourceItem* CloneResourceItem( const sectResolver_t& sectResolver, const PEFile::PEResourceItem *srcItem )
-    {
-        PEFile::PEResourceItem *itemOut = nullptr;
-
-        PEFile::PEResourceItem::eType srcItemType = srcItem->itemType;
-
-        if ( srcItemType == PEFile::PEResourceItem::eType::DATA )
-        {
-            const PEFile::PEResourceInfo *srcDataItem = (const PEFile::PEResourceInfo*)srcItem;
-
-            PEFile::PEResourceInfo dataItem(
-                srcItem->hasIdentifierName, srcDataItem->name, srcDataItem->identifier,
-                ResolvePEDataRedirect( srcDataItem->sectRef, sectResolver )
-            );
-            dataItem.codePage = srcDataItem->codePage;
-            dataItem.reserved = srcDataItem->reserved;
-
-            itemOut = PEFile::PEResourceDir::CreateData( std::move( dataItem ) );
-        }
-        else if ( srcItemType == PEFile::PEResourceItem::eType::DIRECTORY )
-        {
-            const PEFile::PEResourceDir *srcDirItem = (const PEFile::PEResourceDir*)srcItem;
-
-            PEFile::PEResourceDir dirItem(
-                srcItem->hasIdentifierName, srcDirItem->name, srcDirItem->identifier
-            );
-            dirItem.characteristics = srcDirItem->characteristics;
-            dirItem.timeDateStamp = srcDirItem->timeDateStamp;
-            dirItem.majorVersion = srcDirItem->majorVersion;
-            dirItem.minorVersion = srcDirItem->minorVersion;
-
-            // We have to clone all sub directories.
-            srcDirItem->ForAllChildren(
-                [&]( const PEFile::PEResourceItem *srcItemChild, bool hasIdentifierName )
-            {
-                PEFile::PEResourceItem *newItem = CloneResourceItem( sectResolver, srcItemChild );
-
-                try
-                {
-                    dirItem.AddItem( newItem );
-                }
-                catch( ... )
-                {
-                    PEFile::PEResourceDir::DestroyItem( newItem );
-
-                    throw;
-                }
-            });
-
-            itemOut = PEFile::PEResourceDir::CreateDir( std::move( dirItem ) );
-        }
-        else
-        {
-            assert( 0 );
-        }
-
-        return itemOut;
-    }
-};
-
 static void WriteVirtualAddress( PEFile& image, PEFile::PESection *targetSect, std::uint32_t sectOffset, std::uint64_t virtualAddress, std::uint32_t archPointerSize, bool requiresRelocations )
 {
     std::uint32_t itemRVA = ( targetSect->GetVirtualAddress() + sectOffset );
@@ -422,13 +192,13 @@ static inline bool InjectImportsWithExports(
             // Keep track of change count.
             if ( isOrdinalMatch )
             {
-                std::cout << "* by ordinal " << ordinalOfImport << std::endl;
+                LogVerbose() << "* by ordinal " << ordinalOfImport << std::endl;
 
                 numOrdinalMatches++;
             }
             else
             {
-                std::cout << "* by name " << nameOfImport.GetConstString() << std::endl;
+                LogVerbose() << "* by name " << nameOfImport.GetConstString() << std::endl;
 
                 numNameMatches++;
             }
@@ -507,1674 +277,3578 @@ static inline PEFile::PESectionAllocation ResolvePEAllocation( const PEFile::PES
     return redirAlloc;
 }
 
-template <typename sectResolver_t>
-static inline std::uint32_t ResolvePESectionRVA( const PEFile::PESectionDataReference& srcRef, const sectResolver_t& resolver, PEFile::PESection **targetSectOut = nullptr )
+// What happens if an embedded module exports a name that the executable exports already.
+enum class eExportCollisionPolicy
 {
-    PEFile::PESection *srcSect = srcRef.GetSection();
+    FIRST_WINS,         // the name stays with its first owner; the later export is only reachable by ordinal.
+    PREFIX_MODULE,      // the later export is renamed to *module name*_*export name*.
+    FAIL
+};
 
-    if ( srcSect == nullptr )
-    {
-        throw runtime_exception( -20, "attempt to resolve unbound RVA" );
-    }
+struct exportMergeStats
+{
+    size_t numCollisions = 0;
+    size_t numRenamed = 0;
+};
 
-    PEFile::PESection *targetSect = resolver( srcSect );
+// Takes over all exports of a module. Collisions are decided for the whole sorted name table of the
+// module before anything is added, so that a failing merge leaves the export directory as it was.
+template <typename sectResolver_t>
+static void MergeModuleExports(
+    PEFile::PEExportDir& into, const PEFile::PEExportDir& moduleExports, const char *moduleName,
+    const sectResolver_t& sectResolver, eExportCollisionPolicy collisionPolicy, exportMergeStats& statsOut
+)
+{
+    size_t ordInputBase = into.functions.GetCount();
 
-    if ( targetSectOut != nullptr )
+    struct pendingName
     {
-        *targetSectOut = targetSect;
-    }
+        peString <char> name;
+        const PEFile::PEExportDir::mappedName *srcName;     // nullptr if renamed.
+        size_t funcOrd;
+    };
 
-    return ( targetSect->ResolveRVA( srcRef.GetSectionOffset() ) );
-}
+    std::vector <pendingName> pendingNames;
+    pendingNames.reserve( moduleExports.funcNameMap.GetKeyValueCount() );
 
-struct AssemblyEnvironment
-{
-    struct MightyAssembler : public asmjit::X86Assembler
+    std::unordered_set <std::string> renamedNames;
+
+    std::string renamePrefix( moduleName );
     {
-        inline MightyAssembler( asmjit::CodeHolder *codeHolder ) : X86Assembler( codeHolder )
-        {
-            return;
-        }
+        size_t extPos = renamePrefix.find_last_of( '.' );
 
-        void onEmitMemoryAbsOp( std::uint32_t sectIdx, size_t sectOff, std::int64_t immVal, size_t immLen ) override
+        if ( extPos != std::string::npos )
         {
-            // We spawn an abs2abs relocation entry.
-            asmjit::CodeHolder *code = this->getCode();
-
-            asmjit::RelocEntry *reloc = nullptr;
-            code->newRelocEntry( &reloc, asmjit::RelocEntry::kTypeAbsToAbs, (std::uint32_t)immLen );
-
-            if ( reloc )
-            {
-                // Fill in things.
-                reloc->_data = immVal;
-                reloc->_sourceSectionId = sectIdx;
-                reloc->_sourceOffset = sectOff;
-            }
+            renamePrefix.resize( extPos );
         }
-    };
 
-    MightyAssembler x86_asm;
+        renamePrefix += '_';
+    }
 
-    PEFile& embedImage;
+    auto isNameExported = []( const PEFile::PEExportDir& exportDir, const peString <char>& name )
+    {
+        PEFile::PEExportDir::mappedName lookupKey;
+        lookupKey.name = name;
 
-    // List of allocations done by the runtime that should stay until the metaSect has been placed
-    // into the image, finally.
-    std::list <PEFile::PESectionAllocation> persistentAllocations;
+        return ( exportDir.funcNameMap.Find( lookupKey ) != nullptr );
+    };
 
-    inline AssemblyEnvironment( PEFile& embedImage, asmjit::CodeHolder *codeHolder )
-        : x86_asm( codeHolder ), embedImage( embedImage )
+    for ( auto *nameMapIter : moduleExports.funcNameMap )
     {
-        return;
-    }
+        const PEFile::PEExportDir::mappedName& nameMap = nameMapIter->GetKey();
 
-    inline ~AssemblyEnvironment( void )
-    {
-        return;
-    }
+        size_t funcOrd = ( ordInputBase + nameMapIter->GetValue() );
 
-    inline int EmbedModuleIntoExecutable(
-        PEFile& moduleImage, bool requiresRelocations, const char *moduleImageName,
-        bool injectMatchingImports, bool doTakeoverExports, bool doIgnoreResources, bool doFixEntrypointExecutable, bool markAllSectionsExecutable,
-        std::uint32_t archPointerSize
-    )
-    {
-        PEFile& exeImage = this->embedImage;
+        if ( !isNameExported( into, nameMap.name ) )
+        {
+            pendingNames.push_back( { nameMap.name, &nameMap, funcOrd } );
+            continue;
+        }
 
-        // moduleImage cannot be const because we seek inside of its sections.
+        statsOut.numCollisions++;
 
-        // Check that the module is a DLL.
-        if ( moduleImage.pe_finfo.isDLL != true )
+        if ( collisionPolicy == eExportCollisionPolicy::FAIL )
         {
-            std::cout << "provided DLL image is not a DLL image" << std::endl;
+            std::cout << "export name collision: " << nameMap.name.GetConstString() << " of " << moduleName << " is exported already" << std::endl;
 
-            return -6;
+            throw runtime_exception( -29, "export name collision between the executable and embedded modules" );
         }
 
-        // Decide what architecture we generate code for.
-        std::uint32_t genCodeArch = this->x86_asm.getArchInfo().getType();
+        if ( collisionPolicy == eExportCollisionPolicy::PREFIX_MODULE )
+        {
+            std::string newName = ( renamePrefix + nameMap.name.GetConstString() );
 
-        std::uint16_t modMachineType = moduleImage.pe_finfo.machine_id;
+            peString <char> newPEName( newName.c_str(), newName.size() );
 
-        // The DLL module must be relocatable, if 32bit.
-        // If 64bit then the module could be compiled RIP-relative, which is ok.
-        if ( modMachineType == PEL_IMAGE_FILE_MACHINE_I386 )
-        {
-            if ( moduleImage.HasRelocationInfo() == false )
+            // The module could export the prefixed name itself.
+            if ( !isNameExported( into, newPEName ) && !isNameExported( moduleExports, newPEName ) && renamedNames.insert( newName ).second )
             {
-                std::cout << "DLL image is not relocatable (x86 requirement)" << std::endl;
+                pendingNames.push_back( { std::move( newPEName ), nullptr, funcOrd } );
 
-                return -11;
+                statsOut.numRenamed++;
+            }
+            else
+            {
+                std::cout << "export name collision: " << newName << " is taken as well; " << nameMap.name.GetConstString() << " of " << moduleName << " is only reachable by ordinal" << std::endl;
             }
         }
+    }
 
-        // We need the module image base for rebase pointer fixing.
-        std::uint64_t modImageBase = moduleImage.GetImageBase();
-
-        // Generate code along with binding.
+    for ( const PEFile::PEExportDir::func& expEntry : moduleExports.functions )
+    {
+        PEFile::PEExportDir::func newExpEntry;
+        newExpEntry.expRef = ResolvePEDataRedirect( expEntry.expRef, sectResolver );
+        newExpEntry.forwarder = expEntry.forwarder;
+        newExpEntry.isForwarder = expEntry.isForwarder;
 
-        // Perform binding of PE references.
-        // We keep a list of all sections that we put into the executable image.
-        // This is important to transfer all the remaining data that is tied to sections.
-        std::unordered_map
-            <const PEFile::PESection *, // we assume the original module stays immutable.
-                PEFile::PESectionReference> sectLinkMap;
+        into.functions.AddToBack( std::move( newExpEntry ) );
+    }
 
-        sectLinkMap.reserve( moduleImage.GetSectionCount() );
+    // The name map keeps itself sorted for the binary search of the loader.
+    for ( pendingName& pending : pendingNames )
+    {
+        PEFile::PEExportDir::mappedName newNameMap;
+        newNameMap.name = std::move( pending.name );
 
-        auto resolveSectionLink = [&]( const PEFile::PESection *srcSect ) -> PEFile::PESection*
+        // Kept names point at the string in the module. Renamed entries have none, so theirs is written with the directory.
+        if ( pending.srcName != nullptr )
         {
-            // We know that we embedded ALL sections into the executable.
-            // So we should be able to find for all sections a representation.
-            auto findIter = sectLinkMap.find( srcSect );
+            newNameMap.nameAllocEntry = ResolvePEAllocation( pending.srcName->nameAllocEntry, sectResolver );
+        }
 
-            if ( findIter == sectLinkMap.end() )
-            {
-                throw runtime_exception( -19, "attempt to resolve PE reference pointing to not-embedded PE section" );
-            }
+        into.funcNameMap.Set( std::move( newNameMap ), std::move( pending.funcOrd ) );
+    }
+}
 
-            return findIter->second.GetSection();
-        };
+// Size of the export directory that gets written for the current exports.
+static size_t CalculateExportDirectorySize( const PEFile::PEExportDir& exportDir )
+{
+    const size_t exportDirHeaderSize = 40;      // IMAGE_EXPORT_DIRECTORY
 
-        std::cout << "mapping sections of module into executable" << std::endl;
+    size_t dirSize = ( exportDirHeaderSize + exportDir.name.GetLength() + 1 );
 
-        // Embed all sections of the DLL image into the executable image.
-        // For that we have to find a place where we can allocate the "image arena".
-        std::uint32_t embedImageBaseOffset;
-        bool foundNewBase = exeImage.FindSectionSpace( moduleImage.peOptHeader.sizeOfImage, embedImageBaseOffset );
+    for ( const PEFile::PEExportDir::func& expFunc : exportDir.functions )
+    {
+        dirSize += sizeof(std::uint32_t);
 
-        if ( !foundNewBase )
+        if ( expFunc.isForwarder )
         {
-            std::cout << "failed to find virtual address space for module image in executable image region" << std::endl;
-
-            return -13;
+            dirSize += ( expFunc.forwarder.GetLength() + 1 );
         }
+    }
 
-        PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
+    for ( auto *nameMapIter : exportDir.funcNameMap )
+    {
+        // Name pointer, ordinal and the string.
+        dirSize += ( sizeof(std::uint32_t) + sizeof(std::uint16_t) + nameMapIter->GetKey().name.GetLength() + 1 );
+    }
 
-        while ( !iter.IsEnd() )
-        {
-            PEFile::PESection *theSect = iter.Resolve();
+    return dirSize;
+}
 
-            std::cout << "* " << theSect->shortName.GetConstString() << std::endl;
+template <typename sectResolver_t>
+static inline std::uint32_t ResolvePESectionRVA( const PEFile::PESectionDataReference& srcRef, const sectResolver_t& resolver, PEFile::PESection **targetSectOut = nullptr )
+{
+    PEFile::PESection *srcSect = srcRef.GetSection();
 
-            // Create a copy of the section.
-            PEFile::PESection newSect;
-            newSect.shortName = theSect->shortName;
-            newSect.chars = theSect->chars;
+    if ( srcSect == nullptr )
+    {
+        throw runtime_exception( -20, "attempt to resolve unbound RVA" );
+    }
 
-            if ( markAllSectionsExecutable )
-            {
-                newSect.chars.sect_mem_execute = true;
-            }
+    PEFile::PESection *targetSect = resolver( srcSect );
 
-            size_t sectDataSize = (size_t)theSect->stream.Size();
+    if ( targetSectOut != nullptr )
+    {
+        *targetSectOut = targetSect;
+    }
 
-            theSect->stream.Seek( 0 );
+    return ( targetSect->ResolveRVA( srcRef.GetSectionOffset() ) );
+}
 
-            newSect.stream.Seek( 0 );
-            newSect.stream.Truncate( (std::int32_t)sectDataSize );
-            newSect.stream.Write( theSect->stream.Data(), sectDataSize );
+// Checks whether any absolute pointer of an x86 module targets its own image headers, such as &__ImageBase
+// in the CRT. x64 code addresses the headers RIP-relative, so there is no way to tell for x64 modules.
+static bool ModuleReferencesOwnHeaders( PEFile& moduleImage )
+{
+    // Everything in front of the first section is mapped from the headers.
+    std::uint32_t headerEnd = moduleImage.peOptHeader.sizeOfHeaders;
 
-            // Finalize ourselves.
-            newSect.Finalize();
+    PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
 
-            // Put into image.
-            std::uint32_t sectMemPos = ( embedImageBaseOffset + theSect->GetVirtualAddress() );
+    if ( !iter.IsEnd() )
+    {
+        headerEnd = std::max( headerEnd, iter.Resolve()->GetVirtualAddress() );
+    }
 
-            newSect.SetPlacementInfo( sectMemPos, theSect->GetVirtualSize() );
+    std::uint32_t modImageBase = (std::uint32_t)moduleImage.GetImageBase();
 
-            PEFile::PESection *refInside = exeImage.PlaceSection( std::move( newSect ) );
+    for ( auto *modRelocNode : moduleImage.baseRelocs )
+    {
+        std::uint32_t relocChunkOffset = ( modRelocNode->GetKey() * PEFile::baserelocChunkSize );
 
-            if ( refInside == nullptr )
+        for ( const PEFile::PEBaseReloc::item& modRelocItem : modRelocNode->GetValue().items )
+        {
+            if ( (PEFile::PEBaseReloc::eRelocType)modRelocItem.type != PEFile::PEBaseReloc::eRelocType::HIGHLOW )
             {
-                throw runtime_exception( -14, "fatal: failed to allocate module section in executable image" );
+                continue;
             }
 
-            PEFile::PESectionReference sectInsideRef( refInside );
-
-            // Remember this link.
-            sectLinkMap[ theSect ] = std::move( sectInsideRef );
-
-            iter.Increment();
-        }
-
-        std::uint64_t exeModuleBase = exeImage.GetImageBase();
-
-        // We need to create a special PESection that contains the DLL image PE headers,
-        // called ".pedata".
-        {
-            std::cout << "embedding module image PE headers" << std::endl;
-
-            PEFile::PESection pedataSect;
-            pedataSect.shortName = ".pedata";
-            pedataSect.chars.sect_mem_execute = false;
-            pedataSect.chars.sect_mem_read = true;
-            pedataSect.chars.sect_mem_write = false;
-
-            pedataSect.stream.Seek( 0 );
+            std::uint32_t modRelocSectOffset;
+            PEFile::PESection *modRelocSect = moduleImage.FindSectionByRVA( relocChunkOffset + modRelocItem.offset, nullptr, &modRelocSectOffset );
 
-            // Here we go. We actually do not map worthless stuff.
-            PEStructures::IMAGE_DOS_HEADER dosHeader;
-            dosHeader.e_magic = PEL_IMAGE_DOS_SIGNATURE;
-            dosHeader.e_cblp = 0;
-            dosHeader.e_cp = 0;
-            dosHeader.e_crlc = 0;
-            dosHeader.e_cparhdr = 0;
-            dosHeader.e_minalloc = 0;
-            dosHeader.e_maxalloc = 0;
-            dosHeader.e_ss = 0;
-            dosHeader.e_sp = 0;
-            dosHeader.e_csum = 0;
-            dosHeader.e_ip = 0;
-            dosHeader.e_cs = 0;
-            dosHeader.e_lfarlc = 0;
-            dosHeader.e_ovno = 0;
-            dosHeader.e_res[0] = 0;
-            dosHeader.e_res[1] = 0;
-            dosHeader.e_res[2] = 0;
-            dosHeader.e_res[3] = 0;
-            dosHeader.e_oemid = 0;
-            dosHeader.e_oeminfo = 0;
-            memset( dosHeader.e_res2, 0, sizeof( dosHeader.e_res2 ) );
-            // this field actually matters, but is an offset from this header now.
-            dosHeader.e_lfanew = sizeof(dosHeader);
+            if ( modRelocSect == nullptr )
+            {
+                continue;
+            }
 
-            pedataSect.stream.WriteStruct( dosHeader );
+            std::uint32_t pointerValue = 0;
 
-            // Have to calculate the size of the optional header that we will write.
-            std::uint32_t optHeaderSize = sizeof( std::uint16_t );  // magic.
+            modRelocSect->stream.Seek( modRelocSectOffset );
+            modRelocSect->stream.ReadUInt32( pointerValue );
 
-            if ( moduleImage.isExtendedFormat )
-            {
-                optHeaderSize += sizeof(PEStructures::IMAGE_OPTIONAL_HEADER64);
-            }
-            else
+            if ( pointerValue - modImageBase < headerEnd )
             {
-                optHeaderSize += sizeof(PEStructures::IMAGE_OPTIONAL_HEADER32);
+                return true;
             }
+        }
+    }
 
-            optHeaderSize += sizeof(PEStructures::IMAGE_DATA_DIRECTORY) * PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+    return false;
+}
 
-            // Decide on what architecture we have, and embed the correct optional headers.
-            PEStructures::IMAGE_PE_HEADER peHeader;
-            peHeader.Signature = PEL_IMAGE_PE_HEADER_SIGNATURE;
-            peHeader.FileHeader.Machine = modMachineType;
-            peHeader.FileHeader.NumberOfSections = moduleImage.GetSectionCount();
-            peHeader.FileHeader.TimeDateStamp = moduleImage.pe_finfo.timeDateStamp;
-            peHeader.FileHeader.PointerToSymbolTable = 0;
-            peHeader.FileHeader.NumberOfSymbols = 0;
-            peHeader.FileHeader.SizeOfOptionalHeader = optHeaderSize;
-            peHeader.FileHeader.Characteristics = moduleImage.GetPENativeFileFlags();
+// Collects the sections of a module that are safe to be shared with byte-identical sections of other modules.
+// Sections are pinned to their module if they carry relocations (content differs per arena) or if they are
+// written to by the loader or the runtime.
+static void GatherFoldableSections( PEFile& moduleImage, std::unordered_set <const PEFile::PESection*>& sectsOut )
+{
+    std::unordered_set <const PEFile::PESection*> pinnedSects;
 
-            pedataSect.stream.WriteStruct( peHeader );
+    for ( auto *modRelocNode : moduleImage.baseRelocs )
+    {
+        std::uint32_t relocChunkOffset = ( modRelocNode->GetKey() * PEFile::baserelocChunkSize );
 
-            // Now write the machine dependent stuff.
-            if ( moduleImage.isExtendedFormat )
+        for ( const PEFile::PEBaseReloc::item& modRelocItem : modRelocNode->GetValue().items )
+        {
+            if ( (PEFile::PEBaseReloc::eRelocType)modRelocItem.type == PEFile::PEBaseReloc::eRelocType::ABSOLUTE )
             {
-                pedataSect.stream.WriteUInt16( PEL_IMAGE_NT_OPTIONAL_HDR64_MAGIC );
-
-                PEStructures::IMAGE_OPTIONAL_HEADER64 optHeader;
-                optHeader.MajorLinkerVersion = moduleImage.peOptHeader.majorLinkerVersion;
-                optHeader.MinorLinkerVersion = moduleImage.peOptHeader.minorLinkerVersion;
-                optHeader.SizeOfCode = moduleImage.peOptHeader.sizeOfCode;
-                optHeader.SizeOfInitializedData = moduleImage.peOptHeader.sizeOfInitializedData;
-                optHeader.SizeOfUninitializedData = moduleImage.peOptHeader.sizeOfUninitializedData;
-                optHeader.AddressOfEntryPoint = 0;
-                optHeader.BaseOfCode = moduleImage.peOptHeader.baseOfCode;
-                optHeader.ImageBase = ( exeModuleBase + embedImageBaseOffset );
-                optHeader.SectionAlignment = moduleImage.GetSectionAlignment();
-                optHeader.FileAlignment = 0;
-                optHeader.MajorOperatingSystemVersion = moduleImage.peOptHeader.majorOSVersion;
-                optHeader.MinorOperatingSystemVersion = moduleImage.peOptHeader.minorOSVersion;
-                optHeader.MajorImageVersion = moduleImage.peOptHeader.majorImageVersion;
-                optHeader.MinorImageVersion = moduleImage.peOptHeader.minorImageVersion;
-                optHeader.MajorSubsystemVersion = moduleImage.peOptHeader.majorSubsysVersion;
-                optHeader.MinorSubsystemVersion = moduleImage.peOptHeader.minorSubsysVersion;
-                optHeader.Win32VersionValue = moduleImage.peOptHeader.win32VersionValue;
-                optHeader.SizeOfImage = moduleImage.peOptHeader.sizeOfImage;
-                optHeader.SizeOfHeaders = moduleImage.peOptHeader.sizeOfHeaders;
-                optHeader.CheckSum = moduleImage.peOptHeader.checkSum;
-                optHeader.Subsystem = moduleImage.peOptHeader.subsys;
-                optHeader.DllCharacteristics = moduleImage.GetPENativeDLLOptFlags();
-                optHeader.SizeOfStackReserve = moduleImage.peOptHeader.sizeOfStackReserve;
-                optHeader.SizeOfStackCommit = moduleImage.peOptHeader.sizeOfStackCommit;
-                optHeader.SizeOfHeapReserve = moduleImage.peOptHeader.sizeOfHeapReserve;
-                optHeader.SizeOfHeapCommit = moduleImage.peOptHeader.sizeOfHeapCommit;
-                optHeader.LoaderFlags = moduleImage.peOptHeader.loaderFlags;
-                optHeader.NumberOfRvaAndSizes = PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
-
-                // Write.
-                pedataSect.stream.WriteStruct( optHeader );
+                continue;
             }
-            else
-            {
-                pedataSect.stream.WriteUInt16( PEL_IMAGE_NT_OPTIONAL_HDR32_MAGIC );
-
-                PEStructures::IMAGE_OPTIONAL_HEADER32 optHeader;
-                optHeader.MajorLinkerVersion = moduleImage.peOptHeader.majorLinkerVersion;
-                optHeader.MinorLinkerVersion = moduleImage.peOptHeader.minorLinkerVersion;
-                optHeader.SizeOfCode = moduleImage.peOptHeader.sizeOfCode;
-                optHeader.SizeOfInitializedData = moduleImage.peOptHeader.sizeOfInitializedData;
-                optHeader.SizeOfUninitializedData = moduleImage.peOptHeader.sizeOfUninitializedData;
-                optHeader.AddressOfEntryPoint = 0;  // we do not need that.
-                optHeader.BaseOfCode = moduleImage.peOptHeader.baseOfCode;
-                optHeader.BaseOfData = moduleImage.peOptHeader.baseOfData;
-                optHeader.ImageBase = (std::uint32_t)( exeModuleBase + embedImageBaseOffset );
-                optHeader.SectionAlignment = moduleImage.GetSectionAlignment();
-                optHeader.FileAlignment = 0;    // who knows?
-                optHeader.MajorOperatingSystemVersion = moduleImage.peOptHeader.majorOSVersion;
-                optHeader.MinorOperatingSystemVersion = moduleImage.peOptHeader.minorOSVersion;
-                optHeader.MajorImageVersion = moduleImage.peOptHeader.majorImageVersion;
-                optHeader.MinorImageVersion = moduleImage.peOptHeader.minorImageVersion;
-                optHeader.MajorSubsystemVersion = moduleImage.peOptHeader.majorSubsysVersion;
-                optHeader.MinorSubsystemVersion = moduleImage.peOptHeader.minorSubsysVersion;
-                optHeader.Win32VersionValue = moduleImage.peOptHeader.win32VersionValue;
-                optHeader.SizeOfImage = moduleImage.peOptHeader.sizeOfImage;
-                optHeader.SizeOfHeaders = 0;    // no idea, who cares? not going to redo this mess.
-                optHeader.CheckSum = moduleImage.peOptHeader.checkSum;
-                optHeader.Subsystem = moduleImage.peOptHeader.subsys;
-                optHeader.DllCharacteristics = moduleImage.GetPENativeDLLOptFlags();
-                optHeader.SizeOfStackReserve = (std::uint32_t)moduleImage.peOptHeader.sizeOfStackReserve;
-                optHeader.SizeOfStackCommit = (std::uint32_t)moduleImage.peOptHeader.sizeOfStackCommit;
-                optHeader.SizeOfHeapReserve = (std::uint32_t)moduleImage.peOptHeader.sizeOfHeapReserve;
-                optHeader.SizeOfHeapCommit = (std::uint32_t)moduleImage.peOptHeader.sizeOfHeapCommit;
-                optHeader.LoaderFlags = moduleImage.peOptHeader.loaderFlags;
-                optHeader.NumberOfRvaAndSizes = PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
 
-                // Write.
-                pedataSect.stream.WriteStruct( optHeader );
-            }
+            std::uint32_t modRelocSectOffset;
 
-            // Must write data directories now, we sort of simulate them.
+            if ( PEFile::PESection *modRelocSect = moduleImage.FindSectionByRVA( relocChunkOffset + modRelocItem.offset, nullptr, &modRelocSectOffset ) )
             {
-                PEStructures::IMAGE_DATA_DIRECTORY dataDirs[ PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES ];
-                memset( dataDirs, 0, sizeof(dataDirs) );
+                pinnedSects.insert( modRelocSect );
+            }
+        }
+    }
 
-                // TODO: fill them out as necessary.
+    for ( const PEFile::PEImportDesc& impDesc : moduleImage.imports )
+    {
+        pinnedSects.insert( impDesc.firstThunkRef.GetSection() );
+    }
 
-                // Write the data dirs.
-                pedataSect.stream.WriteStruct( dataDirs );
-            }
+    for ( const PEFile::PEDelayLoadDesc& impDesc : moduleImage.delayLoads )
+    {
+        pinnedSects.insert( impDesc.IATRef.GetSection() );
+        pinnedSects.insert( impDesc.DLLHandleAlloc.GetSection() );
+    }
 
-            // Finally we write the section headers.
-            // Those might actually be important, who knows.
-            {
-                PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
+    pinnedSects.insert( moduleImage.tlsInfo.allocEntry.GetSection() );
+    pinnedSects.insert( moduleImage.tlsInfo.addressOfIndexRef.GetSection() );
+    pinnedSects.insert( moduleImage.peOptHeader.addressOfEntryPointRef.GetSection() );
 
-                while ( !iter.IsEnd() )
-                {
-                    PEFile::PESection *theSect = iter.Resolve();
+    PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
 
-                    PEStructures::IMAGE_SECTION_HEADER sectHeader;
-                    strncpy( (char*)sectHeader.Name, theSect->shortName.GetConstString(), countof(sectHeader.Name) );
-                    sectHeader.Misc.VirtualSize = theSect->GetVirtualSize();
-                    // we actually have to write the old information!
-                    // which is very useless at this point, unless you know what you are doing.
-                    sectHeader.VirtualAddress = theSect->GetVirtualAddress();
-                    sectHeader.SizeOfRawData = theSect->stream.Size();
-                    sectHeader.PointerToRawData = 0;    // nobody cares.
-                    sectHeader.PointerToLinenumbers = 0;
-                    sectHeader.NumberOfRelocations = 0;
-                    sectHeader.NumberOfLinenumbers = 0;
-                    sectHeader.Characteristics = theSect->GetPENativeFlags();
+    for ( ; !iter.IsEnd(); iter.Increment() )
+    {
+        PEFile::PESection *theSect = iter.Resolve();
 
-                    // Write.
-                    pedataSect.stream.WriteStruct( sectHeader );
+        if ( theSect->chars.sect_mem_write || theSect->chars.sect_mem_execute || theSect->stream.Size() == 0 )
+        {
+            continue;
+        }
 
-                    iter.Increment();
-                }
-            }
+        if ( pinnedSects.find( theSect ) != pinnedSects.end() )
+        {
+            continue;
+        }
 
-            // Embed the section, if it fits. Otherwise we have a potential disaster.
-            if ( pedataSect.IsEmpty() == false )
-            {
-                pedataSect.Finalize();
+        sectsOut.insert( theSect );
+    }
+}
 
-                std::uint32_t sectMemPos = ( embedImageBaseOffset + 0 );    // must at the beginning of the PE image.
+// Returns the amount of executable image space that the arena of a module takes.
+static inline std::uint32_t GetModuleArenaSize( PEFile& exeImage, const PEFile& moduleImage )
+{
+    std::uint32_t sectAlignment = exeImage.GetSectionAlignment();
 
-                pedataSect.SetPlacementInfo( sectMemPos, pedataSect.GetVirtualSize() );
+    return ( ( moduleImage.peOptHeader.sizeOfImage + sectAlignment - 1 ) / sectAlignment * sectAlignment );
+}
 
-                PEFile::PESection *refInside = exeImage.PlaceSection( std::move( pedataSect ) );
+// HINSTANCE that the DLL entry point and the TLS callbacks of a module are called with.
+enum class eInstanceHandleMode
+{
+    EXECUTABLE,     // the executable module handle; Win32 lookups by handle find the merged resources.
+    ARENA,          // the base of the module arena, where the module image PE headers are mapped.
+    NONE
+};
 
-                if ( refInside == nullptr )
-                {
-                    std::cout << "WARNING: failed to embed module image PE headers (.pedata); module might not work properly" << std::endl;
-                }
-            }
+struct AssemblyEnvironment
+{
+    struct MightyAssembler : public asmjit::X86Assembler
+    {
+        inline MightyAssembler( asmjit::CodeHolder *codeHolder ) : X86Assembler( codeHolder )
+        {
+            return;
         }
 
-        // Embed all import directories.
-        if ( moduleImage.imports.GetCount() != 0 )
+        void onEmitMemoryAbsOp( std::uint32_t sectIdx, size_t sectOff, std::int64_t immVal, size_t immLen ) override
         {
-            std::cout << "embedding import directories" << std::endl;
+            // We spawn an abs2abs relocation entry.
+            asmjit::CodeHolder *code = this->getCode();
 
-            for ( const PEFile::PEImportDesc& impDesc : moduleImage.imports )
+            asmjit::RelocEntry *reloc = nullptr;
+            code->newRelocEntry( &reloc, asmjit::RelocEntry::kTypeAbsToAbs, (std::uint32_t)immLen );
+
+            if ( reloc )
             {
-                // We must merge with existing descriptors because the win32 PE loader expects us to.
-                // This means that multiple import descriptors with redundant items is an absolute no-go.
-                PEFile::PEImportDesc newImports;
-                newImports.DLLName = impDesc.DLLName;
-                newImports.DLLName_allocEntry = ResolvePEAllocation( impDesc.DLLName_allocEntry, resolveSectionLink );
+                // Fill in things.
+                reloc->_data = immVal;
+                reloc->_sourceSectionId = sectIdx;
+                reloc->_sourceOffset = sectOff;
+            }
+        }
+    };
 
-                std::cout << "* " << impDesc.DLLName.GetConstString() << std::endl;
+    MightyAssembler x86_asm;
 
-                // Take over all import entries from the module.
-                newImports.funcs = PEFile::PEImportDesc::CreateEquivalentImportsList( impDesc.funcs );
-                // We cannot take over the import names array because it consists of virtual addresses
-                // that we cannot patch because it is against the rules.
+    PEFile& embedImage;
 
-                //TODO: optimize this by acknowledging the allocations of DLLName and funcs inside of the redirected sections.
+    // List of allocations done by the runtime that should stay until the metaSect has been placed
+    // into the image, finally.
+    std::list <PEFile::PESectionAllocation> persistentAllocations;
 
-                // Since we are spreading thunk IATs across the executable image we cannot
-                // use the Win32 PE loader feature to store them in read-only sections.
-                // We have to bundle all IATs in one place to do that.
-                // Solution: make the section of the IAT writable (hack!)
+    // All sections that were put into the executable image on behalf of modules.
+    std::vector <PEFile::PESectionReference> embeddedSections;
 
-                newImports.firstThunkRef = ResolvePEDataRedirect( impDesc.firstThunkRef, resolveSectionLink );
+    // Read-only sections that later modules can share, by content hash.
+    std::unordered_multimap <std::uint64_t, PEFile::PESectionReference> foldableSections;
+    size_t numFoldedBytes = 0;
 
-                newImports.firstThunkRef.GetSection()->chars.sect_mem_write = true;
+    // Code that the entry stub transfers control to, for output verification.
+    std::vector <stubCallTarget> stubCallTargets;
 
-                exeImage.imports.AddToBack( std::move( newImports ) );
-            }
+    // Arena placement and section links of each embedded module, in embedding order.
+    std::vector <layoutManifest::moduleEntry> moduleArenas;
 
-            // Make sure we rewrite the imports directory.
-            exeImage.importsAllocEntry = PEFile::PESectionAllocation();
-        }
+    // Arena of each embedded module by name, for page-access traces of this build (-pgotrace).
+    std::vector <arenaRecord> arenaRecords;
 
-        // Just for the heck of it we could embed exports aswell.
-        if ( doTakeoverExports && moduleImage.exportDir.functions.GetCount() != 0 )
+    // Set if static TLS is emulated per thread (-tlsemu).
+    tlsEmulationRuntime *tlsEmulation = nullptr;
+
+    // Set if sections that only the loader and the stub write to are protected again (default).
+    sectionProtectionPolicy *protectionPolicy = nullptr;
+
+    inline void RequireStartupWrite( PEFile::PESection *sect )
+    {
+        if ( this->protectionPolicy != nullptr )
         {
-            std::cout << "embedding export functions" << std::endl;
+            this->protectionPolicy->RequireStartupWrite( sect );
+        }
+        else
+        {
+            sect->chars.sect_mem_write = true;
+        }
+    }
+
+    inline AssemblyEnvironment( PEFile& embedImage, asmjit::CodeHolder *codeHolder )
+        : x86_asm( codeHolder ), embedImage( embedImage )
+    {
+        return;
+    }
+
+    inline ~AssemblyEnvironment( void )
+    {
+        return;
+    }
 
-            // First just take over exports.
-            size_t ordInputBase = exeImage.exportDir.functions.GetCount();
+    // Returns an already embedded section that has the same contents as the given module section.
+    inline PEFile::PESection* FindFoldedSectionCopy( std::uint64_t contentHash, PEFile::PESection *srcSect )
+    {
+        size_t srcDataSize = (size_t)srcSect->stream.Size();
 
-            for ( const PEFile::PEExportDir::func& expEntry : moduleImage.exportDir.functions )
-            {
-                PEFile::PEExportDir::func newExpEntry;
-                newExpEntry.expRef = ResolvePEDataRedirect( expEntry.expRef, resolveSectionLink );
-                newExpEntry.forwarder = expEntry.forwarder;
-                newExpEntry.isForwarder = expEntry.isForwarder;
+        auto foundRange = this->foldableSections.equal_range( contentHash );
 
-                // Add it to our exports.
-                exeImage.exportDir.functions.AddToBack( std::move( newExpEntry ) );
-            }
+        for ( auto iter = foundRange.first; iter != foundRange.second; iter++ )
+        {
+            PEFile::PESection *foldSect = iter->second.GetSection();
 
-            // Next put all the name mappings, too.
-            for ( auto *nameMapIter : moduleImage.exportDir.funcNameMap )
+            if ( foldSect == nullptr )
             {
-                const PEFile::PEExportDir::mappedName& nameMap = nameMapIter->GetKey();
+                continue;
+            }
 
-                size_t funcOrd = ( ordInputBase + nameMapIter->GetValue() );
+            if ( foldSect->GetVirtualSize() != srcSect->GetVirtualSize() || (size_t)foldSect->stream.Size() != srcDataSize )
+            {
+                continue;
+            }
 
-                // Just take it over.
-                PEFile::PEExportDir::mappedName newNameMap;
-                newNameMap.name = nameMap.name;
-                newNameMap.nameAllocEntry = ResolvePEAllocation( nameMap.nameAllocEntry, resolveSectionLink );
-                exeImage.exportDir.funcNameMap.Set( std::move( newNameMap ), std::move( funcOrd ) );
+            if ( memcmp( foldSect->stream.Data(), srcSect->stream.Data(), srcDataSize ) != 0 )
+            {
+                continue;
             }
 
-            // Rewrite things.
-            exeImage.exportDir.allocEntry = PEFile::PESectionAllocation();
-            exeImage.exportDir.funcAddressAllocEntry = PEFile::PESectionAllocation();
-            exeImage.exportDir.funcNamesAllocEntry = PEFile::PESectionAllocation();
+            return foldSect;
         }
 
-        // Embed delay import directories aswell.
-        if ( moduleImage.delayLoads.GetCount() != 0 )
-        {
-            std::cout << "embedding delay-load import directories" << std::endl;
+        return nullptr;
+    }
 
-            // We do it just like for the regular imports.
-            for ( const PEFile::PEDelayLoadDesc& impDesc : moduleImage.delayLoads )
-            {
-                PEFile::PEDelayLoadDesc newImports;
-                newImports.attrib = impDesc.attrib;
-                newImports.DLLName = impDesc.DLLName;
-                newImports.DLLName_allocEntry = ResolvePEAllocation( impDesc.DLLName_allocEntry, resolveSectionLink );
-                newImports.DLLHandleAlloc = ResolvePEAllocation( impDesc.DLLHandleAlloc, resolveSectionLink );
+    inline int EmbedModuleIntoExecutable(
+        PEFile& moduleImage, const resourceSnapshot *moduleResources, bool requiresRelocations, const char *moduleImageName,
+        bool injectMatchingImports, bool doTakeoverExports, bool doIgnoreResources, bool doFixEntrypointExecutable, bool markAllSectionsExecutable,
+        std::uint32_t archPointerSize, const std::uint32_t *plannedArenaOffset, bool doFoldReadOnly, bool doVerboseResources,
+        bool doMinimalHeaders, eExportCollisionPolicy exportCollisionPolicy, eInstanceHandleMode instanceHandleMode
+    )
+    {
+        PEFile& exeImage = this->embedImage;
 
-                // The IAT always needs special handling.
-                newImports.IATRef = ResolvePEDataRedirect( impDesc.IATRef, resolveSectionLink );
+        // moduleImage cannot be const because we seek inside of its sections.
 
-                newImports.IATRef.GetSection()->chars.sect_mem_write = true;
+        // The module has been checked by ValidateModuleImage already.
 
-                newImports.importNames = PEFile::PEImportDesc::CreateEquivalentImportsList( impDesc.importNames );
-                // Cannot take over the import names allocation table because it consists of RVAs that
-                // we would have to patch, which is against the rules.
-                newImports.boundImportAddrTableRef = ResolvePEDataRedirect( impDesc.boundImportAddrTableRef, resolveSectionLink );
-                newImports.unloadInfoTableRef = ResolvePEDataRedirect( impDesc.unloadInfoTableRef, resolveSectionLink );
-                newImports.timeDateStamp = impDesc.timeDateStamp;
+        // Decide what architecture we generate code for.
+        std::uint32_t genCodeArch = this->x86_asm.getArchInfo().getType();
 
-                //TODO: optimize this by acknowledging the allocations of DLLName and importNames in the redirected sections.
+        std::uint16_t modMachineType = moduleImage.pe_finfo.machine_id;
 
-                // Take it over.
-                exeImage.delayLoads.AddToBack( std::move( newImports ) );
-            }
-        }
+        // We need the module image base for rebase pointer fixing.
+        std::uint64_t modImageBase = moduleImage.GetImageBase();
+
+        // Generate code along with binding.
+
+        // Perform binding of PE references.
+        // We keep a list of all sections that we put into the executable image.
+        // This is important to transfer all the remaining data that is tied to sections.
+        std::unordered_map
+            <const PEFile::PESection *, // we assume the original module stays immutable.
+                PEFile::PESectionReference> sectLinkMap;
+
+        sectLinkMap.reserve( moduleImage.GetSectionCount() );
 
-        // Copy over the resources aswell.
-        if ( moduleImage.resourceRoot.IsEmpty() == false )
+        auto resolveSectionLink = [&]( const PEFile::PESection *srcSect ) -> PEFile::PESection*
         {
-            if ( !doIgnoreResources )
+            // We know that we embedded ALL sections into the executable.
+            // So we should be able to find for all sections a representation.
+            auto findIter = sectLinkMap.find( srcSect );
+
+            if ( findIter == sectLinkMap.end() )
             {
-                std::cout << "embedding module resources" << std::endl;
+                throw runtime_exception( -19, "attempt to resolve PE reference pointing to not-embedded PE section" );
+            }
 
-                // We merge things.
-                bool hasChanged =
-                    resourceHelpers::EmbedResourceDirectoryInto( peString <wchar_t> (), resolveSectionLink, exeImage.resourceRoot, moduleImage.resourceRoot );
+            return findIter->second.GetSection();
+        };
 
-                if ( hasChanged )
-                {
-                    // Need to write new resource data directory.
-                    exeImage.resAllocEntry = PEFile::PESectionAllocation();
-                }
-            }
-            else
+        LogField( "sections", moduleImage.GetSectionCount() );
+
+        std::cout << "mapping sections of module into executable" << std::endl;
+
+        // Embed all sections of the DLL image into the executable image.
+        // For that we have to find a place where we can allocate the "image arena".
+        // The arena could have been planned by the runtime already.
+        std::uint32_t embedImageBaseOffset;
+
+        if ( plannedArenaOffset != nullptr )
+        {
+            embedImageBaseOffset = *plannedArenaOffset;
+        }
+        else
+        {
+            bool foundNewBase = exeImage.FindSectionSpace( moduleImage.peOptHeader.sizeOfImage, embedImageBaseOffset );
+
+            if ( !foundNewBase )
             {
-                std::cout << "ignoring resources" << std::endl;
+                std::cout << "failed to find virtual address space for module image in executable image region" << std::endl;
+
+                return -13;
             }
         }
 
-        bool hasStaticTLS = ( moduleImage.tlsInfo.addressOfIndexRef.GetSection() != nullptr );
+        // Read-only data can be shared with identical sections of previously embedded modules.
+        // This is only provably safe for x86 modules because every absolute reference is described
+        // by a relocation there; x64 code addresses data RIP-relative, which we cannot redirect.
+        std::unordered_set <const PEFile::PESection*> foldCandidates;
+        std::unordered_set <const PEFile::PESection*> foldedSections;
 
-        if ( hasStaticTLS )
+        if ( doFoldReadOnly && modMachineType == PEL_IMAGE_FILE_MACHINE_I386 )
         {
-            std::cout << "WARNING: module image has static TLS; might not work as expected" << std::endl;
+            GatherFoldableSections( moduleImage, foldCandidates );
         }
 
-        std::cout << "rebasing DLL sections" << std::endl;
+        PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
 
-        // Relocate the module pointers properly. We have to solve two problems:
-        // 1) rebase the offsets to the new executable.
-        // 2) identify each pointer's section and redirect it into the new layout
-        for ( auto *modRelocNode : moduleImage.baseRelocs )
+        while ( !iter.IsEnd() )
         {
-            // Calculate the offset of this relocation chunk, all entries base off of it.
-            std::uint32_t relocChunkOffset = ( modRelocNode->GetKey() * PEFile::baserelocChunkSize );
+            PEFile::PESection *theSect = iter.Resolve();
 
-            const PEFile::PEBaseReloc& modRelocChunk = modRelocNode->GetValue();
+            LogVerbose() << "* " << theSect->shortName.GetConstString() << std::endl;
 
-            for ( const PEFile::PEBaseReloc::item& modRelocItem : modRelocChunk.items )
+            // Create a copy of the section.
+            PEFile::PESection newSect;
+            newSect.shortName = theSect->shortName;
+            newSect.chars = theSect->chars;
+
+            if ( markAllSectionsExecutable )
             {
-                std::uint32_t modRelocRVA = ( relocChunkOffset + modRelocItem.offset );
+                newSect.chars.sect_mem_execute = true;
+            }
 
-                // Find out what section this relocation points to.
-                std::uint32_t modRelocSectOffset;
-                PEFile::PESection *modRelocSect = moduleImage.FindSectionByRVA( modRelocRVA, nullptr, &modRelocSectOffset );
+            size_t sectDataSize = (size_t)theSect->stream.Size();
 
-                if ( modRelocSect )
-                {
-                    // Get the counter-part in the executable image.
-                    auto findIter = sectLinkMap.find( modRelocSect );
+            bool isFoldCandidate = ( foldCandidates.find( theSect ) != foldCandidates.end() );
 
-                    assert( findIter != sectLinkMap.end() );
+            std::uint64_t foldHash = 0;
+            PEFile::PESection *foldTarget = nullptr;
 
-                    PEFile::PESection *exeRelocSect = findIter->second.GetSection();
+            if ( isFoldCandidate )
+            {
+                foldHash = contentHash64::HashData( theSect->stream.Data(), sectDataSize );
 
-                    PEFile::PEBaseReloc::eRelocType relocType = (PEFile::PEBaseReloc::eRelocType)modRelocItem.type;
+                foldTarget = this->FindFoldedSectionCopy( foldHash, theSect );
+            }
 
-                    // Fix the relocation to the new image base.
-                    // For that we have to find out where the target points to and
-                    // where this translates to in our target image.
-                    {
-                        if ( relocType == PEFile::PEBaseReloc::eRelocType::HIGHLOW )
-                        {
-                            std::uint32_t origValue = 0;
+            theSect->stream.Seek( 0 );
 
-                            exeRelocSect->stream.Seek( modRelocSectOffset );
-                            exeRelocSect->stream.ReadUInt32( origValue );
+            newSect.stream.Seek( 0 );
 
-                            std::uint32_t rvaTarget = ( origValue - (std::uint32_t)modImageBase );
-                            std::uint32_t newTargetRVA = ( embedImageBaseOffset + rvaTarget );
+            if ( foldTarget == nullptr )
+            {
+                newSect.stream.Truncate( (std::int32_t)sectDataSize );
+                newSect.stream.Write( theSect->stream.Data(), sectDataSize );
+            }
+            else
+            {
+                // Keep the arena layout intact with a virtual-only section; all references go to the shared copy.
+                std::cout << "  folded into identical read-only section " << foldTarget->shortName.GetConstString() << std::endl;
 
-                            exeRelocSect->stream.Seek( modRelocSectOffset );
-                            exeRelocSect->stream.WriteUInt32( newTargetRVA + (std::uint32_t)exeModuleBase );
-                        }
-                        else if ( relocType == PEFile::PEBaseReloc::eRelocType::DIR64 )
-                        {
-                            std::uint64_t origValue = 0;
+                this->numFoldedBytes += sectDataSize;
+            }
 
-                            exeRelocSect->stream.Seek( modRelocSectOffset );
-                            exeRelocSect->stream.ReadUInt64( origValue );
+            // Finalize ourselves.
+            newSect.Finalize();
 
-                            std::uint32_t rvaTarget = (std::uint32_t)( origValue - modImageBase );
-                            std::uint32_t newTargetRVA = ( embedImageBaseOffset + rvaTarget );
+            // Put into image.
+            std::uint32_t sectMemPos = ( embedImageBaseOffset + theSect->GetVirtualAddress() );
 
-                            exeRelocSect->stream.Seek( modRelocSectOffset );
-                            exeRelocSect->stream.WriteUInt64( newTargetRVA + exeModuleBase );
-                        }
-                        else if ( relocType == PEFile::PEBaseReloc::eRelocType::ABSOLUTE )
-                        {
-                            // Gotta ignore.
-                        }
-                        else
-                        {
-                            std::cout << "unknown relocation type in PE rebasing procedure" << std::endl;
+            newSect.SetPlacementInfo( sectMemPos, theSect->GetVirtualSize() );
 
-                            return -15;
-                        }
-                    }
+            PEFile::PESection *refInside = exeImage.PlaceSection( std::move( newSect ) );
 
-                    if ( requiresRelocations )
-                    {
-                        // Register this new rebasing.
-                        exeImage.AddRelocation( embedImageBaseOffset + modRelocRVA, relocType );
-                    }
-                }
+            if ( refInside == nullptr )
+            {
+                throw runtime_exception( -14, "fatal: failed to allocate module section in executable image" );
             }
-        }
 
-        // We might want to inject exports into the imports of the executable module.
-        if ( injectMatchingImports )
-        {
-            std::cout << "injecting matched PE imports..." << std::endl;
+            PEFile::PESectionReference sectInsideRef( refInside );
 
-            // Should keep track of how many items we matched of which type.
-            size_t numOrdinalMatches = 0;
-            size_t numNameMatches = 0;
+            this->embeddedSections.push_back( sectInsideRef );
 
-            // For each export entry in our importing module we check for all import entries
-            // that match it in the executable module. If we find a match we split the import
-            // directories in the thunk so that we can write into the loader address during
+            // Remember this link.
+            if ( foldTarget != nullptr )
+            {
+                foldedSections.insert( theSect );
+
+                sectLinkMap[ theSect ] = PEFile::PESectionReference( foldTarget );
+            }
+            else
+            {
+                if ( isFoldCandidate )
+                {
+                    this->foldableSections.insert( std::make_pair( foldHash, sectInsideRef ) );
+                }
+
+                sectLinkMap[ theSect ] = std::move( sectInsideRef );
+            }
+
+            iter.Increment();
+        }
+
+        // Remember the placement so that incremental runs can reproduce it.
+        {
+            layoutManifest::moduleEntry arenaInfo;
+            arenaInfo.arenaOffset = embedImageBaseOffset;
+            arenaInfo.arenaSize = GetModuleArenaSize( exeImage, moduleImage );
+
+            for ( const auto& linkPair : sectLinkMap )
+            {
+                arenaInfo.sectionLinks.push_back( { linkPair.first->GetVirtualAddress(), linkPair.second.GetSection()->GetVirtualAddress() } );
+            }
+
+            std::sort( arenaInfo.sectionLinks.begin(), arenaInfo.sectionLinks.end(),
+                []( const layoutManifest::sectionLink& left, const layoutManifest::sectionLink& right )
+            {
+                return ( left.moduleRVA < right.moduleRVA );
+            });
+
+            this->moduleArenas.push_back( std::move( arenaInfo ) );
+        }
+
+        // Page-access traces of this build need the arena to attribute executable RVAs (-pgotrace).
+        this->arenaRecords.push_back( { moduleImageName, embedImageBaseOffset } );
+
+        std::uint64_t exeModuleBase = exeImage.GetImageBase();
+
+        // The headers only have to be mapped if the module reads them.
+        bool needsHeaderSection = true;
+
+        if ( doMinimalHeaders )
+        {
+            if ( modMachineType != PEL_IMAGE_FILE_MACHINE_I386 )
+            {
+                std::cout << "keeping module image PE headers (header access of x64 modules cannot be detected)" << std::endl;
+            }
+            else if ( instanceHandleMode == eInstanceHandleMode::ARENA )
+            {
+                std::cout << "keeping module image PE headers (the module instance handle points at them)" << std::endl;
+            }
+            else if ( ModuleReferencesOwnHeaders( moduleImage ) )
+            {
+                std::cout << "keeping module image PE headers (module references its own headers)" << std::endl;
+            }
+            else
+            {
+                std::cout << "omitting module image PE headers (no references into the header range)" << std::endl;
+
+                needsHeaderSection = false;
+            }
+        }
+
+        // We need to create a special PESection that contains the DLL image PE headers,
+        // called ".pedata".
+        if ( needsHeaderSection )
+        {
+            std::cout << "embedding module image PE headers" << std::endl;
+
+            PEFile::PESection pedataSect;
+            pedataSect.shortName = ".pedata";
+            pedataSect.chars.sect_mem_execute = false;
+            pedataSect.chars.sect_mem_read = true;
+            pedataSect.chars.sect_mem_write = false;
+
+            pedataSect.stream.Seek( 0 );
+
+            // Here we go. We actually do not map worthless stuff.
+            PEStructures::IMAGE_DOS_HEADER dosHeader;
+            dosHeader.e_magic = PEL_IMAGE_DOS_SIGNATURE;
+            dosHeader.e_cblp = 0;
+            dosHeader.e_cp = 0;
+            dosHeader.e_crlc = 0;
+            dosHeader.e_cparhdr = 0;
+            dosHeader.e_minalloc = 0;
+            dosHeader.e_maxalloc = 0;
+            dosHeader.e_ss = 0;
+            dosHeader.e_sp = 0;
+            dosHeader.e_csum = 0;
+            dosHeader.e_ip = 0;
+            dosHeader.e_cs = 0;
+            dosHeader.e_lfarlc = 0;
+            dosHeader.e_ovno = 0;
+            dosHeader.e_res[0] = 0;
+            dosHeader.e_res[1] = 0;
+            dosHeader.e_res[2] = 0;
+            dosHeader.e_res[3] = 0;
+            dosHeader.e_oemid = 0;
+            dosHeader.e_oeminfo = 0;
+            memset( dosHeader.e_res2, 0, sizeof( dosHeader.e_res2 ) );
+            // this field actually matters, but is an offset from this header now.
+            dosHeader.e_lfanew = sizeof(dosHeader);
+
+            pedataSect.stream.WriteStruct( dosHeader );
+
+            // Have to calculate the size of the optional header that we will write.
+            std::uint32_t optHeaderSize = sizeof( std::uint16_t );  // magic.
+
+            if ( moduleImage.isExtendedFormat )
+            {
+                optHeaderSize += sizeof(PEStructures::IMAGE_OPTIONAL_HEADER64);
+            }
+            else
+            {
+                optHeaderSize += sizeof(PEStructures::IMAGE_OPTIONAL_HEADER32);
+            }
+
+            optHeaderSize += sizeof(PEStructures::IMAGE_DATA_DIRECTORY) * PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+
+            // Decide on what architecture we have, and embed the correct optional headers.
+            PEStructures::IMAGE_PE_HEADER peHeader;
+            peHeader.Signature = PEL_IMAGE_PE_HEADER_SIGNATURE;
+            peHeader.FileHeader.Machine = modMachineType;
+            peHeader.FileHeader.NumberOfSections = moduleImage.GetSectionCount();
+            peHeader.FileHeader.TimeDateStamp = moduleImage.pe_finfo.timeDateStamp;
+            peHeader.FileHeader.PointerToSymbolTable = 0;
+            peHeader.FileHeader.NumberOfSymbols = 0;
+            peHeader.FileHeader.SizeOfOptionalHeader = optHeaderSize;
+            peHeader.FileHeader.Characteristics = moduleImage.GetPENativeFileFlags();
+
+            pedataSect.stream.WriteStruct( peHeader );
+
+            // Now write the machine dependent stuff.
+            if ( moduleImage.isExtendedFormat )
+            {
+                pedataSect.stream.WriteUInt16( PEL_IMAGE_NT_OPTIONAL_HDR64_MAGIC );
+
+                PEStructures::IMAGE_OPTIONAL_HEADER64 optHeader;
+                optHeader.MajorLinkerVersion = moduleImage.peOptHeader.majorLinkerVersion;
+                optHeader.MinorLinkerVersion = moduleImage.peOptHeader.minorLinkerVersion;
+                optHeader.SizeOfCode = moduleImage.peOptHeader.sizeOfCode;
+                optHeader.SizeOfInitializedData = moduleImage.peOptHeader.sizeOfInitializedData;
+                optHeader.SizeOfUninitializedData = moduleImage.peOptHeader.sizeOfUninitializedData;
+                optHeader.AddressOfEntryPoint = 0;
+                optHeader.BaseOfCode = moduleImage.peOptHeader.baseOfCode;
+                optHeader.ImageBase = ( exeModuleBase + embedImageBaseOffset );
+                optHeader.SectionAlignment = moduleImage.GetSectionAlignment();
+                optHeader.FileAlignment = 0;
+                optHeader.MajorOperatingSystemVersion = moduleImage.peOptHeader.majorOSVersion;
+                optHeader.MinorOperatingSystemVersion = moduleImage.peOptHeader.minorOSVersion;
+                optHeader.MajorImageVersion = moduleImage.peOptHeader.majorImageVersion;
+                optHeader.MinorImageVersion = moduleImage.peOptHeader.minorImageVersion;
+                optHeader.MajorSubsystemVersion = moduleImage.peOptHeader.majorSubsysVersion;
+                optHeader.MinorSubsystemVersion = moduleImage.peOptHeader.minorSubsysVersion;
+                optHeader.Win32VersionValue = moduleImage.peOptHeader.win32VersionValue;
+                optHeader.SizeOfImage = moduleImage.peOptHeader.sizeOfImage;
+                optHeader.SizeOfHeaders = moduleImage.peOptHeader.sizeOfHeaders;
+                optHeader.CheckSum = moduleImage.peOptHeader.checkSum;
+                optHeader.Subsystem = moduleImage.peOptHeader.subsys;
+                optHeader.DllCharacteristics = moduleImage.GetPENativeDLLOptFlags();
+                optHeader.SizeOfStackReserve = moduleImage.peOptHeader.sizeOfStackReserve;
+                optHeader.SizeOfStackCommit = moduleImage.peOptHeader.sizeOfStackCommit;
+                optHeader.SizeOfHeapReserve = moduleImage.peOptHeader.sizeOfHeapReserve;
+                optHeader.SizeOfHeapCommit = moduleImage.peOptHeader.sizeOfHeapCommit;
+                optHeader.LoaderFlags = moduleImage.peOptHeader.loaderFlags;
+                optHeader.NumberOfRvaAndSizes = PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+
+                // Write.
+                pedataSect.stream.WriteStruct( optHeader );
+            }
+            else
+            {
+                pedataSect.stream.WriteUInt16( PEL_IMAGE_NT_OPTIONAL_HDR32_MAGIC );
+
+                PEStructures::IMAGE_OPTIONAL_HEADER32 optHeader;
+                optHeader.MajorLinkerVersion = moduleImage.peOptHeader.majorLinkerVersion;
+                optHeader.MinorLinkerVersion = moduleImage.peOptHeader.minorLinkerVersion;
+                optHeader.SizeOfCode = moduleImage.peOptHeader.sizeOfCode;
+                optHeader.SizeOfInitializedData = moduleImage.peOptHeader.sizeOfInitializedData;
+                optHeader.SizeOfUninitializedData = moduleImage.peOptHeader.sizeOfUninitializedData;
+                optHeader.AddressOfEntryPoint = 0;  // we do not need that.
+                optHeader.BaseOfCode = moduleImage.peOptHeader.baseOfCode;
+                optHeader.BaseOfData = moduleImage.peOptHeader.baseOfData;
+                optHeader.ImageBase = (std::uint32_t)( exeModuleBase + embedImageBaseOffset );
+                optHeader.SectionAlignment = moduleImage.GetSectionAlignment();
+                optHeader.FileAlignment = 0;    // who knows?
+                optHeader.MajorOperatingSystemVersion = moduleImage.peOptHeader.majorOSVersion;
+                optHeader.MinorOperatingSystemVersion = moduleImage.peOptHeader.minorOSVersion;
+                optHeader.MajorImageVersion = moduleImage.peOptHeader.majorImageVersion;
+                optHeader.MinorImageVersion = moduleImage.peOptHeader.minorImageVersion;
+                optHeader.MajorSubsystemVersion = moduleImage.peOptHeader.majorSubsysVersion;
+                optHeader.MinorSubsystemVersion = moduleImage.peOptHeader.minorSubsysVersion;
+                optHeader.Win32VersionValue = moduleImage.peOptHeader.win32VersionValue;
+                optHeader.SizeOfImage = moduleImage.peOptHeader.sizeOfImage;
+                optHeader.SizeOfHeaders = 0;    // no idea, who cares? not going to redo this mess.
+                optHeader.CheckSum = moduleImage.peOptHeader.checkSum;
+                optHeader.Subsystem = moduleImage.peOptHeader.subsys;
+                optHeader.DllCharacteristics = moduleImage.GetPENativeDLLOptFlags();
+                optHeader.SizeOfStackReserve = (std::uint32_t)moduleImage.peOptHeader.sizeOfStackReserve;
+                optHeader.SizeOfStackCommit = (std::uint32_t)moduleImage.peOptHeader.sizeOfStackCommit;
+                optHeader.SizeOfHeapReserve = (std::uint32_t)moduleImage.peOptHeader.sizeOfHeapReserve;
+                optHeader.SizeOfHeapCommit = (std::uint32_t)moduleImage.peOptHeader.sizeOfHeapCommit;
+                optHeader.LoaderFlags = moduleImage.peOptHeader.loaderFlags;
+                optHeader.NumberOfRvaAndSizes = PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+
+                // Write.
+                pedataSect.stream.WriteStruct( optHeader );
+            }
+
+            // Must write data directories now, we sort of simulate them.
+            {
+                PEStructures::IMAGE_DATA_DIRECTORY dataDirs[ PEL_IMAGE_NUMBEROF_DIRECTORY_ENTRIES ];
+                memset( dataDirs, 0, sizeof(dataDirs) );
+
+                // TODO: fill them out as necessary.
+
+                // Write the data dirs.
+                pedataSect.stream.WriteStruct( dataDirs );
+            }
+
+            // Finally we write the section headers.
+            // Those might actually be important, who knows.
+            {
+                PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
+
+                while ( !iter.IsEnd() )
+                {
+                    PEFile::PESection *theSect = iter.Resolve();
+
+                    PEStructures::IMAGE_SECTION_HEADER sectHeader;
+                    strncpy( (char*)sectHeader.Name, theSect->shortName.GetConstString(), countof(sectHeader.Name) );
+                    sectHeader.Misc.VirtualSize = theSect->GetVirtualSize();
+                    // we actually have to write the old information!
+                    // which is very useless at this point, unless you know what you are doing.
+                    sectHeader.VirtualAddress = theSect->GetVirtualAddress();
+                    sectHeader.SizeOfRawData = theSect->stream.Size();
+                    sectHeader.PointerToRawData = 0;    // nobody cares.
+                    sectHeader.PointerToLinenumbers = 0;
+                    sectHeader.NumberOfRelocations = 0;
+                    sectHeader.NumberOfLinenumbers = 0;
+                    sectHeader.Characteristics = theSect->GetPENativeFlags();
+
+                    // Write.
+                    pedataSect.stream.WriteStruct( sectHeader );
+
+                    iter.Increment();
+                }
+            }
+
+            // Embed the section, if it fits. Otherwise we have a potential disaster.
+            if ( pedataSect.IsEmpty() == false )
+            {
+                pedataSect.Finalize();
+
+                std::uint32_t sectMemPos = ( embedImageBaseOffset + 0 );    // must at the beginning of the PE image.
+
+                pedataSect.SetPlacementInfo( sectMemPos, pedataSect.GetVirtualSize() );
+
+                PEFile::PESection *refInside = exeImage.PlaceSection( std::move( pedataSect ) );
+
+                if ( refInside == nullptr )
+                {
+                    std::cout << "WARNING: failed to embed module image PE headers (.pedata); module might not work properly" << std::endl;
+                }
+                else
+                {
+                    this->embeddedSections.push_back( PEFile::PESectionReference( refInside ) );
+                }
+            }
+        }
+
+        // Embed all import directories.
+        if ( moduleImage.imports.GetCount() != 0 )
+        {
+            size_t numImportFuncs = 0;
+
+            for ( const PEFile::PEImportDesc& impDesc : moduleImage.imports )
+            {
+                numImportFuncs += impDesc.funcs.GetCount();
+            }
+
+            LogField( "importDLLs", moduleImage.imports.GetCount() );
+            LogField( "importFuncs", numImportFuncs );
+
+            std::cout << "embedding import directories" << std::endl;
+
+            for ( const PEFile::PEImportDesc& impDesc : moduleImage.imports )
+            {
+                // We must merge with existing descriptors because the win32 PE loader expects us to.
+                // This means that multiple import descriptors with redundant items is an absolute no-go.
+                PEFile::PEImportDesc newImports;
+                newImports.DLLName = impDesc.DLLName;
+                newImports.DLLName_allocEntry = ResolvePEAllocation( impDesc.DLLName_allocEntry, resolveSectionLink );
+
+                LogVerbose() << "* " << impDesc.DLLName.GetConstString() << std::endl;
+
+                // Take over all import entries from the module.
+                newImports.funcs = PEFile::PEImportDesc::CreateEquivalentImportsList( impDesc.funcs );
+                // We cannot take over the import names array because it consists of virtual addresses
+                // that we cannot patch because it is against the rules.
+
+                //TODO: optimize this by acknowledging the allocations of DLLName and funcs inside of the redirected sections.
+
+                // Since we are spreading thunk IATs across the executable image we cannot
+                // use the Win32 PE loader feature to store them in read-only sections.
+                // We have to bundle all IATs in one place to do that.
+                // Solution: make the section of the IAT writable until the entry stub has run (hack!)
+
+                newImports.firstThunkRef = ResolvePEDataRedirect( impDesc.firstThunkRef, resolveSectionLink );
+
+                this->RequireStartupWrite( newImports.firstThunkRef.GetSection() );
+
+                exeImage.imports.AddToBack( std::move( newImports ) );
+            }
+
+            // Make sure we rewrite the imports directory.
+            exeImage.importsAllocEntry = PEFile::PESectionAllocation();
+        }
+
+        // Just for the heck of it we could embed exports aswell.
+        if ( doTakeoverExports && moduleImage.exportDir.functions.GetCount() != 0 )
+        {
+            std::cout << "embedding export functions" << std::endl;
+
+            exportMergeStats mergeStats;
+
+            MergeModuleExports( exeImage.exportDir, moduleImage.exportDir, moduleImageName, resolveSectionLink, exportCollisionPolicy, mergeStats );
+
+            LogField( "exports", moduleImage.exportDir.functions.GetCount() );
+            LogField( "collisions", mergeStats.numCollisions );
+            LogField( "renamed", mergeStats.numRenamed );
+
+            std::cout << "took over " << moduleImage.exportDir.functions.GetCount() << " exports";
+
+            if ( mergeStats.numCollisions > 0 )
+            {
+                std::cout << " (" << mergeStats.numCollisions << " name collisions, " << mergeStats.numRenamed << " renamed)";
+            }
+
+            std::cout << std::endl;
+
+            // Rewrite things.
+            exeImage.exportDir.allocEntry = PEFile::PESectionAllocation();
+            exeImage.exportDir.funcAddressAllocEntry = PEFile::PESectionAllocation();
+            exeImage.exportDir.funcNamesAllocEntry = PEFile::PESectionAllocation();
+        }
+
+        // Embed delay import directories aswell.
+        if ( moduleImage.delayLoads.GetCount() != 0 )
+        {
+            LogField( "delayLoadDLLs", moduleImage.delayLoads.GetCount() );
+
+            std::cout << "embedding delay-load import directories" << std::endl;
+
+            // We do it just like for the regular imports.
+            for ( const PEFile::PEDelayLoadDesc& impDesc : moduleImage.delayLoads )
+            {
+                PEFile::PEDelayLoadDesc newImports;
+                newImports.attrib = impDesc.attrib;
+                newImports.DLLName = impDesc.DLLName;
+                newImports.DLLName_allocEntry = ResolvePEAllocation( impDesc.DLLName_allocEntry, resolveSectionLink );
+                newImports.DLLHandleAlloc = ResolvePEAllocation( impDesc.DLLHandleAlloc, resolveSectionLink );
+
+                // The IAT always needs special handling.
+                // The delay-load helper writes it whenever a function is first called, so it stays writable.
+                newImports.IATRef = ResolvePEDataRedirect( impDesc.IATRef, resolveSectionLink );
+
+                newImports.IATRef.GetSection()->chars.sect_mem_write = true;
+
+                newImports.importNames = PEFile::PEImportDesc::CreateEquivalentImportsList( impDesc.importNames );
+                // Cannot take over the import names allocation table because it consists of RVAs that
+                // we would have to patch, which is against the rules.
+                newImports.boundImportAddrTableRef = ResolvePEDataRedirect( impDesc.boundImportAddrTableRef, resolveSectionLink );
+                newImports.unloadInfoTableRef = ResolvePEDataRedirect( impDesc.unloadInfoTableRef, resolveSectionLink );
+                newImports.timeDateStamp = impDesc.timeDateStamp;
+
+                //TODO: optimize this by acknowledging the allocations of DLLName and importNames in the redirected sections.
+
+                // Take it over.
+                exeImage.delayLoads.AddToBack( std::move( newImports ) );
+            }
+        }
+
+        // Copy over the resources aswell. Cached images share a snapshot of them between jobs; otherwise
+        // the module image is ours and thrown away after embedding, so its resource items are moved over.
+        bool hasModuleResources = ( moduleResources != nullptr ? moduleResources->IsEmpty() == false : moduleImage.resourceRoot.IsEmpty() == false );
+
+        if ( hasModuleResources )
+        {
+            if ( !doIgnoreResources )
+            {
+                std::cout << "embedding module resources" << std::endl;
+
+                auto mergeStartTime = std::chrono::steady_clock::now();
+
+                resourceHelpers::mergeStats mergeStats;
+
+                // We merge things.
+                bool hasChanged;
+
+                if ( moduleResources != nullptr )
+                {
+                    hasChanged = resourceHelpers::EmbedResourceDirectoryInto( peString <wchar_t> (), resolveSectionLink, exeImage.resourceRoot, *moduleResources, moduleResources->GetRoot(), doVerboseResources, mergeStats );
+                }
+                else
+                {
+                    hasChanged = resourceHelpers::MoveResourceDirectoryInto( peString <wchar_t> (), resolveSectionLink, exeImage.resourceRoot, moduleImage.resourceRoot, doVerboseResources, mergeStats );
+                }
+
+                auto mergeMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( std::chrono::steady_clock::now() - mergeStartTime ).count();
+
+                LogField( "mergedDirs", mergeStats.numMergedDirs );
+                LogField( "addedTrees", mergeStats.numAddedTrees );
+                LogField( "replacedItems", mergeStats.numReplacedItems );
+                LogField( "copiedLeaves", mergeStats.numClonedLeaves );
+                LogField( "movedLeaves", mergeStats.numMovedLeaves );
+                LogField( "ms", mergeMillis );
+
+                std::cout
+                    << "merged " << mergeStats.numMergedDirs << " resource directories in " << mergeMillis << "ms: "
+                    << mergeStats.numAddedTrees << " trees added, " << mergeStats.numReplacedItems << " items replaced, "
+                    << mergeStats.numClonedLeaves << " resource entries copied, " << mergeStats.numMovedLeaves << " moved" << std::endl;
+
+                if ( hasChanged )
+                {
+                    // Need to write new resource data directory.
+                    exeImage.resAllocEntry = PEFile::PESectionAllocation();
+                }
+            }
+            else
+            {
+                std::cout << "ignoring resources" << std::endl;
+            }
+        }
+
+        bool hasStaticTLS = ( moduleImage.tlsInfo.addressOfIndexRef.GetSection() != nullptr );
+
+        if ( hasStaticTLS )
+        {
+            std::cout << "WARNING: module image has static TLS; might not work as expected" << std::endl;
+        }
+
+        std::cout << "rebasing DLL sections" << std::endl;
+
+        // Relocation targets inside of folded sections have to point to the shared copy.
+        auto translateRelocTargetRVA = [&]( std::uint32_t rvaTarget ) -> std::uint32_t
+        {
+            if ( foldedSections.empty() == false )
+            {
+                std::uint32_t targetSectOffset;
+                PEFile::PESection *targetSect = moduleImage.FindSectionByRVA( rvaTarget, nullptr, &targetSectOffset );
+
+                if ( targetSect != nullptr && foldedSections.find( targetSect ) != foldedSections.end() )
+                {
+                    return resolveSectionLink( targetSect )->ResolveRVA( targetSectOffset );
+                }
+            }
+
+            return ( embedImageBaseOffset + rvaTarget );
+        };
+
+        // Relocate the module pointers properly. We have to solve two problems:
+        // 1) rebase the offsets to the new executable.
+        // 2) identify each pointer's section and redirect it into the new layout
+        for ( auto *modRelocNode : moduleImage.baseRelocs )
+        {
+            // Calculate the offset of this relocation chunk, all entries base off of it.
+            std::uint32_t relocChunkOffset = ( modRelocNode->GetKey() * PEFile::baserelocChunkSize );
+
+            const PEFile::PEBaseReloc& modRelocChunk = modRelocNode->GetValue();
+
+            for ( const PEFile::PEBaseReloc::item& modRelocItem : modRelocChunk.items )
+            {
+                std::uint32_t modRelocRVA = ( relocChunkOffset + modRelocItem.offset );
+
+                // Find out what section this relocation points to.
+                std::uint32_t modRelocSectOffset;
+                PEFile::PESection *modRelocSect = moduleImage.FindSectionByRVA( modRelocRVA, nullptr, &modRelocSectOffset );
+
+                if ( modRelocSect )
+                {
+                    // Get the counter-part in the executable image.
+                    auto findIter = sectLinkMap.find( modRelocSect );
+
+                    assert( findIter != sectLinkMap.end() );
+
+                    PEFile::PESection *exeRelocSect = findIter->second.GetSection();
+
+                    PEFile::PEBaseReloc::eRelocType relocType = (PEFile::PEBaseReloc::eRelocType)modRelocItem.type;
+
+                    // Fix the relocation to the new image base.
+                    // For that we have to find out where the target points to and
+                    // where this translates to in our target image.
+                    {
+                        if ( relocType == PEFile::PEBaseReloc::eRelocType::HIGHLOW )
+                        {
+                            std::uint32_t origValue = 0;
+
+                            exeRelocSect->stream.Seek( modRelocSectOffset );
+                            exeRelocSect->stream.ReadUInt32( origValue );
+
+                            std::uint32_t rvaTarget = ( origValue - (std::uint32_t)modImageBase );
+                            std::uint32_t newTargetRVA = translateRelocTargetRVA( rvaTarget );
+
+                            exeRelocSect->stream.Seek( modRelocSectOffset );
+                            exeRelocSect->stream.WriteUInt32( newTargetRVA + (std::uint32_t)exeModuleBase );
+                        }
+                        else if ( relocType == PEFile::PEBaseReloc::eRelocType::DIR64 )
+                        {
+                            std::uint64_t origValue = 0;
+
+                            exeRelocSect->stream.Seek( modRelocSectOffset );
+                            exeRelocSect->stream.ReadUInt64( origValue );
+
+                            std::uint32_t rvaTarget = (std::uint32_t)( origValue - modImageBase );
+                            std::uint32_t newTargetRVA = translateRelocTargetRVA( rvaTarget );
+
+                            exeRelocSect->stream.Seek( modRelocSectOffset );
+                            exeRelocSect->stream.WriteUInt64( newTargetRVA + exeModuleBase );
+                        }
+                        else if ( relocType == PEFile::PEBaseReloc::eRelocType::ABSOLUTE )
+                        {
+                            // Gotta ignore.
+                        }
+                        else
+                        {
+                            std::cout << "unknown relocation type in PE rebasing procedure" << std::endl;
+
+                            return -15;
+                        }
+                    }
+
+                    if ( requiresRelocations )
+                    {
+                        // Register this new rebasing.
+                        exeImage.AddRelocation( embedImageBaseOffset + modRelocRVA, relocType );
+                    }
+                }
+            }
+        }
+
+        // We might want to inject exports into the imports of the executable module.
+        if ( injectMatchingImports )
+        {
+            std::cout << "injecting matched PE imports..." << std::endl;
+
+            // Should keep track of how many items we matched of which type.
+            size_t numOrdinalMatches = 0;
+            size_t numNameMatches = 0;
+
+            // For each export entry in our importing module we check for all import entries
+            // that match it in the executable module. If we find a match we split the import
+            // directories in the thunk so that we can write into the loader address during
             // entry point.
             {
-                size_t dstImpDescIter = 0;
-                size_t numImportDescs = exeImage.imports.GetCount();
+                size_t dstImpDescIter = 0;
+                size_t numImportDescs = exeImage.imports.GetCount();
+
+                while ( dstImpDescIter < numImportDescs )
+                {
+                    PEFile::PEImportDesc& impDesc = exeImage.imports[ dstImpDescIter ];
+
+                    bool removeImpDesc = false;
+
+                    // Do things for matching import descriptors only.
+                    if ( BoundedStringEqual(
+                            impDesc.DLLName.GetConstString(), impDesc.DLLName.GetLength(),
+                            moduleImageName,
+                            false ) )
+                    {
+                        struct basicImpDescriptorHandler
+                        {
+                            PEFile::PEImportDesc& impDesc;
+                            std::uint32_t archPointerSize;
+                            size_t dstImpDescIter;
+
+                            AINLINE basicImpDescriptorHandler( PEFile::PEImportDesc& impDesc, size_t dstImpDescIter, std::uint32_t archPointerSize )
+                                : impDesc( impDesc ), dstImpDescIter( dstImpDescIter )
+                            {
+                                this->archPointerSize = archPointerSize;
+                            }
+
+                            AINLINE void MakeSecondDescriptor( PEFile& image, size_t functake_idx, size_t functake_count, std::uint32_t thunkRefStartOffset )
+                            {
+                                // Simply take over the remainder of the first entry into a new second entry.
+                                PEFile::PEImportDesc newSecondDesc;
+                                newSecondDesc.DLLName = impDesc.DLLName;
+                                newSecondDesc.DLLName_allocEntry = impDesc.DLLName_allocEntry.CloneOnlyFinal();
+
+                                newSecondDesc.funcs.InsertMove( 0, &impDesc.funcs[ functake_idx ], functake_count );
+
+                                // Offset the names allocation entry to the right point.
+                                if ( PEFile::PESection *impNamesSect = impDesc.impNameArrayAllocEntry.GetSection() )
+                                {
+                                    // Import name entries are sized after the architecture pointer size.
+                                    // Which means that we can simply use the offset of the IAT.
+                                    std::uint32_t sectOffsetNames = ( impDesc.impNameArrayAllocEntry.ResolveInternalOffset( thunkRefStartOffset ) );
+                                    std::uint32_t remainderSize = ( this->archPointerSize * (std::uint32_t)functake_count );
+
+                                    impNamesSect->SetPlacedMemoryInline( newSecondDesc.impNameArrayAllocEntry, sectOffsetNames, remainderSize );
+                                }
+
+                                // Need to point to the new entry properly.
+                                newSecondDesc.firstThunkRef = image.ResolveRVAToRef( impDesc.firstThunkRef.GetRVA() + thunkRefStartOffset );
+
+                                // Insert the new import descriptor after our.
+                                image.imports.InsertMove( this->dstImpDescIter + 1, std::move( newSecondDesc ) );
+                            }
+
+                            AINLINE PEFile::PEImportDesc::functions_t& GetImportFunctions( void )
+                            {
+                                return impDesc.funcs;
+                            }
+
+                            AINLINE PEFile::PESectionDataReference& GetFirstThunkRef( void )
+                            {
+                                return impDesc.firstThunkRef;
+                            }
+
+                            AINLINE void TrimFirstDescriptor( size_t trimTo )
+                            {
+                                impDesc.funcs.Resize( trimTo );
+                            }
+
+                            AINLINE void MoveIATBy( PEFile& image, std::uint32_t moveBytes )
+                            {
+                                impDesc.firstThunkRef = image.ResolveRVAToRef( impDesc.firstThunkRef.GetRVA() + moveBytes );
+                            }
+
+                            AINLINE void RemoveFirstEntry( void )
+                            {
+                                impDesc.funcs.RemoveByIndex( 0 );
+                            }
+                        };
+                        basicImpDescriptorHandler splitOp( impDesc, dstImpDescIter, archPointerSize );
+
+                        removeImpDesc = InjectImportsWithExports(
+                            exeImage,
+                            moduleImage.exportDir, splitOp, resolveSectionLink,
+                            numOrdinalMatches, numNameMatches,
+                            archPointerSize, requiresRelocations
+                        );
+                    }
+
+                    if ( removeImpDesc )
+                    {
+                        LogVerbose() << "* terminated import module " << impDesc.DLLName.GetConstString() << std::endl;
+
+                        exeImage.imports.RemoveByIndex( dstImpDescIter );
+
+                        numImportDescs--;
+                    }
+                    else
+                    {
+                        dstImpDescIter++;
+                    }
+                }
+            }
+
+            // Also do the delayed import descriptors, which should be possible.
+            {
+                size_t dstImpDescIter = 0;
+                size_t numImportDescs = exeImage.delayLoads.GetCount();
+
+                while ( dstImpDescIter < numImportDescs )
+                {
+                    bool removeImpDesc = false;
+
+                    // Process this import descriptor.
+                    PEFile::PEDelayLoadDesc& impDesc = exeImage.delayLoads[ dstImpDescIter ];
+
+                    if ( BoundedStringEqual( impDesc.DLLName.GetConstString(), impDesc.DLLName.GetLength(), moduleImageName, false ) )
+                    {
+                        struct delayedImpDescriptorHandler
+                        {
+                            AssemblyEnvironment& env;
+                            PEFile::PEDelayLoadDesc& impDesc;
+                            std::uint32_t archPointerSize;
+                            size_t dstImpDescIter;
+
+                            AINLINE delayedImpDescriptorHandler( AssemblyEnvironment& env, PEFile::PEDelayLoadDesc& impDesc, std::uint32_t archPointerSize, size_t dstImpDescIter )
+                                : env( env ), impDesc( impDesc ), dstImpDescIter( dstImpDescIter )
+                            {
+                                this->archPointerSize = archPointerSize;
+                            }
+
+                            AINLINE PEFile::PEImportDesc::functions_t& GetImportFunctions( void )
+                            {
+                                return impDesc.importNames;
+                            }
+
+                            AINLINE PEFile::PESectionDataReference& GetFirstThunkRef( void )
+                            {
+                                return impDesc.IATRef;
+                            }
+
+                            AINLINE void TrimFirstDescriptor( size_t trimTo )
+                            {
+                                impDesc.importNames.Resize( trimTo );
+                            }
+
+                            AINLINE void RemoveFirstEntry( void )
+                            {
+                                impDesc.importNames.RemoveByIndex( 0 );
+                            }
+
+                            AINLINE void MoveIATBy( PEFile& image, std::uint32_t moveBytes )
+                            {
+                                impDesc.IATRef = image.ResolveRVAToRef( impDesc.IATRef.GetRVA() + moveBytes );
+
+                                // Move the other if it is available.
+                                PEFile::PESectionDataReference& unloadIAT = impDesc.unloadInfoTableRef;
+
+                                if ( unloadIAT.GetSection() != nullptr )
+                                {
+                                    unloadIAT = image.ResolveRVAToRef( unloadIAT.GetRVA() + moveBytes );
+                                }
+                            }
+
+                            AINLINE void MakeSecondDescriptor( PEFile& image, size_t functake_idx, size_t functake_count, std::uint32_t thunkRefStartOffset )
+                            {
+                                PEFile::PEDelayLoadDesc newSecondImp;
+                                newSecondImp.attrib = impDesc.attrib;
+                                newSecondImp.DLLName = impDesc.DLLName;
+                                newSecondImp.DLLName_allocEntry = impDesc.DLLName_allocEntry.CloneOnlyFinal();
+                                // DLL handle memory is automatically allocated during commit-phase of writing.
+
+                                // Create a special IAT out of the previous.
+                                newSecondImp.IATRef = image.ResolveRVAToRef( impDesc.IATRef.GetRVA() + thunkRefStartOffset );
+
+                                // Copy over the import names aswell.
+                                newSecondImp.importNames.InsertMove( 0, &impDesc.importNames[ functake_idx ], functake_count );
+
+                                // Take over the allocation entries.
+                                if ( PEFile::PESection *impNamesSect = impDesc.importNamesAllocEntry.GetSection() )
+                                {
+                                    // Import name entries are sized after the architecture pointer size.
+                                    // Which means that we can simply use the offset of the IAT.
+                                    std::uint32_t sectOffsetNames = ( impDesc.importNamesAllocEntry.ResolveInternalOffset( thunkRefStartOffset ) );
+                                    std::uint32_t remainderSize = ( this->archPointerSize * (std::uint32_t)functake_count );
+
+                                    impNamesSect->SetPlacedMemoryInline( newSecondImp.importNamesAllocEntry, sectOffsetNames, remainderSize );
+                                }
+
+                                // If an unload info table existed previously, also handle that case.
+                                {
+                                    PEFile::PESectionDataReference& unloadIAT = impDesc.unloadInfoTableRef;
+
+                                    if ( unloadIAT.GetSection() != nullptr )
+                                    {
+                                        unloadIAT = image.ResolveRVAToRef( unloadIAT.GetRVA() + thunkRefStartOffset );
+                                    }
+                                }
+
+                                newSecondImp.timeDateStamp = impDesc.timeDateStamp;
+
+                                // Put in the new descriptor after the one we manage.
+                                image.delayLoads.InsertMove( this->dstImpDescIter + 1, std::move( newSecondImp ) );
+
+                                // Done.
+                            }
+                        };
+                        delayedImpDescriptorHandler splitOp( *this, impDesc, archPointerSize, dstImpDescIter );
+
+                        removeImpDesc =
+                            InjectImportsWithExports(
+                                exeImage,
+                                moduleImage.exportDir, splitOp, resolveSectionLink,
+                                numOrdinalMatches, numNameMatches,
+                                archPointerSize, requiresRelocations
+                            );
+                    }
+
+                    if ( removeImpDesc )
+                    {
+                        LogVerbose() << "* terminated delay-load import module " << impDesc.DLLName.GetConstString() << std::endl;
+
+                        exeImage.delayLoads.RemoveByIndex( dstImpDescIter );
+
+                        numImportDescs--;
+                    }
+                    else
+                    {
+                        dstImpDescIter++;
+                    }
+                }
+            }
+
+            // If any work was done then we should rewrite the imports table.
+            if ( numNameMatches > 0 || numOrdinalMatches > 0 )
+            {
+                exeImage.importsAllocEntry = PEFile::PESectionAllocation();
+            }
+
+            // Output some helpful statistics.
+            LogField( "namedImports", numNameMatches );
+            LogField( "ordinalImports", numOrdinalMatches );
+
+            std::cout << "injected " << numNameMatches << " named and " << numOrdinalMatches << " ordinal PE imports" << std::endl;
+        }
+
+        // TODO: generate all code that depends on RVAs over here.
+
+        // Do we need TLS data?
+        tlsEmulationModule *tlsEmuModule = nullptr;
+
+        if ( moduleImage.tlsInfo.startOfRawDataRef.GetSection() != nullptr )
+        {
+            std::cout << "patching static TLS data references" << std::endl;
+
+            // Calculate the RVA to the TLS.
+            std::uint32_t rvaTLSData;
+            {
+                auto findIter = sectLinkMap.find( moduleImage.tlsInfo.allocEntry.GetSection() );
+
+                assert( findIter != sectLinkMap.end() );
+
+                rvaTLSData = findIter->second.GetSection()->ResolveRVA( moduleImage.tlsInfo.allocEntry.ResolveInternalOffset( 0 ) );
+            }
+
+            std::uint64_t vaTLSData = ( exeModuleBase + rvaTLSData );
+
+            // Either every thread gets its own copy of the TLS data through a TLS slot of the process, or
+            // we do a simple patch of all TLS references to point directly inside the TLS data array.
+            // The latter disables all thread-local abilities but it will make the embedding work.
+            if ( this->tlsEmulation != nullptr )
+            {
+                std::uint32_t templateSize = ( moduleImage.tlsInfo.endOfRawDataRef.GetRVA() - moduleImage.tlsInfo.startOfRawDataRef.GetRVA() );
+
+                tlsEmuModule = AddTLSEmulationModule( *this->tlsEmulation, rvaTLSData, templateSize, moduleImage.tlsInfo.sizeOfZeroFill );
+            }
+
+            staticTLSPatchStats tlsPatchStats;
+
+            PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
+
+            for ( ; !iter.IsEnd(); iter.Increment() )
+            {
+                PEFile::PESection *modSect = iter.Resolve();
+
+                auto findIter = sectLinkMap.find( modSect );
+
+                assert( findIter != sectLinkMap.end() );
+
+                PEFile::PESection *exeSect = findIter->second.GetSection();
+
+                // Only process sections that do contain executable code.
+                if ( exeSect->chars.sect_mem_execute == false )
+                {
+                    continue;
+                }
+
+                std::uint8_t *dataBuf = (std::uint8_t*)exeSect->stream.Data();
+                size_t dataSize = (size_t)exeSect->stream.Size();
+
+                if ( tlsEmuModule != nullptr )
+                {
+                    // The thunk calls are written once the entry stub has been placed.
+                    std::vector <staticTLSAccess> accesses;
+
+                    if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                    {
+                        FindStaticTLSAccessesX86( dataBuf, dataSize, accesses );
+                    }
+                    else
+                    {
+                        FindStaticTLSAccessesX64( dataBuf, dataSize, accesses );
+                    }
+
+                    for ( const staticTLSAccess& access : accesses )
+                    {
+                        tlsEmuModule->sites.push_back( { exeSect, access.offset, access.length, access.destReg } );
+
+                        tlsPatchStats.numPatched++;
+
+                        if ( access.hasIndexedLoad )
+                        {
+                            tlsPatchStats.numIndexedLoads++;
+                        }
+                    }
+                }
+                // Depending on architecture...
+                else if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                {
+                    std::vector <size_t> relocOffsets;
+
+                    PatchStaticTLSReferencesX86( dataBuf, dataSize, (std::uint32_t)vaTLSData, relocOffsets, tlsPatchStats );
+
+                    // If the image is relocatable, add a relocation entry aswell.
+                    if ( requiresRelocations )
+                    {
+                        for ( size_t relocOffset : relocOffsets )
+                        {
+                            exeImage.AddRelocation( exeSect->ResolveRVA( (std::uint32_t)relocOffset ), PEFile::PEBaseReloc::eRelocType::HIGHLOW );
+                        }
+                    }
+                }
+                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+                {
+                    PatchStaticTLSReferencesX64( dataBuf, dataSize, exeSect->ResolveRVA( 0 ), rvaTLSData, tlsPatchStats );
+                }
+                else
+                {
+                    assert( 0 );
+                }
+            }
+
+            LogField( "tlsLoads", tlsPatchStats.numPatched );
+            LogField( "indexedLoads", tlsPatchStats.numIndexedLoads );
+
+            std::cout << ( tlsEmuModule != nullptr ? "redirected " : "patched " ) << tlsPatchStats.numPatched << " TLS array loads (" << tlsPatchStats.numIndexedLoads << " with indexed access)";
+
+            if ( tlsEmuModule != nullptr )
+            {
+                std::cout << " to per-thread copies of " << tlsEmuModule->templateSize << " template bytes";
+            }
+
+            std::cout << std::endl;
+        }
+
+        // So if we have TLS indices, we have to use the utility thunk to allocate into the array.
+        if ( hasStaticTLS )
+        {
+            // Good read about TEB native entries:
+            // http://www.geoffchappell.com/studies/windows/win32/ntdll/structs/teb/index.htm
+            // But to keep things simple we ain't gonna do that.
+
+            // TODO: since this Kobalicek dude does not provide a good way to get abs2abs relocation
+            //  entries (he is incapable to understand the concept) we have a bug here. the only way to
+            //  properly solve this is to patch asmjit itself, make it put an optional abs2abs entry
+            //  per X86Mov (on demand, with a flag).
+            // TODO: hacked around asmjit to get something automatic; might want to share with the author of
+            //  asmjit.
+
+            if ( tlsEmuModule != nullptr )
+            {
+                EmitTLSEmulationStartup( x86_asm, *this->tlsEmulation, *tlsEmuModule );
+            }
+
+            if ( this->protectionPolicy != nullptr )
+            {
+                this->protectionPolicy->RequireStartupWrite( resolveSectionLink( moduleImage.tlsInfo.addressOfIndexRef.GetSection() ) );
+            }
+
+            x86_asm.xor_( x86_asm.zax(), x86_asm.zax() ),
+            x86_asm.mov( asmjit::X86Mem( embedImageBaseOffset + moduleImage.tlsInfo.addressOfIndexRef.GetRVA() ), x86_asm.zax() );
+        }
+
+        // Need this param for initializers.
+        // The image base is read from the PEB at runtime, so the handle stays right if the executable is rebased.
+        auto loadInstanceHandle = [&]( const asmjit::X86Gp& destReg )
+        {
+            x86_asm.xor_( destReg, destReg );
+
+            if ( instanceHandleMode == eInstanceHandleMode::NONE )
+            {
+                return;
+            }
+
+            asmjit::X86Mem pebPtr;
+            std::int32_t pebImageBaseOffset;
+
+            if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+            {
+                pebPtr = asmjit::x86::ptr( destReg, 0x60, 8 );
+                pebPtr.setSegment( asmjit::x86::gs );
+
+                pebImageBaseOffset = 0x10;
+            }
+            else
+            {
+                pebPtr = asmjit::x86::ptr( destReg, 0x30, 4 );
+                pebPtr.setSegment( asmjit::x86::fs );
+
+                pebImageBaseOffset = 0x08;
+            }
+
+            x86_asm.mov( destReg, pebPtr );
+            x86_asm.mov( destReg, asmjit::x86::ptr( destReg, pebImageBaseOffset, archPointerSize ) );
+
+            if ( instanceHandleMode == eInstanceHandleMode::ARENA )
+            {
+                x86_asm.add( destReg, embedImageBaseOffset );
+            }
+        };
+
+        // Call all initializers if we have some.
+        if ( PEFile::PESection *tlsSect = moduleImage.tlsInfo.addressOfCallbacksRef.GetSection() )
+        {
+            std::cout << "linking TLS callbacks" << std::endl;
+
+            std::uint32_t indexOfCallback = 0;
+
+            std::uint32_t sectoffAddrOfCallbacks = moduleImage.tlsInfo.addressOfCallbacksRef.GetSectionOffset();
+
+            while ( true )
+            {
+                std::uint64_t callbackPtr;
+
+                tlsSect->stream.Seek( (std::int32_t)( sectoffAddrOfCallbacks + indexOfCallback * archPointerSize ) );
+
+                // Advance the index to next.
+                indexOfCallback++;
+
+                if ( archPointerSize == 4 )
+                {
+                    std::uint32_t value;
+                    bool gotValue = tlsSect->stream.ReadUInt32( value );
+
+                    if ( !gotValue )
+                    {
+                        std::cout << "failed to read 32bit TLS callback value" << std::endl;
+
+                        return -16;
+                    }
+
+                    callbackPtr = value;
+                }
+                else if ( archPointerSize == 8 )
+                {
+                    bool gotValue = tlsSect->stream.ReadUInt64( callbackPtr );
+
+                    if ( !gotValue )
+                    {
+                        std::cout << "failed to read 64bit TLS callback value" << std::endl;
+
+                        return -16;
+                    }
+                }
+                else
+                {
+                    std::cout << "invalid architecture pointer size" << std::endl;
+
+                    return -16;
+                }
+
+                if ( callbackPtr == 0 )
+                {
+                    break;
+                }
+
+                // Need to determine the redirected RVA.
+                // For that we have to find the section this callback is targetting.
+                std::uint32_t rvaToCallback = 0;
+                {
+                    std::uint32_t modrvaToCallback = (std::uint32_t)( callbackPtr - modImageBase );
+
+                    std::uint32_t modTargetSectIntOff;
+                    PEFile::PESection *modTargetSect = moduleImage.FindSectionByRVA( modrvaToCallback, nullptr, &modTargetSectIntOff );
+
+                    if ( modTargetSect )
+                    {
+                        auto findIter = sectLinkMap.find( modTargetSect );
+
+                        assert( findIter != sectLinkMap.end() );
+
+                        rvaToCallback = findIter->second.GetSection()->ResolveRVA( modTargetSectIntOff );
+                    }
+                }
+
+                if ( rvaToCallback != 0 )
+                {
+                    this->stubCallTargets.push_back( { rvaToCallback, std::string( "TLS callback of " ) + moduleImageName } );
+
+                    // Call this function.
+                    std::uint32_t paramReserved = 0;
+                    std::uint32_t paramReason = 1;  // DLL_PROCESS_ATTACH
+
+                    if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                    {
+                        x86_asm.push( paramReserved );
+                        x86_asm.push( paramReason );
+                        loadInstanceHandle( asmjit::x86::eax );
+                        x86_asm.push( asmjit::x86::eax );
+                        x86_asm.call( rvaToCallback );
+                    }
+                    else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+                    {
+                        loadInstanceHandle( asmjit::x86::rcx );
+                        x86_asm.mov( asmjit::x86::rdx, paramReason );
+                        x86_asm.mov( asmjit::x86::r8, paramReserved );
+                        x86_asm.call( rvaToCallback );
+                    }
+                    else
+                    {
+                        std::cout << "failed to call TLS callback due to unknown architecture" << std::endl;
+
+                        return -17;
+                    }
+                }
+            }
+        }
+
+        // Check if we even have an entry point.
+        // If we have no entry point then we do not embed a call to it.
+        const PEFile::PESectionDataReference& modEntryPointRef = moduleImage.peOptHeader.addressOfEntryPointRef;
+
+        if ( modEntryPointRef.GetSection() != nullptr )
+        {
+            PEFile::PESection *targetModEntryPointSect;
+
+            // Call into the DLL entry point with the default parameters.
+            std::uint32_t rvaToDLLEntryPoint = ResolvePESectionRVA( modEntryPointRef, resolveSectionLink, &targetModEntryPointSect );
+            {
+                this->stubCallTargets.push_back( { rvaToDLLEntryPoint, std::string( "entry point of " ) + moduleImageName } );
+
+                std::uint32_t paramReserved = 0;
+                std::uint32_t paramReason = 1;      // DLL_PROCESS_ATTACH
+
+                // Call the DLL entry point.
+                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                {
+                    x86_asm.push( paramReserved );
+                    x86_asm.push( paramReason );
+                    loadInstanceHandle( asmjit::x86::eax );
+                    x86_asm.push( asmjit::x86::eax );
+                    x86_asm.call( rvaToDLLEntryPoint );
+                }
+                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+                {
+                    loadInstanceHandle( asmjit::x86::rcx );
+                    x86_asm.mov( asmjit::x86::rdx, paramReason );
+                    x86_asm.mov( asmjit::x86::r8, paramReserved );
+                    x86_asm.call( rvaToDLLEntryPoint );
+                }
+                else
+                {
+                    std::cout << "unknown target machine architecture for entry point generation" << std::endl;
+
+                    return -12;
+                }
+
+                // If the section of the entry point is not marked executable, then we probably want to fix this here.
+                // This is a strange thing inside of the Win32 PE loader.
+                if ( doFixEntrypointExecutable )
+                {
+                    if ( targetModEntryPointSect->chars.sect_mem_execute == false )
+                    {
+                        std::cout << "fixing module entry point section to executable" << std::endl;
+
+                        targetModEntryPointSect->chars.sect_mem_execute = true;
+                    }
+                }
+            }
+        }
+        else
+        {
+            std::cout << "no DLL entry point (skip)" << std::endl;
+        }
+
+        // Success!
+        return 0;
+    }
+};
+
+// Fetches a filename from a file path, or at least attempts to.
+static const char* FetchFileName( const char *path )
+{
+    // We skip till the last slash character.
+    const char *pathIter = path;
+    const char *last_file_name = pathIter;
+
+    while ( true )
+    {
+        char c = *pathIter;
+
+        if ( c == 0 )
+        {
+            break;
+        }
+
+        pathIter++;
+
+        // Archive entries are separated by a colon.
+        if ( c == '/' || c == '\\' || c == ':' )
+        {
+            last_file_name = pathIter;
+        }
+    }
+
+    return last_file_name;
+}
+
+// Loads a PE image from a file on disk or an archive entry, or takes it from the cache of the embed server.
+// A cached image comes with the snapshot of its resources if resourcesOut is given.
+static std::unique_ptr <PEFile> LoadImageFromDisk( const char *path, peImageCache *imageCache, bool *isFromCacheOut = nullptr, std::shared_ptr <const resourceSnapshot> *resourcesOut = nullptr )
+{
+    if ( imageCache != nullptr )
+    {
+        std::unique_ptr <PEFile> cachedImage = imageCache->Take( path, resourcesOut );
+
+        if ( cachedImage )
+        {
+            if ( isFromCacheOut != nullptr )
+            {
+                *isFromCacheOut = true;
+            }
+            else
+            {
+                std::cout << "using cached image" << std::endl;
+            }
+
+            return cachedImage;
+        }
+    }
+
+    // Archive entries are streamed straight out of the archive.
+    std::unique_ptr <PEStream> peStream = OpenInputStream( path );
+
+    if ( !peStream )
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr <PEFile> image = std::make_unique <PEFile> ();
+
+    image->LoadFromDisk( peStream.get() );
+
+    return image;
+}
+
+// Checks that a module image can be embedded into an executable of the given machine type.
+// Returns zero if it can, otherwise the error code and message.
+static int ValidateModuleImage( const PEFile& moduleImage, std::uint16_t exeMachineType, const char*& errorMessageOut )
+{
+    std::uint16_t modMachineType = moduleImage.pe_finfo.machine_id;
+
+    // Check that both images are of same machine type.
+    if ( exeMachineType != modMachineType )
+    {
+        errorMessageOut = "machine types of images do not match";
+        return -3;
+    }
+
+    // Check that the module is a DLL.
+    if ( moduleImage.pe_finfo.isDLL != true )
+    {
+        errorMessageOut = "provided DLL image is not a DLL image";
+        return -6;
+    }
+
+    // The DLL module must be relocatable, if 32bit.
+    // If 64bit then the module could be compiled RIP-relative, which is ok.
+    if ( modMachineType == PEL_IMAGE_FILE_MACHINE_I386 && moduleImage.HasRelocationInfo() == false )
+    {
+        errorMessageOut = "DLL image is not relocatable (x86 requirement)";
+        return -11;
+    }
+
+    return 0;
+}
+
+// Takes the next module from the loader pipeline and reports its loading like a direct load would.
+static int FetchNextModule( moduleLoadPipeline& modulePipeline, const char *path, std::unique_ptr <PEFile>& imageOut, std::shared_ptr <const resourceSnapshot>& resourcesOut )
+{
+    std::cout << "loading module image (" << path << ")" << std::endl;
+
+    moduleLoadPipeline::loadedModule loaded = modulePipeline.Next();
+
+    if ( loaded.isFromCache )
+    {
+        std::cout << "using cached image" << std::endl;
+    }
+
+    if ( loaded.errorCode != 0 )
+    {
+        std::cout << loaded.errorMessage << std::endl;
+
+        return loaded.errorCode;
+    }
+
+    imageOut = std::move( loaded.image );
+    resourcesOut = std::move( loaded.resources );
+
+    return 0;
+}
+
+// Decides the arena of every module inside of the executable image based on a page-access trace.
+// Module arenas with the most densely touched pages are put first, so that the hot pages of the
+// image end up next to each other; modules that were never touched go to the end of the image.
+// Sections inside of an arena cannot be reordered because modules address across their sections
+// relatively (RIP-relative code, for example).
+static bool PlanArenaLayoutFromTrace(
+    PEFile& exeImage, const pageTrace& trace,
+    const std::vector <const char*>& moduleFileNames, const std::vector <std::unique_ptr <PEFile>>& moduleImages,
+    std::vector <std::uint32_t>& arenaOffsetsOut
+)
+{
+    size_t numModules = moduleImages.size();
+
+    std::vector <std::uint32_t> arenaSizes( numModules );
+    std::uint32_t totalArenaSize = 0;
+
+    for ( size_t n = 0; n < numModules; n++ )
+    {
+        std::uint32_t arenaSize = GetModuleArenaSize( exeImage, *moduleImages[n] );
+
+        arenaSizes[n] = arenaSize;
+        totalArenaSize += arenaSize;
+    }
+
+    // Reserve one region for all arenas so that we can freely order them.
+    std::uint32_t groupBaseOffset;
+
+    if ( !exeImage.FindSectionSpace( totalArenaSize, groupBaseOffset ) )
+    {
+        return false;
+    }
+
+    // Executable RVAs of the trace are attributed by the arena records of the traced build.
+    std::vector <double> hotPageDensity( numModules );
+    {
+        for ( size_t n = 0; n < numModules; n++ )
+        {
+            std::uint32_t arenaSize = arenaSizes[n];
+
+            size_t hotPageCount = trace.GetModuleHotPageCount( moduleFileNames[n], arenaSize );
+
+            std::uint32_t arenaPageCount = ( ( arenaSize + pageTrace::pageSize - 1 ) / pageTrace::pageSize );
+
+            hotPageDensity[n] = ( arenaPageCount != 0 ? (double)hotPageCount / arenaPageCount : 0.0 );
+
+            LogVerbose() << "* " << moduleFileNames[n] << ": " << hotPageCount << " of " << arenaPageCount << " pages hot" << std::endl;
+        }
+    }
+
+    std::vector <size_t> layoutOrder( numModules );
+    std::iota( layoutOrder.begin(), layoutOrder.end(), (size_t)0 );
+
+    std::stable_sort( layoutOrder.begin(), layoutOrder.end(),
+        [&]( size_t left, size_t right )
+    {
+        return ( hotPageDensity[left] > hotPageDensity[right] );
+    });
+
+    arenaOffsetsOut.resize( numModules );
+
+    std::uint32_t curArenaOffset = groupBaseOffset;
+
+    for ( size_t modIdx : layoutOrder )
+    {
+        arenaOffsetsOut[ modIdx ] = curArenaOffset;
+
+        curArenaOffset += arenaSizes[ modIdx ];
+    }
+
+    return true;
+}
+
+static int RunEmbedJob( int argc, char *argv[], peImageCache *imageCache );
+
+// Performs one embedding as described by the command line.
+static int ProcessEmbedJob( int argc, char *argv[], peImageCache *imageCache )
+{
+    // Syntax: pefrmdllembed.exe *OPTIONS* *input exe filename* *input mod1 filename* *input mod2 filename* ... *input modn filename* *output exe filename*
+
+    size_t curArg = 1;
+
+    bool doFixEntryPoint = false;
+    bool doInjectMatchingImports = false;
+    bool doTakeoverExports = true;
+    bool doFixEntrypointExecutable = true;
+    bool markAllSectionsExecutable = false;
+    bool doPrintHelp = false;
+    bool doIgnoreResources = false;
+    const char *pgoTracePath = nullptr;
+    bool doTrimZeroTails = false;
+    bool doFoldReadOnly = false;
+    const char *sigPatchPath = nullptr;
+    unsigned int numWorkerThreads = 1;
+    bool doVerifyOutput = false;
+    bool doIncremental = false;
+    bool doDirectWrite = false;
+    bool doSkipUnchanged = false;
+    bool doWriteDelta = false;
+    bool doPackSections = false;
+    bool doWriteChecksum = false;
+    const char *reportFormat = nullptr;
+    bool doVerboseResources = false;
+    eLogLevel logLevel = eLogLevel::SUMMARY;
+    const char *logJSONPath = nullptr;
+    bool doAppendLogJSON = false;
+    bool doMinimalHeaders = false;
+    bool doEmulateTLS = false;
+    bool doReprotectSections = false;
+    eInstanceHandleMode instanceHandleMode = eInstanceHandleMode::EXECUTABLE;
+    eExportCollisionPolicy exportCollisionPolicy = eExportCollisionPolicy::FIRST_WINS;
+    std::vector <fanOutTarget> fanOutTargets;
+    std::vector <const char*> jobOptionArgs;    // options that are passed on to the target jobs.
+    bool hasInvalidArgument = false;
+
+    if ( argc >= 1 )
+    {
+        // Parse all options.
+        OptionParser optParser( (const char**)argv + curArg, (size_t)argc - curArg );
+
+        std::vector <std::pair <size_t, size_t>> targetArgSpans;
+
+        while ( true )
+        {
+            size_t optStartIdx = optParser.GetArgIndex();
+
+            std::string opt = optParser.FetchOption();
+
+            if ( opt.empty() )
+                break;
+
+            if ( opt == "entryfix" || opt == "efix" )
+            {
+                doFixEntryPoint = true;
+            }
+            else if ( opt == "injimp" || opt == "impinj" )
+            {
+                doInjectMatchingImports = true;
+            }
+            else if ( opt == "noexp" )
+            {
+                doTakeoverExports = false;
+            }
+            else if ( opt == "help" || opt == "h" || opt == "?" )
+            {
+                doPrintHelp = true;
+            }
+            else if ( opt == "nores" || opt == "ignres" )
+            {
+                doIgnoreResources = true;
+            }
+            else if ( opt == "expcollide" )
+            {
+                const char *policyName = optParser.FetchArgument();
+
+                if ( policyName != nullptr && strcmp( policyName, "first" ) == 0 )
+                {
+                    exportCollisionPolicy = eExportCollisionPolicy::FIRST_WINS;
+                }
+                else if ( policyName != nullptr && strcmp( policyName, "prefix" ) == 0 )
+                {
+                    exportCollisionPolicy = eExportCollisionPolicy::PREFIX_MODULE;
+                }
+                else if ( policyName != nullptr && strcmp( policyName, "error" ) == 0 )
+                {
+                    exportCollisionPolicy = eExportCollisionPolicy::FAIL;
+                }
+                else
+                {
+                    std::cout << "missing export collision policy (first, prefix or error) for -expcollide" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+            }
+            else if ( opt == "hinst" )
+            {
+                const char *modeName = optParser.FetchArgument();
+
+                if ( modeName != nullptr && strcmp( modeName, "exe" ) == 0 )
+                {
+                    instanceHandleMode = eInstanceHandleMode::EXECUTABLE;
+                }
+                else if ( modeName != nullptr && strcmp( modeName, "arena" ) == 0 )
+                {
+                    instanceHandleMode = eInstanceHandleMode::ARENA;
+                }
+                else if ( modeName != nullptr && strcmp( modeName, "null" ) == 0 )
+                {
+                    instanceHandleMode = eInstanceHandleMode::NONE;
+                }
+                else
+                {
+                    std::cout << "missing instance handle mode (exe, arena or null) for -hinst" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+            }
+            else if ( opt == "reprotect" )
+            {
+                doReprotectSections = true;
+            }
+            else if ( opt == "tlsemu" )
+            {
+                doEmulateTLS = true;
+            }
+            else if ( opt == "minpedata" )
+            {
+                doMinimalHeaders = true;
+            }
+            else if ( opt == "verboseres" )
+            {
+                doVerboseResources = true;
+            }
+            else if ( opt == "log" )
+            {
+                const char *levelName = optParser.FetchArgument();
+
+                if ( levelName != nullptr && strcmp( levelName, "quiet" ) == 0 )
+                {
+                    logLevel = eLogLevel::QUIET;
+                }
+                else if ( levelName != nullptr && strcmp( levelName, "summary" ) == 0 )
+                {
+                    logLevel = eLogLevel::SUMMARY;
+                }
+                else if ( levelName != nullptr && strcmp( levelName, "verbose" ) == 0 )
+                {
+                    logLevel = eLogLevel::VERBOSE;
+                }
+                else
+                {
+                    std::cout << "missing log level (quiet, summary or verbose) for -log" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+            }
+            else if ( opt == "logjson" )
+            {
+                logJSONPath = optParser.FetchArgument();
+
+                if ( logJSONPath == nullptr )
+                {
+                    std::cout << "missing file path for -logjson" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+            }
+            else if ( opt == "logappend" )
+            {
+                doAppendLogJSON = true;
+            }
+            else if ( opt == "noentryexecfix" || opt == "noeexecfix" )
+            {
+                doFixEntrypointExecutable = false;
+            }
+            else if ( opt == "marksectexec" )
+            {
+                markAllSectionsExecutable = true;
+            }
+            else if ( opt == "foldro" )
+            {
+                doFoldReadOnly = true;
+            }
+            else if ( opt == "incremental" || opt == "incr" )
+            {
+                doIncremental = true;
+            }
+            else if ( opt == "target" )
+            {
+                const char *targetInputPath = optParser.FetchArgument();
+                const char *targetOutputPath = ( targetInputPath ? optParser.FetchArgument() : nullptr );
+
+                if ( targetOutputPath == nullptr )
+                {
+                    std::cout << "missing input or output executable path for -target" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+                else
+                {
+                    fanOutTargets.push_back( { targetInputPath, targetOutputPath } );
+                }
+
+                targetArgSpans.push_back( std::make_pair( optStartIdx, optParser.GetArgIndex() ) );
+            }
+            else if ( opt == "report" )
+            {
+                reportFormat = optParser.FetchArgument();
+
+                if ( reportFormat == nullptr || ( strcmp( reportFormat, "text" ) != 0 && strcmp( reportFormat, "json" ) != 0 ) )
+                {
+                    std::cout << "missing report format (text or json) for -report" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+            }
+            else if ( opt == "checksum" )
+            {
+                doWriteChecksum = true;
+            }
+            else if ( opt == "packsections" || opt == "packsect" )
+            {
+                doPackSections = true;
+            }
+            else if ( opt == "delta" )
+            {
+                doWriteDelta = true;
+            }
+            else if ( opt == "skipunchanged" )
+            {
+                doSkipUnchanged = true;
+            }
+            else if ( opt == "directwrite" )
+            {
+                doDirectWrite = true;
+            }
+            else if ( opt == "verify" )
+            {
+                doVerifyOutput = true;
+            }
+            else if ( opt == "trimzero" )
+            {
+                doTrimZeroTails = true;
+            }
+            else if ( opt == "pgotrace" )
+            {
+                pgoTracePath = optParser.FetchArgument();
+
+                if ( pgoTracePath == nullptr )
+                {
+                    std::cout << "missing page-access trace path for -pgotrace" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+            }
+            else if ( opt == "patchsig" )
+            {
+                sigPatchPath = optParser.FetchArgument();
+
+                if ( sigPatchPath == nullptr )
+                {
+                    std::cout << "missing signature patch file path for -patchsig" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+            }
+            else if ( opt == "threads" )
+            {
+                const char *threadCountStr = optParser.FetchArgument();
+
+                if ( threadCountStr == nullptr )
+                {
+                    std::cout << "missing thread count for -threads" << std::endl;
+
+                    hasInvalidArgument = true;
+                }
+                else
+                {
+                    numWorkerThreads = (unsigned int)strtoul( threadCountStr, nullptr, 10 );
+
+                    // Zero means one thread per hardware thread.
+                    if ( numWorkerThreads == 0 )
+                    {
+                        numWorkerThreads = std::max( 1u, std::thread::hardware_concurrency() );
+                    }
+                }
+            }
+            else
+            {
+                std::cout << "unknown cmdline option: " << opt << std::endl;
+            }
+        }
+
+        size_t optArgIndex = optParser.GetArgIndex();
+
+        for ( size_t argIdx = 0; argIdx < optArgIndex; argIdx++ )
+        {
+            bool isTargetArg = false;
+
+            for ( const std::pair <size_t, size_t>& span : targetArgSpans )
+            {
+                if ( argIdx >= span.first && argIdx < span.second )
+                {
+                    isTargetArg = true;
+                    break;
+                }
+            }
+
+            if ( !isTargetArg )
+            {
+                jobOptionArgs.push_back( argv[ curArg + argIdx ] );
+            }
+        }
+
+        curArg += optArgIndex;
+
+        argc -= (int)optArgIndex;
+    }
+
+    // Running with defaults in place of a mistyped option would produce a different image than asked for.
+    if ( hasInvalidArgument )
+    {
+        return -31;
+    }
+
+    // Verbose logging includes every resource item.
+    if ( logLevel == eLogLevel::VERBOSE )
+    {
+        doVerboseResources = true;
+    }
+
+    if ( !ConfigureLogging( logLevel, logJSONPath, doAppendLogJSON ) )
+    {
+        std::cout << "failed to open JSON log file " << logJSONPath << std::endl;
+
+        return -30;
+    }
+
+    // If we print help, then we just do that and quit.
+    if ( doPrintHelp )
+    {
+        std::cout << "USAGE: -[options] *input.exe* *input1.dll* *input2.dll* ... *inputn.dll* *output.exe*" << std::endl;
+        std::cout << "Input images can be read straight out of ZIP archives: *archive.zip:path/in/archive.dll*" << std::endl;
+        std::cout << std::endl;
+
+        std::cout << "Option Descriptions:" << std::endl;
+        std::cout << "-efix: restores original executable entry point in PE header after DLL load" << std::endl;
+        std::cout << "-injimp: hooks executable imports with input DLL exports" << std::endl;
+        std::cout << "-noexp: does not take over DLL exports into executable" << std::endl;
+        std::cout << "-expcollide *first|prefix|error*: export names that are taken already stay with their first owner (default), get the module name as prefix or fail" << std::endl;
+        std::cout << "-nores: leaves out resources from the DLL" << std::endl;
+        std::cout << "-verboseres: prints every merged or replaced resource item instead of a summary" << std::endl;
+        std::cout << "-log *quiet|summary|verbose*: console output; quiet prints the log only if the job fails, verbose prints every section, import and resource item" << std::endl;
+        std::cout << "-logjson *file*: also writes the log, the phase timings and the result as JSON lines; counts and phase results are fields of the events" << std::endl;
+        std::cout << "-logappend: appends to the -logjson file instead of replacing it" << std::endl;
+        std::cout << "-noentryexecfix: prevents making sections of entry points executable if not already" << std::endl;
+        std::cout << "-marksectexec: marks all injected sections executable" << std::endl;
+        std::cout << "-pgotrace *file*: orders module arenas by a page-access trace (hot modules first); executable RVAs are attributed by the arena records (*output*.arenas) that the traced build wrote" << std::endl;
+        std::cout << "-trimzero: leaves trailing zero bytes of injected sections to loader zero-fill" << std::endl;
+        std::cout << "-packsections: compresses injected module sections and inflates them in the entry stub (images without relocations)" << std::endl;
+        std::cout << "-hinst *exe|arena|null*: instance handle for module entry points and TLS callbacks; the executable (default), the module arena or none" << std::endl;
+        std::cout << "-reprotect: protects sections again after startup that only need write access for the loader, the entry stub or the unpacker" << std::endl;
+        std::cout << "-tlsemu: gives every thread its own copy of the static TLS data of modules instead of sharing one (fibers are not supported; their threads never release the copy)" << std::endl;
+        std::cout << "-minpedata: leaves out the .pedata header section of x86 modules that never reference their own headers" << std::endl;
+        std::cout << "-foldro: shares identical read-only sections between injected x86 modules" << std::endl;
+        std::cout << "-incremental: keeps the module layout of the previous run (*output*.layout) and skips unchanged builds" << std::endl;
+        std::cout << "-target *input.exe* *output.exe*: embeds the modules into this executable; repeatable, all positional arguments are modules then (-threads targets at once)" << std::endl;
+        std::cout << "-delta: also writes *output*.delta, a binary delta that rebuilds the output from the input executable" << std::endl;
+        std::cout << "-skipunchanged: keeps the existing output file (and its timestamp) if the new image is identical" << std::endl;
+        std::cout << "-report *text|json*: writes *output*.report.txt/.json with the size, page and memory cost of each module and section" << std::endl;
+        std::cout << "-checksum: stores a valid optional header checksum into the output image" << std::endl;
+        std::cout << "-directwrite: streams the output image straight into the file instead of buffering it (no atomic replace)" << std::endl;
+        std::cout << "-verify: checks the output image for references outside of mapped sections before it replaces the output file" << std::endl;
+        std::cout << "-patchsig *file*: applies byte signature patch rules to the output image sections" << std::endl;
+        std::cout << "-threads *count*: worker threads for parallel passes (0 = all hardware threads, default 1)" << std::endl;
+        std::cout << "-help: prints this help text" << std::endl;
+        std::cout << std::endl;
+
+        std::cout << "Server mode (Unix only):" << std::endl;
+        std::cout << "-serve *socket* [-workers *count*] [-cachemem *MB*]: runs embed jobs for clients, caching parsed images" << std::endl;
+        std::cout << "-connect *socket* *regular command line*: runs the embedding on the server at the socket" << std::endl;
+        std::cout << std::endl;
+
+        std::cout << "Delta mode:" << std::endl;
+        std::cout << "-applydelta *input exe* *delta* *output exe*: rebuilds an output image from its input executable and a delta" << std::endl;
+
+        return 0;
+    }
+
+    // With targets, all remaining arguments are modules that are embedded into every target.
+    if ( fanOutTargets.empty() == false )
+    {
+        std::vector <char*> moduleArgs;
+
+        for ( int n = 1; n < argc; n++ )
+        {
+            moduleArgs.push_back( argv[ curArg + n - 1 ] );
+        }
+
+        if ( moduleArgs.empty() )
+        {
+            std::cout << "no modules given for the targets" << std::endl;
+
+            return -2;
+        }
+
+        // Parse every module once; the forked target jobs take their copies from this cache. On Windows
+        // the jobs are processes of their own that could not use it, so the modules are not parsed here.
+        peImageCache moduleCache( SIZE_MAX );
+
+#ifndef _WIN32
+        for ( const char *modulePath : moduleArgs )
+        {
+            std::cout << "loading module image (" << modulePath << ")" << std::endl;
+
+            std::string absModulePath;
+            fileStamp moduleStamp;
+
+            if ( !peImageCache::GetFileIdentity( modulePath, absModulePath, moduleStamp ) || !moduleCache.Load( absModulePath ) )
+            {
+                std::cout << "failed to load module image" << std::endl;
 
-                while ( dstImpDescIter < numImportDescs )
+                return -2;
+            }
+        }
+
+        // The jobs are forked from this process; they must not share the offsets of open archive files.
+        CloseInputArchives();
+#endif //_WIN32
+
+        std::cout << "embedding " << moduleArgs.size() << " modules into " << fanOutTargets.size() << " targets" << std::endl << std::endl;
+
+        return RunFanOutJobs( fanOutTargets, numWorkerThreads,
+            [&]( const fanOutTarget& target )
+        {
+            std::vector <char*> jobArgv;
+            jobArgv.push_back( argv[0] );
+
+            for ( const char *optArg : jobOptionArgs )
+            {
+                jobArgv.push_back( (char*)optArg );
+            }
+
+            // Job processes must not replace the JSON log that this process has started.
+            if ( logJSONPath != nullptr )
+            {
+                jobArgv.push_back( (char*)"-logappend" );
+            }
+
+            jobArgv.push_back( (char*)target.inputExecPath );
+            jobArgv.insert( jobArgv.end(), moduleArgs.begin(), moduleArgs.end() );
+            jobArgv.push_back( (char*)target.outputExecPath );
+
+            return jobArgv;
+        },
+            [&]( int jobArgc, char *jobArgv[] )
+        {
+            return RunEmbedJob( jobArgc, jobArgv, &moduleCache );
+        });
+    }
+
+    // Fetch possible input executable and input module from arguments.
+    const char *inputExecImageName = "input.exe";
+
+    if ( argc >= 2 )
+    {
+        inputExecImageName = argv[curArg++];
+    }
+
+    // Calculate the amount of module images to embed.
+    unsigned int numberModules = 1;
+
+    if ( argc >= 5 )
+    {
+        numberModules = (unsigned int)( argc - 3 );
+    }
+
+    std::vector <const char*> toEmbedList;
+
+    if ( argc >= 3 )
+    {
+        toEmbedList.reserve( numberModules );
+
+        for ( unsigned int n = 0; n < numberModules; n++ )
+        {
+            const char *inputModImageName = argv[curArg++];
+
+            toEmbedList.push_back( inputModImageName );
+        }
+    }
+    else
+    {
+        toEmbedList.push_back( "input.dll" );
+    }
+
+    const char *outputModImageName = "output.exe";
+
+    if ( argc >= 4 )
+    {
+        outputModImageName = argv[curArg++];
+    }
+
+    // Create a nice debug string.
+    {
+        std::cout << "loading: \"" << inputExecImageName << "\"";
+
+        for ( unsigned int n = 0; n < numberModules; n++ )
+        {
+            const char *inputModImageName = toEmbedList[ n ];
+
+            std::cout << ", \"" << inputModImageName << "\"";
+        }
+
+        std::cout << std::endl << std::endl;
+    }
+
+    // TODO: create a code building environment and make the DLL embedding a method of it.
+    //  This should optimize the code generation output, which in terms reduces the section
+    //  throughput (good due to Windows NT loader limits).
+
+    // Load the signature patch rules before doing any heavy work, so that typos are reported immediately.
+    sigPatchSet sigPatches;
+
+    if ( sigPatchPath != nullptr )
+    {
+        std::string patchError;
+
+        if ( !sigPatches.LoadFromFile( sigPatchPath, patchError ) )
+        {
+            std::cout << "failed to load signature patch file (" << sigPatchPath << "): " << patchError << std::endl;
+
+            return -22;
+        }
+
+        std::cout << "loaded " << sigPatches.GetRules().size() << " signature patch rules" << std::endl;
+    }
+
+    // Incremental runs compare the inputs against the layout manifest of the previous run.
+    std::string layoutManifestPath;
+    layoutManifest curLayout;
+    layoutManifest prevLayout;
+    bool hasPrevLayout = false;
+
+    if ( doIncremental )
+    {
+        layoutManifestPath = std::string( outputModImageName ) + ".layout";
+
+        // Everything that changes the output has to be part of the fingerprint.
+        {
+            contentHash64 optionsHash;
+
+            // Side outputs count as well: an up-to-date run writes none of them, so a run that asks for a
+            // report, a delta or a verification the previous run did not produce has to rebuild.
+            // The log (-log, -logjson) is not an output; every run writes its own.
+            const bool optionFlags[] =
+            {
+                doFixEntryPoint, doInjectMatchingImports, doTakeoverExports, doFixEntrypointExecutable,
+                markAllSectionsExecutable, doIgnoreResources, doTrimZeroTails, doFoldReadOnly,
+                doWriteDelta, doPackSections, doWriteChecksum, doMinimalHeaders,
+                doEmulateTLS, doReprotectSections, doVerifyOutput
+            };
+
+            optionsHash.Update( optionFlags, sizeof(optionFlags) );
+            optionsHash.Update( &exportCollisionPolicy, sizeof(exportCollisionPolicy) );
+            optionsHash.Update( &instanceHandleMode, sizeof(instanceHandleMode) );
+
+            if ( reportFormat != nullptr )
+            {
+                optionsHash.Update( reportFormat, strlen( reportFormat ) );
+            }
+
+            const char *optionFiles[] = { pgoTracePath, sigPatchPath };
+
+            for ( const char *optionFilePath : optionFiles )
+            {
+                std::uint64_t fileHash = 0;
+                std::uint64_t fileSize = 0;
+
+                if ( optionFilePath != nullptr )
                 {
-                    PEFile::PEImportDesc& impDesc = exeImage.imports[ dstImpDescIter ];
+                    HashFileContents( optionFilePath, fileHash, fileSize );
+                }
 
-                    bool removeImpDesc = false;
+                optionsHash.Update( &fileHash, sizeof(fileHash) );
+            }
 
-                    // Do things for matching import descriptors only.
-                    if ( BoundedStringEqual(
-                            impDesc.DLLName.GetConstString(), impDesc.DLLName.GetLength(),
-                            moduleImageName,
-                            false ) )
-                    {
-                        struct basicImpDescriptorHandler
-                        {
-                            PEFile::PEImportDesc& impDesc;
-                            std::uint32_t archPointerSize;
-                            size_t dstImpDescIter;
+            curLayout.optionsHash = optionsHash.GetValue();
+        }
 
-                            AINLINE basicImpDescriptorHandler( PEFile::PEImportDesc& impDesc, size_t dstImpDescIter, std::uint32_t archPointerSize )
-                                : impDesc( impDesc ), dstImpDescIter( dstImpDescIter )
-                            {
-                                this->archPointerSize = archPointerSize;
-                            }
+        bool hasAllHashes = HashFileContents( inputExecImageName, curLayout.exeHash, curLayout.exeFileSize );
 
-                            AINLINE void MakeSecondDescriptor( PEFile& image, size_t functake_idx, size_t functake_count, std::uint32_t thunkRefStartOffset )
-                            {
-                                // Simply take over the remainder of the first entry into a new second entry.
-                                PEFile::PEImportDesc newSecondDesc;
-                                newSecondDesc.DLLName = impDesc.DLLName;
-                                newSecondDesc.DLLName_allocEntry = impDesc.DLLName_allocEntry.CloneOnlyFinal();
+        for ( unsigned int n = 0; n < numberModules; n++ )
+        {
+            layoutManifest::moduleEntry entry;
+            entry.path = toEmbedList[ n ];
 
-                                newSecondDesc.funcs.InsertMove( 0, &impDesc.funcs[ functake_idx ], functake_count );
+            if ( !HashFileContents( toEmbedList[ n ], entry.contentHash, entry.fileSize ) )
+            {
+                hasAllHashes = false;
+            }
 
-                                // Offset the names allocation entry to the right point.
-                                if ( PEFile::PESection *impNamesSect = impDesc.impNameArrayAllocEntry.GetSection() )
-                                {
-                                    // Import name entries are sized after the architecture pointer size.
-                                    // Which means that we can simply use the offset of the IAT.
-                                    std::uint32_t sectOffsetNames = ( impDesc.impNameArrayAllocEntry.ResolveInternalOffset( thunkRefStartOffset ) );
-                                    std::uint32_t remainderSize = ( this->archPointerSize * (std::uint32_t)functake_count );
+            curLayout.modules.push_back( std::move( entry ) );
+        }
 
-                                    impNamesSect->SetPlacedMemoryInline( newSecondDesc.impNameArrayAllocEntry, sectOffsetNames, remainderSize );
-                                }
+        if ( hasAllHashes && prevLayout.LoadFromFile( layoutManifestPath.c_str() ) && prevLayout.HasSameInputs( curLayout ) )
+        {
+            hasPrevLayout = true;
 
-                                // Need to point to the new entry properly.
-                                newSecondDesc.firstThunkRef = image.ResolveRVAToRef( impDesc.firstThunkRef.GetRVA() + thunkRefStartOffset );
+            bool allModulesUnchanged = true;
 
-                                // Insert the new import descriptor after our.
-                                image.imports.InsertMove( this->dstImpDescIter + 1, std::move( newSecondDesc ) );
-                            }
+            for ( unsigned int n = 0; n < numberModules; n++ )
+            {
+                if ( !curLayout.modules[ n ].HasSameContent( prevLayout.modules[ n ] ) )
+                {
+                    allModulesUnchanged = false;
+                    break;
+                }
+            }
 
-                            AINLINE PEFile::PEImportDesc::functions_t& GetImportFunctions( void )
-                            {
-                                return impDesc.funcs;
-                            }
+            // Nothing to do if the output is still the one that we produced, together with its side outputs.
+            if ( allModulesUnchanged )
+            {
+                std::vector <std::string> sideOutputPaths;
 
-                            AINLINE PEFile::PESectionDataReference& GetFirstThunkRef( void )
-                            {
-                                return impDesc.firstThunkRef;
-                            }
+                sideOutputPaths.push_back( std::string( outputModImageName ) + ".arenas" );
 
-                            AINLINE void TrimFirstDescriptor( size_t trimTo )
-                            {
-                                impDesc.funcs.Resize( trimTo );
-                            }
+                if ( reportFormat != nullptr )
+                {
+                    sideOutputPaths.push_back( std::string( outputModImageName ) + ( strcmp( reportFormat, "json" ) == 0 ? ".report.json" : ".report.txt" ) );
+                }
 
-                            AINLINE void MoveIATBy( PEFile& image, std::uint32_t moveBytes )
-                            {
-                                impDesc.firstThunkRef = image.ResolveRVAToRef( impDesc.firstThunkRef.GetRVA() + moveBytes );
-                            }
+                if ( doWriteDelta )
+                {
+                    sideOutputPaths.push_back( std::string( outputModImageName ) + ".delta" );
+                }
 
-                            AINLINE void RemoveFirstEntry( void )
-                            {
-                                impDesc.funcs.RemoveByIndex( 0 );
-                            }
-                        };
-                        basicImpDescriptorHandler splitOp( impDesc, dstImpDescIter, archPointerSize );
+                bool hasSideOutputs = true;
 
-                        removeImpDesc = InjectImportsWithExports(
-                            exeImage,
-                            moduleImage.exportDir, splitOp, resolveSectionLink,
-                            numOrdinalMatches, numNameMatches,
-                            archPointerSize, requiresRelocations
-                        );
+                for ( const std::string& sideOutputPath : sideOutputPaths )
+                {
+                    if ( !std::fstream( sideOutputPath, std::ios::in ).good() )
+                    {
+                        hasSideOutputs = false;
+                        break;
                     }
+                }
+
+                std::uint64_t outputHash, outputSize;
+
+                if ( hasSideOutputs && HashFileContents( outputModImageName, outputHash, outputSize ) && outputHash == prevLayout.outputHash )
+                {
+                    std::cout << "output image is up to date (" << outputModImageName << ")" << std::endl;
+
+                    return 0;
+                }
+            }
+        }
+        else
+        {
+            std::cout << "no matching layout manifest (" << layoutManifestPath << "); doing a full build" << std::endl;
+        }
+
+        std::cout << std::endl;
+    }
+
+    int iReturnCode;
+
+    try
+    {
+        auto embedStartTime = std::chrono::steady_clock::now();
+
+        // Load both PE images.
+        std::unique_ptr <PEFile> exeImagePtr;
+        {
+            logPhase phase( "load executable" );
+
+            std::cout << "loading executable image (" << inputExecImageName << ")" << std::endl;
+
+            exeImagePtr = LoadImageFromDisk( inputExecImageName, imageCache );
+
+            if ( !exeImagePtr )
+            {
+                std::cout << "failed to load executable image" << std::endl;
+
+                return -1;
+            }
+        }
+
+        PEFile& exeImage = *exeImagePtr;
+
+        // Sections are attributed to the executable or to the module that they came from.
+        std::vector <imageReportOwner> reportOwners;
+
+        if ( reportFormat != nullptr )
+        {
+            imageReportOwner exeOwner;
+            exeOwner.name = FetchFileName( inputExecImageName );
+
+            for ( PEFile::sectionIter_t iter = exeImage.GetSectionIterator(); !iter.IsEnd(); iter.Increment() )
+            {
+                exeOwner.sections.push_back( PEFile::PESectionReference( iter.Resolve() ) );
+            }
+
+            reportOwners.push_back( std::move( exeOwner ) );
+        }
+
+        // Initialize the environment.
+        std::uint16_t exeMachineType = exeImage.pe_finfo.machine_id;
+
+        // We only support x86 and x64 for now.
+        if ( exeMachineType != PEL_IMAGE_FILE_MACHINE_I386 && exeMachineType != PEL_IMAGE_FILE_MACHINE_AMD64 )
+        {
+            throw runtime_exception( -4, "unsupported machine type (x86 or x64 only)" );
+        }
+
+        // Check that the executable is an EXE.
+        if ( exeImage.pe_finfo.isDLL != false )
+        {
+            throw runtime_exception( -5, "provided executable image is not an executable image" );
+        }
+
+        // Decide what architecture we generate code for.
+        std::uint8_t genCodeArch = asmjit::ArchInfo::kTypeNone;
 
-                    if ( removeImpDesc )
-                    {
-                        std::cout << "* terminated import module " << impDesc.DLLName.GetConstString() << std::endl;
+        std::uint32_t archPointerSize;
 
-                        exeImage.imports.RemoveByIndex( dstImpDescIter );
+        if ( exeMachineType == PEL_IMAGE_FILE_MACHINE_I386 )
+        {
+            genCodeArch = asmjit::ArchInfo::kTypeX86;
 
-                        numImportDescs--;
-                    }
-                    else
-                    {
-                        dstImpDescIter++;
-                    }
-                }
-            }
+            archPointerSize = 4;
 
-            // Also do the delayed import descriptors, which should be possible.
-            {
-                size_t dstImpDescIter = 0;
-                size_t numImportDescs = exeImage.delayLoads.GetCount();
+            std::cout << "architecture: 32bit" << std::endl;
+        }
+        else if ( exeMachineType == PEL_IMAGE_FILE_MACHINE_AMD64 )
+        {
+            genCodeArch = asmjit::ArchInfo::kTypeX64;
 
-                while ( dstImpDescIter < numImportDescs )
-                {
-                    bool removeImpDesc = false;
+            archPointerSize = 8;
 
-                    // Process this import descriptor.
-                    PEFile::PEDelayLoadDesc& impDesc = exeImage.delayLoads[ dstImpDescIter ];
+            std::cout << "architecture: 64bit" << std::endl;
+        }
+        else
+        {
+            throw runtime_exception( -7, "invalid machine type for asmjit code generation" );
+        }
 
-                    if ( BoundedStringEqual( impDesc.DLLName.GetConstString(), impDesc.DLLName.GetLength(), moduleImageName, false ) )
-                    {
-                        struct delayedImpDescriptorHandler
-                        {
-                            AssemblyEnvironment& env;
-                            PEFile::PEDelayLoadDesc& impDesc;
-                            std::uint32_t archPointerSize;
-                            size_t dstImpDescIter;
+        // Check if we have to embed any new relocations.
+        bool requiresRelocations = ( exeImage.HasRelocationInfo() == true );
 
-                            AINLINE delayedImpDescriptorHandler( AssemblyEnvironment& env, PEFile::PEDelayLoadDesc& impDesc, std::uint32_t archPointerSize, size_t dstImpDescIter )
-                                : env( env ), impDesc( impDesc ), dstImpDescIter( dstImpDescIter )
-                            {
-                                this->archPointerSize = archPointerSize;
-                            }
+        // Modules are parsed on a background thread while we generate code and embed the previous ones.
+        moduleLoadPipeline modulePipeline( toEmbedList, 2,
+            [&]( const char *path, moduleLoadPipeline::loadedModule& moduleOut )
+        {
+            moduleOut.image = LoadImageFromDisk( path, imageCache, &moduleOut.isFromCache, &moduleOut.resources );
 
-                            AINLINE PEFile::PEImportDesc::functions_t& GetImportFunctions( void )
-                            {
-                                return impDesc.importNames;
-                            }
+            if ( !moduleOut.image )
+            {
+                moduleOut.errorCode = -2;
+                moduleOut.errorMessage = "failed to load module image";
+                return;
+            }
 
-                            AINLINE PEFile::PESectionDataReference& GetFirstThunkRef( void )
-                            {
-                                return impDesc.IATRef;
-                            }
+            // Cached images come with a shared resource snapshot; images that we parsed ourselves have none,
+            // because their resources are moved into the executable.
+            moduleOut.errorCode = ValidateModuleImage( *moduleOut.image, exeMachineType, moduleOut.errorMessage );
+        });
 
-                            AINLINE void TrimFirstDescriptor( size_t trimTo )
-                            {
-                                impDesc.importNames.Resize( trimTo );
-                            }
+        // We want to generate specialized code as executable entry point.
+        // This allows us to do specialized patching according to rules of PE merging.
+        asmjit::CodeInfo asmCodeInfo( genCodeArch );
 
-                            AINLINE void RemoveFirstEntry( void )
-                            {
-                                impDesc.importNames.RemoveByIndex( 0 );
-                            }
+        asmjit::CodeHolder asmCodeHolder;
+        asmCodeHolder.init( asmCodeInfo );
 
-                            AINLINE void MoveIATBy( PEFile& image, std::uint32_t moveBytes )
-                            {
-                                impDesc.IATRef = image.ResolveRVAToRef( impDesc.IATRef.GetRVA() + moveBytes );
+        // We need to remember a label of the entry point.
+        asmjit::Label entryPointLabel;
 
-                                // Move the other if it is available.
-                                PEFile::PESectionDataReference& unloadIAT = impDesc.unloadInfoTableRef;
+        // The unpacker addresses the sections by the preferred image base.
+        bool isPackingSections = ( doPackSections && !requiresRelocations );
 
-                                if ( unloadIAT.GetSection() != nullptr )
-                                {
-                                    unloadIAT = image.ResolveRVAToRef( unloadIAT.GetRVA() + moveBytes );
-                                }
-                            }
+        if ( doPackSections && requiresRelocations )
+        {
+            std::cout << "ignoring -packsections because the executable has relocations" << std::endl;
+        }
 
-                            AINLINE void MakeSecondDescriptor( PEFile& image, size_t functake_idx, size_t functake_count, std::uint32_t thunkRefStartOffset )
-                            {
-                                PEFile::PEDelayLoadDesc newSecondImp;
-                                newSecondImp.attrib = impDesc.attrib;
-                                newSecondImp.DLLName = impDesc.DLLName;
-                                newSecondImp.DLLName_allocEntry = impDesc.DLLName_allocEntry.CloneOnlyFinal();
-                                // DLL handle memory is automatically allocated during commit-phase of writing.
+        asmjit::Label unpackTableRVAEndLabel;
+        asmjit::Label reprotectTableRVAEndLabel;
 
-                                // Create a special IAT out of the previous.
-                                newSecondImp.IATRef = image.ResolveRVAToRef( impDesc.IATRef.GetRVA() + thunkRefStartOffset );
+        std::vector <PEFile::PESectionReference> embeddedSections;
+        std::vector <stubCallTarget> stubCallTargets;
+        std::vector <arenaRecord> arenaRecords;
 
-                                // Copy over the import names aswell.
-                                newSecondImp.importNames.InsertMove( 0, &impDesc.importNames[ functake_idx ], functake_count );
+        // The thunks of the TLS emulation are linked into module code after the stub has been placed.
+        tlsEmulationRuntime tlsEmulation;
 
-                                // Take over the allocation entries.
-                                if ( PEFile::PESection *impNamesSect = impDesc.importNamesAllocEntry.GetSection() )
-                                {
-                                    // Import name entries are sized after the architecture pointer size.
-                                    // Which means that we can simply use the offset of the IAT.
-                                    std::uint32_t sectOffsetNames = ( impDesc.importNamesAllocEntry.ResolveInternalOffset( thunkRefStartOffset ) );
-                                    std::uint32_t remainderSize = ( this->archPointerSize * (std::uint32_t)functake_count );
+        sectionProtectionPolicy protectionPolicy;
+        {
+            logPhase phase( "embed modules" );
 
-                                    impNamesSect->SetPlacedMemoryInline( newSecondImp.importNamesAllocEntry, sectOffsetNames, remainderSize );
-                                }
+            phase.SetField( "modules", numberModules );
 
-                                // If an unload info table existed previously, also handle that case.
-                                {
-                                    PEFile::PESectionDataReference& unloadIAT = impDesc.unloadInfoTableRef;
+            AssemblyEnvironment asmEnv( exeImage, &asmCodeHolder );
 
-                                    if ( unloadIAT.GetSection() != nullptr )
-                                    {
-                                        unloadIAT = image.ResolveRVAToRef( unloadIAT.GetRVA() + thunkRefStartOffset );
-                                    }
-                                }
+            asmjit::X86Assembler& x86_asm = asmEnv.x86_asm;
 
-                                newSecondImp.timeDateStamp = impDesc.timeDateStamp;
+            // Now the entry point starts.
+            entryPointLabel = x86_asm.newLabel();
 
-                                // Put in the new descriptor after the one we manage.
-                                image.delayLoads.InsertMove( this->dstImpDescIter + 1, std::move( newSecondImp ) );
+            if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+            {
+                // Align the stack pointer.
+                x86_asm.mov( asmjit::x86::rax, asmjit::x86::rsp );
+                x86_asm.and_( asmjit::x86::rax, 0x0F );
+                x86_asm.sub( asmjit::x86::rsp, asmjit::x86::rax );
 
-                                // Done.
-                            }
-                        };
-                        delayedImpDescriptorHandler splitOp( *this, impDesc, archPointerSize, dstImpDescIter );
+                // Reserve register spill space.
+                x86_asm.sub( asmjit::x86::rsp, 0x20 );
+            }
 
-                        removeImpDesc =
-                            InjectImportsWithExports(
-                                exeImage,
-                                moduleImage.exportDir, splitOp, resolveSectionLink,
-                                numOrdinalMatches, numNameMatches,
-                                archPointerSize, requiresRelocations
-                            );
-                    }
+            // Packed module sections have to be inflated before any module code runs.
+            if ( isPackingSections )
+            {
+                EmitSectionUnpacker( x86_asm, exeImage.GetImageBase(), unpackTableRVAEndLabel );
+            }
 
-                    if ( removeImpDesc )
-                    {
-                        std::cout << "* terminated delay-load import module " << impDesc.DLLName.GetConstString() << std::endl;
+            // User could have requested to fix the entry point in the original executable to the previous
+            // one because it is used for version detection by some executable logic.
+            if ( doFixEntryPoint )
+            {
+                std::cout << "adjusting executable entry point to old on startup ..." << std::endl;
 
-                        exeImage.delayLoads.RemoveByIndex( dstImpDescIter );
+                PEFile::PESection metaSection;
+                metaSection.shortName = ".meta";
+                metaSection.chars.sect_mem_write = true;
 
-                        numImportDescs--;
-                    }
-                    else
+                // Determine the size of a thunk entry.
+                // It depends on the image type.
+                size_t thunkEntrySize;
+
+                if ( exeImage.isExtendedFormat )
+                {
+                    thunkEntrySize = 8;
+                }
+                else
+                {
+                    thunkEntrySize = 4;
+                }
+
+                // We must allocate certain functions that we should use for memory management.
+                PEFile::PESectionAllocation utilThunk;
+                {
+                    PEFile::PEImportDesc utilImports;
+                    utilImports.DLLName = "KERNEL32.DLL";
                     {
-                        dstImpDescIter++;
+                        PEFile::PEImportDesc::importFunc fVirtualProtect;
+                        fVirtualProtect.name = "VirtualProtect";
+                        fVirtualProtect.isOrdinalImport = false;
+                        fVirtualProtect.ordinal_hint = 0;
+                        utilImports.funcs.AddToBack( std::move( fVirtualProtect ) );
                     }
-                }
-            }
 
-            // If any work was done then we should rewrite the imports table.
-            if ( numNameMatches > 0 || numOrdinalMatches > 0 )
-            {
-                exeImage.importsAllocEntry = PEFile::PESectionAllocation();
-            }
+                    // Give it some memory region.
+                    size_t utilThunkSize = ( thunkEntrySize * utilImports.funcs.GetCount() );
 
-            // Output some helpful statistics.
-            std::cout << "injected " << numNameMatches << " named and " << numOrdinalMatches << " ordinal PE imports" << std::endl;
-        }
+                    metaSection.Allocate( utilThunk, (std::uint32_t)utilThunkSize, (std::uint32_t)thunkEntrySize );
 
-        // TODO: generate all code that depends on RVAs over here.
+                    // We want to link the thunk into the imports desc.
+                    utilImports.firstThunkRef = utilThunk;
 
-        // Do we need TLS data?
-        if ( moduleImage.tlsInfo.startOfRawDataRef.GetSection() != nullptr )
-        {
-            std::cout << "patching static TLS data references" << std::endl;
+                    exeImage.imports.AddToBack( std::move( utilImports ) );
+                }
 
-            // Calculate the VA to the TLS.
-            std::uint64_t vaTLSData;
-            {
-                auto findIter = sectLinkMap.find( moduleImage.tlsInfo.allocEntry.GetSection() );
+                if ( metaSection.IsEmpty() == false )
+                {
+                    metaSection.Finalize();
 
-                assert( findIter != sectLinkMap.end() );
+                    exeImage.AddSection( std::move( metaSection ) );
+                }
 
-                vaTLSData = ( exeModuleBase + findIter->second.GetSection()->ResolveRVA( moduleImage.tlsInfo.allocEntry.ResolveInternalOffset( 0 ) ) );
-            }
+                // Now since we have module RVAs for the util imports, we
+                // can generate code that uses them.
+                // Unprotect the beginning of the image, write the original executable
+                // entry point into the PE optional header and protect it again.
+                // We assume that the type of image (PE32 or PE32+) will never change.
+                // Unless you are a PE hacker and want to create that tool.
 
-            // We do a simple patch of all TLS references to point directly inside the TLS data array.
-            // This will disable all thread-local abilities but it will make the embedding work.
-            PEFile::sectionIter_t iter = moduleImage.GetSectionIterator();
+                // Unprotect the first 1024 bytes of the image.
+                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                {
+                    x86_asm.sub( asmjit::x86::esp, 4 );
+                    x86_asm.push( asmjit::x86::esp );
+                    x86_asm.push( (std::uint32_t)_PAGE_READWRITE );
+                    x86_asm.push( (std::uint32_t)1024 );
+                    x86_asm.push( asmjit::Imm( 0, true ) );
+                }
+                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+                {
+                    x86_asm.sub( asmjit::x86::rsp, 16 );
+                    x86_asm.mov( asmjit::x86::rcx, asmjit::Imm( 0, true ) );
+                    x86_asm.mov( asmjit::x86::rdx, 1024u );
+                    x86_asm.mov( asmjit::x86::r8, (std::uint32_t)_PAGE_READWRITE );
+                    x86_asm.mov( asmjit::x86::r9, asmjit::x86::rsp );
+                }
+                else
+                {
+                    assert( 0 );
 
-            for ( ; !iter.IsEnd(); iter.Increment() )
-            {
-                PEFile::PESection *modSect = iter.Resolve();
+                    return -1;
+                }
+
+                // Call the thunk function directly.
+                asmjit::X86Mem fVirtualProtect( utilThunk.ResolveOffset( 0 ), (std::uint32_t)thunkEntrySize );
 
-                auto findIter = sectLinkMap.find( modSect );
+                x86_asm.call( fVirtualProtect );
 
-                assert( findIter != sectLinkMap.end() );
+                // Fix entry point with old.
+                x86_asm.mov( x86_asm.zax(), asmjit::X86Mem( offsetof(PEStructures::IMAGE_DOS_HEADER, e_lfanew), sizeof(std::int32_t) ) );
 
-                PEFile::PESection *exeSect = findIter->second.GetSection();
+                std::uint32_t structEP_off;
 
-                // Only process sections that do contain executable code.
-                if ( exeSect->chars.sect_mem_execute == false )
+                if ( exeImage.isExtendedFormat )
                 {
-                    continue;
+                    structEP_off = offsetof(PEStructures::IMAGE_OPTIONAL_HEADER64, AddressOfEntryPoint);
                 }
-
-                // Depending on architecture...
-                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                else
                 {
-                    static const char *patterns[] =
-                    {
-                        "\x06\x64\xa1\x2c\x00\x00\x00",         // mov eax,fs:[1Ch]
-                        "\x07\x64\x8b\x1d\x2c\x00\x00\x00",     // mov ebx,fs:[1Ch]
-                        "\x07\x64\x8b\x0d\x2c\x00\x00\x00",     // mov ecx,fs:[1Ch]
-                        "\x07\x64\x8b\x15\x2c\x00\x00\x00",     // mov edx,fs:[1Ch]
-                        "\x07\x64\x8b\x35\x2c\x00\x00\x00",     // mov esi,fs:[1Ch]
-                        "\x07\x64\x8b\x3d\x2c\x00\x00\x00"      // mov edi,fs:[1Ch]
-                    };
-
-                    char *dataBuf = (char*)exeSect->stream.Data();
-
-                    BufferPatternFind( dataBuf, (size_t)exeSect->stream.Size(), countof(patterns), patterns,
-                        [&]( size_t patIdx, size_t bufOff, size_t matchSize )
-                    {
-                        // Just need to put a NOP.
-                        // Then patch the offset with a new one.
-                        char *curPtr = ( dataBuf + bufOff );
+                    structEP_off = offsetof(PEStructures::IMAGE_OPTIONAL_HEADER32, AddressOfEntryPoint);
+                }
 
-                        char methodChars[] = { 0x05, 0x1d, 0x0d, 0x15, 0x35, 0x3d };
+                // We need to skip some data.
+                structEP_off += sizeof(PEStructures::IMAGE_PE_HEADER) + sizeof(std::uint16_t);
 
-                        *( curPtr + 0 ) = (char)0x8d;
-                        *( curPtr + 1 ) = methodChars[ patIdx ];
-                        // We want to give it the address of the static TLS thing.
-                        *( (std::uint32_t*)( curPtr + 2 ) ) = (std::uint32_t)( vaTLSData + 0 );
+                x86_asm.add( x86_asm.zax(), asmjit::Imm( 0, true ) );
+                x86_asm.mov( asmjit::X86Mem( x86_asm.zax(), structEP_off, 4 ), exeImage.peOptHeader.addressOfEntryPointRef.GetRVA() );
 
-                        // If the image is relocatable, add a relocation entry aswell.
-                        if ( requiresRelocations )
-                        {
-                            exeImage.AddRelocation( exeSect->ResolveRVA( (std::uint32_t)( bufOff + 2 ) ), PEFile::PEBaseReloc::eRelocType::HIGHLOW );
-                        }
+                // Protect the memory again.
+                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                {
+                    x86_asm.push( asmjit::x86::esp );
+                    x86_asm.push( asmjit::X86Mem( asmjit::x86::esp, 4, 4 ) );
+                    x86_asm.push( (std::uint32_t)1024u );
+                    x86_asm.push( asmjit::Imm( 0, true ) );
+                }
+                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+                {
+                    x86_asm.mov( asmjit::x86::rcx, asmjit::Imm( 0, true ) );
+                    x86_asm.mov( asmjit::x86::rdx, asmjit::X86Mem( asmjit::x86::rsp, 0, 4 ) );
+                    x86_asm.mov( asmjit::x86::r8, 1024u );
+                    x86_asm.mov( asmjit::x86::r9, asmjit::x86::rsp );
+                }
+                else
+                {
+                    assert( 0 );
+                }
+
+                // Call the thunk function directly.
+                x86_asm.call( fVirtualProtect );
 
-                        // Pad the remainder with NOPs.
-                        memset( curPtr + 6, 0x90, matchSize - 6 );
-                    });
+                // Release stack space for the oldProt variable.
+                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
+                {
+                    x86_asm.add( asmjit::x86::esp, 4 );
                 }
                 else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
                 {
-                    // No idea what to do here; this is for later I guess.
+                    x86_asm.add( asmjit::x86::rsp, 16 );
                 }
                 else
                 {
                     assert( 0 );
                 }
             }
-        }
 
-        // So if we have TLS indices, we have to use the utility thunk to allocate into the array.
-        if ( hasStaticTLS )
-        {
-            // Good read about TEB native entries:
-            // http://www.geoffchappell.com/studies/windows/win32/ntdll/structs/teb/index.htm
-            // But to keep things simple we ain't gonna do that.
+            if ( doEmulateTLS )
+            {
+                CreateTLSEmulationSection( exeImage, numberModules, tlsEmulation );
 
-            // TODO: since this Kobalicek dude does not provide a good way to get abs2abs relocation
-            //  entries (he is incapable to understand the concept) we have a bug here. the only way to
-            //  properly solve this is to patch asmjit itself, make it put an optional abs2abs entry
-            //  per X86Mov (on demand, with a flag).
-            // TODO: hacked around asmjit to get something automatic; might want to share with the author of
-            //  asmjit.
+                asmEnv.tlsEmulation = &tlsEmulation;
+            }
 
-            x86_asm.xor_( x86_asm.zax(), x86_asm.zax() ),
-            x86_asm.mov( asmjit::X86Mem( embedImageBaseOffset + moduleImage.tlsInfo.addressOfIndexRef.GetRVA() ), x86_asm.zax() );
-        }
+            if ( doReprotectSections )
+            {
+                asmEnv.protectionPolicy = &protectionPolicy;
+            }
 
-        // Need this param for initializers.
-        std::uint32_t dllInstanceHandle = 0;    // todo(?)
+            // Modules have to be known up-front if we plan the arena layout.
+            std::vector <std::unique_ptr <PEFile>> preloadedModules;
+            std::vector <std::shared_ptr <const resourceSnapshot>> preloadedResources;
+            std::vector <std::uint32_t> plannedArenaOffsets;
 
-        // Call all initializers if we have some.
-        if ( PEFile::PESection *tlsSect = moduleImage.tlsInfo.addressOfCallbacksRef.GetSection() )
-        {
-            std::cout << "linking TLS callbacks" << std::endl;
+            if ( pgoTracePath != nullptr || hasPrevLayout )
+            {
+                for ( unsigned int n = 0; n < numberModules; n++ )
+                {
+                    std::unique_ptr <PEFile> moduleImage;
+                    std::shared_ptr <const resourceSnapshot> moduleResources;
 
-            std::uint32_t indexOfCallback = 0;
+                    int loadStatus = FetchNextModule( modulePipeline, toEmbedList[ n ], moduleImage, moduleResources );
 
-            std::uint32_t sectoffAddrOfCallbacks = moduleImage.tlsInfo.addressOfCallbacksRef.GetSectionOffset();
+                    if ( loadStatus != 0 )
+                    {
+                        return loadStatus;
+                    }
 
-            while ( true )
-            {
-                std::uint64_t callbackPtr;
+                    preloadedModules.push_back( std::move( moduleImage ) );
+                    preloadedResources.push_back( std::move( moduleResources ) );
+                }
 
-                tlsSect->stream.Seek( (std::int32_t)( sectoffAddrOfCallbacks + indexOfCallback * archPointerSize ) );
+                std::cout << std::endl;
+            }
 
-                // Advance the index to next.
-                indexOfCallback++;
+            if ( pgoTracePath != nullptr )
+            {
+                pageTrace trace;
 
-                if ( archPointerSize == 4 )
+                if ( !trace.LoadFromFile( pgoTracePath ) )
                 {
-                    std::uint32_t value;
-                    bool gotValue = tlsSect->stream.ReadUInt32( value );
+                    std::cout << "failed to load page-access trace (" << pgoTracePath << ")" << std::endl;
 
-                    if ( !gotValue )
-                    {
-                        std::cout << "failed to read 32bit TLS callback value" << std::endl;
+                    return -21;
+                }
 
-                        return -16;
-                    }
+                LogField( "entries", trace.GetEntryCount() );
 
-                    callbackPtr = value;
-                }
-                else if ( archPointerSize == 8 )
-                {
-                    bool gotValue = tlsSect->stream.ReadUInt64( callbackPtr );
+                std::cout << "loaded page-access trace with " << trace.GetEntryCount() << " entries" << std::endl;
 
-                    if ( !gotValue )
-                    {
-                        std::cout << "failed to read 64bit TLS callback value" << std::endl;
+                // The output is still the traced build; its arena records attribute the executable RVAs.
+                std::string arenaRecordsPath = std::string( outputModImageName ) + ".arenas";
 
-                        return -16;
-                    }
-                }
-                else
+                if ( trace.LoadArenaRecords( arenaRecordsPath.c_str() ) )
                 {
-                    std::cout << "invalid architecture pointer size" << std::endl;
+                    std::cout << "loaded module arena records of the traced build (" << arenaRecordsPath << ")" << std::endl;
+                }
 
-                    return -16;
+                if ( trace.HasUnmappableEntries() )
+                {
+                    std::cout << "WARNING: trace has executable RVAs but no arena records; only module offsets are used" << std::endl;
                 }
 
-                if ( callbackPtr == 0 )
+                std::vector <const char*> moduleFileNames;
+                moduleFileNames.reserve( numberModules );
+
+                for ( unsigned int n = 0; n < numberModules; n++ )
                 {
-                    break;
+                    moduleFileNames.push_back( FetchFileName( toEmbedList[ n ] ) );
                 }
 
-                // Need to determine the redirected RVA.
-                // For that we have to find the section this callback is targetting.
-                std::uint32_t rvaToCallback = 0;
+                std::cout << "planning module arena layout from trace" << std::endl;
+
+                if ( !PlanArenaLayoutFromTrace( exeImage, trace, moduleFileNames, preloadedModules, plannedArenaOffsets ) )
                 {
-                    std::uint32_t modrvaToCallback = (std::uint32_t)( callbackPtr - modImageBase );
+                    std::cout << "failed to find virtual address space for module images in executable image region" << std::endl;
 
-                    std::uint32_t modTargetSectIntOff;
-                    PEFile::PESection *modTargetSect = moduleImage.FindSectionByRVA( modrvaToCallback, nullptr, &modTargetSectIntOff );
+                    return -13;
+                }
 
-                    if ( modTargetSect )
-                    {
-                        auto findIter = sectLinkMap.find( modTargetSect );
+                std::cout << std::endl;
+            }
 
-                        assert( findIter != sectLinkMap.end() );
+            // Place every module at its arena of the previous run, as long as it still fits.
+            // Unchanged modules then come out byte-identical to the previous output.
+            if ( hasPrevLayout )
+            {
+                std::cout << "reusing module layout of previous run" << std::endl;
 
-                        rvaToCallback = findIter->second.GetSection()->ResolveRVA( modTargetSectIntOff );
-                    }
-                }
+                std::vector <std::uint32_t> prevArenaOffsets( numberModules );
 
-                if ( rvaToCallback != 0 )
+                bool canReuseLayout = true;
+
+                for ( unsigned int n = 0; n < numberModules; n++ )
                 {
-                    // Call this function.
-                    std::uint32_t paramReserved = 0;
-                    std::uint32_t paramReason = 1;  // DLL_PROCESS_ATTACH
+                    const layoutManifest::moduleEntry& prevEntry = prevLayout.modules[ n ];
 
-                    if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
-                    {
-                        x86_asm.push( paramReserved );
-                        x86_asm.push( paramReason );
-                        x86_asm.push( dllInstanceHandle );
-                        x86_asm.call( rvaToCallback );
-                    }
-                    else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
-                    {
-                        x86_asm.mov( asmjit::x86::rcx, dllInstanceHandle );
-                        x86_asm.mov( asmjit::x86::rdx, paramReason );
-                        x86_asm.mov( asmjit::x86::r8, paramReserved );
-                        x86_asm.call( rvaToCallback );
-                    }
-                    else
+                    bool isUnchanged = curLayout.modules[ n ].HasSameContent( prevEntry );
+
+                    if ( !isUnchanged && GetModuleArenaSize( exeImage, *preloadedModules[ n ] ) > prevEntry.arenaSize )
                     {
-                        std::cout << "failed to call TLS callback due to unknown architecture" << std::endl;
+                        std::cout << "* " << toEmbedList[ n ] << ": no longer fits its previous arena; doing a full rebuild" << std::endl;
 
-                        return -17;
+                        canReuseLayout = false;
+                        break;
                     }
+
+                    std::cout << "* " << toEmbedList[ n ] << ": " << ( isUnchanged ? "unchanged" : "changed, re-embedding into previous arena" ) << std::endl;
+
+                    prevArenaOffsets[ n ] = prevEntry.arenaOffset;
                 }
-            }
-        }
 
-        // Check if we even have an entry point.
-        // If we have no entry point then we do not embed a call to it.
-        const PEFile::PESectionDataReference& modEntryPointRef = moduleImage.peOptHeader.addressOfEntryPointRef;
+                // The previous layout takes precedence over a trace-planned one to keep addresses stable.
+                if ( canReuseLayout )
+                {
+                    plannedArenaOffsets = std::move( prevArenaOffsets );
+                }
 
-        if ( modEntryPointRef.GetSection() != nullptr )
-        {
-            PEFile::PESection *targetModEntryPointSect;
+                std::cout << std::endl;
+            }
 
-            // Call into the DLL entry point with the default parameters.
-            std::uint32_t rvaToDLLEntryPoint = ResolvePESectionRVA( modEntryPointRef, resolveSectionLink, &targetModEntryPointSect );
+            // Embed each requested image.
+            for ( unsigned int n = 0; n < numberModules; n++ )
             {
-                std::uint32_t paramReserved = 0;
-                std::uint32_t paramReason = 1;      // DLL_PROCESS_ATTACH
+                const char *inputModImageName = toEmbedList[ n ];
 
-                // Call the DLL entry point.
-                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
-                {
-                    x86_asm.push( paramReserved );
-                    x86_asm.push( paramReason );
-                    x86_asm.push( dllInstanceHandle );
-                    x86_asm.call( rvaToDLLEntryPoint );
-                }
-                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+                std::unique_ptr <PEFile> moduleImagePtr;
+                std::shared_ptr <const resourceSnapshot> moduleResources;
+
+                if ( n < preloadedModules.size() )
                 {
-                    x86_asm.mov( asmjit::x86::rcx, dllInstanceHandle );
-                    x86_asm.mov( asmjit::x86::rdx, paramReason );
-                    x86_asm.mov( asmjit::x86::r8, paramReserved );
-                    x86_asm.call( rvaToDLLEntryPoint );
+                    moduleImagePtr = std::move( preloadedModules[ n ] );
+                    moduleResources = std::move( preloadedResources[ n ] );
                 }
                 else
                 {
-                    std::cout << "unknown target machine architecture for entry point generation" << std::endl;
-
-                    return -12;
-                }
+                    int loadStatus = FetchNextModule( modulePipeline, inputModImageName, moduleImagePtr, moduleResources );
 
-                // If the section of the entry point is not marked executable, then we probably want to fix this here.
-                // This is a strange thing inside of the Win32 PE loader.
-                if ( doFixEntrypointExecutable )
-                {
-                    if ( targetModEntryPointSect->chars.sect_mem_execute == false )
+                    if ( loadStatus != 0 )
                     {
-                        std::cout << "fixing module entry point section to executable" << std::endl;
-
-                        targetModEntryPointSect->chars.sect_mem_execute = true;
+                        return loadStatus;
                     }
                 }
-            }
-        }
-        else
-        {
-            std::cout << "no DLL entry point (skip)" << std::endl;
-        }
 
-        // Success!
-        return 0;
-    }
-};
+                PEFile& moduleImage = *moduleImagePtr;
 
-// Fetches a filename from a file path, or at least attempts to.
-static const char* FetchFileName( const char *path )
-{
-    // We skip till the last slash character.
-    const char *pathIter = path;
-    const char *last_file_name = pathIter;
+                // Fetch module name.
+                const char *moduleFileName = FetchFileName( inputModImageName );
 
-    while ( true )
-    {
-        char c = *pathIter;
+                size_t numPrevEmbeddedSections = asmEnv.embeddedSections.size();
 
-        if ( c == 0 )
-        {
-            break;
-        }
+                // Perform the embedding.
+                int statusEmbed = asmEnv.EmbedModuleIntoExecutable(
+                    moduleImage, moduleResources.get(), requiresRelocations, moduleFileName,
+                    doInjectMatchingImports, doTakeoverExports, doIgnoreResources, doFixEntrypointExecutable, markAllSectionsExecutable,
+                    archPointerSize, ( n < plannedArenaOffsets.size() ? &plannedArenaOffsets[ n ] : nullptr ), doFoldReadOnly, doVerboseResources,
+                    doMinimalHeaders, exportCollisionPolicy, instanceHandleMode
+                );
 
-        pathIter++;
+                if ( statusEmbed != 0 )
+                {
+                    return statusEmbed;
+                }
 
-        if ( c == '/' || c == '\\' )
-        {
-            last_file_name = pathIter;
-        }
-    }
+                if ( reportFormat != nullptr )
+                {
+                    imageReportOwner moduleOwner;
+                    moduleOwner.name = moduleFileName;
+                    moduleOwner.sections.assign( asmEnv.embeddedSections.begin() + numPrevEmbeddedSections, asmEnv.embeddedSections.end() );
 
-    return last_file_name;
-}
+                    reportOwners.push_back( std::move( moduleOwner ) );
+                }
 
-int main( int argc, char *argv[] )
-{
-    std::cout <<
-        "pefrmdllembed - Inject DLL file into EXE file, compiled on " __DATE__ << std::endl
-     << "visit http://pefrm-units.osdn.jp/pefrmdllembed.html" << std::endl << std::endl;
+                // Print some seperation for easier log viewing.
+                if ( n + 1 != numberModules )
+                {
+                    std::cout << std::endl;
+                }
+            }
 
-    // Syntax: pefrmdllembed.exe *OPTIONS* *input exe filename* *input mod1 filename* *input mod2 filename* ... *input modn filename* *output exe filename*
+            // Module initialization is done, so the loader, unpacker and stub writes are over.
+            if ( doReprotectSections && ( protectionPolicy.GetStartupWritableCount() > 0 || isPackingSections ) )
+            {
+                LogField( "sections", protectionPolicy.GetStartupWritableCount() );
 
-    size_t curArg = 1;
+                std::cout << "protecting " << protectionPolicy.GetStartupWritableCount() << " sections";
 
-    bool doFixEntryPoint = false;
-    bool doInjectMatchingImports = false;
-    bool doTakeoverExports = true;
-    bool doFixEntrypointExecutable = true;
-    bool markAllSectionsExecutable = false;
-    bool doPrintHelp = false;
-    bool doIgnoreResources = false;
+                if ( isPackingSections )
+                {
+                    std::cout << " and the read-only packed sections";
+                }
 
-    if ( argc >= 1 )
-    {
-        // Parse all options.
-        OptionParser optParser( (const char**)argv + curArg, (size_t)argc - curArg );
+                std::cout << " again after startup" << std::endl;
 
-        while ( true )
-        {
-            std::string opt = optParser.FetchOption();
+                protectionPolicy.EmitReprotection( x86_asm, exeImage, ( isPackingSections ? &reprotectTableRVAEndLabel : nullptr ) );
+            }
 
-            if ( opt.empty() )
-                break;
+            // We jump to the original executable entry point.
+            x86_asm.jmp( exeImage.peOptHeader.addressOfEntryPointRef.GetRVA() );
 
-            if ( opt == "entryfix" || opt == "efix" )
-            {
-                doFixEntryPoint = true;
-            }
-            else if ( opt == "injimp" || opt == "impinj" )
-            {
-                doInjectMatchingImports = true;
-            }
-            else if ( opt == "noexp" )
-            {
-                doTakeoverExports = false;
-            }
-            else if ( opt == "help" || opt == "h" || opt == "?" )
-            {
-                doPrintHelp = true;
-            }
-            else if ( opt == "nores" || opt == "ignres" )
-            {
-                doIgnoreResources = true;
-            }
-            else if ( opt == "noentryexecfix" || opt == "noeexecfix" )
+            asmEnv.stubCallTargets.push_back( { exeImage.peOptHeader.addressOfEntryPointRef.GetRVA(), "original executable entry point" } );
+
+            // The stub never returns, so the TLS thunks can follow it.
+            if ( tlsEmulation.modules.empty() == false )
             {
-                doFixEntrypointExecutable = false;
+                EmitTLSEmulationThunks( x86_asm, tlsEmulation );
             }
-            else if ( opt == "marksectexec" )
+
+            if ( doTakeoverExports && exeImage.exportDir.functions.GetCount() != 0 )
             {
-                markAllSectionsExecutable = true;
+                LogField( "functions", exeImage.exportDir.functions.GetCount() );
+                LogField( "names", exeImage.exportDir.funcNameMap.GetKeyValueCount() );
+                LogField( "bytes", CalculateExportDirectorySize( exeImage.exportDir ) );
+
+                std::cout << "export directory: " << exeImage.exportDir.functions.GetCount() << " functions, " << exeImage.exportDir.funcNameMap.GetKeyValueCount() << " names, " << CalculateExportDirectorySize( exeImage.exportDir ) << " bytes" << std::endl;
             }
-            else
+
+            if ( doFoldReadOnly )
             {
-                std::cout << "unknown cmdline option: " << opt << std::endl;
+                LogField( "bytes", asmEnv.numFoldedBytes );
+
+                std::cout << "folded " << asmEnv.numFoldedBytes << " bytes of identical read-only module data" << std::endl;
             }
-        }
 
-        size_t optArgIndex = optParser.GetArgIndex();
+            // Finished generating code.
+            embeddedSections = std::move( asmEnv.embeddedSections );
+            stubCallTargets = std::move( asmEnv.stubCallTargets );
+            arenaRecords = std::move( asmEnv.arenaRecords );
 
-        curArg += optArgIndex;
+            for ( unsigned int n = 0; n < numberModules && n < asmEnv.moduleArenas.size(); n++ )
+            {
+                layoutManifest::moduleEntry& curEntry = curLayout.modules[ n ];
+                layoutManifest::moduleEntry& arenaInfo = asmEnv.moduleArenas[ n ];
 
-        argc -= (int)optArgIndex;
-    }
+                curEntry.arenaOffset = arenaInfo.arenaOffset;
+                curEntry.arenaSize = arenaInfo.arenaSize;
+                curEntry.sectionLinks = std::move( arenaInfo.sectionLinks );
 
-    // If we print help, then we just do that and quit.
-    if ( doPrintHelp )
-    {
-        std::cout << "USAGE: -[options] *input.exe* *input1.dll* *input2.dll* ... *inputn.dll* *output.exe*" << std::endl;
-        std::cout << std::endl;
+                if ( hasPrevLayout )
+                {
+                    const layoutManifest::moduleEntry& prevEntry = prevLayout.modules[ n ];
 
-        std::cout << "Option Descriptions:" << std::endl;
-        std::cout << "-efix: restores original executable entry point in PE header after DLL load" << std::endl;
-        std::cout << "-injimp: hooks executable imports with input DLL exports" << std::endl;
-        std::cout << "-noexp: does not take over DLL exports into executable" << std::endl;
-        std::cout << "-nores: leaves out resources from the DLL" << std::endl;
-        std::cout << "-noentryexecfix: prevents making sections of entry points executable if not already" << std::endl;
-        std::cout << "-marksectexec: marks all injected sections executable" << std::endl;
-        std::cout << "-help: prints this help text" << std::endl;
+                    if ( curEntry.arenaOffset == prevEntry.arenaOffset )
+                    {
+                        // A module that shrank keeps its whole previous arena, so it can grow back later.
+                        curEntry.arenaSize = std::max( curEntry.arenaSize, prevEntry.arenaSize );
+
+                        // Unchanged modules should have ended up with the very same section links.
+                        bool hasSameLinks = std::equal(
+                            curEntry.sectionLinks.begin(), curEntry.sectionLinks.end(),
+                            prevEntry.sectionLinks.begin(), prevEntry.sectionLinks.end(),
+                            []( const layoutManifest::sectionLink& left, const layoutManifest::sectionLink& right )
+                        {
+                            return ( left.moduleRVA == right.moduleRVA && left.imageRVA == right.imageRVA );
+                        });
 
-        return 0;
-    }
+                        if ( curEntry.HasSameContent( prevEntry ) && !hasSameLinks )
+                        {
+                            std::cout << "WARNING: section layout of unchanged module " << curEntry.path << " differs from previous run" << std::endl;
+                        }
+                    }
+                }
+            }
+        }
 
-    // Fetch possible input executable and input module from arguments.
-    const char *inputExecImageName = "input.exe";
+        // Notify that there is now a divide between module code generation and asmjit embedding.
+        std::cout << std::endl;
 
-    if ( argc >= 2 )
-    {
-        inputExecImageName = argv[curArg++];
-    }
+        // Commit the code into the buffers.
+        asmCodeHolder.sync();
 
-    // Calculate the amount of module images to embed.
-    unsigned int numberModules = 1;
+        // Location of the unpack table RVA inside of the linked entry stub.
+        PEFile::PESection *unpackStubSect = nullptr;
+        std::vector <std::uint32_t> unpackTableRVAOffsets;
 
-    if ( argc >= 5 )
-    {
-        numberModules = (unsigned int)( argc - 3 );
-    }
+        // We have to embed all asmjit sections into our executable aswell.
+        {
+            logPhase phase( "link entry stub" );
 
-    std::vector <const char*> toEmbedList;
+            std::cout << "linking asmjit code into executable" << std::endl;
 
-    if ( argc >= 3 )
-    {
-        toEmbedList.reserve( numberModules );
+            PEFile::PESectionDataReference entryPointRef;
+            bool couldLinkCode = asmjitshared::EmbedASMJITCodeIntoModule( exeImage, requiresRelocations, asmCodeHolder, entryPointLabel, entryPointRef );
 
-        for ( unsigned int n = 0; n < numberModules; n++ )
-        {
-            const char *inputModImageName = argv[curArg++];
+            if ( !couldLinkCode )
+            {
+                std::cout << "failed to link asmjit code into executable" << std::endl;
 
-            toEmbedList.push_back( inputModImageName );
-        }
-    }
-    else
-    {
-        toEmbedList.push_back( "input.dll" );
-    }
+                return -10;
+            }
 
-    const char *outputModImageName = "output.exe";
+            if ( isPackingSections )
+            {
+                unpackStubSect = entryPointRef.GetSection();
 
-    if ( argc >= 4 )
-    {
-        outputModImageName = argv[curArg++];
-    }
+                // The unpacker and the reprotection of packed sections both walk the unpack table.
+                unpackTableRVAOffsets.push_back( (std::uint32_t)( entryPointRef.GetSectionOffset() + asmCodeHolder.getLabelOffset( unpackTableRVAEndLabel ) - sizeof(std::uint32_t) ) );
 
-    // Create a nice debug string.
-    {
-        std::cout << "loading: \"" << inputExecImageName << "\"";
+                if ( doReprotectSections )
+                {
+                    unpackTableRVAOffsets.push_back( (std::uint32_t)( entryPointRef.GetSectionOffset() + asmCodeHolder.getLabelOffset( reprotectTableRVAEndLabel ) - sizeof(std::uint32_t) ) );
+                }
+            }
 
-        for ( unsigned int n = 0; n < numberModules; n++ )
-        {
-            const char *inputModImageName = toEmbedList[ n ];
+            LinkTLSEmulationAccesses( exeImage, tlsEmulation, asmCodeHolder, entryPointRef.GetSection(), entryPointRef.GetSectionOffset(), requiresRelocations );
 
-            std::cout << ", \"" << inputModImageName << "\"";
+            // Make our executable entry point to our newly compiled routine.
+            exeImage.peOptHeader.addressOfEntryPointRef = std::move( entryPointRef );
+
+            // Finito.
         }
 
-        std::cout << std::endl << std::endl;
-    }
+        // Apply the user-supplied signature patches to the final section contents.
+        if ( sigPatchPath != nullptr )
+        {
+            logPhase phase( "patch signatures" );
 
-    // TODO: create a code building environment and make the DLL embedding a method of it.
-    //  This should optimize the code generation output, which in terms reduces the section
-    //  throughput (good due to Windows NT loader limits).
+            std::cout << "applying signature patches (" << numWorkerThreads << " threads)" << std::endl;
 
-    int iReturnCode;
+            sigPatchStats patchStats;
 
-    try
-    {
-        // Load both PE images.
-        PEFile exeImage;
-        {
-            std::cout << "loading executable image (" << inputExecImageName << ")" << std::endl;
+            sigPatches.Apply( exeImage, numWorkerThreads, patchStats );
 
-            std::fstream stlFileStream( inputExecImageName, std::ios::binary | std::ios::in );
+            const std::vector <sigPatchRule>& patchRules = sigPatches.GetRules();
 
-            if ( !stlFileStream.good() )
+            for ( size_t ruleIdx = 0; ruleIdx < patchRules.size(); ruleIdx++ )
             {
-                std::cout << "failed to load executable image" << std::endl;
-
-                return -1;
+                LogVerbose() << "* rule at line " << patchRules[ ruleIdx ].lineNumber << ": " << patchStats.ruleHitCounts[ ruleIdx ] << " patches" << std::endl;
             }
 
-            PEStreamSTL peStream( &stlFileStream );
+            phase.SetField( "applied", patchStats.numPatchesApplied );
+            phase.SetField( "overlapsSkipped", patchStats.numOverlapsSkipped );
+            phase.SetField( "relocConflicts", patchStats.numRelocConflicts );
 
-            exeImage.LoadFromDisk( &peStream );
-        }
+            LogField( "applied", patchStats.numPatchesApplied );
 
-        // Initialize the environment.
-        std::uint16_t exeMachineType = exeImage.pe_finfo.machine_id;
+            std::cout << "applied " << patchStats.numPatchesApplied << " signature patches";
 
-        // We only support x86 and x64 for now.
-        if ( exeMachineType != PEL_IMAGE_FILE_MACHINE_I386 && exeMachineType != PEL_IMAGE_FILE_MACHINE_AMD64 )
-        {
-            throw runtime_exception( -4, "unsupported machine type (x86 or x64 only)" );
+            if ( patchStats.numOverlapsSkipped > 0 || patchStats.numRelocConflicts > 0 )
+            {
+                std::cout << " (skipped " << patchStats.numOverlapsSkipped << " overlapping matches, " << patchStats.numRelocConflicts << " relocation conflicts)";
+            }
+
+            std::cout << std::endl;
         }
 
-        // Check that the executable is an EXE.
-        if ( exeImage.pe_finfo.isDLL != false )
+        // Zero tails do not have to be stored on disk.
+        if ( doTrimZeroTails )
         {
-            throw runtime_exception( -5, "provided executable image is not an executable image" );
-        }
+            logPhase phase( "trim zero tails" );
 
-        // Decide what architecture we generate code for.
-        std::uint8_t genCodeArch = asmjit::ArchInfo::kTypeNone;
+            std::cout << "trimming zero tails of injected sections" << std::endl;
 
-        std::uint32_t archPointerSize;
+            size_t numTrimmedBytes = TrimSectionZeroTails( exeImage, embeddedSections, archPointerSize );
 
-        if ( exeMachineType == PEL_IMAGE_FILE_MACHINE_I386 )
-        {
-            genCodeArch = asmjit::ArchInfo::kTypeX86;
+            phase.SetField( "trimmedBytes", numTrimmedBytes );
 
-            archPointerSize = 4;
+            LogField( "bytes", numTrimmedBytes );
 
-            std::cout << "architecture: 32bit" << std::endl;
+            std::cout << "saved " << numTrimmedBytes << " bytes of raw section data" << std::endl;
         }
-        else if ( exeMachineType == PEL_IMAGE_FILE_MACHINE_AMD64 )
-        {
-            genCodeArch = asmjit::ArchInfo::kTypeX64;
-
-            archPointerSize = 8;
 
-            std::cout << "architecture: 64bit" << std::endl;
-        }
-        else
+        // Compress the injected sections; done last so that the packed data is final.
+        if ( isPackingSections )
         {
-            throw runtime_exception( -7, "invalid machine type for asmjit code generation" );
-        }
+            logPhase phase( "pack sections" );
 
-        // Check if we have to embed any new relocations.
-        bool requiresRelocations = ( exeImage.HasRelocationInfo() == true );
+            std::cout << "packing injected sections" << std::endl;
 
-        // We want to generate specialized code as executable entry point.
-        // This allows us to do specialized patching according to rules of PE merging.
-        asmjit::CodeInfo asmCodeInfo( genCodeArch );
+            sectionPackStats packStats;
 
-        asmjit::CodeHolder asmCodeHolder;
-        asmCodeHolder.init( asmCodeInfo );
+            bool couldPack = PackEmbeddedSections(
+                exeImage, embeddedSections, unpackStubSect, unpackTableRVAOffsets,
+                ( doReprotectSections ? &protectionPolicy : nullptr ), packStats
+            );
 
-        // We need to remember a label of the entry point.
-        asmjit::Label entryPointLabel;
-        {
-            AssemblyEnvironment asmEnv( exeImage, &asmCodeHolder );
+            if ( !couldPack )
+            {
+                std::cout << "failed to pack injected sections" << std::endl;
 
-            asmjit::X86Assembler& x86_asm = asmEnv.x86_asm;
+                return -27;
+            }
 
-            // Now the entry point starts.
-            entryPointLabel = x86_asm.newLabel();
+            phase.SetField( "packedSections", packStats.numPackedSections );
+            phase.SetField( "skippedSections", packStats.numSkippedSections );
+            phase.SetField( "rawBytes", packStats.numRawBytes );
+            phase.SetField( "packedBytes", packStats.numPackedBytes );
 
-            if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
-            {
-                // Align the stack pointer.
-                x86_asm.mov( asmjit::x86::rax, asmjit::x86::rsp );
-                x86_asm.and_( asmjit::x86::rax, 0x0F );
-                x86_asm.sub( asmjit::x86::rsp, asmjit::x86::rax );
+            std::cout
+                << "packed " << packStats.numPackedSections << " sections (" << packStats.numSkippedSections << " left unpacked), "
+                << packStats.numRawBytes << " -> " << packStats.numPackedBytes << " bytes of raw section data, decoding at "
+                << (std::uint64_t)packStats.decodeMegabytesPerSecond << " MB/s" << std::endl;
+        }
 
-                // Reserve register spill space.
-                x86_asm.sub( asmjit::x86::rsp, 0x20 );
-            }
+        {
+            writablePageStats pageStats;
 
-            // User could have requested to fix the entry point in the original executable to the previous
-            // one because it is used for version detection by some executable logic.
-            if ( doFixEntryPoint )
-            {
-                std::cout << "adjusting executable entry point to old on startup ..." << std::endl;
+            CountWritablePages( exeImage, protectionPolicy, pageStats );
 
-                PEFile::PESection metaSection;
-                metaSection.shortName = ".meta";
-                metaSection.chars.sect_mem_write = true;
+            LogField( "loadPages", pageStats.numLoadWritablePages );
+            LogField( "steadyPages", pageStats.numSteadyWritablePages );
 
-                // Determine the size of a thunk entry.
-                // It depends on the image type.
-                size_t thunkEntrySize;
+            std::cout << "writable pages: " << pageStats.numLoadWritablePages << " at load, " << pageStats.numSteadyWritablePages << " after startup" << std::endl;
+        }
 
-                if ( exeImage.isExtendedFormat )
-                {
-                    thunkEntrySize = 8;
-                }
-                else
-                {
-                    thunkEntrySize = 4;
-                }
+        // Content hash of the written image, for the layout manifest.
+        std::uint64_t outputContentHash = 0;
+        bool hasOutputContentHash = false;
 
-                // We must allocate certain functions that we should use for memory management.
-                PEFile::PESectionAllocation utilThunk;
-                {
-                    PEFile::PEImportDesc utilImports;
-                    utilImports.DLLName = "KERNEL32.DLL";
-                    {
-                        PEFile::PEImportDesc::importFunc fVirtualProtect;
-                        fVirtualProtect.name = "VirtualProtect";
-                        fVirtualProtect.isOrdinalImport = false;
-                        fVirtualProtect.ordinal_hint = 0;
-                        utilImports.funcs.AddToBack( std::move( fVirtualProtect ) );
-                    }
+        // Write out the new executable image.
+        {
+            logPhase phase( "write output" );
 
-                    // Give it some memory region.
-                    size_t utilThunkSize = ( thunkEntrySize * utilImports.funcs.GetCount() );
+            std::cout << "writing output image (" << outputModImageName << ")" << std::endl;
 
-                    metaSection.Allocate( utilThunk, (std::uint32_t)utilThunkSize, (std::uint32_t)thunkEntrySize );
+            auto writeStartTime = std::chrono::steady_clock::now();
 
-                    // We want to link the thunk into the imports desc.
-                    utilImports.firstThunkRef = utilThunk;
+            // Also verified before it is written, so that the verification re-parses the exact file contents.
+            PEStreamMemory peMemStream;
 
-                    exeImage.imports.AddToBack( std::move( utilImports ) );
-                }
+            if ( doDirectWrite && doVerifyOutput == false && doSkipUnchanged == false && doWriteChecksum == false )
+            {
+                std::fstream stlStreamOut( outputModImageName, std::ios::binary | std::ios::out );
 
-                if ( metaSection.IsEmpty() == false )
+                if ( !stlStreamOut.good() )
                 {
-                    metaSection.Finalize();
+                    std::cout << "failed to create output file (" << outputModImageName << ")" << std::endl;
 
-                    exeImage.AddSection( std::move( metaSection ) );
+                    return -18;
                 }
 
-                // Now since we have module RVAs for the util imports, we
-                // can generate code that uses them.
-                // Unprotect the beginning of the image, write the original executable
-                // entry point into the PE optional header and protect it again.
-                // We assume that the type of image (PE32 or PE32+) will never change.
-                // Unless you are a PE hacker and want to create that tool.
+                PEStreamSTL peOutStream( &stlStreamOut );
 
-                // Unprotect the first 1024 bytes of the image.
-                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
-                {
-                    x86_asm.sub( asmjit::x86::esp, 4 );
-                    x86_asm.push( asmjit::x86::esp );
-                    x86_asm.push( (std::uint32_t)_PAGE_READWRITE );
-                    x86_asm.push( (std::uint32_t)1024 );
-                    x86_asm.push( asmjit::Imm( 0, true ) );
-                }
-                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+                exeImage.WriteToStream( &peOutStream );
+
+                auto writeMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( std::chrono::steady_clock::now() - writeStartTime ).count();
+
+                phase.SetField( "result", "written" );
+
+                std::cout << "wrote output image in " << writeMillis << "ms" << std::endl;
+            }
+            else
+            {
+                // Serialize the whole file layout into one buffer and store it with a single write.
+                peMemStream.Reserve( EstimateImageFileSize( exeImage ) );
+
+                exeImage.WriteToStream( &peMemStream );
+
+                // The checksum is summed over the serialized buffer, so the file is never read back.
+                if ( doWriteChecksum )
                 {
-                    x86_asm.sub( asmjit::x86::rsp, 16 );
-                    x86_asm.mov( asmjit::x86::rcx, asmjit::Imm( 0, true ) );
-                    x86_asm.mov( asmjit::x86::rdx, 1024u );
-                    x86_asm.mov( asmjit::x86::r8, (std::uint32_t)_PAGE_READWRITE );
-                    x86_asm.mov( asmjit::x86::r9, asmjit::x86::rsp );
+                    std::uint32_t imageChecksum;
+
+                    if ( UpdatePEChecksum( peMemStream.GetData(), peMemStream.GetSize(), &imageChecksum ) )
+                    {
+                        exeImage.peOptHeader.checkSum = imageChecksum;
+
+                        std::cout << "image checksum: 0x" << std::hex << imageChecksum << std::dec << std::endl;
+                    }
+                    else
+                    {
+                        std::cout << "failed to compute the image checksum" << std::endl;
+                    }
                 }
-                else
+
+                auto serializeEndTime = std::chrono::steady_clock::now();
+
+                // Verified before the output file is replaced, so that a failing image never overwrites a good one.
+                if ( doVerifyOutput )
                 {
-                    assert( 0 );
+                    auto verifyStartTime = std::chrono::steady_clock::now();
 
-                    return -1;
-                }
+                    std::cout << "verifying output image" << std::endl;
 
-                // Call the thunk function directly.
-                asmjit::X86Mem fVirtualProtect( utilThunk.ResolveOffset( 0 ), (std::uint32_t)thunkEntrySize );
+                    PEFile verifyImage;
 
-                x86_asm.call( fVirtualProtect );
+                    peMemStream.Seek( 0 );
 
-                // Fix entry point with old.
-                x86_asm.mov( x86_asm.zax(), asmjit::X86Mem( offsetof(PEStructures::IMAGE_DOS_HEADER, e_lfanew), sizeof(std::int32_t) ) );
+                    verifyImage.LoadFromDisk( &peMemStream );
 
-                std::uint32_t structEP_off;
+                    imageVerifyReport verifyReport;
 
-                if ( exeImage.isExtendedFormat )
-                {
-                    structEP_off = offsetof(PEStructures::IMAGE_OPTIONAL_HEADER64, AddressOfEntryPoint);
-                }
-                else
-                {
-                    structEP_off = offsetof(PEStructures::IMAGE_OPTIONAL_HEADER32, AddressOfEntryPoint);
-                }
+                    VerifyEmbeddedImage( verifyImage, stubCallTargets, verifyReport );
 
-                // We need to skip some data.
-                structEP_off += sizeof(PEStructures::IMAGE_PE_HEADER) + sizeof(std::uint16_t);
+                    auto verifyEndTime = std::chrono::steady_clock::now();
 
-                x86_asm.add( x86_asm.zax(), asmjit::Imm( 0, true ) );
-                x86_asm.mov( asmjit::X86Mem( x86_asm.zax(), structEP_off, 4 ), exeImage.peOptHeader.addressOfEntryPointRef.GetRVA() );
+                    for ( const imageVerifyReport::checkResult& check : verifyReport.checks )
+                    {
+                        size_t numIssues = ( check.issues.size() + check.numSuppressedIssues );
 
-                // Protect the memory again.
-                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
-                {
-                    x86_asm.push( asmjit::x86::esp );
-                    x86_asm.push( asmjit::X86Mem( asmjit::x86::esp, 4, 4 ) );
-                    x86_asm.push( (std::uint32_t)1024u );
-                    x86_asm.push( asmjit::Imm( 0, true ) );
-                }
-                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
-                {
-                    x86_asm.mov( asmjit::x86::rcx, asmjit::Imm( 0, true ) );
-                    x86_asm.mov( asmjit::x86::rdx, asmjit::X86Mem( asmjit::x86::rsp, 0, 4 ) );
-                    x86_asm.mov( asmjit::x86::r8, 1024u );
-                    x86_asm.mov( asmjit::x86::r9, asmjit::x86::rsp );
-                }
-                else
-                {
-                    assert( 0 );
-                }
+                        LogField( "checked", check.numChecked );
+                        LogField( "issues", numIssues );
 
-                // Call the thunk function directly.
-                x86_asm.call( fVirtualProtect );
+                        std::cout << "* " << check.name << ": " << check.numChecked << " checked";
 
-                // Release stack space for the oldProt variable.
-                if ( genCodeArch == asmjit::ArchInfo::kTypeX86 )
-                {
-                    x86_asm.add( asmjit::x86::esp, 4 );
+                        if ( numIssues > 0 )
+                        {
+                            std::cout << ", " << numIssues << " issues";
+                        }
+
+                        std::cout << std::endl;
+
+                        for ( const std::string& issue : check.issues )
+                        {
+                            std::cout << "  " << issue << std::endl;
+                        }
+
+                        if ( check.numSuppressedIssues > 0 )
+                        {
+                            std::cout << "  ... and " << check.numSuppressedIssues << " more" << std::endl;
+                        }
+                    }
+
+                    auto verifyMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( verifyEndTime - verifyStartTime ).count();
+                    auto embedMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( verifyStartTime - embedStartTime ).count();
+
+                    std::cout << "verification took " << verifyMillis << "ms (embedding took " << embedMillis << "ms)" << std::endl;
+
+                    phase.SetField( "verifyIssues", verifyReport.GetIssueCount() );
+
+                    if ( verifyReport.GetIssueCount() > 0 )
+                    {
+                        phase.SetField( "result", "failed verification" );
+
+                        std::cout << "output image failed verification" << std::endl;
+
+                        return -23;
+                    }
                 }
-                else if ( genCodeArch == asmjit::ArchInfo::kTypeX64 )
+
+                if ( doIncremental )
                 {
-                    x86_asm.add( asmjit::x86::rsp, 16 );
+                    outputContentHash = contentHash64::HashData( peMemStream.GetData(), peMemStream.GetSize() );
+                    hasOutputContentHash = true;
                 }
-                else
+
+                // Do not touch the output file if its contents would stay the same, so that its timestamp is kept.
+                bool isOutputUnchanged = false;
+
+                if ( doSkipUnchanged )
                 {
-                    assert( 0 );
+                    // Byte for byte; the content hash is only good enough for the layout manifest.
+                    isOutputUnchanged = IsFileContentSame( outputModImageName, peMemStream.GetData(), peMemStream.GetSize() );
                 }
-            }
 
-            // Embed each requested image.
-            for ( unsigned int n = 0; n < numberModules; n++ )
-            {
-                const char *inputModImageName = toEmbedList[ n ];
+                phase.SetField( "bytes", peMemStream.GetSize() );
 
-                PEFile moduleImage;
+                if ( isOutputUnchanged )
                 {
-                    std::cout << "loading module image (" << inputModImageName << ")" << std::endl;
+                    phase.SetField( "result", "unchanged" );
 
-                    std::fstream stlFileStream( inputModImageName, std::ios::binary | std::ios::in );
+                    std::cout << "output image is unchanged; keeping the existing file" << std::endl;
+                }
+                else
+                {
+                    auto flushStartTime = std::chrono::steady_clock::now();
 
-                    if ( !stlFileStream.good() )
+                    if ( !WriteFileAtomic( outputModImageName, peMemStream.GetData(), peMemStream.GetSize() ) )
                     {
-                        std::cout << "failed to load module image" << std::endl;
+                        std::cout << "failed to write output file (" << outputModImageName << ")" << std::endl;
 
-                        return -2;
+                        return -18;
                     }
 
-                    PEStreamSTL peStream( &stlFileStream );
+                    auto writeEndTime = std::chrono::steady_clock::now();
 
-                    moduleImage.LoadFromDisk( &peStream );
-                }
+                    auto serializeMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( serializeEndTime - writeStartTime ).count();
+                    auto flushMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( writeEndTime - flushStartTime ).count();
 
-                std::uint16_t modMachineType = moduleImage.pe_finfo.machine_id;
+                    phase.SetField( "result", "written" );
 
-                // Check that both images are of same machine type.
-                if ( exeMachineType != modMachineType )
-                {
-                    std::cout << "machine types of images do not match" << std::endl;
+                    LogField( "bytes", peMemStream.GetSize() );
+                    LogField( "ms", serializeMillis + flushMillis );
 
-                    return -3;
+                    std::cout << "wrote output image (" << peMemStream.GetSize() << " bytes) in " << ( serializeMillis + flushMillis ) << "ms (serialize " << serializeMillis << "ms, flush " << flushMillis << "ms)" << std::endl;
                 }
+            }
+        }
 
-                // Fetch module name.
-                const char *moduleFileName = FetchFileName( inputModImageName );
+        // Traces captured from the output are attributed through the arena records of this build.
+        {
+            std::string arenaRecordsPath = std::string( outputModImageName ) + ".arenas";
 
-                // Perform the embedding.
-                int statusEmbed = asmEnv.EmbedModuleIntoExecutable(
-                    moduleImage, requiresRelocations, moduleFileName,
-                    doInjectMatchingImports, doTakeoverExports, doIgnoreResources, doFixEntrypointExecutable, markAllSectionsExecutable,
-                    archPointerSize
-                );
+            if ( !SaveArenaRecords( arenaRecordsPath.c_str(), arenaRecords ) )
+            {
+                std::cout << "WARNING: failed to write module arena records (" << arenaRecordsPath << ")" << std::endl;
+            }
+        }
 
-                if ( statusEmbed != 0 )
-                {
-                    return statusEmbed;
-                }
+        // Remember the layout for the next incremental run.
+        if ( doIncremental )
+        {
+            bool hasOutputHash = hasOutputContentHash;
 
-                // Print some seperation for easier log viewing.
-                if ( n + 1 != numberModules )
-                {
-                    std::cout << std::endl;
-                }
+            if ( hasOutputHash )
+            {
+                curLayout.outputHash = outputContentHash;
             }
+            else
+            {
+                // Directly written images are not in memory.
+                std::uint64_t outputSize;
 
-            // We jump to the original executable entry point.
-            x86_asm.jmp( exeImage.peOptHeader.addressOfEntryPointRef.GetRVA() );
+                hasOutputHash = HashFileContents( outputModImageName, curLayout.outputHash, outputSize );
+            }
 
-            // Finished generating code.
+            if ( hasOutputHash && curLayout.SaveToFile( layoutManifestPath.c_str() ) )
+            {
+                std::cout << "wrote layout manifest (" << layoutManifestPath << ")" << std::endl;
+            }
+            else
+            {
+                std::cout << "WARNING: failed to write layout manifest (" << layoutManifestPath << ")" << std::endl;
+            }
         }
 
-        // Notify that there is now a divide between module code generation and asmjit embedding.
-        std::cout << std::endl;
+        // Break down what the output image costs on disk and in memory.
+        if ( reportFormat != nullptr )
+        {
+            logPhase phase( "report" );
 
-        // Commit the code into the buffers.
-        asmCodeHolder.sync();
+            bool isJSONReport = ( strcmp( reportFormat, "json" ) == 0 );
 
-        // We have to embed all asmjit sections into our executable aswell.
-        {
-            std::cout << "linking asmjit code into executable" << std::endl;
+            std::string reportPath = std::string( outputModImageName ) + ( isJSONReport ? ".report.json" : ".report.txt" );
 
-            PEFile::PESectionDataReference entryPointRef;
-            bool couldLinkCode = asmjitshared::EmbedASMJITCodeIntoModule( exeImage, requiresRelocations, asmCodeHolder, entryPointLabel, entryPointRef );
+            imageCompositionReport compReport;
 
-            if ( !couldLinkCode )
-            {
-                std::cout << "failed to link asmjit code into executable" << std::endl;
+            BuildImageReport( exeImage, reportOwners, compReport );
 
-                return -10;
+            std::fstream reportStream( reportPath, std::ios::out | std::ios::trunc );
+
+            if ( isJSONReport )
+            {
+                WriteImageReportJSON( compReport, reportStream );
+            }
+            else
+            {
+                WriteImageReportText( compReport, reportStream );
             }
 
-            // Make our executable entry point to our newly compiled routine.
-            exeImage.peOptHeader.addressOfEntryPointRef = std::move( entryPointRef );
+            reportStream.flush();
 
-            // Finito.
+            if ( !reportStream.good() )
+            {
+                std::cout << "failed to write image report (" << reportPath << ")" << std::endl;
+
+                return -28;
+            }
+
+            std::cout << "wrote image report (" << reportPath << ")" << std::endl;
         }
 
-        // Write out the new executable image.
+        // Write the delta against the input executable for distribution.
+        if ( doWriteDelta )
         {
-            std::cout << "writing output image (" << outputModImageName << ")" << std::endl;
+            logPhase phase( "delta" );
+
+            std::string deltaPath = std::string( outputModImageName ) + ".delta";
 
-            std::fstream stlStreamOut( outputModImageName, std::ios::binary | std::ios::out );
+            imageDeltaStats deltaStats;
+            std::string deltaError;
 
-            if ( !stlStreamOut.good() )
+            if ( !CreateImageDelta( inputExecImageName, outputModImageName, deltaPath.c_str(), deltaStats, deltaError ) )
             {
-                std::cout << "failed to create output file (" << outputModImageName << ")" << std::endl;
+                std::cout << "failed to create delta (" << deltaPath << "): " << deltaError << std::endl;
 
-                return -18;
+                return -26;
             }
 
-            PEStreamSTL peOutStream( &stlStreamOut );
-
-            exeImage.WriteToStream( &peOutStream );
+            std::cout
+                << "wrote delta (" << deltaPath << "): " << deltaStats.deltaFileSize << " bytes, "
+                << deltaStats.numCopiedBytes << " bytes copied, " << deltaStats.numLiteralBytes << " bytes literal, "
+                << deltaStats.numOperations << " operations" << std::endl;
         }
 
         // Success!
@@ -2198,4 +3872,97 @@ int main( int argc, char *argv[] )
     }
 
     return iReturnCode;
+}
+
+// Runs one job and reports its result to the log.
+static int RunEmbedJob( int argc, char *argv[], peImageCache *imageCache )
+{
+    int resultCode = ProcessEmbedJob( argc, argv, imageCache );
+
+    FinishLogJob( resultCode );
+
+    return resultCode;
+}
+
+int main( int argc, char *argv[] )
+{
+    InstallLogging();
+
+    std::cout <<
+        "pefrmdllembed - Inject DLL file into EXE file, compiled on " __DATE__ << std::endl
+     << "visit http://pefrm-units.osdn.jp/pefrmdllembed.html" << std::endl << std::endl;
+
+    // The resident embed server and its client take over the whole command line.
+    if ( argc >= 3 && strcmp( argv[1], "-serve" ) == 0 )
+    {
+        const char *socketPath = argv[2];
+
+        unsigned int maxWorkers = std::max( 1u, std::thread::hardware_concurrency() );
+        size_t cacheMemoryCap = ( (size_t)512 << 20 );
+
+        OptionParser optParser( (const char**)argv + 3, (size_t)argc - 3 );
+
+        while ( true )
+        {
+            std::string opt = optParser.FetchOption();
+
+            if ( opt.empty() )
+                break;
+
+            if ( opt == "workers" )
+            {
+                const char *countStr = optParser.FetchArgument();
+
+                if ( countStr != nullptr )
+                {
+                    maxWorkers = (unsigned int)strtoul( countStr, nullptr, 10 );
+                }
+            }
+            else if ( opt == "cachemem" )
+            {
+                const char *megabytesStr = optParser.FetchArgument();
+
+                if ( megabytesStr != nullptr )
+                {
+                    cacheMemoryCap = ( (size_t)strtoull( megabytesStr, nullptr, 10 ) << 20 );
+                }
+            }
+            else
+            {
+                std::cout << "unknown server option: " << opt << std::endl;
+            }
+        }
+
+        return RunEmbedServer( socketPath, maxWorkers, cacheMemoryCap, RunEmbedJob );
+    }
+
+    if ( argc >= 3 && strcmp( argv[1], "-connect" ) == 0 )
+    {
+        return RunEmbedClient( argv[2], argc - 3, argv + 3 );
+    }
+
+    if ( argc >= 2 && strcmp( argv[1], "-applydelta" ) == 0 )
+    {
+        if ( argc < 5 )
+        {
+            std::cout << "usage: -applydelta *input exe* *delta* *output exe*" << std::endl;
+
+            return -26;
+        }
+
+        std::string deltaError;
+
+        if ( !ApplyImageDelta( argv[2], argv[3], argv[4], deltaError ) )
+        {
+            std::cout << "failed to apply delta: " << deltaError << std::endl;
+
+            return -26;
+        }
+
+        std::cout << "rebuilt output image (" << argv[4] << ")" << std::endl;
+
+        return 0;
+    }
+
+    return RunEmbedJob( argc, argv, nullptr );
 }
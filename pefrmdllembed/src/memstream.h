@@ -0,0 +1,76 @@
+#ifndef _MEMORY_STREAM_
+#define _MEMORY_STREAM_
+
+#include <peframework.h>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+// Growable in-memory PE stream, so that an image can be serialized once and then be
+// written to disk and re-parsed from the same buffer.
+struct PEStreamMemory final : public PEStream
+{
+    size_t Read( void *buf, size_t readCount ) override
+    {
+        size_t bufSize = this->buffer.size();
+
+        if ( this->seekPtr >= bufSize )
+        {
+            return 0;
+        }
+
+        size_t canRead = std::min( readCount, bufSize - this->seekPtr );
+
+        memcpy( buf, this->buffer.data() + this->seekPtr, canRead );
+
+        this->seekPtr += canRead;
+
+        return canRead;
+    }
+
+    bool Write( const void *buf, size_t writeCount ) override
+    {
+        size_t writeEnd = ( this->seekPtr + writeCount );
+
+        if ( writeEnd > this->buffer.size() )
+        {
+            this->buffer.resize( writeEnd );
+        }
+
+        memcpy( this->buffer.data() + this->seekPtr, buf, writeCount );
+
+        this->seekPtr = writeEnd;
+
+        return true;
+    }
+
+    bool Seek( pe_file_ptr_t seek ) override
+    {
+        if ( seek < 0 )
+        {
+            return false;
+        }
+
+        this->seekPtr = (size_t)seek;
+
+        return true;
+    }
+
+    pe_file_ptr_t Tell( void ) const override
+    {
+        return (pe_file_ptr_t)this->seekPtr;
+    }
+
+    inline void Reserve( size_t size )              { this->buffer.reserve( size ); }
+
+    inline char* GetData( void )                    { return this->buffer.data(); }
+    inline const char* GetData( void ) const        { return this->buffer.data(); }
+    inline size_t GetSize( void ) const             { return this->buffer.size(); }
+
+private:
+    std::vector <char> buffer;
+    size_t seekPtr = 0;
+};
+
+#endif //_MEMORY_STREAM_
@@ -0,0 +1,93 @@
+#include "moduleloader.h"
+
+moduleLoadPipeline::moduleLoadPipeline( std::vector <const char*> paths, size_t maxLookahead, loadFunc_t loadFunc )
+    : paths( std::move( paths ) ), maxLookahead( maxLookahead > 0 ? maxLookahead : 1 ), loadFunc( std::move( loadFunc ) )
+{
+    this->loaderThread = std::thread( &moduleLoadPipeline::LoaderThreadMain, this );
+}
+
+moduleLoadPipeline::~moduleLoadPipeline( void )
+{
+    {
+        std::unique_lock <std::mutex> guard( this->lock );
+
+        this->isTerminating = true;
+    }
+
+    this->condSpace.notify_all();
+
+    this->loaderThread.join();
+}
+
+void moduleLoadPipeline::LoaderThreadMain( void )
+{
+    size_t numPaths = this->paths.size();
+
+    for ( size_t n = 0; n < numPaths; n++ )
+    {
+        // Do not run too far ahead of the embedding.
+        {
+            std::unique_lock <std::mutex> guard( this->lock );
+
+            this->condSpace.wait( guard,
+                [&]
+            {
+                return ( this->isTerminating || this->readySlots.size() < this->maxLookahead );
+            });
+
+            if ( this->isTerminating )
+            {
+                return;
+            }
+        }
+
+        loadSlot slot;
+
+        try
+        {
+            this->loadFunc( this->paths[ n ], slot.module );
+        }
+        catch( ... )
+        {
+            slot.error = std::current_exception();
+        }
+
+        {
+            std::unique_lock <std::mutex> guard( this->lock );
+
+            this->readySlots.push_back( std::move( slot ) );
+        }
+
+        this->condReady.notify_one();
+    }
+}
+
+moduleLoadPipeline::loadedModule moduleLoadPipeline::Next( void )
+{
+    loadSlot slot;
+    {
+        std::unique_lock <std::mutex> guard( this->lock );
+
+        assert( this->numDelivered < this->paths.size() );
+
+        this->condReady.wait( guard,
+            [&]
+        {
+            return ( this->readySlots.empty() == false );
+        });
+
+        slot = std::move( this->readySlots.front() );
+        this->readySlots.pop_front();
+
+        this->numDelivered++;
+    }
+
+    this->condSpace.notify_one();
+
+    if ( slot.error )
+    {
+        std::rethrow_exception( slot.error );
+    }
+
+    return std::move( slot.module );
+}
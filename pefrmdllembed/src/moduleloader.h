@@ -0,0 +1,62 @@
+#ifndef _MODULE_LOADER_
+#define _MODULE_LOADER_
+
+#include <peframework.h>
+
+#include "resourcesnapshot.h"
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Loads and validates module images on a background thread while the previous modules are embedded.
+// Modules are handed out strictly in the order of the path list, so the output does not depend on timing.
+struct moduleLoadPipeline
+{
+    struct loadedModule
+    {
+        std::unique_ptr <PEFile> image;
+        std::shared_ptr <const resourceSnapshot> resources;     // only cached images share a snapshot.
+        bool isFromCache = false;
+        int errorCode = 0;                  // validation result; the image is valid if zero.
+        const char *errorMessage = nullptr;
+    };
+
+    // Runs on the loader thread; fills in the module and may throw.
+    typedef std::function <void ( const char *path, loadedModule& moduleOut )> loadFunc_t;
+
+    moduleLoadPipeline( std::vector <const char*> paths, size_t maxLookahead, loadFunc_t loadFunc );
+    ~moduleLoadPipeline( void );
+
+    // Waits for the next module; exceptions of its loading are rethrown here.
+    loadedModule Next( void );
+
+private:
+    void LoaderThreadMain( void );
+
+    struct loadSlot
+    {
+        loadedModule module;
+        std::exception_ptr error;
+    };
+
+    std::vector <const char*> paths;
+    size_t maxLookahead;
+    loadFunc_t loadFunc;
+
+    std::mutex lock;
+    std::condition_variable condReady;      // a slot was finished.
+    std::condition_variable condSpace;      // a slot was taken, or we are terminating.
+    std::deque <loadSlot> readySlots;
+    size_t numDelivered = 0;
+    bool isTerminating = false;
+
+    std::thread loaderThread;
+};
+
+#endif //_MODULE_LOADER_
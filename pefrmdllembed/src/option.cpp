@@ -86,4 +86,25 @@ std::string OptionParser::FetchOption( void )
     this->curArgPtr = argPtr;
 
     return optString;
+}
+
+const char* OptionParser::FetchArgument( void )
+{
+    // Returns the argument that follows an option, for options that take a value.
+    size_t argIdx = this->curArg;
+    size_t numArgs = this->numArgs;
+
+    if ( argIdx >= numArgs )
+    {
+        return nullptr;
+    }
+
+    const char *argPtr = this->curArgPtr;
+
+    argIdx++;
+
+    this->curArg = argIdx;
+    this->curArgPtr = UpdateArgPtr( argIdx, numArgs );
+
+    return argPtr;
 }
\ No newline at end of file
@@ -9,6 +9,7 @@ struct OptionParser
     ~OptionParser( void );
 
     std::string FetchOption( void );
+    const char* FetchArgument( void );
 
     inline size_t GetArgIndex( void ) const             { return this->curArg; }
     inline const char* GetArgPointer( void ) const      { return this->curArgPtr; }
@@ -0,0 +1,265 @@
+#include "outputsink.h"
+
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif //_WIN32
+
+size_t EstimateImageFileSize( PEFile& image )
+{
+    std::uint32_t fileAlignment = image.GetFileAlignment();
+
+    if ( fileAlignment == 0 )
+    {
+        fileAlignment = 0x200;
+    }
+
+    // The headers are rebuilt during writing; leave some room for additional section headers.
+    size_t estimatedSize = ( (size_t)image.peOptHeader.sizeOfHeaders + 0x1000 );
+
+    PEFile::sectionIter_t iter = image.GetSectionIterator();
+
+    for ( ; !iter.IsEnd(); iter.Increment() )
+    {
+        const PEFile::PESection *sect = iter.Resolve();
+
+        size_t rawSize = (size_t)sect->stream.Size();
+
+        estimatedSize += ( ( rawSize + fileAlignment - 1 ) / fileAlignment * fileAlignment );
+    }
+
+    return estimatedSize;
+}
+
+bool IsFileContentSame( const char *path, const void *data, size_t dataSize )
+{
+    std::fstream prevStream( path, std::ios::binary | std::ios::in );
+
+    if ( !prevStream.good() )
+    {
+        return false;
+    }
+
+    prevStream.seekg( 0, std::ios::end );
+
+    if ( (size_t)prevStream.tellg() != dataSize )
+    {
+        return false;
+    }
+
+    prevStream.seekg( 0, std::ios::beg );
+
+    const char *bytes = (const char*)data;
+
+    char chunkBuf[ 0x10000 ];
+    size_t compareOff = 0;
+
+    while ( compareOff < dataSize )
+    {
+        size_t chunkSize = std::min( sizeof( chunkBuf ), dataSize - compareOff );
+
+        if ( !prevStream.read( chunkBuf, (std::streamsize)chunkSize ) || memcmp( chunkBuf, bytes + compareOff, chunkSize ) != 0 )
+        {
+            return false;
+        }
+
+        compareOff += chunkSize;
+    }
+
+    return true;
+}
+
+#ifndef _WIN32
+
+// Writes the data of a file to the disk, so that a rename cannot become durable before it.
+static bool SyncFile( const char *path )
+{
+    int fd = open( path, O_RDONLY );
+
+    if ( fd < 0 )
+    {
+        return false;
+    }
+
+    bool success = ( fsync( fd ) == 0 );
+
+    close( fd );
+
+    return success;
+}
+
+// Makes the rename durable, too; not all file systems support syncing a directory.
+static void SyncParentDirectory( const char *path )
+{
+    std::string dirPath( path );
+
+    size_t slashPos = dirPath.find_last_of( '/' );
+
+    if ( slashPos == std::string::npos )
+    {
+        dirPath = ".";
+    }
+    else
+    {
+        dirPath.resize( slashPos + 1 );
+    }
+
+    int fd = open( dirPath.c_str(), O_RDONLY | O_DIRECTORY );
+
+    if ( fd >= 0 )
+    {
+        fsync( fd );
+        close( fd );
+    }
+}
+
+bool ReplaceFileWithTemp( const char *tmpPath, const char *path )
+{
+    if ( !SyncFile( tmpPath ) || rename( tmpPath, path ) != 0 )
+    {
+        unlink( tmpPath );
+        return false;
+    }
+
+    SyncParentDirectory( path );
+
+    return true;
+}
+
+bool WriteFileAtomic( const char *path, const void *data, size_t dataSize )
+{
+    std::string tmpPath = std::string( path ) + ".tmp";
+
+    // Keep the permissions of the file that we replace.
+    mode_t fileMode = 0644;
+    {
+        struct stat prevInfo;
+
+        if ( stat( path, &prevInfo ) == 0 )
+        {
+            fileMode = ( prevInfo.st_mode & 07777 );
+        }
+    }
+
+    int fd = open( tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, fileMode );
+
+    if ( fd < 0 )
+    {
+        return false;
+    }
+
+    bool success = true;
+
+#ifdef __linux__
+    // Reserve the blocks up front so that the file system can lay them out in one piece.
+    if ( dataSize > 0 )
+    {
+        posix_fallocate( fd, 0, (off_t)dataSize );
+    }
+#endif //__linux__
+
+    const char *bytes = (const char*)data;
+    size_t leftToWrite = dataSize;
+
+    while ( leftToWrite > 0 )
+    {
+        ssize_t numWritten = write( fd, bytes, leftToWrite );
+
+        if ( numWritten < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+
+            success = false;
+            break;
+        }
+
+        bytes += numWritten;
+        leftToWrite -= (size_t)numWritten;
+    }
+
+    if ( close( fd ) != 0 )
+    {
+        success = false;
+    }
+
+    if ( !success )
+    {
+        unlink( tmpPath.c_str() );
+        return false;
+    }
+
+    return ReplaceFileWithTemp( tmpPath.c_str(), path );
+}
+
+#else
+
+bool ReplaceFileWithTemp( const char *tmpPath, const char *path )
+{
+    bool success = false;
+
+    // Writes the data of the file to the disk, so that the rename cannot become durable before it.
+    HANDLE tmpFile = CreateFileA( tmpPath, GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+
+    if ( tmpFile != INVALID_HANDLE_VALUE )
+    {
+        success = ( FlushFileBuffers( tmpFile ) != FALSE );
+
+        CloseHandle( tmpFile );
+    }
+
+    if ( success && MoveFileExA( tmpPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ) == FALSE )
+    {
+        success = false;
+    }
+
+    if ( !success )
+    {
+        DeleteFileA( tmpPath );
+    }
+
+    return success;
+}
+
+bool WriteFileAtomic( const char *path, const void *data, size_t dataSize )
+{
+    std::string tmpPath = std::string( path ) + ".tmp";
+
+    bool success;
+    {
+        std::fstream stlFileStream( tmpPath, std::ios::binary | std::ios::out | std::ios::trunc );
+
+        if ( !stlFileStream.good() )
+        {
+            return false;
+        }
+
+        stlFileStream.write( (const char*)data, (std::streamsize)dataSize );
+        stlFileStream.flush();
+
+        success = stlFileStream.good();
+    }
+
+    if ( !success )
+    {
+        DeleteFileA( tmpPath.c_str() );
+        return false;
+    }
+
+    return ReplaceFileWithTemp( tmpPath.c_str(), path );
+}
+
+#endif //_WIN32
@@ -0,0 +1,24 @@
+#ifndef _OUTPUT_SINK_
+#define _OUTPUT_SINK_
+
+#include <peframework.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Estimates the size of the serialized image so that the output buffer and file can be preallocated.
+size_t EstimateImageFileSize( PEFile& image );
+
+// Replaces the file at path with the given data: the data is written with as few calls as possible
+// into a preallocated temporary file next to it, which is then renamed over the destination.
+// Readers of the destination thus never see a half-written image.
+bool WriteFileAtomic( const char *path, const void *data, size_t dataSize );
+
+// Returns true if the file at path already contains exactly the given data. Compared in chunks.
+bool IsFileContentSame( const char *path, const void *data, size_t dataSize );
+
+// Renames a completely written temporary file over path. Its data is flushed to the disk first, so that
+// a crash leaves either the previous or the new file behind. The temporary file is deleted on failure.
+bool ReplaceFileWithTemp( const char *tmpPath, const char *path );
+
+#endif //_OUTPUT_SINK_
@@ -0,0 +1,97 @@
+#include "pechecksum.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#define PE_CHECKSUM_SSE2
+#include <emmintrin.h>
+#endif
+
+// Adds up the little-endian 16bit words of an even-sized block into a 64bit sum; folding happens later.
+static std::uint64_t SumChecksumWords( const unsigned char *data, size_t numBytes )
+{
+    std::uint64_t sum = 0;
+    size_t off = 0;
+
+#ifdef PE_CHECKSUM_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    while ( numBytes - off >= 16 )
+    {
+        // Each 32bit lane takes two words per round, so it cannot overflow within 0x8000 rounds.
+        size_t numRounds = std::min( ( numBytes - off ) / 16, (size_t)0x8000 );
+
+        __m128i laneSums = zero;
+
+        for ( size_t n = 0; n < numRounds; n++ )
+        {
+            __m128i words = _mm_loadu_si128( (const __m128i*)( data + off ) );
+
+            laneSums = _mm_add_epi32( laneSums, _mm_unpacklo_epi16( words, zero ) );
+            laneSums = _mm_add_epi32( laneSums, _mm_unpackhi_epi16( words, zero ) );
+
+            off += 16;
+        }
+
+        std::uint32_t lanes[4];
+        _mm_storeu_si128( (__m128i*)lanes, laneSums );
+
+        sum += ( (std::uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] );
+    }
+#endif //PE_CHECKSUM_SSE2
+
+    for ( ; off + 1 < numBytes; off += 2 )
+    {
+        sum += ( (std::uint32_t)data[off] | ( (std::uint32_t)data[off+1] << 8 ) );
+    }
+
+    return sum;
+}
+
+bool UpdatePEChecksum( void *imageData, size_t imageSize, std::uint32_t *checksumOut )
+{
+    unsigned char *bytes = (unsigned char*)imageData;
+
+    if ( imageSize < 0x40 )
+    {
+        return false;
+    }
+
+    std::uint32_t peHeaderOff;
+    memcpy( &peHeaderOff, bytes + 0x3C, sizeof(peHeaderOff) );
+
+    // PE signature, file header, then the checksum at the same offset for PE32 and PE32+.
+    size_t checksumOff = ( (size_t)peHeaderOff + 4 + 20 + 64 );
+
+    if ( checksumOff + 4 > imageSize || memcmp( bytes + peHeaderOff, "PE\0\0", 4 ) != 0 )
+    {
+        return false;
+    }
+
+    // The field itself counts as zero.
+    memset( bytes + checksumOff, 0, 4 );
+
+    std::uint64_t sum = SumChecksumWords( bytes, imageSize & ~(size_t)1 );
+
+    if ( imageSize & 1 )
+    {
+        sum += bytes[ imageSize - 1 ];
+    }
+
+    while ( sum >> 16 )
+    {
+        sum = ( ( sum & 0xFFFF ) + ( sum >> 16 ) );
+    }
+
+    std::uint32_t checksum = (std::uint32_t)( sum + imageSize );
+
+    memcpy( bytes + checksumOff, &checksum, sizeof(checksum) );
+
+    if ( checksumOut )
+    {
+        *checksumOut = checksum;
+    }
+
+    return true;
+}
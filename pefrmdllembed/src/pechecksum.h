@@ -0,0 +1,11 @@
+#ifndef _PE_CHECKSUM_
+#define _PE_CHECKSUM_
+
+#include <cstddef>
+#include <cstdint>
+
+// Computes the optional header checksum of a serialized image and stores it into the image data.
+// Uses SSE2 for the 16bit ones' complement sum where available. Returns false if the data is not a PE image.
+bool UpdatePEChecksum( void *imageData, size_t imageSize, std::uint32_t *checksumOut = nullptr );
+
+#endif //_PE_CHECKSUM_
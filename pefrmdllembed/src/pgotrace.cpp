@@ -0,0 +1,236 @@
+#include "pgotrace.h"
+
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+std::string pageTrace::NormalizeModuleName( const char *name, size_t nameLen )
+{
+    // Module names are matched by filename only, case-insensitive.
+    size_t nameStart = 0;
+
+    for ( size_t n = 0; n < nameLen; n++ )
+    {
+        char c = name[n];
+
+        if ( c == '/' || c == '\\' )
+        {
+            nameStart = ( n + 1 );
+        }
+    }
+
+    std::string normalName;
+    normalName.reserve( nameLen - nameStart );
+
+    for ( size_t n = nameStart; n < nameLen; n++ )
+    {
+        normalName += (char)tolower( (unsigned char)name[n] );
+    }
+
+    return normalName;
+}
+
+static inline bool ParseHexNumber( const std::string& str, std::uint32_t& numOut )
+{
+    if ( str.empty() )
+    {
+        return false;
+    }
+
+    char *endPtr = nullptr;
+
+    unsigned long long num = strtoull( str.c_str(), &endPtr, 16 );
+
+    if ( endPtr == nullptr || *endPtr != 0 )
+    {
+        return false;
+    }
+
+    numOut = (std::uint32_t)num;
+    return true;
+}
+
+static inline std::string TrimString( const std::string& str )
+{
+    size_t startPos = str.find_first_not_of( " \t\r\n" );
+
+    if ( startPos == std::string::npos )
+    {
+        return std::string();
+    }
+
+    size_t endPos = str.find_last_not_of( " \t\r\n" );
+
+    return str.substr( startPos, endPos - startPos + 1 );
+}
+
+// Parses an "arena *module name* *rva*" line. Returns false if it is no arena record.
+static bool ParseArenaRecord( const std::string& line, std::string& moduleNameOut, std::uint32_t& arenaRVAOut )
+{
+    if ( line.compare( 0, 6, "arena " ) != 0 && line.compare( 0, 6, "arena\t" ) != 0 )
+    {
+        return false;
+    }
+
+    std::string recordArgs = TrimString( line.substr( 6 ) );
+
+    size_t argSplitPos = recordArgs.find_last_of( " \t" );
+
+    if ( argSplitPos == std::string::npos )
+    {
+        return false;
+    }
+
+    moduleNameOut = TrimString( recordArgs.substr( 0, argSplitPos ) );
+
+    return ( moduleNameOut.empty() == false && ParseHexNumber( recordArgs.substr( argSplitPos + 1 ), arenaRVAOut ) );
+}
+
+bool pageTrace::LoadFromFile( const char *path )
+{
+    std::fstream stlFileStream( path, std::ios::in );
+
+    if ( !stlFileStream.good() )
+    {
+        return false;
+    }
+
+    std::string line;
+
+    while ( std::getline( stlFileStream, line ) )
+    {
+        line = TrimString( line );
+
+        if ( line.empty() || line[0] == '#' || line[0] == ';' )
+        {
+            continue;
+        }
+
+        // Arena record of the traced build; otherwise it could be a module called "arena".
+        {
+            std::string moduleName;
+            std::uint32_t arenaRVA;
+
+            if ( ParseArenaRecord( line, moduleName, arenaRVA ) )
+            {
+                this->tracedArenas[ NormalizeModuleName( moduleName.c_str(), moduleName.size() ) ] = arenaRVA;
+                continue;
+            }
+        }
+
+        // Split into module name and offset, if there is a module name.
+        size_t splitPos = line.find_last_of( "+ \t" );
+
+        if ( splitPos == std::string::npos )
+        {
+            std::uint32_t rva;
+
+            if ( ParseHexNumber( line, rva ) )
+            {
+                this->imagePages.insert( rva / pageSize );
+                this->numEntries++;
+            }
+
+            continue;
+        }
+
+        std::string moduleName = TrimString( line.substr( 0, splitPos ) );
+        std::string offsetStr = TrimString( line.substr( splitPos + 1 ) );
+
+        std::uint32_t moduleOffset;
+
+        if ( moduleName.empty() || !ParseHexNumber( offsetStr, moduleOffset ) )
+        {
+            // Silently skip malformed lines; traces are frequently produced by scripts.
+            continue;
+        }
+
+        this->modulePages[ NormalizeModuleName( moduleName.c_str(), moduleName.size() ) ].insert( moduleOffset / pageSize );
+        this->numEntries++;
+    }
+
+    return true;
+}
+
+bool pageTrace::LoadArenaRecords( const char *path )
+{
+    std::fstream stlFileStream( path, std::ios::in );
+
+    if ( !stlFileStream.good() )
+    {
+        return false;
+    }
+
+    std::string line;
+
+    while ( std::getline( stlFileStream, line ) )
+    {
+        line = TrimString( line );
+
+        std::string moduleName;
+        std::uint32_t arenaRVA;
+
+        if ( ParseArenaRecord( line, moduleName, arenaRVA ) )
+        {
+            // Records that came with the trace win.
+            this->tracedArenas.insert( std::make_pair( NormalizeModuleName( moduleName.c_str(), moduleName.size() ), arenaRVA ) );
+        }
+    }
+
+    return true;
+}
+
+size_t pageTrace::GetModuleHotPageCount( const char *moduleFileName, std::uint32_t arenaSize ) const
+{
+    std::set <std::uint32_t> hotPages;
+
+    std::string moduleName = NormalizeModuleName( moduleFileName, strlen( moduleFileName ) );
+
+    auto findIter = this->modulePages.find( moduleName );
+
+    if ( findIter != this->modulePages.end() )
+    {
+        hotPages = findIter->second;
+    }
+
+    auto arenaIter = this->tracedArenas.find( moduleName );
+
+    if ( arenaIter == this->tracedArenas.end() )
+    {
+        return hotPages.size();
+    }
+
+    std::uint32_t tracedArenaOffset = arenaIter->second;
+
+    // Map the executable RVAs that landed inside of the module arena.
+    std::uint32_t firstPage = ( tracedArenaOffset / pageSize );
+    std::uint32_t endPage = ( ( tracedArenaOffset + arenaSize + pageSize - 1 ) / pageSize );
+
+    for ( auto iter = this->imagePages.lower_bound( firstPage ); iter != this->imagePages.end() && *iter < endPage; iter++ )
+    {
+        hotPages.insert( *iter - firstPage );
+    }
+
+    return hotPages.size();
+}
+
+bool SaveArenaRecords( const char *path, const std::vector <arenaRecord>& records )
+{
+    std::fstream stlFileStream( path, std::ios::out | std::ios::trunc );
+
+    if ( !stlFileStream.good() )
+    {
+        return false;
+    }
+
+    stlFileStream << "# module arenas of this build, for -pgotrace" << std::endl;
+    stlFileStream << std::hex;
+
+    for ( const arenaRecord& record : records )
+    {
+        stlFileStream << "arena " << record.moduleName << " " << record.arenaRVA << std::endl;
+    }
+
+    return stlFileStream.good();
+}
@@ -0,0 +1,61 @@
+#ifndef _PAGE_TRACE_LAYOUT_
+#define _PAGE_TRACE_LAYOUT_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <set>
+#include <vector>
+
+// Page-access trace that was captured from a real run of an embedded executable.
+// Each line of the trace file is one of the following:
+//  *module name*+*offset* or *module name* *offset*: module-relative RVA (hex) of a touched byte
+//  *rva*: executable RVA (hex) of a touched byte
+//  arena *module name* *rva*: executable RVA (hex) of the module arena in the traced run
+// Executable RVAs can only be attributed through the arena records, because the arenas of the traced build
+// need not be where this run would put them. Every build writes the records of the modules it places into
+// a sidecar file next to the output image (see SaveArenaRecords); records in the trace itself take precedence.
+// Empty lines and lines starting with '#' or ';' are ignored.
+struct pageTrace
+{
+    static const std::uint32_t pageSize = 0x1000;
+
+    bool LoadFromFile( const char *path );
+
+    // Reads the arena records of the traced build from its sidecar file. Returns false if there is none.
+    bool LoadArenaRecords( const char *path );
+
+    // Returns the amount of distinct module pages that were touched inside of the trace.
+    // Executable RVAs are mapped into the module by the arena record of the module, if there is one.
+    size_t GetModuleHotPageCount( const char *moduleFileName, std::uint32_t arenaSize ) const;
+
+    inline size_t GetEntryCount( void ) const       { return this->numEntries; }
+
+    // Executable RVAs are useless without arena records.
+    inline bool HasUnmappableEntries( void ) const  { return ( this->imagePages.empty() == false && this->tracedArenas.empty() ); }
+
+private:
+    static std::string NormalizeModuleName( const char *name, size_t nameLen );
+
+    // Module name (lower-case) to touched module page indices.
+    std::unordered_map <std::string, std::set <std::uint32_t>> modulePages;
+    // Touched executable pages.
+    std::set <std::uint32_t> imagePages;
+    // Module name (lower-case) to the executable RVA of its arena in the traced run.
+    std::unordered_map <std::string, std::uint32_t> tracedArenas;
+
+    size_t numEntries = 0;
+};
+
+// Placement of a module arena in the executable.
+struct arenaRecord
+{
+    std::string moduleName;
+    std::uint32_t arenaRVA;
+};
+
+// Writes the arena records of a build, one "arena *module name* *rva*" line per module, to the
+// sidecar file *output*.arenas. It is only read back by -pgotrace, not shown on the console.
+bool SaveArenaRecords( const char *path, const std::vector <arenaRecord>& records );
+
+#endif //_PAGE_TRACE_LAYOUT_
@@ -0,0 +1,445 @@
+#ifndef _RESOURCE_MERGE_
+#define _RESOURCE_MERGE_
+
+#include <peframework.h>
+
+#include "resourcesnapshot.h"
+#include "embedlog.h"
+
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdint>
+#include <cassert>
+
+// Embed a directory entry into the executable.
+struct resourceHelpers
+{
+    static peString <wchar_t> AppendPath( const peString <wchar_t>& curPath, peString <wchar_t> nameToAppend )
+    {
+        if ( curPath.IsEmpty() )
+        {
+            return nameToAppend;
+        }
+
+        return ( curPath + L"::" + nameToAppend );
+    }
+
+    // Resource paths are wide strings; the log is UTF-8.
+    static void WritePath( std::ostream& outStream, const peString <wchar_t>& path )
+    {
+        const wchar_t *pathStr = path.GetConstString();
+
+        for ( size_t n = 0; pathStr[n] != L'\0'; n++ )
+        {
+            std::uint32_t cp = (std::uint32_t)pathStr[n];
+
+            if ( cp < 0x80 )
+            {
+                outStream << (char)cp;
+            }
+            else if ( cp < 0x800 )
+            {
+                outStream << (char)( 0xC0 | ( cp >> 6 ) ) << (char)( 0x80 | ( cp & 0x3F ) );
+            }
+            else if ( cp < 0x10000 )
+            {
+                outStream << (char)( 0xE0 | ( cp >> 12 ) ) << (char)( 0x80 | ( ( cp >> 6 ) & 0x3F ) ) << (char)( 0x80 | ( cp & 0x3F ) );
+            }
+            else
+            {
+                outStream << (char)( 0xF0 | ( ( cp >> 18 ) & 0x07 ) ) << (char)( 0x80 | ( ( cp >> 12 ) & 0x3F ) ) << (char)( 0x80 | ( ( cp >> 6 ) & 0x3F ) ) << (char)( 0x80 | ( cp & 0x3F ) );
+            }
+        }
+    }
+
+    struct mergeStats
+    {
+        size_t numAddedTrees = 0;
+        size_t numReplacedItems = 0;
+        size_t numMergedDirs = 0;
+        size_t numClonedLeaves = 0;
+        size_t numMovedLeaves = 0;
+    };
+
+    // Lookup table of the children of a directory, built once per merged directory so that
+    // each child of the embedded directory is found in constant time.
+    struct childIndex
+    {
+        inline childIndex( const PEFile::PEResourceDir& dir )
+        {
+            dir.ForAllChildren(
+                [&]( const PEFile::PEResourceItem *item, bool hasIdentifierName )
+            {
+                // The directory that we index is the one we modify, so its items are mutable.
+                PEFile::PEResourceItem *mutableItem = const_cast <PEFile::PEResourceItem*> ( item );
+
+                if ( hasIdentifierName )
+                {
+                    this->namedItems[ std::wstring( item->name.GetConstString(), item->name.GetLength() ) ] = mutableItem;
+                }
+                else
+                {
+                    this->idItems[ item->identifier ] = mutableItem;
+                }
+            });
+        }
+
+        inline PEFile::PEResourceItem* Find( const resourceSnapshot::node& item ) const
+        {
+            if ( item.hasIdentifierName )
+            {
+                return FindNamed( item.nameKey );
+            }
+
+            return FindIdentifier( item.identifier );
+        }
+
+        inline PEFile::PEResourceItem* Find( const PEFile::PEResourceItem& item ) const
+        {
+            if ( item.hasIdentifierName )
+            {
+                return FindNamed( std::wstring( item.name.GetConstString(), item.name.GetLength() ) );
+            }
+
+            return FindIdentifier( item.identifier );
+        }
+
+    private:
+        inline PEFile::PEResourceItem* FindNamed( const std::wstring& nameKey ) const
+        {
+            auto findIter = this->namedItems.find( nameKey );
+
+            return ( findIter != this->namedItems.end() ? findIter->second : nullptr );
+        }
+
+        inline PEFile::PEResourceItem* FindIdentifier( std::uint16_t identifier ) const
+        {
+            auto findIter = this->idItems.find( identifier );
+
+            return ( findIter != this->idItems.end() ? findIter->second : nullptr );
+        }
+
+        std::unordered_map <std::wstring, PEFile::PEResourceItem*> namedItems;
+        std::unordered_map <std::uint16_t, PEFile::PEResourceItem*> idItems;
+    };
+
+    // Merges the snapshot directory toEmbed into the directory; its items replace data items of the same name.
+    // The snapshot stays untouched, only the directories of into that it runs into are modified.
+    // Every item is only printed if isVerbose, otherwise the caller prints the statistics.
+    template <typename sectResolver_t>
+    static bool EmbedResourceDirectoryInto(
+        const peString <wchar_t>& curPath, const sectResolver_t& sectResolver, PEFile::PEResourceDir& into,
+        const resourceSnapshot& snapshot, const resourceSnapshot::node& toEmbed, bool isVerbose, mergeStats& stats
+    )
+    {
+        bool hasChanged = false;
+
+        stats.numMergedDirs++;
+
+        childIndex intoChildren( into );
+
+        for ( size_t childIdx = 0; childIdx < toEmbed.numChildren; childIdx++ )
+        {
+            const resourceSnapshot::node& embedItem = snapshot.GetChild( toEmbed, childIdx );
+
+            PEFile::PEResourceItem *resItem = intoChildren.Find( embedItem );
+
+            // Paths are only needed for the output.
+            peString <wchar_t> newPath;
+
+            if ( isVerbose )
+            {
+                newPath = AppendPath( curPath, GetItemDisplayName( embedItem ) );
+            }
+
+            if ( !resItem )
+            {
+                if ( isVerbose )
+                {
+                    LogVerbose() << "* merging resource tree '";
+                    WritePath( LogVerbose(), newPath );
+                    LogVerbose() << "'" << std::endl;
+                }
+
+                // Create it if not there yet.
+                resItem = CloneResourceItem( sectResolver, snapshot, embedItem, stats );
+
+                // Simply insert this item.
+                try
+                {
+                    into.AddItem( resItem );
+                }
+                catch( ... )
+                {
+                    PEFile::PEResourceDir::DestroyItem( resItem );
+
+                    throw;
+                }
+
+                stats.numAddedTrees++;
+
+                hasChanged = true;
+            }
+            else
+            {
+                // Need to merge the two items, embedItem into resItem.
+                PEFile::PEResourceItem::eType embedItemType = embedItem.itemType;
+
+                // Two directories are merged, anything else is replaced because data is data.
+                bool wantsMerge =
+                    ( embedItemType == PEFile::PEResourceItem::eType::DIRECTORY &&
+                      resItem->itemType == PEFile::PEResourceItem::eType::DIRECTORY );
+
+                if ( !wantsMerge )
+                {
+                    // Give a warning to the user that we replace a resource.
+                    if ( isVerbose )
+                    {
+                        LogVerbose() << "* replacing resource item '";
+                        WritePath( LogVerbose(), newPath );
+                        LogVerbose() << "'" << std::endl;
+                    }
+
+                    hasChanged = true;
+
+                    into.RemoveItem( resItem );
+
+                    PEFile::PEResourceDir::DestroyItem( resItem );
+
+                    resItem = CloneResourceItem( sectResolver, snapshot, embedItem, stats );
+
+                    try
+                    {
+                        into.AddItem( resItem );
+                    }
+                    catch( ... )
+                    {
+                        PEFile::PEResourceDir::DestroyItem( resItem );
+
+                        throw;
+                    }
+
+                    stats.numReplacedItems++;
+                }
+                else
+                {
+                    PEFile::PEResourceDir *resDir = (PEFile::PEResourceDir*)resItem;
+
+                    bool subHasChanged = EmbedResourceDirectoryInto( newPath, sectResolver, *resDir, snapshot, embedItem, isVerbose, stats );
+
+                    if ( subHasChanged )
+                    {
+                        hasChanged = true;
+                    }
+                }
+            }
+        }
+
+        return hasChanged;
+    }
+
+    // Merges the directory toEmbed of a module image that is thrown away afterwards into the directory.
+    // Nothing is copied: the items are moved over, with their data references redirected in place.
+    // Used if the module resources are not shared through a snapshot, i.e. the image was not cached.
+    template <typename sectResolver_t>
+    static bool MoveResourceDirectoryInto(
+        const peString <wchar_t>& curPath, const sectResolver_t& sectResolver, PEFile::PEResourceDir& into,
+        PEFile::PEResourceDir& toEmbed, bool isVerbose, mergeStats& stats
+    )
+    {
+        bool hasChanged = false;
+
+        stats.numMergedDirs++;
+
+        childIndex intoChildren( into );
+
+        // The items are unlinked from toEmbed while we go.
+        std::vector <PEFile::PEResourceItem*> embedItems;
+
+        toEmbed.ForAllChildren(
+            [&]( const PEFile::PEResourceItem *item, bool hasIdentifierName )
+        {
+            embedItems.push_back( const_cast <PEFile::PEResourceItem*> ( item ) );
+        });
+
+        for ( PEFile::PEResourceItem *embedItem : embedItems )
+        {
+            PEFile::PEResourceItem *resItem = intoChildren.Find( *embedItem );
+
+            // Paths are only needed for the output.
+            peString <wchar_t> newPath;
+
+            if ( isVerbose )
+            {
+                newPath = AppendPath( curPath, GetItemDisplayName( *embedItem ) );
+            }
+
+            // Two directories are merged, anything else is replaced because data is data.
+            if ( resItem != nullptr &&
+                 embedItem->itemType == PEFile::PEResourceItem::eType::DIRECTORY &&
+                 resItem->itemType == PEFile::PEResourceItem::eType::DIRECTORY )
+            {
+                bool subHasChanged = MoveResourceDirectoryInto( newPath, sectResolver, *(PEFile::PEResourceDir*)resItem, *(PEFile::PEResourceDir*)embedItem, isVerbose, stats );
+
+                if ( subHasChanged )
+                {
+                    hasChanged = true;
+                }
+
+                continue;
+            }
+
+            if ( isVerbose )
+            {
+                LogVerbose() << ( resItem == nullptr ? "* merging resource tree '" : "* replacing resource item '" );
+                WritePath( LogVerbose(), newPath );
+                LogVerbose() << "'" << std::endl;
+            }
+
+            if ( resItem != nullptr )
+            {
+                into.RemoveItem( resItem );
+
+                PEFile::PEResourceDir::DestroyItem( resItem );
+
+                stats.numReplacedItems++;
+            }
+            else
+            {
+                stats.numAddedTrees++;
+            }
+
+            toEmbed.RemoveItem( embedItem );
+
+            try
+            {
+                RedirectResourceItem( sectResolver, *embedItem, stats );
+
+                into.AddItem( embedItem );
+            }
+            catch( ... )
+            {
+                PEFile::PEResourceDir::DestroyItem( embedItem );
+
+                throw;
+            }
+
+            hasChanged = true;
+        }
+
+        return hasChanged;
+    }
+
+    static peString <wchar_t> GetItemDisplayName( const PEFile::PEResourceItem& item )
+    {
+        if ( item.hasIdentifierName )
+        {
+            return item.name;
+        }
+
+        std::wstring idName = std::to_wstring( item.identifier );
+
+        return peString <wchar_t> ( idName.c_str(), idName.size() );
+    }
+
+    static peString <wchar_t> GetItemDisplayName( const resourceSnapshot::node& item )
+    {
+        if ( item.hasIdentifierName )
+        {
+            return item.name;
+        }
+
+        std::wstring idName = std::to_wstring( item.identifier );
+
+        return peString <wchar_t> ( idName.c_str(), idName.size() );
+    }
+
+    // Creates the destination items of a snapshot subtree.
+    template <typename sectResolver_t>
+    static PEFile::PEResourceItem* CloneResourceItem( const sectResolver_t& sectResolver, const resourceSnapshot& snapshot, const resourceSnapshot::node& srcItem, mergeStats& stats )
+    {
+        PEFile::PEResourceItem *itemOut = nullptr;
+
+        if ( srcItem.itemType == PEFile::PEResourceItem::eType::DATA )
+        {
+            PEFile::PESectionDataReference dataRef;
+
+            if ( srcItem.dataSect != nullptr )
+            {
+                dataRef = PEFile::PESectionDataReference( sectResolver( srcItem.dataSect ), srcItem.dataSectOffset, srcItem.dataSize );
+            }
+
+            PEFile::PEResourceInfo dataItem( srcItem.hasIdentifierName, srcItem.name, srcItem.identifier, std::move( dataRef ) );
+            dataItem.codePage = srcItem.codePage;
+            dataItem.reserved = srcItem.reserved;
+
+            itemOut = PEFile::PEResourceDir::CreateData( std::move( dataItem ) );
+
+            stats.numClonedLeaves++;
+        }
+        else if ( srcItem.itemType == PEFile::PEResourceItem::eType::DIRECTORY )
+        {
+            PEFile::PEResourceDir dirItem( srcItem.hasIdentifierName, srcItem.name, srcItem.identifier );
+            dirItem.characteristics = srcItem.characteristics;
+            dirItem.timeDateStamp = srcItem.timeDateStamp;
+            dirItem.majorVersion = srcItem.majorVersion;
+            dirItem.minorVersion = srcItem.minorVersion;
+
+            // We have to clone all sub directories.
+            for ( size_t childIdx = 0; childIdx < srcItem.numChildren; childIdx++ )
+            {
+                PEFile::PEResourceItem *newItem = CloneResourceItem( sectResolver, snapshot, snapshot.GetChild( srcItem, childIdx ), stats );
+
+                try
+                {
+                    dirItem.AddItem( newItem );
+                }
+                catch( ... )
+                {
+                    PEFile::PEResourceDir::DestroyItem( newItem );
+
+                    throw;
+                }
+            }
+
+            itemOut = PEFile::PEResourceDir::CreateDir( std::move( dirItem ) );
+        }
+        else
+        {
+            assert( 0 );
+        }
+
+        return itemOut;
+    }
+
+    // Points the data references of a moved subtree at the embedded sections.
+    template <typename sectResolver_t>
+    static void RedirectResourceItem( const sectResolver_t& sectResolver, PEFile::PEResourceItem& item, mergeStats& stats )
+    {
+        if ( item.itemType == PEFile::PEResourceItem::eType::DATA )
+        {
+            PEFile::PEResourceInfo& dataItem = (PEFile::PEResourceInfo&)item;
+
+            if ( const PEFile::PESection *srcSect = dataItem.sectRef.GetSection() )
+            {
+                dataItem.sectRef = PEFile::PESectionDataReference( sectResolver( srcSect ), dataItem.sectRef.GetSectionOffset(), dataItem.sectRef.GetDataSize() );
+            }
+
+            stats.numMovedLeaves++;
+        }
+        else if ( item.itemType == PEFile::PEResourceItem::eType::DIRECTORY )
+        {
+            PEFile::PEResourceDir& dirItem = (PEFile::PEResourceDir&)item;
+
+            dirItem.ForAllChildren(
+                [&]( const PEFile::PEResourceItem *childItem, bool hasIdentifierName )
+            {
+                RedirectResourceItem( sectResolver, *const_cast <PEFile::PEResourceItem*> ( childItem ), stats );
+            });
+        }
+    }
+};
+
+#endif //_RESOURCE_MERGE_
@@ -0,0 +1,84 @@
+#include "resourcesnapshot.h"
+
+static void FillSnapshotNode( resourceSnapshot::node& nodeOut, const PEFile::PEResourceItem& item )
+{
+    nodeOut.itemType = item.itemType;
+    nodeOut.hasIdentifierName = item.hasIdentifierName;
+    nodeOut.name = item.name;
+    nodeOut.identifier = item.identifier;
+
+    if ( item.hasIdentifierName )
+    {
+        nodeOut.nameKey.assign( item.name.GetConstString(), item.name.GetLength() );
+    }
+
+    if ( item.itemType == PEFile::PEResourceItem::eType::DIRECTORY )
+    {
+        const PEFile::PEResourceDir& dirItem = (const PEFile::PEResourceDir&)item;
+
+        nodeOut.characteristics = dirItem.characteristics;
+        nodeOut.timeDateStamp = dirItem.timeDateStamp;
+        nodeOut.majorVersion = dirItem.majorVersion;
+        nodeOut.minorVersion = dirItem.minorVersion;
+    }
+    else
+    {
+        const PEFile::PEResourceInfo& dataItem = (const PEFile::PEResourceInfo&)item;
+
+        nodeOut.dataSect = dataItem.sectRef.GetSection();
+        nodeOut.dataSectOffset = dataItem.sectRef.GetSectionOffset();
+        nodeOut.dataSize = dataItem.sectRef.GetDataSize();
+        nodeOut.codePage = dataItem.codePage;
+        nodeOut.reserved = dataItem.reserved;
+    }
+}
+
+std::shared_ptr <const resourceSnapshot> resourceSnapshot::Create( const PEFile::PEResourceDir& root )
+{
+    std::shared_ptr <resourceSnapshot> snapshot = std::make_shared <resourceSnapshot> ();
+
+    std::vector <node>& nodes = snapshot->nodes;
+
+    // Breadth-first, so that the children of every directory end up in one run.
+    struct queuedDir
+    {
+        const PEFile::PEResourceDir *dir;
+        size_t nodeIdx;
+    };
+
+    std::vector <queuedDir> dirQueue;
+
+    nodes.emplace_back();
+    FillSnapshotNode( nodes.back(), root );
+
+    dirQueue.push_back( { &root, 0 } );
+
+    for ( size_t queueIdx = 0; queueIdx < dirQueue.size(); queueIdx++ )
+    {
+        const queuedDir curDir = dirQueue[ queueIdx ];
+
+        size_t firstChild = nodes.size();
+
+        curDir.dir->ForAllChildren(
+            [&]( const PEFile::PEResourceItem *childItem, bool hasIdentifierName )
+        {
+            if ( childItem->itemType == PEFile::PEResourceItem::eType::DIRECTORY )
+            {
+                dirQueue.push_back( { (const PEFile::PEResourceDir*)childItem, nodes.size() } );
+            }
+            else
+            {
+                snapshot->numLeaves++;
+            }
+
+            nodes.emplace_back();
+            FillSnapshotNode( nodes.back(), *childItem );
+        });
+
+        node& dirNode = nodes[ curDir.nodeIdx ];
+        dirNode.firstChild = firstChild;
+        dirNode.numChildren = ( nodes.size() - firstChild );
+    }
+
+    return snapshot;
+}
@@ -0,0 +1,56 @@
+#ifndef _RESOURCE_SNAPSHOT_
+#define _RESOURCE_SNAPSHOT_
+
+#include <peframework.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Immutable copy of the resource tree of a cached module, taken once when the module is cached and then
+// shared by every executable that the module is embedded into: the embed server and -target runs keep it
+// next to the cached image, so forked jobs read the same pages. Merging never modifies it; only the
+// directories of the destination tree that a merge runs into are changed. Modules that are not cached
+// have no snapshot; their resource items are moved into the executable (resourceHelpers).
+// Data leaves point into the sections of the module image, which has to outlive the snapshot's use.
+struct resourceSnapshot
+{
+    struct node
+    {
+        PEFile::PEResourceItem::eType itemType;
+        bool hasIdentifierName;
+        peString <wchar_t> name;
+        std::wstring nameKey;               // lookup key of named items.
+        std::uint16_t identifier;
+
+        // Directories; the children are stored next to each other.
+        std::uint32_t characteristics = 0;
+        std::uint32_t timeDateStamp = 0;
+        std::uint16_t majorVersion = 0;
+        std::uint16_t minorVersion = 0;
+        size_t firstChild = 0;
+        size_t numChildren = 0;
+
+        // Data.
+        const PEFile::PESection *dataSect = nullptr;
+        std::uint32_t dataSectOffset = 0;
+        std::uint32_t dataSize = 0;
+        std::uint32_t codePage = 0;
+        std::uint32_t reserved = 0;
+    };
+
+    static std::shared_ptr <const resourceSnapshot> Create( const PEFile::PEResourceDir& root );
+
+    inline const node& GetRoot( void ) const                        { return this->nodes[ 0 ]; }
+    inline const node& GetChild( const node& dir, size_t idx ) const { return this->nodes[ dir.firstChild + idx ]; }
+
+    inline bool IsEmpty( void ) const                               { return ( this->nodes[ 0 ].numChildren == 0 ); }
+    inline size_t GetLeafCount( void ) const                        { return this->numLeaves; }
+
+private:
+    std::vector <node> nodes;               // the root directory comes first.
+    size_t numLeaves = 0;
+};
+
+#endif //_RESOURCE_SNAPSHOT_
@@ -0,0 +1,473 @@
+#include "sectpack.h"
+
+#include "lzcodec.h"
+
+#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// The unpack table is a list of entries, terminated by one with zero size.
+struct unpackTableEntry
+{
+    std::uint32_t packedDataRVA;
+    std::uint32_t targetRVA;
+    std::uint32_t targetSize;
+    std::uint32_t protectSize;          // page-aligned virtual size, 0 if the section stays writable.
+    std::uint32_t steadyProtection;     // VirtualProtect constant after startup.
+};
+
+void EmitSectionUnpacker( asmjit::X86Assembler& x86_asm, std::uint64_t imageBase, asmjit::Label& tableRVAEndLabel )
+{
+    using namespace asmjit;
+
+    // Keep every register of the process startup state.
+    x86_asm.push( x86_asm.zax() );
+    x86_asm.push( x86_asm.zbx() );
+    x86_asm.push( x86_asm.zcx() );
+    x86_asm.push( x86_asm.zdx() );
+    x86_asm.push( x86_asm.zsi() );
+    x86_asm.push( x86_asm.zdi() );
+    x86_asm.push( x86_asm.zbp() );
+
+    // zbp walks the unpack table; the RVA is filled in once the packed section is placed.
+    tableRVAEndLabel = x86_asm.newLabel();
+
+    x86_asm.mov( x86::ebp, Imm( 0 ) );
+    x86_asm.bind( tableRVAEndLabel );
+    x86_asm.mov( x86_asm.zax(), Imm( (std::int64_t)imageBase ) );
+    x86_asm.add( x86_asm.zbp(), x86_asm.zax() );
+
+    Label tableLoop = x86_asm.newLabel();
+    Label tableDone = x86_asm.newLabel();
+    Label decodeLoop = x86_asm.newLabel();
+    Label entryDone = x86_asm.newLabel();
+    Label litExtra = x86_asm.newLabel();
+    Label litReady = x86_asm.newLabel();
+    Label litCopy = x86_asm.newLabel();
+    Label litDone = x86_asm.newLabel();
+    Label matchExtra = x86_asm.newLabel();
+    Label matchReady = x86_asm.newLabel();
+    Label matchCopy = x86_asm.newLabel();
+
+    x86_asm.bind( tableLoop );
+    x86_asm.mov( x86::ebx, x86::dword_ptr( x86_asm.zbp(), offsetof(unpackTableEntry, targetSize) ) );
+    x86_asm.test( x86::ebx, x86::ebx );
+    x86_asm.jz( tableDone );
+
+    // zsi = packed data, zdi = output, zbx = output end.
+    x86_asm.mov( x86::esi, x86::dword_ptr( x86_asm.zbp(), offsetof(unpackTableEntry, packedDataRVA) ) );
+    x86_asm.mov( x86::edi, x86::dword_ptr( x86_asm.zbp(), offsetof(unpackTableEntry, targetRVA) ) );
+    x86_asm.mov( x86_asm.zax(), Imm( (std::int64_t)imageBase ) );
+    x86_asm.add( x86_asm.zsi(), x86_asm.zax() );
+    x86_asm.add( x86_asm.zdi(), x86_asm.zax() );
+    x86_asm.add( x86_asm.zbx(), x86_asm.zdi() );
+
+    // Decode one LZ sequence per iteration (see lzcodec.h).
+    x86_asm.bind( decodeLoop );
+    x86_asm.cmp( x86_asm.zdi(), x86_asm.zbx() );
+    x86_asm.jae( entryDone );
+
+    x86_asm.movzx( x86::eax, x86::byte_ptr( x86_asm.zsi() ) );
+    x86_asm.inc( x86_asm.zsi() );
+    x86_asm.mov( x86::ecx, x86::eax );
+    x86_asm.shr( x86::ecx, 4 );
+    x86_asm.cmp( x86::ecx, 15 );
+    x86_asm.jne( litReady );
+
+    x86_asm.bind( litExtra );
+    x86_asm.movzx( x86::edx, x86::byte_ptr( x86_asm.zsi() ) );
+    x86_asm.inc( x86_asm.zsi() );
+    x86_asm.add( x86::ecx, x86::edx );
+    x86_asm.cmp( x86::edx, 255 );
+    x86_asm.je( litExtra );
+
+    x86_asm.bind( litReady );
+    x86_asm.push( x86_asm.zax() );
+    x86_asm.test( x86::ecx, x86::ecx );
+    x86_asm.jz( litDone );
+
+    x86_asm.bind( litCopy );
+    x86_asm.mov( x86::al, x86::byte_ptr( x86_asm.zsi() ) );
+    x86_asm.mov( x86::byte_ptr( x86_asm.zdi() ), x86::al );
+    x86_asm.inc( x86_asm.zsi() );
+    x86_asm.inc( x86_asm.zdi() );
+    x86_asm.dec( x86::ecx );
+    x86_asm.jnz( litCopy );
+
+    x86_asm.bind( litDone );
+    x86_asm.pop( x86_asm.zax() );
+    x86_asm.cmp( x86_asm.zdi(), x86_asm.zbx() );
+    x86_asm.jae( entryDone );
+
+    x86_asm.movzx( x86::edx, x86::word_ptr( x86_asm.zsi() ) );
+    x86_asm.add( x86_asm.zsi(), 2 );
+    x86_asm.mov( x86::ecx, x86::eax );
+    x86_asm.and_( x86::ecx, 15 );
+    x86_asm.cmp( x86::ecx, 15 );
+    x86_asm.jne( matchReady );
+
+    x86_asm.bind( matchExtra );
+    x86_asm.movzx( x86::eax, x86::byte_ptr( x86_asm.zsi() ) );
+    x86_asm.inc( x86_asm.zsi() );
+    x86_asm.add( x86::ecx, x86::eax );
+    x86_asm.cmp( x86::eax, 255 );
+    x86_asm.je( matchExtra );
+
+    x86_asm.bind( matchReady );
+    x86_asm.add( x86::ecx, 4 );
+
+    // zdx = output - offset; copied byte-wise because the match may overlap the output.
+    x86_asm.neg( x86_asm.zdx() );
+    x86_asm.add( x86_asm.zdx(), x86_asm.zdi() );
+
+    x86_asm.bind( matchCopy );
+    x86_asm.mov( x86::al, x86::byte_ptr( x86_asm.zdx() ) );
+    x86_asm.mov( x86::byte_ptr( x86_asm.zdi() ), x86::al );
+    x86_asm.inc( x86_asm.zdx() );
+    x86_asm.inc( x86_asm.zdi() );
+    x86_asm.dec( x86::ecx );
+    x86_asm.jnz( matchCopy );
+    x86_asm.jmp( decodeLoop );
+
+    x86_asm.bind( entryDone );
+    x86_asm.add( x86_asm.zbp(), (std::uint32_t)sizeof(unpackTableEntry) );
+    x86_asm.jmp( tableLoop );
+
+    x86_asm.bind( tableDone );
+    x86_asm.pop( x86_asm.zbp() );
+    x86_asm.pop( x86_asm.zdi() );
+    x86_asm.pop( x86_asm.zsi() );
+    x86_asm.pop( x86_asm.zdx() );
+    x86_asm.pop( x86_asm.zcx() );
+    x86_asm.pop( x86_asm.zbx() );
+    x86_asm.pop( x86_asm.zax() );
+}
+
+void EmitPackedSectionReprotection(
+    asmjit::X86Assembler& x86_asm, std::uint64_t imageBase, const asmjit::X86Mem& fVirtualProtect, asmjit::Label& tableRVAEndLabel
+)
+{
+    using namespace asmjit;
+
+    bool is64Bit = ( x86_asm.getArchInfo().getType() == ArchInfo::kTypeX64 );
+
+    // zsi walks the unpack table, zbx holds the image base; both survive the calls.
+    x86_asm.push( x86_asm.zbx() );
+    x86_asm.push( x86_asm.zsi() );
+
+    // Register spill space and the old protection; keeps the stack aligned.
+    if ( is64Bit )
+    {
+        x86_asm.sub( x86::rsp, 0x30 );
+    }
+    else
+    {
+        x86_asm.sub( x86::esp, 4 );
+    }
+
+    tableRVAEndLabel = x86_asm.newLabel();
+
+    x86_asm.mov( x86::esi, Imm( 0 ) );
+    x86_asm.bind( tableRVAEndLabel );
+    x86_asm.mov( x86_asm.zbx(), Imm( (std::int64_t)imageBase ) );
+    x86_asm.add( x86_asm.zsi(), x86_asm.zbx() );
+
+    Label tableLoop = x86_asm.newLabel();
+    Label tableDone = x86_asm.newLabel();
+    Label entryDone = x86_asm.newLabel();
+
+    x86_asm.bind( tableLoop );
+    x86_asm.mov( x86::edx, x86::dword_ptr( x86_asm.zsi(), offsetof(unpackTableEntry, targetSize) ) );
+    x86_asm.test( x86::edx, x86::edx );
+    x86_asm.jz( tableDone );
+
+    x86_asm.mov( x86::edx, x86::dword_ptr( x86_asm.zsi(), offsetof(unpackTableEntry, protectSize) ) );
+    x86_asm.test( x86::edx, x86::edx );
+    x86_asm.jz( entryDone );
+
+    x86_asm.mov( x86::eax, x86::dword_ptr( x86_asm.zsi(), offsetof(unpackTableEntry, steadyProtection) ) );
+    x86_asm.mov( x86::ecx, x86::dword_ptr( x86_asm.zsi(), offsetof(unpackTableEntry, targetRVA) ) );
+    x86_asm.add( x86_asm.zcx(), x86_asm.zbx() );
+
+    if ( is64Bit )
+    {
+        x86_asm.mov( x86::r8, x86::rax );
+        x86_asm.lea( x86::r9, x86::ptr( x86::rsp, 0x20 ) );
+    }
+    else
+    {
+        x86_asm.push( x86::esp );
+        x86_asm.push( x86::eax );
+        x86_asm.push( x86::edx );
+        x86_asm.push( x86::ecx );
+    }
+
+    x86_asm.call( fVirtualProtect );
+
+    x86_asm.bind( entryDone );
+    x86_asm.add( x86_asm.zsi(), (std::uint32_t)sizeof(unpackTableEntry) );
+    x86_asm.jmp( tableLoop );
+
+    x86_asm.bind( tableDone );
+
+    if ( is64Bit )
+    {
+        x86_asm.add( x86::rsp, 0x30 );
+    }
+    else
+    {
+        x86_asm.add( x86::esp, 4 );
+    }
+
+    x86_asm.pop( x86_asm.zsi() );
+    x86_asm.pop( x86_asm.zbx() );
+}
+
+template <typename refType>
+static inline void AddReferencedSection( std::unordered_set <const PEFile::PESection*>& sectsOut, const refType& ref )
+{
+    if ( const PEFile::PESection *sect = ref.GetSection() )
+    {
+        sectsOut.insert( sect );
+    }
+}
+
+static void GatherResourceSections( std::unordered_set <const PEFile::PESection*>& sectsOut, const PEFile::PEResourceDir& dir )
+{
+    dir.ForAllChildren(
+        [&]( const PEFile::PEResourceItem *item, bool hasIdentifierName )
+    {
+        if ( item->itemType == PEFile::PEResourceItem::eType::DATA )
+        {
+            AddReferencedSection( sectsOut, ( (const PEFile::PEResourceInfo*)item )->sectRef );
+        }
+        else if ( item->itemType == PEFile::PEResourceItem::eType::DIRECTORY )
+        {
+            GatherResourceSections( sectsOut, *(const PEFile::PEResourceDir*)item );
+        }
+    });
+}
+
+// Sections that the loader or the system read before our entry point has run.
+static void GatherLoaderSections( PEFile& image, std::unordered_set <const PEFile::PESection*>& sectsOut )
+{
+    for ( const PEFile::PEImportDesc& impDesc : image.imports )
+    {
+        AddReferencedSection( sectsOut, impDesc.firstThunkRef );
+        AddReferencedSection( sectsOut, impDesc.DLLName_allocEntry );
+        AddReferencedSection( sectsOut, impDesc.impNameArrayAllocEntry );
+
+        for ( const PEFile::PEImportDesc::importFunc& func : impDesc.funcs )
+        {
+            AddReferencedSection( sectsOut, func.nameAllocEntry );
+        }
+    }
+
+    for ( const PEFile::PEDelayLoadDesc& delayDesc : image.delayLoads )
+    {
+        AddReferencedSection( sectsOut, delayDesc.IATRef );
+        AddReferencedSection( sectsOut, delayDesc.DLLName_allocEntry );
+        AddReferencedSection( sectsOut, delayDesc.DLLHandleAlloc );
+        AddReferencedSection( sectsOut, delayDesc.importNamesAllocEntry );
+        AddReferencedSection( sectsOut, delayDesc.boundImportAddrTableRef );
+        AddReferencedSection( sectsOut, delayDesc.unloadInfoTableRef );
+    }
+
+    AddReferencedSection( sectsOut, image.tlsInfo.startOfRawDataRef );
+    AddReferencedSection( sectsOut, image.tlsInfo.endOfRawDataRef );
+    AddReferencedSection( sectsOut, image.tlsInfo.addressOfIndexRef );
+    AddReferencedSection( sectsOut, image.tlsInfo.addressOfCallbacksRef );
+    AddReferencedSection( sectsOut, image.tlsInfo.allocEntry );
+
+    GatherResourceSections( sectsOut, image.resourceRoot );
+
+    // Other modules may resolve our exports while they initialize.
+    AddReferencedSection( sectsOut, image.exportDir.allocEntry );
+    AddReferencedSection( sectsOut, image.exportDir.funcAddressAllocEntry );
+    AddReferencedSection( sectsOut, image.exportDir.funcNamesAllocEntry );
+
+    for ( const PEFile::PEExportDir::func& expFunc : image.exportDir.functions )
+    {
+        AddReferencedSection( sectsOut, expFunc.expRef );
+    }
+}
+
+bool PackEmbeddedSections(
+    PEFile& image, const std::vector <PEFile::PESectionReference>& sections,
+    PEFile::PESection *stubSect, const std::vector <std::uint32_t>& tableRVAOffsets,
+    sectionProtectionPolicy *protectionPolicy, sectionPackStats& statsOut
+)
+{
+    std::unordered_set <const PEFile::PESection*> loaderSects;
+
+    GatherLoaderSections( image, loaderSects );
+
+    // Only worth it if at least one unit of file alignment is saved.
+    std::uint32_t fileAlignment = std::max( image.GetFileAlignment(), 0x200u );
+
+    struct packedSection
+    {
+        PEFile::PESection *sect;
+        std::uint32_t packedDataOffset;
+        std::uint32_t targetSize;
+    };
+
+    std::vector <packedSection> packedSects;
+    std::vector <char> packedData;
+
+    sectionPackStats stats;
+
+    std::unordered_set <const PEFile::PESection*> visitedSects;
+
+    std::vector <char> checkBuf;
+    std::chrono::steady_clock::duration decodeTime( 0 );
+
+    for ( const PEFile::PESectionReference& sectRef : sections )
+    {
+        PEFile::PESection *sect = sectRef.GetSection();
+
+        // Folded read-only sections are listed once per module.
+        if ( sect == nullptr || visitedSects.insert( sect ).second == false )
+        {
+            continue;
+        }
+
+        size_t rawSize = (size_t)sect->stream.Size();
+
+        if ( rawSize == 0 )
+        {
+            continue;
+        }
+
+        if ( loaderSects.find( sect ) != loaderSects.end() )
+        {
+            stats.numSkippedSections++;
+            continue;
+        }
+
+        std::vector <char> compressed;
+
+        LZCompress( sect->stream.Data(), rawSize, compressed );
+
+        if ( compressed.size() + fileAlignment > rawSize )
+        {
+            stats.numSkippedSections++;
+            continue;
+        }
+
+        // Prove that the block decodes before we throw away the raw data.
+        checkBuf.resize( rawSize );
+
+        auto decodeStartTime = std::chrono::steady_clock::now();
+
+        bool isDecodable = LZDecompress( compressed.data(), compressed.size(), checkBuf.data(), rawSize );
+
+        decodeTime += ( std::chrono::steady_clock::now() - decodeStartTime );
+
+        if ( !isDecodable || memcmp( checkBuf.data(), sect->stream.Data(), rawSize ) != 0 )
+        {
+            return false;
+        }
+
+        packedSects.push_back( { sect, (std::uint32_t)packedData.size(), (std::uint32_t)rawSize } );
+
+        packedData.insert( packedData.end(), compressed.begin(), compressed.end() );
+
+        stats.numPackedSections++;
+        stats.numRawBytes += rawSize;
+        stats.numPackedBytes += compressed.size();
+    }
+
+    // The table is always present because the unpacker has been generated already.
+    std::uint32_t tableSize = (std::uint32_t)( ( packedSects.size() + 1 ) * sizeof(unpackTableEntry) );
+
+    PEFile::PESection packSect;
+    packSect.shortName = ".pack";
+    packSect.chars.sect_containsCode = false;
+    packSect.chars.sect_containsInitData = true;
+    packSect.chars.sect_containsUninitData = false;
+    packSect.chars.sect_mem_farData = false;
+    packSect.chars.sect_mem_purgeable = false;
+    packSect.chars.sect_mem_locked = false;
+    packSect.chars.sect_mem_preload = false;
+    packSect.chars.sect_mem_discardable = false;
+    packSect.chars.sect_mem_not_cached = false;
+    packSect.chars.sect_mem_not_paged = false;
+    packSect.chars.sect_mem_shared = false;
+    packSect.chars.sect_mem_execute = false;
+    packSect.chars.sect_mem_read = true;
+    packSect.chars.sect_mem_write = false;
+    packSect.stream.Truncate( (std::int32_t)( tableSize + packedData.size() ) );
+
+    if ( packedData.empty() == false )
+    {
+        memcpy( (char*)packSect.stream.Data() + tableSize, packedData.data(), packedData.size() );
+    }
+
+    packSect.Finalize();
+
+    PEFile::PESection *placedPackSect = image.AddSection( std::move( packSect ) );
+
+    if ( placedPackSect == nullptr )
+    {
+        return false;
+    }
+
+    std::uint32_t packRVA = placedPackSect->GetVirtualAddress();
+
+    placedPackSect->stream.Seek( 0 );
+
+    for ( const packedSection& info : packedSects )
+    {
+        placedPackSect->stream.WriteUInt32( packRVA + tableSize + info.packedDataOffset );
+        placedPackSect->stream.WriteUInt32( info.sect->GetVirtualAddress() );
+        placedPackSect->stream.WriteUInt32( info.targetSize );
+
+        // The contents come from the unpacker now; the virtual size stays reserved.
+        info.sect->stream.Truncate( 0 );
+
+        std::uint32_t steadyProtection = 0;
+
+        if ( protectionPolicy != nullptr )
+        {
+            steadyProtection = protectionPolicy->RequireUnpackWrite( info.sect );
+        }
+        else
+        {
+            info.sect->chars.sect_mem_write = true;
+        }
+
+        std::uint32_t protectSize = 0;
+
+        if ( steadyProtection != 0 )
+        {
+            protectSize = ( ( info.sect->GetVirtualSize() + 0xFFF ) & ~0xFFFu );
+        }
+
+        placedPackSect->stream.WriteUInt32( protectSize );
+        placedPackSect->stream.WriteUInt32( steadyProtection );
+    }
+
+    placedPackSect->stream.WriteUInt32( 0 );
+    placedPackSect->stream.WriteUInt32( 0 );
+    placedPackSect->stream.WriteUInt32( 0 );
+    placedPackSect->stream.WriteUInt32( 0 );
+    placedPackSect->stream.WriteUInt32( 0 );
+
+    for ( std::uint32_t tableRVAOffset : tableRVAOffsets )
+    {
+        stubSect->stream.Seek( (std::int32_t)tableRVAOffset );
+        stubSect->stream.WriteUInt32( packRVA );
+    }
+
+    double decodeSeconds = std::chrono::duration <double> ( decodeTime ).count();
+
+    if ( decodeSeconds > 0 )
+    {
+        stats.decodeMegabytesPerSecond = ( (double)stats.numRawBytes / ( 1024.0 * 1024.0 ) / decodeSeconds );
+    }
+
+    statsOut = stats;
+    return true;
+}
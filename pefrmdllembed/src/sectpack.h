@@ -0,0 +1,47 @@
+#ifndef _SECTION_PACKER_
+#define _SECTION_PACKER_
+
+#include <peframework.h>
+#define ASMJIT_STATIC
+#include <asmjit/asmjit.h>
+
+#undef ABSOLUTE
+
+#include "sectpolicy.h"
+
+#include <cstdint>
+#include <vector>
+
+// Generates the unpacker at the current position of the entry stub. It inflates every packed section
+// into its virtual range, so it has to run before anything touches module memory. Since the unpacker
+// addresses memory by the preferred image base, packing requires an image without relocations.
+// The RVA of the unpack table is not known yet; it is a 32bit immediate that ends at tableRVAEndLabel.
+void EmitSectionUnpacker( asmjit::X86Assembler& x86_asm, std::uint64_t imageBase, asmjit::Label& tableRVAEndLabel );
+
+// Generates the calls that give the packed sections their steady protection, once the entry stub is done
+// writing module memory. Walks the unpack table like the unpacker; its RVA is patched in the same way.
+void EmitPackedSectionReprotection(
+    asmjit::X86Assembler& x86_asm, std::uint64_t imageBase, const asmjit::X86Mem& fVirtualProtect, asmjit::Label& tableRVAEndLabel
+);
+
+struct sectionPackStats
+{
+    size_t numPackedSections = 0;
+    size_t numSkippedSections = 0;      // sections that the loader reads or that did not shrink.
+    std::uint64_t numRawBytes = 0;
+    std::uint64_t numPackedBytes = 0;
+    double decodeMegabytesPerSecond = 0;
+};
+
+// Compresses the given sections into a new packed section and stores its table RVA at
+// each of tableRVAOffsets in stubSect. Sections that the loader accesses before the entry point
+// (import address tables, import names, TLS, resources, exports) stay uncompressed.
+// Packed sections keep their virtual size and become writable. With a protection policy, the
+// ones that were read-only are protected again by EmitPackedSectionReprotection.
+bool PackEmbeddedSections(
+    PEFile& image, const std::vector <PEFile::PESectionReference>& sections,
+    PEFile::PESection *stubSect, const std::vector <std::uint32_t>& tableRVAOffsets,
+    sectionProtectionPolicy *protectionPolicy, sectionPackStats& statsOut
+);
+
+#endif //_SECTION_PACKER_
@@ -0,0 +1,162 @@
+#include "sectpolicy.h"
+
+#include "sectpack.h"
+
+// Memory protection constants of VirtualProtect.
+#define _PAGE_READONLY          0x02
+#define _PAGE_EXECUTE_READ      0x20
+
+static const std::uint32_t policyPageSize = 0x1000;
+
+static inline std::uint32_t GetSectionPageCount( const PEFile::PESection *sect )
+{
+    return ( ( sect->GetVirtualSize() + policyPageSize - 1 ) / policyPageSize );
+}
+
+static inline std::uint32_t GetSteadyProtection( const PEFile::PESection *sect )
+{
+    return ( sect->chars.sect_mem_execute ? _PAGE_EXECUTE_READ : _PAGE_READONLY );
+}
+
+void sectionProtectionPolicy::RequireStartupWrite( PEFile::PESection *sect )
+{
+    if ( sect == nullptr || sect->chars.sect_mem_write )
+    {
+        return;
+    }
+
+    sect->chars.sect_mem_write = true;
+
+    this->startupWritable.push_back( sect );
+    this->startupWritableSet.insert( sect );
+}
+
+std::uint32_t sectionProtectionPolicy::RequireUnpackWrite( PEFile::PESection *sect )
+{
+    // Writable sections are either writable for good or protected by the stub already.
+    if ( sect->chars.sect_mem_write )
+    {
+        return 0;
+    }
+
+    sect->chars.sect_mem_write = true;
+
+    this->startupWritableSet.insert( sect );
+
+    return GetSteadyProtection( sect );
+}
+
+void sectionProtectionPolicy::EmitReprotection( asmjit::X86Assembler& x86_asm, PEFile& image, asmjit::Label *unpackTableRVAEndLabel ) const
+{
+    using namespace asmjit;
+
+    if ( this->startupWritable.empty() && unpackTableRVAEndLabel == nullptr )
+    {
+        return;
+    }
+
+    bool is64Bit = ( x86_asm.getArchInfo().getType() == ArchInfo::kTypeX64 );
+
+    std::uint32_t thunkEntrySize = ( image.isExtendedFormat ? 8 : 4 );
+
+    PEFile::PESection protSection;
+    protSection.shortName = ".sprot";
+    protSection.chars.sect_mem_read = true;
+    protSection.chars.sect_mem_write = true;
+
+    PEFile::PESectionAllocation utilThunk;
+    {
+        PEFile::PEImportDesc utilImports;
+        utilImports.DLLName = "KERNEL32.DLL";
+        {
+            PEFile::PEImportDesc::importFunc fVirtualProtect;
+            fVirtualProtect.name = "VirtualProtect";
+            fVirtualProtect.isOrdinalImport = false;
+            fVirtualProtect.ordinal_hint = 0;
+            utilImports.funcs.AddToBack( std::move( fVirtualProtect ) );
+        }
+
+        protSection.Allocate( utilThunk, thunkEntrySize, thunkEntrySize );
+
+        utilImports.firstThunkRef = utilThunk;
+
+        image.imports.AddToBack( std::move( utilImports ) );
+    }
+
+    protSection.Finalize();
+
+    image.AddSection( std::move( protSection ) );
+
+    X86Mem fVirtualProtect( utilThunk.ResolveOffset( 0 ), thunkEntrySize );
+
+    // Space for the old protection.
+    if ( is64Bit )
+    {
+        x86_asm.sub( x86::rsp, 16 );
+    }
+    else
+    {
+        x86_asm.sub( x86::esp, 4 );
+    }
+
+    for ( const PEFile::PESection *sect : this->startupWritable )
+    {
+        std::uint32_t newProtect = GetSteadyProtection( sect );
+        std::uint32_t protSize = ( GetSectionPageCount( sect ) * policyPageSize );
+
+        if ( is64Bit )
+        {
+            x86_asm.mov( x86::rcx, Imm( sect->GetVirtualAddress(), true ) );
+            x86_asm.mov( x86::rdx, protSize );
+            x86_asm.mov( x86::r8, newProtect );
+            x86_asm.lea( x86::r9, x86::ptr( x86::rsp, 0x20 ) );
+        }
+        else
+        {
+            x86_asm.push( x86::esp );
+            x86_asm.push( newProtect );
+            x86_asm.push( protSize );
+            x86_asm.push( Imm( sect->GetVirtualAddress(), true ) );
+        }
+
+        x86_asm.call( fVirtualProtect );
+    }
+
+    if ( is64Bit )
+    {
+        x86_asm.add( x86::rsp, 16 );
+    }
+    else
+    {
+        x86_asm.add( x86::esp, 4 );
+    }
+
+    if ( unpackTableRVAEndLabel != nullptr )
+    {
+        EmitPackedSectionReprotection( x86_asm, image.GetImageBase(), fVirtualProtect, *unpackTableRVAEndLabel );
+    }
+}
+
+void CountWritablePages( PEFile& image, const sectionProtectionPolicy& policy, writablePageStats& statsOut )
+{
+    PEFile::sectionIter_t iter = image.GetSectionIterator();
+
+    for ( ; !iter.IsEnd(); iter.Increment() )
+    {
+        const PEFile::PESection *sect = iter.Resolve();
+
+        if ( sect->chars.sect_mem_write == false )
+        {
+            continue;
+        }
+
+        std::uint32_t numPages = GetSectionPageCount( sect );
+
+        statsOut.numLoadWritablePages += numPages;
+
+        if ( !policy.IsStartupWritable( sect ) )
+        {
+            statsOut.numSteadyWritablePages += numPages;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef _SECTION_POLICY_
+#define _SECTION_POLICY_
+
+#include <peframework.h>
+#define ASMJIT_STATIC
+#include <asmjit/asmjit.h>
+
+#undef ABSOLUTE
+
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Embedded sections keep the characteristics of the module, except where the loader or the entry stub have
+// to write into them: the loader fills import address tables that now lie in module sections outside of the
+// IAT directory, the stub writes the TLS index of each module and the unpacker fills packed sections. Such
+// sections are writable in the headers. With -reprotect, the stub protects them again once it is done, so
+// that in the steady state only pages that the module itself writes to are writable. Base relocations need
+// no write access; the loader unprotects for them. Delay-load import address tables stay writable, because
+// the delay helper writes them at call time. Protection is per section; sections are not split into ranges.
+struct sectionProtectionPolicy
+{
+    // Grants write access until the end of the entry stub. Sections that are writable already are left alone.
+    void RequireStartupWrite( PEFile::PESection *sect );
+
+    inline size_t GetStartupWritableCount( void ) const     { return this->startupWritable.size(); }
+
+    inline bool IsStartupWritable( const PEFile::PESection *sect ) const
+    {
+        return ( this->startupWritableSet.find( sect ) != this->startupWritableSet.end() );
+    }
+
+    // Grants write access to a packed section for the unpacker. Returns the steady protection that the
+    // unpack table has to carry for it, or 0 if the section stays writable.
+    std::uint32_t RequireUnpackWrite( PEFile::PESection *sect );
+
+    // Adds the .sprot section with the VirtualProtect import and generates the calls that give the
+    // startup-writable sections their steady protection back, at the current position of the entry stub.
+    // If sections are packed, unpackTableRVAEndLabel receives the label of the unpack table RVA to patch.
+    void EmitReprotection( asmjit::X86Assembler& x86_asm, PEFile& image, asmjit::Label *unpackTableRVAEndLabel ) const;
+
+private:
+    // Sections that are protected by calls of their own. Packed sections are only in the set;
+    // they are protected through the unpack table, which is written after the stub.
+    std::vector <PEFile::PESection*> startupWritable;
+    std::unordered_set <const PEFile::PESection*> startupWritableSet;
+};
+
+struct writablePageStats
+{
+    std::uint32_t numLoadWritablePages = 0;     // writable according to the section headers.
+    std::uint32_t numSteadyWritablePages = 0;   // still writable after the entry stub.
+};
+
+void CountWritablePages( PEFile& image, const sectionProtectionPolicy& policy, writablePageStats& statsOut );
+
+#endif //_SECTION_POLICY_
@@ -0,0 +1,550 @@
+#include "sigpatch.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <cstring>
+
+static inline int HexDigitValue( char c )
+{
+    if ( c >= '0' && c <= '9' )
+    {
+        return ( c - '0' );
+    }
+    if ( c >= 'a' && c <= 'f' )
+    {
+        return ( c - 'a' + 10 );
+    }
+    if ( c >= 'A' && c <= 'F' )
+    {
+        return ( c - 'A' + 10 );
+    }
+    return -1;
+}
+
+bool bytePattern::Parse( const std::string& desc, bytePattern& patOut )
+{
+    std::istringstream tokenStream( desc );
+
+    std::string token;
+
+    patOut.bytes.clear();
+    patOut.isWildcard.clear();
+
+    while ( tokenStream >> token )
+    {
+        if ( token == "?" || token == "??" )
+        {
+            patOut.bytes.push_back( 0 );
+            patOut.isWildcard.push_back( true );
+        }
+        else if ( token.size() == 2 )
+        {
+            int hi = HexDigitValue( token[0] );
+            int lo = HexDigitValue( token[1] );
+
+            if ( hi < 0 || lo < 0 )
+            {
+                return false;
+            }
+
+            patOut.bytes.push_back( (std::uint8_t)( hi * 16 + lo ) );
+            patOut.isWildcard.push_back( false );
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return ( patOut.bytes.empty() == false );
+}
+
+bool multiPatternScanner::AddPattern( const bytePattern& pattern, size_t& indexOut )
+{
+    // Find the longest run of literal bytes.
+    size_t bestOffset = 0;
+    size_t bestLength = 0;
+
+    size_t patLen = pattern.GetLength();
+    size_t runStart = 0;
+
+    for ( size_t n = 0; n <= patLen; n++ )
+    {
+        if ( n == patLen || pattern.isWildcard[n] )
+        {
+            size_t runLength = ( n - runStart );
+
+            if ( runLength > bestLength )
+            {
+                bestOffset = runStart;
+                bestLength = runLength;
+            }
+
+            runStart = ( n + 1 );
+        }
+    }
+
+    if ( bestLength == 0 )
+    {
+        return false;
+    }
+
+    anchoredPattern info;
+    info.pattern = pattern;
+    info.anchorOffset = bestOffset;
+    info.anchorLength = bestLength;
+
+    indexOut = this->patterns.size();
+
+    this->patterns.push_back( std::move( info ) );
+    return true;
+}
+
+void multiPatternScanner::Build( void )
+{
+    // Build the trie of all anchors.
+    std::vector <std::int32_t> trieNext( 256, -1 );
+    std::vector <std::vector <size_t>> outputs( 1 );
+
+    size_t numPatterns = this->patterns.size();
+
+    for ( size_t patIdx = 0; patIdx < numPatterns; patIdx++ )
+    {
+        const anchoredPattern& info = this->patterns[ patIdx ];
+
+        std::int32_t node = 0;
+
+        for ( size_t n = 0; n < info.anchorLength; n++ )
+        {
+            std::uint8_t c = info.pattern.bytes[ info.anchorOffset + n ];
+
+            std::int32_t& next = trieNext[ (size_t)node * 256 + c ];
+
+            if ( next < 0 )
+            {
+                std::int32_t newNode = (std::int32_t)outputs.size();
+
+                // The reference could be invalidated by the resize.
+                trieNext[ (size_t)node * 256 + c ] = newNode;
+
+                trieNext.resize( trieNext.size() + 256, -1 );
+                outputs.emplace_back();
+
+                node = newNode;
+            }
+            else
+            {
+                node = next;
+            }
+        }
+
+        outputs[ node ].push_back( patIdx );
+    }
+
+    // Turn the trie into a complete automaton, breadth-first so that failure states are finished first.
+    size_t numNodes = outputs.size();
+
+    std::vector <std::int32_t> failLinks( numNodes, 0 );
+    std::deque <std::int32_t> queue;
+
+    for ( unsigned int c = 0; c < 256; c++ )
+    {
+        std::int32_t& next = trieNext[c];
+
+        if ( next < 0 )
+        {
+            next = 0;
+        }
+        else
+        {
+            failLinks[ next ] = 0;
+            queue.push_back( next );
+        }
+    }
+
+    while ( queue.empty() == false )
+    {
+        std::int32_t node = queue.front();
+        queue.pop_front();
+
+        std::int32_t failNode = failLinks[ node ];
+
+        // Matches of suffixes are matches of this node aswell.
+        const std::vector <size_t>& failOutputs = outputs[ failNode ];
+        outputs[ node ].insert( outputs[ node ].end(), failOutputs.begin(), failOutputs.end() );
+
+        for ( unsigned int c = 0; c < 256; c++ )
+        {
+            std::int32_t& next = trieNext[ (size_t)node * 256 + c ];
+
+            std::int32_t failNext = trieNext[ (size_t)failNode * 256 + c ];
+
+            if ( next < 0 )
+            {
+                next = failNext;
+            }
+            else
+            {
+                failLinks[ next ] = failNext;
+                queue.push_back( next );
+            }
+        }
+    }
+
+    this->transitions = std::move( trieNext );
+    this->nodeOutputs = std::move( outputs );
+}
+
+static inline std::string TrimString( const std::string& str )
+{
+    size_t startPos = str.find_first_not_of( " \t\r\n" );
+
+    if ( startPos == std::string::npos )
+    {
+        return std::string();
+    }
+
+    size_t endPos = str.find_last_not_of( " \t\r\n" );
+
+    return str.substr( startPos, endPos - startPos + 1 );
+}
+
+bool sigPatchSet::LoadFromFile( const char *path, std::string& errorOut )
+{
+    std::fstream stlFileStream( path, std::ios::in );
+
+    if ( !stlFileStream.good() )
+    {
+        errorOut = "failed to open signature patch file";
+        return false;
+    }
+
+    std::string line;
+    size_t lineNumber = 0;
+
+    while ( std::getline( stlFileStream, line ) )
+    {
+        lineNumber++;
+
+        line = TrimString( line );
+
+        if ( line.empty() || line[0] == '#' )
+        {
+            continue;
+        }
+
+        size_t filterEnd = line.find( ':' );
+        size_t replaceStart = line.find( "=>" );
+
+        if ( filterEnd == std::string::npos || replaceStart == std::string::npos || replaceStart < filterEnd )
+        {
+            errorOut = "line " + std::to_string( lineNumber ) + ": expected *section filter* : *pattern* => *replacement*";
+            return false;
+        }
+
+        sigPatchRule rule;
+        rule.sectionFilter = TrimString( line.substr( 0, filterEnd ) );
+        rule.lineNumber = lineNumber;
+
+        if ( rule.sectionFilter.empty() )
+        {
+            rule.sectionFilter = "*";
+        }
+
+        if ( !bytePattern::Parse( line.substr( filterEnd + 1, replaceStart - filterEnd - 1 ), rule.pattern ) )
+        {
+            errorOut = "line " + std::to_string( lineNumber ) + ": invalid pattern";
+            return false;
+        }
+
+        if ( !bytePattern::Parse( line.substr( replaceStart + 2 ), rule.replacement ) )
+        {
+            errorOut = "line " + std::to_string( lineNumber ) + ": invalid replacement";
+            return false;
+        }
+
+        // We only ever write into bytes that we matched.
+        if ( rule.replacement.GetLength() > rule.pattern.GetLength() )
+        {
+            errorOut = "line " + std::to_string( lineNumber ) + ": replacement is longer than pattern";
+            return false;
+        }
+
+        size_t patIdx;
+
+        if ( !this->scanner.AddPattern( rule.pattern, patIdx ) )
+        {
+            errorOut = "line " + std::to_string( lineNumber ) + ": pattern needs at least one literal byte";
+            return false;
+        }
+
+        assert( patIdx == this->rules.size() );
+
+        this->rules.push_back( std::move( rule ) );
+    }
+
+    this->scanner.Build();
+
+    return true;
+}
+
+static inline bool MatchSectionFilter( const std::string& filter, const char *sectName )
+{
+    if ( filter == "*" )
+    {
+        return true;
+    }
+
+    size_t filterLen = filter.size();
+
+    if ( filterLen > 0 && filter[ filterLen - 1 ] == '*' )
+    {
+        return ( strncmp( sectName, filter.c_str(), filterLen - 1 ) == 0 );
+    }
+
+    return ( filter == sectName );
+}
+
+// Returns true if the byte at the given RVA is rewritten by the loader during rebasing.
+static inline bool IsRelocatedByte( const PEFile& image, std::uint32_t rva )
+{
+    std::uint32_t pageIdx = ( rva / PEFile::baserelocChunkSize );
+
+    // A relocation of the previous chunk could reach into this one.
+    for ( std::uint32_t checkPage = ( pageIdx > 0 ? pageIdx - 1 : 0 ); checkPage <= pageIdx; checkPage++ )
+    {
+        auto *relocNode = image.baseRelocs.Find( checkPage );
+
+        if ( relocNode == nullptr )
+        {
+            continue;
+        }
+
+        std::uint32_t chunkOffset = ( checkPage * PEFile::baserelocChunkSize );
+
+        for ( const PEFile::PEBaseReloc::item& relocItem : relocNode->GetValue().items )
+        {
+            PEFile::PEBaseReloc::eRelocType relocType = (PEFile::PEBaseReloc::eRelocType)relocItem.type;
+
+            std::uint32_t relocSize;
+
+            if ( relocType == PEFile::PEBaseReloc::eRelocType::HIGHLOW )
+            {
+                relocSize = 4;
+            }
+            else if ( relocType == PEFile::PEBaseReloc::eRelocType::DIR64 )
+            {
+                relocSize = 8;
+            }
+            else
+            {
+                continue;
+            }
+
+            std::uint32_t relocRVA = ( chunkOffset + relocItem.offset );
+
+            if ( rva >= relocRVA && rva < relocRVA + relocSize )
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void sigPatchSet::Apply( PEFile& image, unsigned int numThreads, sigPatchStats& statsOut ) const
+{
+    std::vector <PEFile::PESection*> sections;
+    {
+        PEFile::sectionIter_t iter = image.GetSectionIterator();
+
+        for ( ; !iter.IsEnd(); iter.Increment() )
+        {
+            sections.push_back( iter.Resolve() );
+        }
+    }
+
+    size_t numSections = sections.size();
+    size_t numRules = this->rules.size();
+
+    // Each section is patched by exactly one worker, so results are kept per section.
+    struct sectionResult
+    {
+        size_t numPatchesApplied = 0;
+        size_t numOverlapsSkipped = 0;
+        size_t numRelocConflicts = 0;
+        std::vector <size_t> ruleHitCounts;
+    };
+
+    std::vector <sectionResult> results( numSections );
+
+    auto patchSection = [&]( size_t sectIdx )
+    {
+        PEFile::PESection *sect = sections[ sectIdx ];
+        sectionResult& result = results[ sectIdx ];
+
+        result.ruleHitCounts.resize( numRules, 0 );
+
+        std::vector <bool> ruleApplies( numRules );
+        bool anyRuleApplies = false;
+
+        for ( size_t ruleIdx = 0; ruleIdx < numRules; ruleIdx++ )
+        {
+            bool applies = MatchSectionFilter( this->rules[ ruleIdx ].sectionFilter, sect->shortName.GetConstString() );
+
+            ruleApplies[ ruleIdx ] = applies;
+            anyRuleApplies |= applies;
+        }
+
+        if ( !anyRuleApplies )
+        {
+            return;
+        }
+
+        std::uint8_t *data = (std::uint8_t*)sect->stream.Data();
+        size_t dataSize = (size_t)sect->stream.Size();
+
+        struct sigMatch
+        {
+            size_t offset;
+            size_t ruleIdx;
+        };
+
+        std::vector <sigMatch> matches;
+
+        this->scanner.Scan( data, dataSize,
+            [&]( size_t ruleIdx, size_t matchOffset )
+        {
+            if ( ruleApplies[ ruleIdx ] )
+            {
+                matches.push_back( { matchOffset, ruleIdx } );
+            }
+        });
+
+        // Earlier matches win; for the same offset the rule that comes first in the file wins.
+        std::sort( matches.begin(), matches.end(),
+            []( const sigMatch& left, const sigMatch& right )
+        {
+            if ( left.offset != right.offset )
+            {
+                return ( left.offset < right.offset );
+            }
+
+            return ( left.ruleIdx < right.ruleIdx );
+        });
+
+        size_t patchedEnd = 0;
+
+        for ( const sigMatch& match : matches )
+        {
+            const sigPatchRule& rule = this->rules[ match.ruleIdx ];
+
+            if ( match.offset < patchedEnd )
+            {
+                result.numOverlapsSkipped++;
+                continue;
+            }
+
+            const bytePattern& replacement = rule.replacement;
+            size_t replaceLen = replacement.GetLength();
+
+            // Do not touch bytes that the loader rewrites during rebasing.
+            bool hasRelocConflict = false;
+
+            for ( size_t n = 0; n < replaceLen; n++ )
+            {
+                if ( replacement.isWildcard[n] || data[ match.offset + n ] == replacement.bytes[n] )
+                {
+                    continue;
+                }
+
+                if ( IsRelocatedByte( image, sect->ResolveRVA( (std::uint32_t)( match.offset + n ) ) ) )
+                {
+                    hasRelocConflict = true;
+                    break;
+                }
+            }
+
+            if ( hasRelocConflict )
+            {
+                result.numRelocConflicts++;
+                continue;
+            }
+
+            for ( size_t n = 0; n < replaceLen; n++ )
+            {
+                if ( replacement.isWildcard[n] == false )
+                {
+                    data[ match.offset + n ] = replacement.bytes[n];
+                }
+            }
+
+            patchedEnd = ( match.offset + rule.pattern.GetLength() );
+
+            result.numPatchesApplied++;
+            result.ruleHitCounts[ match.ruleIdx ]++;
+        }
+    };
+
+    if ( numThreads <= 1 || numSections <= 1 )
+    {
+        for ( size_t sectIdx = 0; sectIdx < numSections; sectIdx++ )
+        {
+            patchSection( sectIdx );
+        }
+    }
+    else
+    {
+        std::atomic <size_t> nextSectIdx( 0 );
+
+        auto worker = [&]( void )
+        {
+            while ( true )
+            {
+                size_t sectIdx = nextSectIdx++;
+
+                if ( sectIdx >= numSections )
+                {
+                    break;
+                }
+
+                patchSection( sectIdx );
+            }
+        };
+
+        size_t numWorkers = std::min( (size_t)numThreads, numSections );
+
+        std::vector <std::thread> workers;
+        workers.reserve( numWorkers );
+
+        for ( size_t n = 0; n < numWorkers; n++ )
+        {
+            workers.emplace_back( worker );
+        }
+
+        for ( std::thread& workerThread : workers )
+        {
+            workerThread.join();
+        }
+    }
+
+    // Merge the results.
+    statsOut.ruleHitCounts.assign( numRules, 0 );
+
+    for ( const sectionResult& result : results )
+    {
+        statsOut.numPatchesApplied += result.numPatchesApplied;
+        statsOut.numOverlapsSkipped += result.numOverlapsSkipped;
+        statsOut.numRelocConflicts += result.numRelocConflicts;
+
+        for ( size_t ruleIdx = 0; ruleIdx < result.ruleHitCounts.size(); ruleIdx++ )
+        {
+            statsOut.ruleHitCounts[ ruleIdx ] += result.ruleHitCounts[ ruleIdx ];
+        }
+    }
+}
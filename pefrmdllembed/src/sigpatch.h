@@ -0,0 +1,144 @@
+#ifndef _SIGNATURE_PATCHING_
+#define _SIGNATURE_PATCHING_
+
+#include <peframework.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Byte pattern with '?' wildcards.
+struct bytePattern
+{
+    // Parses whitespace-separated hex bytes; "?" or "??" is a wildcard byte.
+    static bool Parse( const std::string& desc, bytePattern& patOut );
+
+    inline size_t GetLength( void ) const           { return this->bytes.size(); }
+
+    inline bool MatchesAt( const std::uint8_t *data, size_t dataSize, size_t offset ) const
+    {
+        size_t patLen = this->bytes.size();
+
+        if ( offset > dataSize || dataSize - offset < patLen )
+        {
+            return false;
+        }
+
+        for ( size_t n = 0; n < patLen; n++ )
+        {
+            if ( this->isWildcard[n] == false && data[ offset + n ] != this->bytes[n] )
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::vector <std::uint8_t> bytes;
+    std::vector <bool> isWildcard;
+};
+
+// Finds many byte patterns in a single pass over a buffer.
+// The longest literal run of each pattern is fed into an Aho-Corasick automaton; hits of that
+// anchor are then verified against the full pattern, including its wildcards.
+struct multiPatternScanner
+{
+    // Returns the index of the pattern; patterns without any literal byte cannot be anchored.
+    bool AddPattern( const bytePattern& pattern, size_t& indexOut );
+
+    // Must be called after all patterns were added and before scanning.
+    void Build( void );
+
+    inline size_t GetPatternCount( void ) const     { return this->patterns.size(); }
+    inline const bytePattern& GetPattern( size_t idx ) const    { return this->patterns[ idx ].pattern; }
+
+    // Calls cb( patternIndex, matchOffset ) for every match, ordered by the end of the anchor.
+    template <typename callbackType>
+    inline void Scan( const void *buf, size_t bufSize, callbackType&& cb ) const
+    {
+        const std::uint8_t *data = (const std::uint8_t*)buf;
+
+        const std::int32_t *transitions = this->transitions.data();
+
+        std::int32_t state = 0;
+
+        for ( size_t n = 0; n < bufSize; n++ )
+        {
+            state = transitions[ (size_t)state * 256 + data[n] ];
+
+            const std::vector <size_t>& outputs = this->nodeOutputs[ state ];
+
+            for ( size_t patIdx : outputs )
+            {
+                const anchoredPattern& info = this->patterns[ patIdx ];
+
+                size_t anchorEnd = ( n + 1 );
+                size_t anchorReach = ( info.anchorOffset + info.anchorLength );
+
+                if ( anchorEnd < anchorReach )
+                {
+                    continue;
+                }
+
+                size_t matchOffset = ( anchorEnd - anchorReach );
+
+                if ( info.pattern.MatchesAt( data, bufSize, matchOffset ) )
+                {
+                    cb( patIdx, matchOffset );
+                }
+            }
+        }
+    }
+
+private:
+    struct anchoredPattern
+    {
+        bytePattern pattern;
+        size_t anchorOffset;
+        size_t anchorLength;
+    };
+
+    std::vector <anchoredPattern> patterns;
+
+    // Complete DFA, 256 transitions per node.
+    std::vector <std::int32_t> transitions;
+    std::vector <std::vector <size_t>> nodeOutputs;
+};
+
+// Rule that replaces every match of a pattern inside of the filtered sections.
+struct sigPatchRule
+{
+    std::string sectionFilter;      // "*" for all sections, "name*" for a prefix, otherwise exact name.
+    bytePattern pattern;
+    bytePattern replacement;        // wildcard bytes keep the original content.
+    size_t lineNumber;
+};
+
+struct sigPatchStats
+{
+    size_t numPatchesApplied = 0;
+    size_t numOverlapsSkipped = 0;
+    size_t numRelocConflicts = 0;
+    std::vector <size_t> ruleHitCounts;
+};
+
+// Set of signature patch rules that is loaded from a text file. Each line has the format
+//  *section filter* : *pattern* => *replacement*
+// where '#' starts a comment line.
+struct sigPatchSet
+{
+    bool LoadFromFile( const char *path, std::string& errorOut );
+
+    // Matches all rules against every section of the image in one pass per section.
+    // Sections are distributed across numThreads worker threads.
+    void Apply( PEFile& image, unsigned int numThreads, sigPatchStats& statsOut ) const;
+
+    inline const std::vector <sigPatchRule>& GetRules( void ) const     { return this->rules; }
+
+private:
+    std::vector <sigPatchRule> rules;
+    multiPatternScanner scanner;
+};
+
+#endif //_SIGNATURE_PATCHING_
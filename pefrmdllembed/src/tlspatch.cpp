@@ -0,0 +1,737 @@
+#include "tlspatch.h"
+
+#include "sigpatch.h"
+
+#include <algorithm>
+#include <cstring>
+
+struct tlsAccessMatch
+{
+    size_t offset;
+    size_t patIdx;
+};
+
+static multiPatternScanner BuildTLSScanner( const char *const patternDescs[], size_t numPatterns )
+{
+    multiPatternScanner scanner;
+
+    for ( size_t n = 0; n < numPatterns; n++ )
+    {
+        bytePattern pattern;
+        size_t patIdx;
+
+        bool couldParse = bytePattern::Parse( patternDescs[n], pattern );
+
+        assert( couldParse == true );
+
+        bool couldAdd = scanner.AddPattern( pattern, patIdx );
+
+        assert( couldAdd == true && patIdx == n );
+    }
+
+    scanner.Build();
+
+    return scanner;
+}
+
+// Matches are patched after the scan so that the scanner only ever sees original code.
+static std::vector <tlsAccessMatch> FindTLSAccesses( const multiPatternScanner& scanner, const std::uint8_t *code, size_t codeSize )
+{
+    std::vector <tlsAccessMatch> matches;
+
+    scanner.Scan( code, codeSize,
+        [&]( size_t patIdx, size_t matchOffset )
+    {
+        matches.push_back( { matchOffset, patIdx } );
+    });
+
+    std::sort( matches.begin(), matches.end(),
+        []( const tlsAccessMatch& left, const tlsAccessMatch& right )
+    {
+        return ( left.offset < right.offset );
+    });
+
+    return matches;
+}
+
+// Is there a mov reg,[baseReg+index*scale] at the offset?
+static bool IsIndexedLoad( const std::uint8_t *code, size_t codeSize, size_t offset, unsigned int baseReg, unsigned int scaleBits, bool hasREX )
+{
+    size_t instLen = ( hasREX ? 4 : 3 );
+
+    if ( offset > codeSize || codeSize - offset < instLen )
+    {
+        return false;
+    }
+
+    unsigned int rexB = 0;
+
+    if ( hasREX )
+    {
+        std::uint8_t rex = code[ offset++ ];
+
+        // Need REX.W for a pointer sized load.
+        if ( ( rex & 0xF8 ) != 0x48 )
+        {
+            return false;
+        }
+
+        rexB = ( ( rex & 0x01 ) << 3 );
+    }
+
+    std::uint8_t opcode = code[ offset + 0 ];
+    std::uint8_t modrm = code[ offset + 1 ];
+    std::uint8_t sib = code[ offset + 2 ];
+
+    if ( opcode != 0x8B || ( modrm & 0xC7 ) != 0x04 || ( sib >> 6 ) != scaleBits || ( sib & 0x07 ) == 0x05 )
+    {
+        return false;
+    }
+
+    return ( ( ( sib & 0x07 ) | rexB ) == baseReg );
+}
+
+void FindStaticTLSAccessesX86( const std::uint8_t *code, size_t codeSize, std::vector <staticTLSAccess>& accessesOut )
+{
+    static const char *const patternDescs[] =
+    {
+        "64 A1 2C 00 00 00",            // mov eax,fs:[2Ch]
+        "64 8B ? 2C 00 00 00"           // mov reg,fs:[2Ch]
+    };
+
+    static const multiPatternScanner scanner = BuildTLSScanner( patternDescs, sizeof(patternDescs) / sizeof(*patternDescs) );
+
+    size_t accessEnd = 0;
+
+    for ( const tlsAccessMatch& match : FindTLSAccesses( scanner, code, codeSize ) )
+    {
+        if ( match.offset < accessEnd )
+        {
+            continue;
+        }
+
+        staticTLSAccess access;
+        access.offset = match.offset;
+
+        if ( match.patIdx == 0 )
+        {
+            access.destReg = 0;
+            access.length = 6;
+        }
+        else
+        {
+            std::uint8_t modrm = code[ match.offset + 2 ];
+
+            // Only the absolute disp32 form addresses the TEB field.
+            if ( ( modrm & 0xC7 ) != 0x05 )
+            {
+                continue;
+            }
+
+            access.destReg = ( ( modrm >> 3 ) & 0x07 );
+            access.length = 7;
+        }
+
+        // Nothing loads the stack pointer out of the TEB.
+        if ( access.destReg == 4 )
+        {
+            continue;
+        }
+
+        accessEnd = ( access.offset + access.length );
+
+        access.hasIndexedLoad = IsIndexedLoad( code, codeSize, accessEnd, access.destReg, 2, false );
+
+        accessesOut.push_back( access );
+    }
+}
+
+void FindStaticTLSAccessesX64( const std::uint8_t *code, size_t codeSize, std::vector <staticTLSAccess>& accessesOut )
+{
+    // MSVC reads the TLS array pointer like this and then indexes it with _tls_index:
+    //  mov ecx,[rip+_tls_index]
+    //  mov rax,gs:[58h]
+    //  mov rax,[rax+rcx*8]
+    static const char *const patternDescs[] =
+    {
+        "65 48 8B ? 25 58 00 00 00",    // mov reg,gs:[58h]
+        "65 4C 8B ? 25 58 00 00 00"     // mov r8-r15,gs:[58h]
+    };
+
+    static const multiPatternScanner scanner = BuildTLSScanner( patternDescs, sizeof(patternDescs) / sizeof(*patternDescs) );
+
+    size_t accessEnd = 0;
+
+    for ( const tlsAccessMatch& match : FindTLSAccesses( scanner, code, codeSize ) )
+    {
+        if ( match.offset < accessEnd )
+        {
+            continue;
+        }
+
+        std::uint8_t rex = code[ match.offset + 1 ];
+        std::uint8_t modrm = code[ match.offset + 3 ];
+
+        // Must be the SIB form without base and index, which is an absolute disp32.
+        if ( ( modrm & 0xC7 ) != 0x04 )
+        {
+            continue;
+        }
+
+        staticTLSAccess access;
+        access.offset = match.offset;
+        access.length = 9;
+        access.destReg = ( ( ( modrm >> 3 ) & 0x07 ) | ( ( rex & 0x04 ) << 1 ) );
+
+        if ( access.destReg == 4 )
+        {
+            continue;
+        }
+
+        accessEnd = ( access.offset + access.length );
+
+        access.hasIndexedLoad = IsIndexedLoad( code, codeSize, accessEnd, access.destReg, 3, true );
+
+        accessesOut.push_back( access );
+    }
+}
+
+void PatchStaticTLSReferencesX86( std::uint8_t *code, size_t codeSize, std::uint32_t vaTLSArray, std::vector <size_t>& relocOffsetsOut, staticTLSPatchStats& statsOut )
+{
+    std::vector <staticTLSAccess> accesses;
+
+    FindStaticTLSAccessesX86( code, codeSize, accesses );
+
+    for ( const staticTLSAccess& access : accesses )
+    {
+        std::uint8_t *curPtr = ( code + access.offset );
+
+        // lea reg,[vaTLSArray]
+        curPtr[0] = 0x8D;
+        curPtr[1] = (std::uint8_t)( ( access.destReg << 3 ) | 0x05 );
+        memcpy( curPtr + 2, &vaTLSArray, sizeof(vaTLSArray) );
+
+        relocOffsetsOut.push_back( access.offset + 2 );
+
+        // Pad the remainder with NOPs.
+        memset( curPtr + 6, 0x90, access.length - 6 );
+
+        statsOut.numPatched++;
+
+        if ( access.hasIndexedLoad )
+        {
+            statsOut.numIndexedLoads++;
+        }
+    }
+}
+
+void PatchStaticTLSReferencesX64( std::uint8_t *code, size_t codeSize, std::uint32_t codeRVA, std::uint32_t rvaTLSArray, staticTLSPatchStats& statsOut )
+{
+    std::vector <staticTLSAccess> accesses;
+
+    FindStaticTLSAccessesX64( code, codeSize, accesses );
+
+    const size_t leaSize = 7;
+
+    for ( const staticTLSAccess& access : accesses )
+    {
+        std::uint8_t *curPtr = ( code + access.offset );
+
+        std::uint32_t rvaNextInst = ( codeRVA + (std::uint32_t)( access.offset + leaSize ) );
+        std::int32_t relTLSArray = (std::int32_t)( rvaTLSArray - rvaNextInst );
+
+        // lea reg,[rip+relTLSArray]; the REX prefix stays.
+        curPtr[0] = curPtr[1];
+        curPtr[1] = 0x8D;
+        curPtr[2] = (std::uint8_t)( ( ( access.destReg & 0x07 ) << 3 ) | 0x05 );
+        memcpy( curPtr + 3, &relTLSArray, sizeof(relTLSArray) );
+
+        // Two byte NOP for the remainder.
+        curPtr[7] = 0x66;
+        curPtr[8] = 0x90;
+
+        statsOut.numPatched++;
+
+        if ( access.hasIndexedLoad )
+        {
+            statsOut.numIndexedLoads++;
+        }
+    }
+}
+
+// Offsets into the TEB.
+static const std::int32_t tebLastErrorValueX86 = 0x34;
+static const std::int32_t tebTlsSlotsX86 = 0xE10;
+static const std::int32_t tebLastErrorValueX64 = 0x68;
+static const std::int32_t tebTlsSlotsX64 = 0x1480;
+
+// TLS_MINIMUM_AVAILABLE; higher slot indices are stored in the expansion array.
+static const std::uint32_t numTebTlsSlots = 64;
+
+// The per-thread block starts with the TLS array, which only uses index zero, followed by the TLS data.
+static const std::uint32_t tlsBlockHeaderSize = 16;
+
+static const std::uint32_t _LMEM_ZEROINIT = 0x40;
+
+// FXSAVE image of the x87, MMX and SSE state; has to be 16 byte aligned.
+static const std::uint32_t fxsaveAreaSize = 512;
+
+static inline asmjit::X86Mem GetTLSEmulationImport( const tlsEmulationRuntime& runtime, eTLSEmulationImport importIdx )
+{
+    return asmjit::X86Mem( runtime.rvaImportThunks + (std::uint32_t)importIdx * runtime.pointerSize, runtime.pointerSize );
+}
+
+void CreateTLSEmulationSection( PEFile& image, size_t numModules, tlsEmulationRuntime& runtimeOut )
+{
+    static const char *const importNames[] =
+    {
+        "TlsAlloc",
+        "TlsGetValue",
+        "TlsSetValue",
+        "FlsAlloc",
+        "FlsSetValue",
+        "LocalAlloc",
+        "LocalFree",
+        "IsThreadAFiber"
+    };
+
+    static_assert( sizeof(importNames) / sizeof(*importNames) == (size_t)eTLSEmulationImport::COUNT, "TLS emulation import names mismatch" );
+
+    std::uint32_t thunkEntrySize = ( image.isExtendedFormat ? 8 : 4 );
+
+    PEFile::PESection tlsEmuSection;
+    tlsEmuSection.shortName = ".tlsemu";
+    tlsEmuSection.chars.sect_mem_read = true;
+    tlsEmuSection.chars.sect_mem_write = true;
+
+    PEFile::PEImportDesc emuImports;
+    emuImports.DLLName = "KERNEL32.DLL";
+
+    for ( const char *importName : importNames )
+    {
+        PEFile::PEImportDesc::importFunc importEntry;
+        importEntry.name = importName;
+        importEntry.isOrdinalImport = false;
+        importEntry.ordinal_hint = 0;
+        emuImports.funcs.AddToBack( std::move( importEntry ) );
+    }
+
+    PEFile::PESectionAllocation importThunks;
+    tlsEmuSection.Allocate( importThunks, thunkEntrySize * (std::uint32_t)eTLSEmulationImport::COUNT, thunkEntrySize );
+
+    tlsEmuSection.Allocate( runtimeOut.slotsAlloc, (std::uint32_t)( numModules * 2 * sizeof(std::uint32_t) ), sizeof(std::uint32_t) );
+
+    tlsEmuSection.Allocate( runtimeOut.flsCallbackAlloc, thunkEntrySize, thunkEntrySize );
+
+    tlsEmuSection.Finalize();
+
+    image.AddSection( std::move( tlsEmuSection ) );
+
+    runtimeOut.pointerSize = thunkEntrySize;
+    runtimeOut.rvaImportThunks = importThunks.ResolveOffset( 0 );
+    runtimeOut.rvaSlots = runtimeOut.slotsAlloc.ResolveOffset( 0 );
+    runtimeOut.rvaFLSCallback = runtimeOut.flsCallbackAlloc.ResolveOffset( 0 );
+    runtimeOut.numSlotPairs = numModules;
+
+    // Keep pointers to the modules stable.
+    runtimeOut.modules.reserve( numModules );
+
+    emuImports.firstThunkRef = std::move( importThunks );
+
+    image.imports.AddToBack( std::move( emuImports ) );
+}
+
+tlsEmulationModule* AddTLSEmulationModule( tlsEmulationRuntime& runtime, std::uint32_t rvaTLSDirectory, std::uint32_t templateSize, std::uint32_t zeroFillSize )
+{
+    size_t slotPairIdx = runtime.modules.size();
+
+    if ( slotPairIdx >= runtime.numSlotPairs )
+    {
+        return nullptr;
+    }
+
+    std::uint32_t rvaSlotPair = ( runtime.rvaSlots + (std::uint32_t)( slotPairIdx * 2 * sizeof(std::uint32_t) ) );
+
+    tlsEmulationModule module;
+    module.rvaTLSDirectory = rvaTLSDirectory;
+    module.templateSize = templateSize;
+    module.zeroFillSize = zeroFillSize;
+    module.rvaTLSSlot = rvaSlotPair;
+    module.rvaFLSSlot = ( rvaSlotPair + sizeof(std::uint32_t) );
+
+    runtime.modules.push_back( std::move( module ) );
+
+    return &runtime.modules.back();
+}
+
+void EmitTLSEmulationStartup( asmjit::X86Assembler& x86_asm, const tlsEmulationRuntime& runtime, const tlsEmulationModule& module )
+{
+    using namespace asmjit;
+
+    bool is64Bit = ( x86_asm.getArchInfo().getType() == ArchInfo::kTypeX64 );
+
+    x86_asm.call( GetTLSEmulationImport( runtime, eTLSEmulationImport::TLS_ALLOC ) );
+
+    // Without its slot the module cannot run at all (TLS_OUT_OF_INDEXES).
+    Label gotSlot = x86_asm.newLabel();
+
+    x86_asm.cmp( x86::eax, Imm( -1 ) );
+    x86_asm.jne( gotSlot );
+    x86_asm.ud2();
+    x86_asm.bind( gotSlot );
+
+    x86_asm.mov( X86Mem( module.rvaTLSSlot, 4 ), x86::eax );
+
+    // The blocks are released through the FLS callback when a thread exits.
+    if ( is64Bit )
+    {
+        x86_asm.mov( x86::rcx, X86Mem( runtime.rvaFLSCallback, 8 ) );
+    }
+    else
+    {
+        x86_asm.push( X86Mem( runtime.rvaFLSCallback, 4 ) );
+    }
+
+    x86_asm.call( GetTLSEmulationImport( runtime, eTLSEmulationImport::FLS_ALLOC ) );
+    x86_asm.mov( X86Mem( module.rvaFLSSlot, 4 ), x86::eax );
+}
+
+// Returns the TLS array of the calling thread in zax. The general purpose, x87 and SSE registers are kept;
+// flags and the upper halves of AVX registers are not.
+static void EmitTLSEmulationResolver( asmjit::X86Assembler& x86_asm, const tlsEmulationRuntime& runtime, const tlsEmulationModule& module )
+{
+    using namespace asmjit;
+
+    bool is64Bit = ( x86_asm.getArchInfo().getType() == ArchInfo::kTypeX64 );
+
+    X86Seg tebSeg = ( is64Bit ? x86::gs : x86::fs );
+    std::int32_t tebTlsSlots = ( is64Bit ? tebTlsSlotsX64 : tebTlsSlotsX86 );
+    std::int32_t tebLastErrorValue = ( is64Bit ? tebLastErrorValueX64 : tebLastErrorValueX86 );
+    std::uint32_t pointerSize = runtime.pointerSize;
+
+    Label slowPath = x86_asm.newLabel();
+    Label copyLoop = x86_asm.newLabel();
+    Label copyDone = x86_asm.newLabel();
+    Label resolved = x86_asm.newLabel();
+
+    // Fast path: the slot value straight out of the TEB, without touching the last error value.
+    x86_asm.mov( x86::eax, X86Mem( module.rvaTLSSlot, 4 ) );
+    x86_asm.cmp( x86::eax, Imm( numTebTlsSlots ) );
+    x86_asm.jae( slowPath );
+    x86_asm.shl( x86::eax, Imm( is64Bit ? 3 : 2 ) );
+    {
+        X86Mem tebSlot = x86::ptr( x86_asm.zax(), tebTlsSlots, pointerSize );
+        tebSlot.setSegment( tebSeg );
+
+        x86_asm.mov( x86_asm.zax(), tebSlot );
+    }
+    x86_asm.test( x86_asm.zax(), x86_asm.zax() );
+    x86_asm.jz( slowPath );
+    x86_asm.ret();
+
+    x86_asm.bind( slowPath );
+
+    x86_asm.push( x86_asm.zcx() );
+    x86_asm.push( x86_asm.zdx() );
+
+    if ( is64Bit )
+    {
+        x86_asm.push( x86::r8 );
+        x86_asm.push( x86::r9 );
+        x86_asm.push( x86::r10 );
+        x86_asm.push( x86::r11 );
+    }
+
+    x86_asm.push( x86_asm.zbx() );
+    x86_asm.push( x86_asm.zsi() );
+    x86_asm.push( x86_asm.zdi() );
+    x86_asm.push( x86_asm.zbp() );
+
+    x86_asm.mov( x86_asm.zbp(), x86_asm.zsp() );
+    x86_asm.and_( x86_asm.zsp(), Imm( -16 ) );
+
+    // The access site can be anywhere inside module code, so the volatile XMM registers (xmm0-xmm5 on x64,
+    // all of them on x86) and the x87 stack may be live while the API calls are free to clobber them.
+    x86_asm.sub( x86_asm.zsp(), Imm( fxsaveAreaSize ) );
+    x86_asm.fxsave( x86::ptr( x86_asm.zsp() ) );
+
+    if ( is64Bit )
+    {
+        // Register spill space.
+        x86_asm.sub( x86::rsp, Imm( 0x20 ) );
+    }
+
+    // The API calls must not change the last error value that the module code sees.
+    X86Mem tebLastError = x86::dword_ptr( x86_asm.zcx(), tebLastErrorValue );
+    tebLastError.setSegment( tebSeg );
+
+    x86_asm.xor_( x86::ecx, x86::ecx );
+    x86_asm.mov( x86::ebx, tebLastError );
+
+    // First access of the thread or a slot that lives in the expansion array.
+    if ( is64Bit )
+    {
+        x86_asm.mov( x86::ecx, X86Mem( module.rvaTLSSlot, 4 ) );
+    }
+    else
+    {
+        x86_asm.push( X86Mem( module.rvaTLSSlot, 4 ) );
+    }
+
+    x86_asm.call( GetTLSEmulationImport( runtime, eTLSEmulationImport::TLS_GET_VALUE ) );
+    x86_asm.test( x86_asm.zax(), x86_asm.zax() );
+    x86_asm.jnz( resolved );
+
+    std::uint32_t blockSize = ( tlsBlockHeaderSize + module.templateSize + module.zeroFillSize );
+
+    if ( is64Bit )
+    {
+        x86_asm.mov( x86::ecx, Imm( _LMEM_ZEROINIT ) );
+        x86_asm.mov( x86::edx, Imm( blockSize ) );
+    }
+    else
+    {
+        x86_asm.push( Imm( blockSize ) );
+        x86_asm.push( Imm( _LMEM_ZEROINIT ) );
+    }
+
+    x86_asm.call( GetTLSEmulationImport( runtime, eTLSEmulationImport::LOCAL_ALLOC ) );
+
+    // The module code cannot continue without its TLS data, like at startup.
+    Label gotBlock = x86_asm.newLabel();
+
+    x86_asm.test( x86_asm.zax(), x86_asm.zax() );
+    x86_asm.jnz( gotBlock );
+    x86_asm.ud2();
+    x86_asm.bind( gotBlock );
+
+    x86_asm.mov( x86_asm.zdi(), x86_asm.zax() );
+
+    // TLS array entry of index zero.
+    x86_asm.lea( x86_asm.zdx(), x86::ptr( x86_asm.zdi(), tlsBlockHeaderSize ) );
+    x86_asm.mov( x86::ptr( x86_asm.zdi(), 0, pointerSize ), x86_asm.zdx() );
+
+    // Copy the template; the zero fill is done by the allocation.
+    x86_asm.mov( x86_asm.zsi(), X86Mem( module.rvaTLSDirectory, pointerSize ) );
+    x86_asm.mov( x86::ecx, Imm( module.templateSize ) );
+    x86_asm.test( x86::ecx, x86::ecx );
+    x86_asm.jz( copyDone );
+
+    x86_asm.bind( copyLoop );
+    x86_asm.mov( x86::al, x86::byte_ptr( x86_asm.zsi() ) );
+    x86_asm.mov( x86::byte_ptr( x86_asm.zdx() ), x86::al );
+    x86_asm.inc( x86_asm.zsi() );
+    x86_asm.inc( x86_asm.zdx() );
+    x86_asm.dec( x86::ecx );
+    x86_asm.jnz( copyLoop );
+
+    x86_asm.bind( copyDone );
+
+    for ( std::uint32_t rvaSlot : { module.rvaTLSSlot, module.rvaFLSSlot } )
+    {
+        if ( is64Bit )
+        {
+            x86_asm.mov( x86::ecx, X86Mem( rvaSlot, 4 ) );
+            x86_asm.mov( x86::rdx, x86::rdi );
+        }
+        else
+        {
+            x86_asm.push( x86::edi );
+            x86_asm.push( X86Mem( rvaSlot, 4 ) );
+        }
+
+        x86_asm.call( GetTLSEmulationImport( runtime, ( rvaSlot == module.rvaTLSSlot ? eTLSEmulationImport::TLS_SET_VALUE : eTLSEmulationImport::FLS_SET_VALUE ) ) );
+    }
+
+    x86_asm.mov( x86_asm.zax(), x86_asm.zdi() );
+
+    x86_asm.bind( resolved );
+
+    x86_asm.xor_( x86::ecx, x86::ecx );
+    x86_asm.mov( tebLastError, x86::ebx );
+
+    // The called APIs have removed their stack arguments.
+    x86_asm.fxrstor( x86::ptr( x86_asm.zsp(), ( is64Bit ? 0x20 : 0 ) ) );
+
+    x86_asm.mov( x86_asm.zsp(), x86_asm.zbp() );
+
+    x86_asm.pop( x86_asm.zbp() );
+    x86_asm.pop( x86_asm.zdi() );
+    x86_asm.pop( x86_asm.zsi() );
+    x86_asm.pop( x86_asm.zbx() );
+
+    if ( is64Bit )
+    {
+        x86_asm.pop( x86::r11 );
+        x86_asm.pop( x86::r10 );
+        x86_asm.pop( x86::r9 );
+        x86_asm.pop( x86::r8 );
+    }
+
+    x86_asm.pop( x86_asm.zdx() );
+    x86_asm.pop( x86_asm.zcx() );
+    x86_asm.ret();
+}
+
+// FLS callback that releases the block of a thread. FLS values belong to fibers, not threads: deleting the fiber
+// that first touched the TLS data would free the block that the other fibers of its thread still use through
+// the TLS slot. Fibers are not supported, so the block of a thread that runs fibers is left allocated instead.
+static void EmitTLSEmulationCleanup( asmjit::X86Assembler& x86_asm, const tlsEmulationRuntime& runtime )
+{
+    using namespace asmjit;
+
+    bool is64Bit = ( x86_asm.getArchInfo().getType() == ArchInfo::kTypeX64 );
+
+    Label keepBlock = x86_asm.newLabel();
+
+    if ( is64Bit )
+    {
+        x86_asm.push( x86::rcx );
+        x86_asm.sub( x86::rsp, Imm( 0x20 ) );
+        x86_asm.call( GetTLSEmulationImport( runtime, eTLSEmulationImport::IS_THREAD_A_FIBER ) );
+        x86_asm.add( x86::rsp, Imm( 0x20 ) );
+        x86_asm.pop( x86::rcx );
+    }
+    else
+    {
+        x86_asm.call( GetTLSEmulationImport( runtime, eTLSEmulationImport::IS_THREAD_A_FIBER ) );
+    }
+
+    x86_asm.test( x86::eax, x86::eax );
+    x86_asm.jnz( keepBlock );
+
+    // LocalFree takes the same argument and returns to our caller.
+    x86_asm.jmp( GetTLSEmulationImport( runtime, eTLSEmulationImport::LOCAL_FREE ) );
+
+    x86_asm.bind( keepBlock );
+
+    if ( is64Bit )
+    {
+        x86_asm.ret();
+    }
+    else
+    {
+        x86_asm.ret( Imm( 4 ) );
+    }
+}
+
+void EmitTLSEmulationThunks( asmjit::X86Assembler& x86_asm, tlsEmulationRuntime& runtime )
+{
+    using namespace asmjit;
+
+    bool is64Bit = ( x86_asm.getArchInfo().getType() == ArchInfo::kTypeX64 );
+
+    unsigned int numRegs = ( is64Bit ? 16 : 8 );
+
+    runtime.flsCallbackLabel = x86_asm.newLabel();
+
+    x86_asm.bind( runtime.flsCallbackLabel );
+
+    EmitTLSEmulationCleanup( x86_asm, runtime );
+
+    for ( tlsEmulationModule& module : runtime.modules )
+    {
+        module.resolverLabel = x86_asm.newLabel();
+
+        x86_asm.bind( module.resolverLabel );
+
+        EmitTLSEmulationResolver( x86_asm, runtime, module );
+
+        // The access sites load the TLS array pointer into different registers.
+        std::vector <bool> isRegUsed( numRegs, false );
+
+        for ( const tlsEmulationModule::accessSite& site : module.sites )
+        {
+            isRegUsed[ site.destReg ] = true;
+        }
+
+        module.regThunkLabels.resize( numRegs );
+
+        for ( unsigned int regId = 0; regId < numRegs; regId++ )
+        {
+            if ( !isRegUsed[ regId ] )
+            {
+                continue;
+            }
+
+            module.regThunkLabels[ regId ] = x86_asm.newLabel();
+
+            x86_asm.bind( module.regThunkLabels[ regId ] );
+
+            // The replaced mov did not touch any flags.
+            x86_asm.pushf();
+
+            if ( regId == 0 )
+            {
+                x86_asm.call( module.resolverLabel );
+            }
+            else
+            {
+                X86Gp destReg = ( is64Bit ? x86::gpq( regId ) : x86::gpd( regId ) );
+
+                x86_asm.push( x86_asm.zax() );
+                x86_asm.call( module.resolverLabel );
+                x86_asm.mov( destReg, x86_asm.zax() );
+                x86_asm.pop( x86_asm.zax() );
+            }
+
+            x86_asm.popf();
+            x86_asm.ret();
+        }
+    }
+}
+
+void LinkTLSEmulationAccesses( PEFile& image, const tlsEmulationRuntime& runtime, const asmjit::CodeHolder& codeHolder, PEFile::PESection *stubSect, std::uint32_t codeOffset, bool requiresRelocations )
+{
+    const size_t callSize = 5;
+
+    if ( runtime.modules.empty() )
+    {
+        return;
+    }
+
+    // Address of the FLS callback for the startup code.
+    {
+        std::uint32_t rvaCallback = stubSect->ResolveRVA( codeOffset + (std::uint32_t)codeHolder.getLabelOffset( runtime.flsCallbackLabel ) );
+        std::uint64_t vaCallback = ( image.GetImageBase() + rvaCallback );
+
+        PEFile::PESection *slotSect = runtime.flsCallbackAlloc.GetSection();
+        std::uint32_t slotOffset = runtime.flsCallbackAlloc.ResolveInternalOffset( 0 );
+
+        slotSect->stream.Seek( slotOffset );
+
+        if ( runtime.pointerSize == 8 )
+        {
+            slotSect->stream.WriteUInt64( vaCallback );
+        }
+        else
+        {
+            slotSect->stream.WriteUInt32( (std::uint32_t)vaCallback );
+        }
+
+        if ( requiresRelocations )
+        {
+            image.AddRelocation( runtime.rvaFLSCallback, PEFile::PEBaseReloc::GetRelocTypeForPointerSize( runtime.pointerSize ) );
+        }
+    }
+
+    for ( const tlsEmulationModule& module : runtime.modules )
+    {
+        for ( const tlsEmulationModule::accessSite& site : module.sites )
+        {
+            std::uint32_t rvaThunk = stubSect->ResolveRVA( codeOffset + (std::uint32_t)codeHolder.getLabelOffset( module.regThunkLabels[ site.destReg ] ) );
+            std::uint32_t rvaNextInst = site.codeSect->ResolveRVA( (std::uint32_t)( site.offset + callSize ) );
+
+            std::int32_t relThunk = (std::int32_t)( rvaThunk - rvaNextInst );
+
+            std::uint8_t *curPtr = ( (std::uint8_t*)site.codeSect->stream.Data() + site.offset );
+
+            // call thunk
+            curPtr[0] = 0xE8;
+            memcpy( curPtr + 1, &relThunk, sizeof(relThunk) );
+
+            // Pad the remainder with NOPs.
+            memset( curPtr + callSize, 0x90, site.length - callSize );
+        }
+    }
+}
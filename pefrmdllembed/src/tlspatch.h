@@ -0,0 +1,123 @@
+#ifndef _STATIC_TLS_PATCHING_
+#define _STATIC_TLS_PATCHING_
+
+#include <peframework.h>
+#define ASMJIT_STATIC
+#include <asmjit/asmjit.h>
+
+#undef ABSOLUTE
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Embedded modules do not get a slot in the thread local storage array of the process, so their static TLS
+// accesses are redirected: each load of the TLS array pointer out of the TEB is turned into a load of the
+// address of the module's TLS directory. The first field of that directory points at the TLS template data,
+// which the module code then picks up through TLS index zero. TLS variables become process-global this way.
+
+struct staticTLSPatchStats
+{
+    size_t numPatched = 0;
+    size_t numIndexedLoads = 0;     // patched loads that are directly followed by the MSVC array indexing.
+};
+
+// Load of the TLS array pointer out of the TEB.
+struct staticTLSAccess
+{
+    size_t offset;
+    size_t length;
+    unsigned int destReg;           // register id, including the REX extension.
+    bool hasIndexedLoad;
+};
+
+// mov reg,fs:[2Ch] of 32bit code.
+void FindStaticTLSAccessesX86( const std::uint8_t *code, size_t codeSize, std::vector <staticTLSAccess>& accessesOut );
+
+// mov reg,gs:[58h] of 64bit code.
+void FindStaticTLSAccessesX64( const std::uint8_t *code, size_t codeSize, std::vector <staticTLSAccess>& accessesOut );
+
+// 32bit code: mov reg,fs:[2Ch] becomes lea reg,[vaTLSArray].
+// The offsets of the written absolute addresses are appended to relocOffsetsOut.
+void PatchStaticTLSReferencesX86( std::uint8_t *code, size_t codeSize, std::uint32_t vaTLSArray, std::vector <size_t>& relocOffsetsOut, staticTLSPatchStats& statsOut );
+
+// 64bit code: mov reg,gs:[58h] becomes lea reg,[rip+*TLS array*], which needs no relocation.
+void PatchStaticTLSReferencesX64( std::uint8_t *code, size_t codeSize, std::uint32_t codeRVA, std::uint32_t rvaTLSArray, staticTLSPatchStats& statsOut );
+
+// Per-thread TLS emulation (-tlsemu).
+// Instead of sharing the template data, every TLS access calls a thunk of the entry stub. The thunk returns a
+// TLS array of the calling thread, which is taken from a Win32 TLS slot that the stub allocates at startup.
+// The first access of a thread allocates the block and copies the TLS template into it; a fiber local
+// storage slot releases the block when the thread exits. Fibers are not supported: the block of a thread
+// that runs fibers is never released, since the FLS callback also runs when a fiber is deleted.
+enum class eTLSEmulationImport
+{
+    TLS_ALLOC,
+    TLS_GET_VALUE,
+    TLS_SET_VALUE,
+    FLS_ALLOC,
+    FLS_SET_VALUE,
+    LOCAL_ALLOC,
+    LOCAL_FREE,
+    IS_THREAD_A_FIBER,
+
+    COUNT
+};
+
+struct tlsEmulationModule
+{
+    std::uint32_t rvaTLSDirectory;      // the first field points at the TLS template data.
+    std::uint32_t templateSize;
+    std::uint32_t zeroFillSize;
+    std::uint32_t rvaTLSSlot;
+    std::uint32_t rvaFLSSlot;
+
+    struct accessSite
+    {
+        PEFile::PESection *codeSect;
+        size_t offset;
+        size_t length;
+        unsigned int destReg;
+    };
+
+    std::vector <accessSite> sites;
+
+    // Thunks of the entry stub, per destination register.
+    asmjit::Label resolverLabel;
+    std::vector <asmjit::Label> regThunkLabels;
+};
+
+struct tlsEmulationRuntime
+{
+    std::uint32_t pointerSize = 0;
+    std::uint32_t rvaImportThunks = 0;      // eTLSEmulationImport order.
+    std::uint32_t rvaSlots = 0;             // one TLS and one FLS slot per module.
+    size_t numSlotPairs = 0;
+
+    PEFile::PESectionAllocation slotsAlloc;
+
+    // Pointer to the FLS callback of the entry stub, for FlsAlloc.
+    std::uint32_t rvaFLSCallback = 0;
+    PEFile::PESectionAllocation flsCallbackAlloc;
+    asmjit::Label flsCallbackLabel;
+
+    std::vector <tlsEmulationModule> modules;
+};
+
+// Adds the .tlsemu section with the kernel32 imports and the slots for up to numModules modules.
+void CreateTLSEmulationSection( PEFile& image, size_t numModules, tlsEmulationRuntime& runtimeOut );
+
+// Takes the next slot pair. Returns nullptr if all modules have one already.
+tlsEmulationModule* AddTLSEmulationModule( tlsEmulationRuntime& runtime, std::uint32_t rvaTLSDirectory, std::uint32_t templateSize, std::uint32_t zeroFillSize );
+
+// Allocates the slots of the module at the current position of the entry stub.
+void EmitTLSEmulationStartup( asmjit::X86Assembler& x86_asm, const tlsEmulationRuntime& runtime, const tlsEmulationModule& module );
+
+// Generates the resolver and register thunks of every module. Must be placed where the stub never falls through.
+void EmitTLSEmulationThunks( asmjit::X86Assembler& x86_asm, tlsEmulationRuntime& runtime );
+
+// Writes the thunk call of every access site and the FLS callback pointer once the stub code has been placed
+// at codeOffset of stubSect.
+void LinkTLSEmulationAccesses( PEFile& image, const tlsEmulationRuntime& runtime, const asmjit::CodeHolder& codeHolder, PEFile::PESection *stubSect, std::uint32_t codeOffset, bool requiresRelocations );
+
+#endif //_STATIC_TLS_PATCHING_
@@ -0,0 +1,487 @@
+#include "verify.h"
+
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <exception>
+
+// Read-only snapshot of the image layout, so that the checks can look up addresses from
+// multiple threads without touching the PEFile structures.
+struct sectionSpan
+{
+    std::uint32_t rva;
+    std::uint32_t virtualSize;
+    std::uint32_t rawSize;
+    const std::uint8_t *data;
+    bool isSection;
+    bool isWritable;
+    bool isExecutable;
+    std::string name;
+};
+
+struct sectionSpanTable
+{
+    void Build( PEFile& image )
+    {
+        this->imageBase = image.GetImageBase();
+        this->pointerSize = ( image.isExtendedFormat ? 8u : 4u );
+
+        // The PE headers are mapped read-only at the image base.
+        sectionSpan headerSpan;
+        headerSpan.rva = 0;
+        headerSpan.virtualSize = image.peOptHeader.sizeOfHeaders;
+        headerSpan.rawSize = 0;
+        headerSpan.data = nullptr;
+        headerSpan.isSection = false;
+        headerSpan.isWritable = false;
+        headerSpan.isExecutable = false;
+        headerSpan.name = "(headers)";
+
+        this->spans.push_back( std::move( headerSpan ) );
+
+        PEFile::sectionIter_t iter = image.GetSectionIterator();
+
+        for ( ; !iter.IsEnd(); iter.Increment() )
+        {
+            const PEFile::PESection *sect = iter.Resolve();
+
+            sectionSpan span;
+            span.rva = sect->GetVirtualAddress();
+            span.virtualSize = sect->GetVirtualSize();
+            span.rawSize = (std::uint32_t)sect->stream.Size();
+            span.data = (const std::uint8_t*)sect->stream.Data();
+            span.isSection = true;
+            span.isWritable = sect->chars.sect_mem_write;
+            span.isExecutable = sect->chars.sect_mem_execute;
+            span.name = sect->shortName.GetConstString();
+
+            this->spans.push_back( std::move( span ) );
+        }
+
+        std::sort( this->spans.begin(), this->spans.end(),
+            []( const sectionSpan& left, const sectionSpan& right )
+        {
+            return ( left.rva < right.rva );
+        });
+    }
+
+    inline const sectionSpan* Find( std::uint32_t rva ) const
+    {
+        auto iter = std::upper_bound( this->spans.begin(), this->spans.end(), rva,
+            []( std::uint32_t rva, const sectionSpan& span )
+        {
+            return ( rva < span.rva );
+        });
+
+        if ( iter == this->spans.begin() )
+        {
+            return nullptr;
+        }
+
+        const sectionSpan& span = *( iter - 1 );
+
+        if ( rva - span.rva >= span.virtualSize )
+        {
+            return nullptr;
+        }
+
+        return &span;
+    }
+
+    // Returns the section that contains the whole memory range.
+    inline const sectionSpan* FindRange( std::uint32_t rva, std::uint32_t size ) const
+    {
+        const sectionSpan *span = this->Find( rva );
+
+        if ( span == nullptr || (std::uint64_t)( rva - span->rva ) + size > span->virtualSize )
+        {
+            return nullptr;
+        }
+
+        return span;
+    }
+
+    // Pointers that end a range may point right behind their section.
+    inline const sectionSpan* FindTargetOrEnd( std::uint32_t rva ) const
+    {
+        const sectionSpan *span = this->Find( rva );
+
+        if ( span == nullptr && rva > 0 )
+        {
+            span = this->Find( rva - 1 );
+        }
+
+        return span;
+    }
+
+    // Reads a pointer-sized value as the loader would map it; bytes past the raw data are zero.
+    inline bool ReadPointer( std::uint32_t rva, std::uint64_t& valueOut ) const
+    {
+        const sectionSpan *span = this->FindRange( rva, this->pointerSize );
+
+        if ( span == nullptr || span->isSection == false )
+        {
+            return false;
+        }
+
+        std::uint32_t sectOff = ( rva - span->rva );
+
+        std::uint8_t valueBytes[ 8 ] = { 0 };
+
+        if ( sectOff < span->rawSize )
+        {
+            memcpy( valueBytes, span->data + sectOff, std::min( this->pointerSize, span->rawSize - sectOff ) );
+        }
+
+        if ( this->pointerSize == 8 )
+        {
+            std::uint64_t value;
+            memcpy( &value, valueBytes, sizeof(value) );
+
+            valueOut = value;
+        }
+        else
+        {
+            std::uint32_t value;
+            memcpy( &value, valueBytes, sizeof(value) );
+
+            valueOut = value;
+        }
+
+        return true;
+    }
+
+    std::vector <sectionSpan> spans;
+    std::uint64_t imageBase;
+    std::uint32_t pointerSize;
+};
+
+static inline std::string FormatRVA( std::uint32_t rva )
+{
+    std::stringstream stream;
+    stream << "0x" << std::hex << rva;
+
+    return stream.str();
+}
+
+// Keep the report readable for badly broken images.
+static const size_t maxIssuesPerCheck = 32;
+
+static inline void AddIssue( imageVerifyReport::checkResult& check, std::string issue )
+{
+    if ( check.issues.size() < maxIssuesPerCheck )
+    {
+        check.issues.push_back( std::move( issue ) );
+    }
+    else
+    {
+        check.numSuppressedIssues++;
+    }
+}
+
+static void VerifyRelocations( PEFile& image, const sectionSpanTable& layout, imageVerifyReport::checkResult& check )
+{
+    for ( auto *relocNode : image.baseRelocs )
+    {
+        std::uint32_t chunkOffset = ( relocNode->GetKey() * PEFile::baserelocChunkSize );
+
+        for ( const PEFile::PEBaseReloc::item& relocItem : relocNode->GetValue().items )
+        {
+            PEFile::PEBaseReloc::eRelocType relocType = (PEFile::PEBaseReloc::eRelocType)relocItem.type;
+
+            if ( relocType == PEFile::PEBaseReloc::eRelocType::ABSOLUTE )
+            {
+                continue;
+            }
+
+            std::uint32_t siteRVA = ( chunkOffset + relocItem.offset );
+
+            check.numChecked++;
+
+            std::uint32_t expectedType = ( layout.pointerSize == 8 ? (std::uint32_t)PEFile::PEBaseReloc::eRelocType::DIR64 : (std::uint32_t)PEFile::PEBaseReloc::eRelocType::HIGHLOW );
+
+            if ( relocItem.type != expectedType )
+            {
+                AddIssue( check, "relocation at " + FormatRVA( siteRVA ) + " has unexpected type " + std::to_string( relocItem.type ) );
+                continue;
+            }
+
+            std::uint64_t targetVA;
+
+            if ( !layout.ReadPointer( siteRVA, targetVA ) )
+            {
+                AddIssue( check, "relocation site " + FormatRVA( siteRVA ) + " is outside of mapped sections" );
+                continue;
+            }
+
+            if ( targetVA < layout.imageBase || targetVA - layout.imageBase > 0xFFFFFFFFu )
+            {
+                AddIssue( check, "relocation at " + FormatRVA( siteRVA ) + " points outside of the image" );
+                continue;
+            }
+
+            std::uint32_t targetRVA = (std::uint32_t)( targetVA - layout.imageBase );
+
+            if ( layout.FindTargetOrEnd( targetRVA ) == nullptr )
+            {
+                AddIssue( check, "relocation at " + FormatRVA( siteRVA ) + " targets unmapped address " + FormatRVA( targetRVA ) );
+            }
+        }
+    }
+}
+
+static void VerifyImports( PEFile& image, const sectionSpanTable& layout, imageVerifyReport::checkResult& check )
+{
+    for ( const PEFile::PEImportDesc& impDesc : image.imports )
+    {
+        check.numChecked++;
+
+        const PEFile::PESectionDataReference& thunkRef = impDesc.firstThunkRef;
+
+        if ( thunkRef.GetSection() == nullptr )
+        {
+            AddIssue( check, std::string( "IAT of " ) + impDesc.DLLName.GetConstString() + " is not placed" );
+            continue;
+        }
+
+        std::uint32_t iatSize = (std::uint32_t)( ( impDesc.funcs.GetCount() + 1 ) * layout.pointerSize );
+
+        const sectionSpan *span = layout.FindRange( thunkRef.GetRVA(), iatSize );
+
+        if ( span == nullptr || span->isSection == false )
+        {
+            AddIssue( check, std::string( "IAT of " ) + impDesc.DLLName.GetConstString() + " at " + FormatRVA( thunkRef.GetRVA() ) + " is not inside of a section" );
+        }
+    }
+
+    for ( const PEFile::PEDelayLoadDesc& delayDesc : image.delayLoads )
+    {
+        check.numChecked++;
+
+        const PEFile::PESectionDataReference& iatRef = delayDesc.IATRef;
+
+        if ( iatRef.GetSection() == nullptr )
+        {
+            AddIssue( check, std::string( "delay-load IAT of " ) + delayDesc.DLLName.GetConstString() + " is not placed" );
+            continue;
+        }
+
+        std::uint32_t iatSize = (std::uint32_t)( ( delayDesc.importNames.GetCount() + 1 ) * layout.pointerSize );
+
+        const sectionSpan *span = layout.FindRange( iatRef.GetRVA(), iatSize );
+
+        if ( span == nullptr || span->isSection == false )
+        {
+            AddIssue( check, std::string( "delay-load IAT of " ) + delayDesc.DLLName.GetConstString() + " at " + FormatRVA( iatRef.GetRVA() ) + " is not inside of a section" );
+        }
+        else if ( span->isWritable == false )
+        {
+            // The delay-load helper writes the resolved addresses at runtime.
+            AddIssue( check, std::string( "delay-load IAT of " ) + delayDesc.DLLName.GetConstString() + " is inside of read-only section " + span->name );
+        }
+    }
+}
+
+static void VerifyExports( PEFile& image, const sectionSpanTable& layout, imageVerifyReport::checkResult& check )
+{
+    size_t numFuncs = image.exportDir.functions.GetCount();
+
+    for ( size_t ordIdx = 0; ordIdx < numFuncs; ordIdx++ )
+    {
+        const PEFile::PEExportDir::func& expFunc = image.exportDir.functions[ ordIdx ];
+
+        // Unused ordinals have no target.
+        if ( expFunc.isForwarder || expFunc.expRef.GetSection() == nullptr )
+        {
+            continue;
+        }
+
+        check.numChecked++;
+
+        std::uint32_t expRVA = expFunc.expRef.GetRVA();
+
+        const sectionSpan *span = layout.Find( expRVA );
+
+        if ( span == nullptr || span->isSection == false )
+        {
+            AddIssue( check, "export ordinal " + std::to_string( image.exportDir.ordinalBase + ordIdx ) + " points to unmapped address " + FormatRVA( expRVA ) );
+        }
+    }
+}
+
+static void VerifyTLS( PEFile& image, const sectionSpanTable& layout, imageVerifyReport::checkResult& check )
+{
+    const auto& tlsInfo = image.tlsInfo;
+
+    if ( tlsInfo.allocEntry.GetSection() == nullptr )
+    {
+        return;
+    }
+
+    auto checkRef = [&]( const PEFile::PESectionDataReference& ref, const char *fieldName, bool needsWrite, bool mayPointToEnd )
+    {
+        if ( ref.GetSection() == nullptr )
+        {
+            return;
+        }
+
+        check.numChecked++;
+
+        std::uint32_t rva = ref.GetRVA();
+
+        const sectionSpan *span = ( mayPointToEnd ? layout.FindTargetOrEnd( rva ) : layout.Find( rva ) );
+
+        if ( span == nullptr || span->isSection == false )
+        {
+            AddIssue( check, std::string( "TLS " ) + fieldName + " points to unmapped address " + FormatRVA( rva ) );
+        }
+        else if ( needsWrite && span->isWritable == false )
+        {
+            AddIssue( check, std::string( "TLS " ) + fieldName + " is inside of read-only section " + span->name );
+        }
+    };
+
+    checkRef( tlsInfo.startOfRawDataRef, "raw data start", false, false );
+    checkRef( tlsInfo.endOfRawDataRef, "raw data end", false, true );
+    checkRef( tlsInfo.addressOfIndexRef, "index", true, false );
+    checkRef( tlsInfo.addressOfCallbacksRef, "callback array", false, false );
+
+    // Every callback has to be executable code.
+    if ( tlsInfo.addressOfCallbacksRef.GetSection() != nullptr )
+    {
+        std::uint32_t callbackPtrRVA = tlsInfo.addressOfCallbacksRef.GetRVA();
+
+        while ( true )
+        {
+            std::uint64_t callbackVA;
+
+            if ( !layout.ReadPointer( callbackPtrRVA, callbackVA ) )
+            {
+                AddIssue( check, "TLS callback array runs out of its section" );
+                break;
+            }
+
+            if ( callbackVA == 0 )
+            {
+                break;
+            }
+
+            check.numChecked++;
+
+            const sectionSpan *span = nullptr;
+
+            if ( callbackVA >= layout.imageBase && callbackVA - layout.imageBase <= 0xFFFFFFFFu )
+            {
+                span = layout.Find( (std::uint32_t)( callbackVA - layout.imageBase ) );
+            }
+
+            if ( span == nullptr || span->isSection == false )
+            {
+                AddIssue( check, "TLS callback at " + FormatRVA( callbackPtrRVA ) + " points to unmapped memory" );
+            }
+            else if ( span->isExecutable == false )
+            {
+                AddIssue( check, "TLS callback at " + FormatRVA( callbackPtrRVA ) + " points into non-executable section " + span->name );
+            }
+
+            callbackPtrRVA += layout.pointerSize;
+        }
+    }
+}
+
+static void VerifyCodeTargets( PEFile& image, const sectionSpanTable& layout, const std::vector <stubCallTarget>& stubCallTargets, imageVerifyReport::checkResult& check )
+{
+    auto checkCodeRVA = [&]( std::uint32_t rva, const std::string& desc )
+    {
+        check.numChecked++;
+
+        const sectionSpan *span = layout.Find( rva );
+
+        if ( span == nullptr || span->isSection == false )
+        {
+            AddIssue( check, desc + " points to unmapped address " + FormatRVA( rva ) );
+        }
+        else if ( span->isExecutable == false )
+        {
+            AddIssue( check, desc + " points into non-executable section " + span->name );
+        }
+    };
+
+    const PEFile::PESectionDataReference& entryPointRef = image.peOptHeader.addressOfEntryPointRef;
+
+    if ( entryPointRef.GetSection() == nullptr )
+    {
+        AddIssue( check, "image has no entry point" );
+    }
+    else
+    {
+        checkCodeRVA( entryPointRef.GetRVA(), "entry point" );
+    }
+
+    for ( const stubCallTarget& target : stubCallTargets )
+    {
+        checkCodeRVA( target.rva, target.desc );
+    }
+}
+
+void VerifyEmbeddedImage( PEFile& image, const std::vector <stubCallTarget>& stubCallTargets, imageVerifyReport& reportOut )
+{
+    sectionSpanTable layout;
+    layout.Build( image );
+
+    typedef std::function <void ( imageVerifyReport::checkResult& )> checkFunc_t;
+
+    struct checkTask
+    {
+        const char *name;
+        checkFunc_t func;
+    };
+
+    const checkTask tasks[] =
+    {
+        { "relocations", [&]( imageVerifyReport::checkResult& check ) { VerifyRelocations( image, layout, check ); } },
+        { "imports", [&]( imageVerifyReport::checkResult& check ) { VerifyImports( image, layout, check ); } },
+        { "exports", [&]( imageVerifyReport::checkResult& check ) { VerifyExports( image, layout, check ); } },
+        { "TLS", [&]( imageVerifyReport::checkResult& check ) { VerifyTLS( image, layout, check ); } },
+        { "code targets", [&]( imageVerifyReport::checkResult& check ) { VerifyCodeTargets( image, layout, stubCallTargets, check ); } }
+    };
+
+    const size_t numTasks = countof(tasks);
+
+    reportOut.checks.resize( numTasks );
+
+    auto runTask = [&]( size_t taskIdx )
+    {
+        imageVerifyReport::checkResult& check = reportOut.checks[ taskIdx ];
+
+        check.name = tasks[ taskIdx ].name;
+
+        try
+        {
+            tasks[ taskIdx ].func( check );
+        }
+        catch( ... )
+        {
+            // Errors must not escape the worker thread.
+            check.issues.push_back( "check aborted due to an exception" );
+        }
+    };
+
+    // The checks only read the image, so each of them gets its own thread.
+    std::vector <std::thread> workers;
+    workers.reserve( numTasks - 1 );
+
+    for ( size_t taskIdx = 1; taskIdx < numTasks; taskIdx++ )
+    {
+        workers.emplace_back( runTask, taskIdx );
+    }
+
+    // The relocation check is usually the biggest one, so we do it on this thread.
+    runTask( 0 );
+
+    for ( std::thread& workerThread : workers )
+    {
+        workerThread.join();
+    }
+}
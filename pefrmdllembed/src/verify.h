@@ -0,0 +1,47 @@
+#ifndef _IMAGE_VERIFICATION_
+#define _IMAGE_VERIFICATION_
+
+#include <peframework.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Address that the generated entry stub calls or jumps to.
+struct stubCallTarget
+{
+    std::uint32_t rva;
+    std::string desc;
+};
+
+struct imageVerifyReport
+{
+    struct checkResult
+    {
+        const char *name;
+        size_t numChecked = 0;
+        std::vector <std::string> issues;
+        size_t numSuppressedIssues = 0;     // issues beyond the per-check limit are only counted.
+    };
+
+    std::vector <checkResult> checks;
+
+    inline size_t GetIssueCount( void ) const
+    {
+        size_t numIssues = 0;
+
+        for ( const checkResult& check : this->checks )
+        {
+            numIssues += ( check.issues.size() + check.numSuppressedIssues );
+        }
+
+        return numIssues;
+    }
+};
+
+// Checks that relocation targets, IAT slots, exports, TLS references, the entry point and the
+// entry stub call targets of an image all land inside of mapped sections with fitting
+// characteristics. The image is not modified; the independent checks run in parallel.
+void VerifyEmbeddedImage( PEFile& image, const std::vector <stubCallTarget>& stubCallTargets, imageVerifyReport& reportOut );
+
+#endif //_IMAGE_VERIFICATION_
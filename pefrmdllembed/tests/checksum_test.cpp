@@ -0,0 +1,189 @@
+// Checks the SSE2 image checksum of pefrmdllembed, peresembed and pe_debug against known checksums
+// of the sample images and against a plain word-by-word sum. The three tools are separate projects,
+// so each keeps its own copy; this test keeps them in agreement.
+// Run with "make test" in pefrmdllembed/build.
+
+#include "../src/pechecksum.h"
+#include "../../peresembed/src/pechecksum.hxx"
+#include "../../pe_debug/src/pechecksum.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+static int numFailures = 0;
+
+// Reference implementation of the checksum that CheckSumMappedFile computes.
+static std::uint32_t ReferenceChecksum( const std::vector <char>& image )
+{
+    std::uint32_t peHeaderOff;
+    memcpy( &peHeaderOff, image.data() + 0x3C, sizeof(peHeaderOff) );
+
+    size_t checksumOff = ( (size_t)peHeaderOff + 4 + 20 + 64 );
+
+    std::uint64_t sum = 0;
+
+    for ( size_t off = 0; off < image.size(); off += 2 )
+    {
+        std::uint32_t word = (unsigned char)image[ off ];
+
+        if ( off + 1 < image.size() )
+        {
+            word |= ( (std::uint32_t)(unsigned char)image[ off + 1 ] << 8 );
+        }
+
+        if ( off >= checksumOff && off < checksumOff + 4 )
+        {
+            word = 0;
+        }
+
+        sum += word;
+
+        sum = ( ( sum & 0xFFFF ) + ( sum >> 16 ) );
+    }
+
+    sum = ( ( sum & 0xFFFF ) + ( sum >> 16 ) );
+
+    return (std::uint32_t)( sum + image.size() );
+}
+
+static void CheckImage( const char *name, const std::vector <char>& image, std::uint32_t expectedChecksum )
+{
+    std::uint32_t checksums[ 3 ] = { 0, 0, 0 };
+    bool results[ 3 ];
+    {
+        std::vector <char> data( image );
+        results[0] = UpdatePEChecksum( data.data(), data.size(), &checksums[0] );
+    }
+    {
+        std::vector <char> data( image );
+        results[1] = UpdatePEChecksum( data.data(), data.size(), checksums[1] );
+    }
+    {
+        std::vector <char> data( image );
+        results[2] = updatePEChecksum( data.data(), data.size(), checksums[2] );
+    }
+
+    static const char *const implNames[ 3 ] = { "pefrmdllembed", "peresembed", "pe_debug" };
+
+    for ( unsigned int n = 0; n < 3; n++ )
+    {
+        if ( results[ n ] == false || checksums[ n ] != expectedChecksum )
+        {
+            printf( "FAIL %s (%s): 0x%08X, expected 0x%08X\n", name, implNames[ n ], (unsigned int)checksums[ n ], (unsigned int)expectedChecksum );
+
+            numFailures++;
+        }
+    }
+}
+
+static bool ReadSampleFile( const std::string& path, std::vector <char>& dataOut )
+{
+    std::ifstream fileStream( path, std::ios::binary );
+
+    if ( !fileStream.good() )
+    {
+        return false;
+    }
+
+    dataOut.assign( std::istreambuf_iterator <char> ( fileStream ), std::istreambuf_iterator <char> () );
+
+    return true;
+}
+
+int main( int argc, char *argv[] )
+{
+    // Directory of the sample images.
+    std::string sampleDir = ( argc >= 2 ? argv[1] : ".." );
+
+    struct sampleImage
+    {
+        const char *fileName;
+        std::uint32_t checksum;
+    };
+
+    static const sampleImage samples[] =
+    {
+        { "input.exe", 0xFB39 },
+        { "input.dll", 0x85A8 },
+        { "input_x64.exe", 0x4969 },
+        { "input_x64.dll", 0x9FC6 }
+    };
+
+    for ( const sampleImage& sample : samples )
+    {
+        std::vector <char> image;
+
+        if ( !ReadSampleFile( sampleDir + "/" + sample.fileName, image ) )
+        {
+            printf( "FAIL %s: cannot read the sample image\n", sample.fileName );
+
+            numFailures++;
+            continue;
+        }
+
+        CheckImage( sample.fileName, image, sample.checksum );
+
+        // A stored checksum must not change the result.
+        std::vector <char> withChecksum( image );
+        {
+            std::uint32_t peHeaderOff;
+            memcpy( &peHeaderOff, withChecksum.data() + 0x3C, sizeof(peHeaderOff) );
+
+            memset( withChecksum.data() + peHeaderOff + 4 + 20 + 64, 0xA5, 4 );
+        }
+
+        CheckImage( ( std::string( sample.fileName ) + " with stored checksum" ).c_str(), withChecksum, sample.checksum );
+
+        // Odd sizes and sizes that are not a multiple of the SSE2 block leave a tail for the word loop.
+        for ( size_t trimSize = 1; trimSize <= 17; trimSize++ )
+        {
+            std::vector <char> trimmed( image.begin(), image.end() - trimSize );
+
+            CheckImage( ( std::string( sample.fileName ) + " trimmed by " + std::to_string( trimSize ) ).c_str(), trimmed, ReferenceChecksum( trimmed ) );
+        }
+    }
+
+    // Large images of all-ones words run more than 0x8000 SSE2 rounds, which is where the lane sums are flushed.
+    for ( size_t imageSize : { (size_t)0x80000, (size_t)0x80011, (size_t)0x400003 } )
+    {
+        std::vector <char> image( imageSize, (char)0xFF );
+
+        memset( image.data(), 0, 0x200 );
+        image[ 0 ] = 'M';
+        image[ 1 ] = 'Z';
+        image[ 0x3C ] = (char)0x80;
+        memcpy( image.data() + 0x80, "PE\0\0", 4 );
+
+        CheckImage( ( "synthetic " + std::to_string( imageSize ) ).c_str(), image, ReferenceChecksum( image ) );
+    }
+
+    // Not PE images.
+    {
+        std::vector <char> data( 0x200, 0 );
+
+        std::uint32_t checksum;
+
+        if ( UpdatePEChecksum( data.data(), data.size(), &checksum ) || UpdatePEChecksum( data.data(), data.size(), checksum ) || updatePEChecksum( data.data(), data.size(), checksum ) )
+        {
+            printf( "FAIL: checksum of a non-PE buffer\n" );
+
+            numFailures++;
+        }
+    }
+
+    if ( numFailures > 0 )
+    {
+        printf( "%d checksum checks failed\n", numFailures );
+
+        return 1;
+    }
+
+    printf( "all checksum checks passed\n" );
+
+    return 0;
+}
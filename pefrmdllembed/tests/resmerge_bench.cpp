@@ -0,0 +1,176 @@
+// Times the resource tree merge on large generated trees.
+// Run with "make bench" in pefrmdllembed/build; an optional argument scales the number of types.
+//
+// Both trees are type -> name -> language, like the resource directories of real images.
+// The executable tree has the types 1..N, the module tree the types N/2+1..N/2+N, each with
+// 100 named entries of 10 languages. With the default N = 100 every tree has 100k leaves:
+// half of the module types are merged leaf by leaf (50k replaced data items), the other half
+// are new and cloned as whole trees (50k cloned leaves).
+// Two merges are timed: from a shared snapshot, which cached modules use and which copies every
+// merged leaf, and the move of the items of an owned module tree, which uncached modules use.
+
+#include "../src/resourcemerge.h"
+
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+static const std::uint16_t numNamesPerType = 100;
+static const std::uint16_t numLangsPerName = 10;
+
+static PEFile::PEResourceItem* AddToDir( PEFile::PEResourceDir& dir, PEFile::PEResourceItem *item )
+{
+    try
+    {
+        dir.AddItem( item );
+    }
+    catch( ... )
+    {
+        PEFile::PEResourceDir::DestroyItem( item );
+
+        throw;
+    }
+
+    return item;
+}
+
+static peString <wchar_t> GetEntryName( std::uint16_t nameIdx )
+{
+    std::wstring name = ( L"ENTRY_" + std::to_wstring( nameIdx ) );
+
+    return peString <wchar_t> ( name.c_str(), name.size() );
+}
+
+// Fills root with the types firstType..firstType+numTypes-1.
+static void GenerateResourceTree( PEFile::PEResourceDir& root, std::uint16_t firstType, std::uint16_t numTypes )
+{
+    for ( std::uint16_t typeIdx = 0; typeIdx < numTypes; typeIdx++ )
+    {
+        PEFile::PEResourceDir *typeDir = (PEFile::PEResourceDir*)AddToDir( root,
+            PEFile::PEResourceDir::CreateDir( PEFile::PEResourceDir( false, peString <wchar_t> (), (std::uint16_t)( firstType + typeIdx ) ) )
+        );
+
+        for ( std::uint16_t nameIdx = 0; nameIdx < numNamesPerType; nameIdx++ )
+        {
+            PEFile::PEResourceDir *nameDir = (PEFile::PEResourceDir*)AddToDir( *typeDir,
+                PEFile::PEResourceDir::CreateDir( PEFile::PEResourceDir( true, GetEntryName( nameIdx ), 0 ) )
+            );
+
+            for ( std::uint16_t langIdx = 0; langIdx < numLangsPerName; langIdx++ )
+            {
+                AddToDir( *nameDir,
+                    PEFile::PEResourceDir::CreateData( PEFile::PEResourceInfo( false, peString <wchar_t> (), (std::uint16_t)( 1033 + langIdx ), PEFile::PESectionDataReference() ) )
+                );
+            }
+        }
+    }
+}
+
+static double GetMilliseconds( std::chrono::steady_clock::time_point startTime )
+{
+    return std::chrono::duration <double, std::milli> ( std::chrono::steady_clock::now() - startTime ).count();
+}
+
+int main( int argc, char *argv[] )
+{
+    int numTypesArg = ( argc >= 2 ? atoi( argv[1] ) : 100 );
+
+    if ( numTypesArg < 2 || numTypesArg > 30000 )
+    {
+        printf( "number of types has to be between 2 and 30000\n" );
+
+        return 1;
+    }
+
+    std::uint16_t numTypes = (std::uint16_t)numTypesArg;
+
+    const int numRuns = 5;
+
+    double bestSnapshotTime = 0, bestMergeTime = 0, bestMoveTime = 0;
+    size_t numModuleLeaves = 0;
+    resourceHelpers::mergeStats lastStats, lastMoveStats;
+
+    // The generated leaves carry no data, so sections never have to be resolved.
+    auto sectResolver = []( const PEFile::PESection *srcSect ) -> PEFile::PESection*
+    {
+        return const_cast <PEFile::PESection*> ( srcSect );
+    };
+
+    for ( int run = 0; run < numRuns; run++ )
+    {
+        PEFile::PEResourceDir exeRoot( false, peString <wchar_t> (), 0 );
+        PEFile::PEResourceDir moduleRoot( false, peString <wchar_t> (), 0 );
+
+        GenerateResourceTree( exeRoot, 1, numTypes );
+        GenerateResourceTree( moduleRoot, (std::uint16_t)( 1 + numTypes / 2 ), numTypes );
+
+        auto snapshotStartTime = std::chrono::steady_clock::now();
+
+        std::shared_ptr <const resourceSnapshot> snapshot = resourceSnapshot::Create( moduleRoot );
+
+        double snapshotTime = GetMilliseconds( snapshotStartTime );
+
+        resourceHelpers::mergeStats stats;
+
+        auto mergeStartTime = std::chrono::steady_clock::now();
+
+        resourceHelpers::EmbedResourceDirectoryInto( peString <wchar_t> (), sectResolver, exeRoot, *snapshot, snapshot->GetRoot(), false, stats );
+
+        double mergeTime = GetMilliseconds( mergeStartTime );
+
+        if ( run == 0 || snapshotTime < bestSnapshotTime )
+        {
+            bestSnapshotTime = snapshotTime;
+        }
+
+        if ( run == 0 || mergeTime < bestMergeTime )
+        {
+            bestMergeTime = mergeTime;
+        }
+
+        numModuleLeaves = snapshot->GetLeafCount();
+        lastStats = stats;
+
+        // Moving needs trees that were not merged yet.
+        PEFile::PEResourceDir moveExeRoot( false, peString <wchar_t> (), 0 );
+        PEFile::PEResourceDir moveModuleRoot( false, peString <wchar_t> (), 0 );
+
+        GenerateResourceTree( moveExeRoot, 1, numTypes );
+        GenerateResourceTree( moveModuleRoot, (std::uint16_t)( 1 + numTypes / 2 ), numTypes );
+
+        resourceHelpers::mergeStats moveStats;
+
+        auto moveStartTime = std::chrono::steady_clock::now();
+
+        resourceHelpers::MoveResourceDirectoryInto( peString <wchar_t> (), sectResolver, moveExeRoot, moveModuleRoot, false, moveStats );
+
+        double moveTime = GetMilliseconds( moveStartTime );
+
+        if ( run == 0 || moveTime < bestMoveTime )
+        {
+            bestMoveTime = moveTime;
+        }
+
+        lastMoveStats = moveStats;
+    }
+
+    size_t numExpectedReplaced = ( (size_t)( numTypes - numTypes / 2 ) * numNamesPerType * numLangsPerName );
+
+    printf( "module leaves: %zu\n", numModuleLeaves );
+    printf( "added trees: %zu, replaced items: %zu, merged dirs: %zu, cloned leaves: %zu\n",
+        lastStats.numAddedTrees, lastStats.numReplacedItems, lastStats.numMergedDirs, lastStats.numClonedLeaves
+    );
+    printf( "snapshot: %.2f ms, merge from snapshot: %.2f ms, move merge: %.2f ms (best of %d runs)\n", bestSnapshotTime, bestMergeTime, bestMoveTime, numRuns );
+
+    if ( lastStats.numReplacedItems != numExpectedReplaced || lastStats.numClonedLeaves != numModuleLeaves ||
+         lastMoveStats.numReplacedItems != numExpectedReplaced || lastMoveStats.numMovedLeaves != numModuleLeaves || lastMoveStats.numClonedLeaves != 0 )
+    {
+        printf( "FAIL: unexpected merge statistics\n" );
+
+        return 1;
+    }
+
+    return 0;
+}
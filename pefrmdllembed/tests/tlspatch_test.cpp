@@ -0,0 +1,224 @@
+// Checks the static TLS access scanner and patcher on synthetic code blobs.
+// Run with "make test" in pefrmdllembed/build.
+
+#include "../src/tlspatch.h"
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+static int numFailures = 0;
+
+static void Check( bool condition, const std::string& what )
+{
+    if ( !condition )
+    {
+        printf( "FAIL %s\n", what.c_str() );
+
+        numFailures++;
+    }
+}
+
+static void CheckBytes( const std::vector <std::uint8_t>& code, size_t offset, const std::vector <std::uint8_t>& expected, const std::string& what )
+{
+    bool isSame = ( offset + expected.size() <= code.size() && memcmp( code.data() + offset, expected.data(), expected.size() ) == 0 );
+
+    Check( isSame, what );
+}
+
+static std::vector <std::uint8_t> Concat( std::initializer_list <std::vector <std::uint8_t>> parts )
+{
+    std::vector <std::uint8_t> code;
+
+    for ( const std::vector <std::uint8_t>& part : parts )
+    {
+        code.insert( code.end(), part.begin(), part.end() );
+    }
+
+    return code;
+}
+
+static std::vector <std::uint8_t> RelBytes( std::int32_t rel )
+{
+    std::vector <std::uint8_t> bytes( sizeof(rel) );
+    memcpy( bytes.data(), &rel, sizeof(rel) );
+
+    return bytes;
+}
+
+static void TestFindX64( void )
+{
+    const std::vector <std::uint8_t> loadRipTLSIndex = { 0x8B, 0x0D, 0x10, 0x20, 0x30, 0x00 };     // mov ecx,[rip+_tls_index]
+    const std::vector <std::uint8_t> movRaxTLS = { 0x65, 0x48, 0x8B, 0x04, 0x25, 0x58, 0x00, 0x00, 0x00 };   // mov rax,gs:[58h]
+    const std::vector <std::uint8_t> indexRax = { 0x48, 0x8B, 0x04, 0xC8 };                      // mov rax,[rax+rcx*8]
+    const std::vector <std::uint8_t> movR8TLS = { 0x65, 0x4C, 0x8B, 0x04, 0x25, 0x58, 0x00, 0x00, 0x00 };    // mov r8,gs:[58h]
+    const std::vector <std::uint8_t> indexR8 = { 0x4D, 0x8B, 0x04, 0xC8 };                       // mov r8,[r8+rcx*8]
+    const std::vector <std::uint8_t> movR9TLS = { 0x65, 0x4C, 0x8B, 0x0C, 0x25, 0x58, 0x00, 0x00, 0x00 };    // mov r9,gs:[58h]
+    const std::vector <std::uint8_t> movRcxTLS = { 0x65, 0x48, 0x8B, 0x0C, 0x25, 0x58, 0x00, 0x00, 0x00 };   // mov rcx,gs:[58h]
+    const std::vector <std::uint8_t> nops = { 0x90, 0x90, 0x90 };
+
+    // REX.W and REX.R forms, each followed by the MSVC array indexing.
+    {
+        std::vector <std::uint8_t> code = Concat( { loadRipTLSIndex, movRaxTLS, indexRax, nops, movR8TLS, indexR8 } );
+
+        std::vector <staticTLSAccess> accesses;
+        FindStaticTLSAccessesX64( code.data(), code.size(), accesses );
+
+        Check( accesses.size() == 2, "x64: two accesses found" );
+
+        if ( accesses.size() == 2 )
+        {
+            Check( accesses[0].offset == 6 && accesses[0].length == 9, "x64: rax access position" );
+            Check( accesses[0].destReg == 0, "x64: rax access register" );
+            Check( accesses[0].hasIndexedLoad, "x64: rax access indexed load" );
+
+            Check( accesses[1].offset == 22 && accesses[1].length == 9, "x64: r8 access position" );
+            Check( accesses[1].destReg == 8, "x64: r8 access register (REX.R)" );
+            Check( accesses[1].hasIndexedLoad, "x64: r8 access indexed load (REX.B base)" );
+        }
+    }
+
+    // Loads without the indexing, or indexing through another base register.
+    {
+        std::vector <std::uint8_t> code = Concat( { movRcxTLS, nops, movR9TLS, indexR8 } );
+
+        std::vector <staticTLSAccess> accesses;
+        FindStaticTLSAccessesX64( code.data(), code.size(), accesses );
+
+        Check( accesses.size() == 2, "x64: unindexed accesses found" );
+
+        if ( accesses.size() == 2 )
+        {
+            Check( accesses[0].destReg == 1 && accesses[0].hasIndexedLoad == false, "x64: rcx access without indexed load" );
+            Check( accesses[1].destReg == 9 && accesses[1].hasIndexedLoad == false, "x64: r9 access does not take the r8 indexing" );
+        }
+    }
+
+    // The indexing needs REX.W; a 32bit load is no array access.
+    {
+        std::vector <std::uint8_t> code = Concat( { movRaxTLS, { 0x40, 0x8B, 0x04, 0xC8 } } );
+
+        std::vector <staticTLSAccess> accesses;
+        FindStaticTLSAccessesX64( code.data(), code.size(), accesses );
+
+        Check( accesses.size() == 1 && accesses[0].hasIndexedLoad == false, "x64: indexed load without REX.W" );
+    }
+
+    // Forms that do not address the TEB field: rip-relative and rsp as the destination.
+    {
+        std::vector <std::uint8_t> code =
+        {
+            0x65, 0x48, 0x8B, 0x05, 0x25, 0x58, 0x00, 0x00, 0x00,       // mov rax,gs:[rip+...]
+            0x65, 0x48, 0x8B, 0x24, 0x25, 0x58, 0x00, 0x00, 0x00        // mov rsp,gs:[58h]
+        };
+
+        std::vector <staticTLSAccess> accesses;
+        FindStaticTLSAccessesX64( code.data(), code.size(), accesses );
+
+        Check( accesses.empty(), "x64: rip-relative and rsp forms are skipped" );
+    }
+
+    // Matches at the end of the buffer.
+    {
+        std::vector <std::uint8_t> code = Concat( { nops, movRaxTLS } );
+
+        std::vector <staticTLSAccess> accesses;
+        FindStaticTLSAccessesX64( code.data(), code.size(), accesses );
+
+        Check( accesses.size() == 1 && accesses[0].offset == 3 && accesses[0].hasIndexedLoad == false, "x64: access that ends the buffer" );
+
+        // The indexing is cut off by the end of the buffer.
+        code = Concat( { movRaxTLS, { 0x48, 0x8B, 0x04 } } );
+
+        accesses.clear();
+        FindStaticTLSAccessesX64( code.data(), code.size(), accesses );
+
+        Check( accesses.size() == 1 && accesses[0].hasIndexedLoad == false, "x64: indexed load cut off by the buffer end" );
+
+        // The access itself is cut off.
+        code = Concat( { nops, movRaxTLS } );
+        code.pop_back();
+
+        accesses.clear();
+        FindStaticTLSAccessesX64( code.data(), code.size(), accesses );
+
+        Check( accesses.empty(), "x64: access cut off by the buffer end" );
+    }
+}
+
+static void TestPatchX64( void )
+{
+    const std::uint32_t codeRVA = 0x11000;
+    const std::uint32_t rvaTLSArray = 0x4000;
+
+    std::vector <std::uint8_t> code =
+    {
+        0x90, 0x90,
+        0x65, 0x48, 0x8B, 0x04, 0x25, 0x58, 0x00, 0x00, 0x00,       // mov rax,gs:[58h]
+        0x48, 0x8B, 0x04, 0xC8,                                     // mov rax,[rax+rcx*8]
+        0x65, 0x4C, 0x8B, 0x0C, 0x25, 0x58, 0x00, 0x00, 0x00        // mov r9,gs:[58h]
+    };
+
+    std::vector <std::uint8_t> origCode = code;
+
+    staticTLSPatchStats stats;
+    PatchStaticTLSReferencesX64( code.data(), code.size(), codeRVA, rvaTLSArray, stats );
+
+    Check( stats.numPatched == 2 && stats.numIndexedLoads == 1, "x64 patch: statistics" );
+
+    // lea rax,[rip+rel]; rel is taken from the end of the 7 byte lea.
+    std::int32_t relFirst = (std::int32_t)( rvaTLSArray - ( codeRVA + 2 + 7 ) );
+
+    CheckBytes( code, 2, Concat( { { 0x48, 0x8D, 0x05 }, RelBytes( relFirst ), { 0x66, 0x90 } } ), "x64 patch: lea rax,[rip+rel] and padding" );
+
+    CheckBytes( code, 11, { 0x48, 0x8B, 0x04, 0xC8 }, "x64 patch: indexed load is kept" );
+
+    // lea r9,[rip+rel] keeps REX.R.
+    std::int32_t relSecond = (std::int32_t)( rvaTLSArray - ( codeRVA + 15 + 7 ) );
+
+    CheckBytes( code, 15, Concat( { { 0x4C, 0x8D, 0x0D }, RelBytes( relSecond ), { 0x66, 0x90 } } ), "x64 patch: lea r9,[rip+rel] and padding" );
+
+    CheckBytes( code, 0, { 0x90, 0x90 }, "x64 patch: code before the access is kept" );
+}
+
+static void TestX86( void )
+{
+    std::vector <std::uint8_t> code =
+    {
+        0x64, 0xA1, 0x2C, 0x00, 0x00, 0x00,             // mov eax,fs:[2Ch]
+        0x8B, 0x04, 0x88,                               // mov eax,[eax+ecx*4]
+        0x64, 0x8B, 0x0D, 0x2C, 0x00, 0x00, 0x00,       // mov ecx,fs:[2Ch]
+        0x8B, 0x0C, 0x81                                // mov ecx,[ecx+eax*4]
+    };
+
+    std::vector <size_t> relocOffsets;
+    staticTLSPatchStats stats;
+
+    PatchStaticTLSReferencesX86( code.data(), code.size(), 0x10203040, relocOffsets, stats );
+
+    Check( stats.numPatched == 2 && stats.numIndexedLoads == 2, "x86 patch: statistics" );
+    Check( relocOffsets.size() == 2 && relocOffsets[0] == 2 && relocOffsets[1] == 11, "x86 patch: relocation offsets" );
+
+    CheckBytes( code, 0, { 0x8D, 0x05, 0x40, 0x30, 0x20, 0x10 }, "x86 patch: lea eax,[va]" );
+    CheckBytes( code, 9, { 0x8D, 0x0D, 0x40, 0x30, 0x20, 0x10, 0x90 }, "x86 patch: lea ecx,[va] and padding" );
+}
+
+int main( int argc, char *argv[] )
+{
+    TestFindX64();
+    TestPatchX64();
+    TestX86();
+
+    if ( numFailures > 0 )
+    {
+        printf( "%d TLS patching checks failed\n", numFailures );
+
+        return 1;
+    }
+
+    printf( "all TLS patching checks passed\n" );
+
+    return 0;
+}
@@ -4,6 +4,11 @@
 
 #include "utils.hxx"
 
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+
 struct basic_runtime_exception
 {
     inline basic_runtime_exception( int code, peString <char> desc ) : retcode( code ), msg( std::move( desc ) )
@@ -93,6 +98,155 @@ static FileSystem::fileTrans open_root_dir( CFileTranslator *base, const filePat
     throw basic_runtime_exception( fail_ret_code, std::move( err_msg ) );
 }
 
+// Returns true if the file at location already contains exactly the given data.
+static bool is_file_content_same( const filePath& location, const char *data, size_t dataSize )
+{
+    FileSystem::filePtr prevStream( fileRoot, location, "rb" );
+
+    if ( !prevStream.is_good() || (size_t)prevStream->GetSizeNative() != dataSize )
+    {
+        return false;
+    }
+
+    char chunkBuf[ 0x10000 ];
+    size_t compareOff = 0;
+
+    while ( compareOff < dataSize )
+    {
+        size_t chunkSize = std::min( sizeof( chunkBuf ), dataSize - compareOff );
+
+        if ( prevStream->Read( chunkBuf, chunkSize ) != chunkSize || memcmp( chunkBuf, data + compareOff, chunkSize ) != 0 )
+        {
+            return false;
+        }
+
+        compareOff += chunkSize;
+    }
+
+    return true;
+}
+
+// Serializes the image into memory and stores it with a single write into a preallocated
+// temporary file, which then replaces the destination.
+static void write_image_buffered( PEFile& image, const filePath& location, int open_fail_code, int write_fail_code, bool skipUnchanged, bool updateChecksum )
+{
+    auto writeStartTime = std::chrono::steady_clock::now();
+
+    PEStreamMemory memStream;
+
+    image.WriteToStream( &memStream );
+
+    char *imageData = memStream.GetData();
+    size_t imageSize = memStream.GetSize();
+
+    // Summed over the serialized buffer, so the written file does not have to be read again.
+    if ( updateChecksum )
+    {
+        std::uint32_t imageChecksum;
+
+        if ( UpdatePEChecksum( imageData, imageSize, imageChecksum ) )
+        {
+            image.peOptHeader.checkSum = imageChecksum;
+
+            printf( "image checksum: 0x%08X\n", (unsigned int)imageChecksum );
+        }
+        else
+        {
+            printf( "failed to compute the image checksum\n" );
+        }
+    }
+
+    // Keep the previous file (and its timestamp) if nothing would change.
+    if ( skipUnchanged && is_file_content_same( location, imageData, imageSize ) )
+    {
+        printf( "output image is unchanged; keeping the existing file\n" );
+        return;
+    }
+
+    bool hasWritten = false;
+
+    filePath tmpLocation = location;
+    tmpLocation += ".tmp";
+
+    bool wroteTemp = false;
+    {
+        FileSystem::filePtr tmpStream( fileRoot, tmpLocation, "wb" );
+
+        if ( tmpStream.is_good() )
+        {
+            // Reserve the file space up front.
+            tmpStream->SeekNative( (fsOffsetNumber_t)imageSize, SEEK_SET );
+            tmpStream->SetSeekEnd();
+            tmpStream->SeekNative( 0, SEEK_SET );
+
+            wroteTemp = ( tmpStream->Write( imageData, imageSize ) == imageSize );
+
+            // The data has to be on the disk before the rename is, or a crash could leave an empty destination.
+            if ( wroteTemp )
+            {
+                tmpStream->Flush();
+            }
+        }
+    }
+
+    if ( wroteTemp )
+    {
+        hasWritten = fileRoot->Rename( tmpLocation, location );
+
+        if ( !hasWritten )
+        {
+            // Not every file system replaces the destination on rename.
+            fileRoot->Delete( location );
+
+            hasWritten = fileRoot->Rename( tmpLocation, location );
+        }
+    }
+
+    if ( !hasWritten )
+    {
+        fileRoot->Delete( tmpLocation );
+
+        // Fall back to writing the destination directly.
+        FileSystem::filePtr outputStream = open_stream_redir( location, "wb", open_fail_code, "output image" );
+
+        if ( outputStream->Write( imageData, imageSize ) != imageSize )
+        {
+            throw basic_runtime_exception( write_fail_code, "failed to write output image" );
+        }
+    }
+
+    auto writeMillis = std::chrono::duration_cast <std::chrono::milliseconds> ( std::chrono::steady_clock::now() - writeStartTime ).count();
+
+    printf( "wrote output image (%u bytes) in %ums\n", (unsigned int)imageSize, (unsigned int)writeMillis );
+}
+
+// Calls the callback for every file below the root, ordered by path, so that the output
+// does not depend on the directory enumeration order of the file system.
+template <typename callbackType>
+static void scan_files_sorted( CFileTranslator *root, const callbackType& cb )
+{
+    std::vector <std::pair <std::wstring, filePath>> foundFiles;
+
+    root->ScanDirectory( "/", "*", true, nullptr,
+        [&]( const filePath& absFilePath )
+    {
+        auto widePath = absFilePath.convert_unicode <FileSysCommonAllocator> ();
+
+        foundFiles.emplace_back( std::wstring( widePath.GetConstString(), widePath.GetLength() ), absFilePath );
+    }, nullptr );
+
+    std::sort( foundFiles.begin(), foundFiles.end(),
+        []( const std::pair <std::wstring, filePath>& left, const std::pair <std::wstring, filePath>& right )
+    {
+        return ( left.first < right.first );
+    });
+
+    for ( const std::pair <std::wstring, filePath>& fileInfo : foundFiles )
+    {
+        cb( fileInfo.second );
+    }
+}
+
 static inline PEFile::PESection* embed_file_as_section( PEFile& inputImage, CFile *tempFile )
 {
     // We can only write as much as a section allows.
@@ -186,6 +340,8 @@ int main( int argc, const char *argv[] )
     bool wantsHelp = false;
     eProcessingMode mode = eProcessingMode::UNKNOWN;
     bool keepExport = false;
+    bool skipUnchanged = false;
+    bool updateChecksum = false;
 
     while ( true )
     {
@@ -216,6 +372,14 @@ int main( int argc, const char *argv[] )
         {
             keepExport = true;
         }
+        else if ( curOpt == "skipunchanged" )
+        {
+            skipUnchanged = true;
+        }
+        else if ( curOpt == "checksum" )
+        {
+            updateChecksum = true;
+        }
     }
 
     printf(
@@ -234,6 +398,8 @@ int main( int argc, const char *argv[] )
             "-resfldr: puts all files from a folder into the application resource tree\n"
             "* USAGE: peresembed -resfldr *FOLDER_PATH* *INPUT_EXE_PATH* *OUTPUT_EXE_PATH*\n"
             "-keepexp: if operation resolves an export then keep the export after resolution\n"
+            "-skipunchanged: keeps the existing output file (and its timestamp) if the new image is identical\n"
+            "-checksum: stores a valid optional header checksum into the output image\n"
         );
 
         if ( mode == eProcessingMode::UNKNOWN )
@@ -299,7 +465,7 @@ int main( int argc, const char *argv[] )
 
                 size_t file_count = 0;
 
-                accessRoot->ScanDirectory( "/", "*", true, nullptr,
+                scan_files_sorted( accessRoot,
                     [&]( const filePath& absFilePath )
                 {
                     filePath relFilePath;
@@ -316,7 +482,7 @@ int main( int argc, const char *argv[] )
 
                         printf( "* %s\n", ansiFilePath.GetConstString() );
                     }
-                }, nullptr );
+                });
 
                 // Output nice stats.
                 printf( "added %zu files to archive\n", file_count );
@@ -399,15 +565,11 @@ int main( int argc, const char *argv[] )
 
             // Write the PE image back to disk.
             {
-                FileSystem::filePtr outputPEStream = open_stream_redir( outputExecFilePath, "wb", -7, "output image" );
-
-                PEStreamFS stream( outputPEStream );
-
                 printf( "writing output image...\n" );
 
                 try
                 {
-                    inputImage.WriteToStream( &stream );
+                    write_image_buffered( inputImage, outputExecFilePath, -7, -8, skipUnchanged, updateChecksum );
                 }
                 catch( peframework_exception& )
                 {
@@ -535,13 +697,9 @@ int main( int argc, const char *argv[] )
 
             // Finish by writing image back to disk.
             {
-                FileSystem::filePtr outputFileStream = open_stream_redir( pathToOutputExec, "wb", -11, "output image" );
-
-                PEStreamFS stream( outputFileStream );
-
                 try
                 {
-                    inputImage.WriteToStream( &stream );
+                    write_image_buffered( inputImage, pathToOutputExec, -11, -13, skipUnchanged, updateChecksum );
                 }
                 catch( peframework_exception& )
                 {
@@ -626,7 +784,7 @@ int main( int argc, const char *argv[] )
 
                 size_t embedCount = 0;
 
-                embedRoot->ScanDirectory( "/", "*", true, nullptr,
+                scan_files_sorted( embedRoot,
                     [&]( const filePath& absFilePath )
                 {
                     // Print a nice message.
@@ -710,7 +868,7 @@ int main( int argc, const char *argv[] )
                         printf( "failed to add.\n" );
                     }
 
-                }, nullptr );
+                });
 
                 printf( "total embed count: %zu\n", embedCount );
             }
@@ -732,13 +890,9 @@ int main( int argc, const char *argv[] )
 
             // Write our new image.
             {
-                FileSystem::filePtr outputImageStream = open_stream_redir( pathToOutputExec, "wb", -7, "output image" );
-
-                PEStreamFS stream( outputImageStream );
-
                 try
                 {
-                    inputImage.WriteToStream( &stream );
+                    write_image_buffered( inputImage, pathToOutputExec, -7, -8, skipUnchanged, updateChecksum );
                 }
                 catch( peframework_exception& )
                 {
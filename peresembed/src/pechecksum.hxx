@@ -0,0 +1,92 @@
+#ifndef _PE_CHECKSUM_UTILS_
+#define _PE_CHECKSUM_UTILS_
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#endif
+
+// Computes the optional header checksum of a serialized image and stores it into the image data.
+// The 16bit ones' complement sum uses SSE2 where available. Returns false if the data is not a PE image.
+inline bool UpdatePEChecksum( char *imageData, size_t imageSize, std::uint32_t& checksumOut )
+{
+    unsigned char *bytes = (unsigned char*)imageData;
+
+    if ( imageSize < 0x40 )
+    {
+        return false;
+    }
+
+    std::uint32_t peHeaderOff;
+    memcpy( &peHeaderOff, bytes + 0x3C, sizeof(peHeaderOff) );
+
+    // PE signature, file header, then the checksum at the same offset for PE32 and PE32+.
+    size_t checksumOff = ( (size_t)peHeaderOff + 4 + 20 + 64 );
+
+    if ( checksumOff + 4 > imageSize || memcmp( bytes + peHeaderOff, "PE\0\0", 4 ) != 0 )
+    {
+        return false;
+    }
+
+    // The field itself counts as zero.
+    memset( bytes + checksumOff, 0, 4 );
+
+    size_t numWordBytes = ( imageSize & ~(size_t)1 );
+
+    std::uint64_t sum = 0;
+    size_t off = 0;
+
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+    const __m128i zero = _mm_setzero_si128();
+
+    while ( numWordBytes - off >= 16 )
+    {
+        // Each 32bit lane takes two words per round, so it cannot overflow within 0x8000 rounds.
+        size_t numRounds = std::min( ( numWordBytes - off ) / 16, (size_t)0x8000 );
+
+        __m128i laneSums = zero;
+
+        for ( size_t n = 0; n < numRounds; n++ )
+        {
+            __m128i words = _mm_loadu_si128( (const __m128i*)( bytes + off ) );
+
+            laneSums = _mm_add_epi32( laneSums, _mm_unpacklo_epi16( words, zero ) );
+            laneSums = _mm_add_epi32( laneSums, _mm_unpackhi_epi16( words, zero ) );
+
+            off += 16;
+        }
+
+        std::uint32_t lanes[4];
+        _mm_storeu_si128( (__m128i*)lanes, laneSums );
+
+        sum += ( (std::uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] );
+    }
+#endif
+
+    for ( ; off < numWordBytes; off += 2 )
+    {
+        sum += ( (std::uint32_t)bytes[off] | ( (std::uint32_t)bytes[off+1] << 8 ) );
+    }
+
+    if ( imageSize & 1 )
+    {
+        sum += bytes[ imageSize - 1 ];
+    }
+
+    while ( sum >> 16 )
+    {
+        sum = ( ( sum & 0xFFFF ) + ( sum >> 16 ) );
+    }
+
+    checksumOut = (std::uint32_t)( sum + imageSize );
+
+    memcpy( bytes + checksumOff, &checksumOut, sizeof(checksumOut) );
+
+    return true;
+}
+
+#endif //_PE_CHECKSUM_UTILS_